@@ -0,0 +1,203 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Shared helpers of the benchmark executables: command line options,
+//  latency percentiles and machine-readable output.
+//
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define BENCH_WARMUP        10          // untimed iterations before each case
+#define BENCH_MIN_ITERS     100
+#define BENCH_MAX_ITERS     100000
+#define BENCH_BYTES_BUDGET  (256u << 20) // bytes moved per round trip case
+#define BENCH_BATCH_NS      2000        // codec iterations are timed in batches of about this length
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct BenchOptions {
+    size_t      min_width;
+    size_t      max_width;
+    int         iters;       // 0 picks the count from the payload size
+    std::string format;      // "json" (one object per line) or "csv"
+    std::vector<std::string> transports;
+    std::vector<std::string> benches;
+};
+
+inline std::vector<std::string> split_list(const std::string &s)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+inline void print_usage(const char *prog, const char *transports, const char *benches)
+{
+    std::cerr << "usage: " << prog << " [--min-width N] [--max-width N] [--iters N] [--format json|csv]"
+              << " [--transports " << transports << "] [--bench " << benches << "]" << std::endl;
+}
+
+// Returns false and prints the usage on bad arguments
+inline bool parse_options(int argc, char *argv[], const char *transports, const char *benches, BenchOptions &opt)
+{
+    opt.min_width  = 1;
+    opt.max_width  = 1000000;
+    opt.iters      = 0;
+    opt.format     = "json";
+    opt.transports = split_list(transports);
+    opt.benches    = split_list(benches);
+
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        if (k+1 >= argc) {
+            print_usage(argv[0], transports, benches);
+            return false;
+        }
+        std::string val = argv[++k];
+        if (arg == "--min-width") {
+            opt.min_width = std::strtoul(val.c_str(), nullptr, 10);
+        } else if (arg == "--max-width") {
+            opt.max_width = std::strtoul(val.c_str(), nullptr, 10);
+        } else if (arg == "--iters") {
+            opt.iters = std::atoi(val.c_str());
+        } else if (arg == "--format" && (val == "json" || val == "csv")) {
+            opt.format = val;
+        } else if (arg == "--transports") {
+            opt.transports = split_list(val);
+        } else if (arg == "--bench") {
+            opt.benches = split_list(val);
+        } else {
+            print_usage(argv[0], transports, benches);
+            return false;
+        }
+    }
+    return opt.min_width >= 1 && opt.min_width <= opt.max_width;
+}
+
+inline bool selected(const std::vector<std::string> &list, const std::string &name)
+{
+    return std::find(list.begin(), list.end(), name) != list.end();
+}
+
+// Payload widths 1, 10, 100, ... within the options' range
+inline std::vector<size_t> bench_widths(const BenchOptions &opt)
+{
+    std::vector<size_t> widths;
+    for (size_t w = 1; w <= opt.max_width; w *= 10) {
+        if (w >= opt.min_width) widths.push_back(w);
+        if (w > opt.max_width/10) break;
+    }
+    return widths;
+}
+
+// Round trip iterations so that each case moves about BENCH_BYTES_BUDGET
+inline int bench_iters(const BenchOptions &opt, const size_t bytes)
+{
+    if (opt.iters > 0) return opt.iters;
+    size_t n = BENCH_BYTES_BUDGET/std::max<size_t>(bytes, 1);
+    return static_cast<int>(std::min<size_t>(std::max<size_t>(n, BENCH_MIN_ITERS), BENCH_MAX_ITERS));
+}
+
+// Collects per-iteration latencies of one case
+class LatencyRecorder {
+  public:
+    explicit LatencyRecorder(const int n) : count(0)
+    {
+        samples.reserve(n);
+    }
+
+    // One sample covering ops operations of equal cost
+    void add(const bench_clock::duration d, const int ops = 1)
+    {
+        samples.push_back(std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(d).count()/ops);
+        count += ops;
+    }
+
+    void start() { t0 = bench_clock::now(); }
+    void stop()  { elapsed = bench_clock::now()-t0; }
+
+    // One line per case. Latencies in nanoseconds.
+    void report(const BenchOptions &opt, const std::string &bench, const std::string &transport,
+                const size_t width, const size_t bytes)
+    {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double s : samples) sum += s;
+        const double secs = std::chrono::duration<double>(elapsed).count();
+
+        static bool header_done = false;
+        char line[512];
+        if (opt.format == "csv") {
+            if (!header_done) {
+                std::cout << "bench,transport,width,bytes,iters,mean_ns,p50_ns,p99_ns,p999_ns,msgs_per_s" << std::endl;
+                header_done = true;
+            }
+            std::snprintf(line, sizeof(line), "%s,%s,%zu,%zu,%ld,%.1f,%.1f,%.1f,%.1f,%.1f",
+                          bench.c_str(), transport.c_str(), width, bytes, count,
+                          sum/samples.size(), pct(0.5), pct(0.99), pct(0.999), count/secs);
+        } else {
+            std::snprintf(line, sizeof(line),
+                          "{\"bench\":\"%s\",\"transport\":\"%s\",\"width\":%zu,\"bytes\":%zu,\"iters\":%ld,"
+                          "\"mean_ns\":%.1f,\"p50_ns\":%.1f,\"p99_ns\":%.1f,\"p999_ns\":%.1f,\"msgs_per_s\":%.1f}",
+                          bench.c_str(), transport.c_str(), width, bytes, count,
+                          sum/samples.size(), pct(0.5), pct(0.99), pct(0.999), count/secs);
+        }
+        std::cout << line << std::endl;
+    }
+
+  private:
+    std::vector<double>     samples;
+    long                    count;
+    bench_clock::time_point t0;
+    bench_clock::duration   elapsed;
+
+    // Nearest-rank percentile of the sorted samples
+    double pct(const double p) const
+    {
+        if (samples.empty()) return 0;
+        size_t idx = static_cast<size_t>(p*samples.size());
+        return samples[std::min(idx, samples.size()-1)];
+    }
+};
+
+// Time fcn in batches, each about BENCH_BATCH_NS long, until about budget
+// bytes were processed
+template <typename Fcn>
+void run_batched(const BenchOptions &opt, const size_t bytes, LatencyRecorder &rec, Fcn fcn)
+{
+    for (int k = 0; k < BENCH_WARMUP; k++) fcn();
+
+    // Batch size from a rough single-shot estimate
+    auto t = bench_clock::now();
+    fcn();
+    double one = std::chrono::duration<double, std::nano>(bench_clock::now()-t).count();
+    int batch = std::max(1, static_cast<int>(BENCH_BATCH_NS/std::max(one, 1.0)));
+
+    int batches = std::max(1, bench_iters(opt, bytes)/batch);
+    if (opt.iters == 0) batches = std::max(batches, BENCH_MIN_ITERS);
+
+    rec.start();
+    for (int b = 0; b < batches; b++) {
+        auto t0 = bench_clock::now();
+        for (int k = 0; k < batch; k++) fcn();
+        rec.add(bench_clock::now()-t0, batch);
+    }
+    rec.stop();
+}
+
+#endif // BENCH_UTIL_HPP
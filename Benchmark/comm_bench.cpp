@@ -0,0 +1,263 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Latency and throughput of the CommExample protocol, without MATLAB.
+//
+//  Benchmarks
+//    encode, decode             dense codec of one double port
+//    encode_delta, decode_delta delta codec with 2% of the elements changing
+//    roundtrip                  transmit block request, receive block decode
+//                               and reply, as in request/reply mode
+//  Transports: tcp, ipc, inproc and shm (shared memory ring)
+//
+//  Build (from the repository root):
+//    g++ -O2 -std=c++14 -ICommExample/sfun -I<cppzmq> -I<libzmq>/include
+//        Benchmark/comm_bench.cpp CommExample/sfun/statcal_util.cpp
+//        CommExample/sfun/shm_ring.cpp -o comm_bench -lzmq -lpthread -lrt
+//    cl /O2 /EHsc /ICommExample\sfun /I<cppzmq> /I<libzmq>\include
+//        Benchmark\comm_bench.cpp CommExample\sfun\statcal_util.cpp
+//        CommExample\sfun\shm_ring.cpp <libzmq>\lib\libzmq.lib
+//
+//  Run: comm_bench [--max-width 1000000] [--format json|csv] ...
+//  Prints one line per benchmark, transport and width.
+//
+#include <zmq.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <random>
+
+#include "bench_util.hpp"
+#include "statcal_util.hpp"
+#include "shm_ring.hpp"
+
+#if defined(_WIN32)
+#include <process.h>
+#define bench_getpid _getpid
+#else
+#include <unistd.h>
+#define bench_getpid getpid
+#endif
+
+#define TRANSPORTS "tcp,ipc,inproc,shm"
+#define BENCHES    "encode,decode,encode_delta,decode_delta,roundtrip"
+#define TCP_PORT   5599
+#define IO_TIMEOUT 5000 // msecs
+
+namespace {
+
+std::vector<double> random_data(const size_t width)
+{
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<double> v(width);
+    for (auto &x : v) x = dist(gen);
+    return v;
+}
+
+void bench_codec(const BenchOptions &opt, const size_t width)
+{
+    std::vector<PortSpec> ports = {{DT_DOUBLE, static_cast<int>(width)}};
+    std::vector<double> u = random_data(width), y(width);
+    const void *u_ptrs[] = {&u[0]};
+    void *y_ptrs[] = {&y[0]};
+
+    std::vector<char> buf(encoded_size(ports, true));
+    const size_t size = encode_message(INP_DATA, 1, 0.0, ports, u_ptrs, &buf[0]);
+
+    if (selected(opt.benches, "encode")) {
+        LatencyRecorder rec(bench_iters(opt, size));
+        run_batched(opt, size, rec, [&]() {
+            encode_message(INP_DATA, 1, 0.0, ports, u_ptrs, &buf[0]);
+        });
+        rec.report(opt, "encode", "none", width, size);
+    }
+
+    if (selected(opt.benches, "decode")) {
+        LatencyRecorder rec(bench_iters(opt, size));
+        run_batched(opt, size, rec, [&]() {
+            decode_message(decode_header(&buf[0], size), ports, &buf[0], size, y_ptrs);
+        });
+        rec.report(opt, "decode", "none", width, size);
+    }
+
+    if (!selected(opt.benches, "encode_delta") && !selected(opt.benches, "decode_delta")) {
+        return;
+    }
+
+    // Two inputs which differ in 2% of the elements, sent alternately
+    std::vector<double> u2 = u;
+    for (size_t k = 0; k < width; k += 50) u2[k] += 1.0;
+    const void *u2_ptrs[] = {&u2[0]};
+    std::vector<char> ref(data_size(ports)), rx_ref(data_size(ports));
+    std::vector<uint32_t> changed(width);
+
+    encode_delta_message(STREAM_DATA, 1, 0.0, ports, u_ptrs, true, &ref[0], &changed[0], &buf[0]);
+    const size_t delta_size = encode_delta_message(STREAM_DATA, 2, 0.0, ports, u2_ptrs, false,
+                                                   &ref[0], &changed[0], &buf[0]);
+
+    if (selected(opt.benches, "encode_delta")) {
+        LatencyRecorder rec(bench_iters(opt, delta_size));
+        bool flip = false;
+        run_batched(opt, delta_size, rec, [&]() {
+            flip = !flip;
+            encode_delta_message(STREAM_DATA, 2, 0.0, ports, flip ? u_ptrs : u2_ptrs, false,
+                                 &ref[0], &changed[0], &buf[0]);
+        });
+        rec.report(opt, "encode_delta", "none", width, delta_size);
+    }
+
+    if (selected(opt.benches, "decode_delta")) {
+        // Apply the same delta from u to u2 over and over
+        encode_delta_message(STREAM_DATA, 1, 0.0, ports, u_ptrs, true, &ref[0], &changed[0], &buf[0]);
+        encode_delta_message(STREAM_DATA, 2, 0.0, ports, u_ptrs, false, &ref[0], &changed[0], &buf[0]);
+        const size_t size0 = encode_delta_message(STREAM_DATA, 3, 0.0, ports, u2_ptrs, false,
+                                                  &ref[0], &changed[0], &buf[0]);
+        bool has_ref = true;
+        LatencyRecorder rec(bench_iters(opt, size0));
+        run_batched(opt, size0, rec, [&]() {
+            decode_delta_message(decode_header(&buf[0], size0), ports, &buf[0], size0, &rx_ref[0], has_ref);
+            unpack_ports(ports, &rx_ref[0], y_ptrs);
+        });
+        rec.report(opt, "decode_delta", "none", width, size0);
+    }
+}
+
+// Receive side of the round trip, as sfcn_receive: decode into the output and
+// reply with a control message
+class Receiver {
+  public:
+    Receiver(zmq::context_t &ctx, const std::string &addr, const std::vector<PortSpec> &p) :
+        ports(p), recv_buf(encoded_size(p)), reply_buf(header_size()), y(p[0].width)
+    {
+        encode_message(INP_DATA, 0, 0.0, {}, nullptr, &reply_buf[0]);
+        if (is_shm_address(addr)) {
+            shm = ShmChannel::create(addr, recv_buf.size());
+        } else {
+            socket.reset(new zmq::socket_t(ctx, ZMQ_ROUTER));
+            int linger = 0;
+            socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            socket->bind(addr.c_str());
+        }
+    }
+
+    void serve(const int n)
+    {
+        void *y_ptrs[] = {&y[0]};
+        zmq::message_t peer;
+        for (int k = 0; k < n; k++) {
+            size_t size;
+            if (shm) {
+                if (!shm->recv(&recv_buf[0], recv_buf.size(), size, IO_TIMEOUT)) return;
+            } else {
+                socket->recv(&peer);
+                socket->recv(&recv_buf[0], 0);   // empty delimiter
+                size = socket->recv(&recv_buf[0], recv_buf.size());
+            }
+            decode_message(decode_header(&recv_buf[0], size), ports, &recv_buf[0], size, y_ptrs);
+
+            if (shm) {
+                shm->send(&reply_buf[0], reply_buf.size(), IO_TIMEOUT);
+            } else {
+                socket->send(peer.data(), peer.size(), ZMQ_SNDMORE);
+                socket->send("", 0, ZMQ_SNDMORE);
+                socket->send(&reply_buf[0], reply_buf.size());
+            }
+        }
+    }
+
+  private:
+    std::vector<PortSpec> ports;
+    std::vector<char>     recv_buf;
+    std::vector<char>     reply_buf;
+    std::vector<double>   y;
+    std::unique_ptr<zmq::socket_t> socket;
+    std::unique_ptr<ShmChannel>    shm;
+};
+
+std::string transport_addr(const std::string &transport, const bool bind)
+{
+    const std::string id = std::to_string(bench_getpid());
+    if (transport == "tcp")    return bind ? "tcp://*:" + std::to_string(TCP_PORT) : "tcp://127.0.0.1:" + std::to_string(TCP_PORT);
+    if (transport == "ipc")    return "ipc:///tmp/comm_bench_" + id;
+    if (transport == "inproc") return "inproc://comm_bench";
+    if (transport == "shm")    return "shm://comm_bench:" + id;
+    throw std::runtime_error("Unknown transport " + transport);
+}
+
+void bench_roundtrip(const BenchOptions &opt, zmq::context_t &ctx, const std::string &transport, const size_t width)
+{
+    std::vector<PortSpec> ports = {{DT_DOUBLE, static_cast<int>(width)}};
+    std::vector<double> u = random_data(width);
+    const void *u_ptrs[] = {&u[0]};
+    std::vector<char> send_buf(encoded_size(ports)), recv_buf(header_size());
+    const size_t size = encoded_size(ports);
+    const int n = bench_iters(opt, size);
+
+    std::unique_ptr<Receiver> receiver(new Receiver(ctx, transport_addr(transport, true), ports));
+
+    // Transmit side, as sfcn_transmit in request/reply mode
+    std::unique_ptr<zmq::socket_t> socket;
+    std::unique_ptr<ShmChannel>    shm;
+    if (transport == "shm") {
+        shm = ShmChannel::open(transport_addr(transport, false), send_buf.size(), IO_TIMEOUT);
+    } else {
+        socket.reset(new zmq::socket_t(ctx, ZMQ_REQ));
+        int linger = 0;
+        socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+        socket->connect(transport_addr(transport, false).c_str());
+    }
+    std::thread server([&]() { receiver->serve(BENCH_WARMUP+n); });
+
+    LatencyRecorder rec(n);
+    for (int k = 0; k < BENCH_WARMUP+n; k++) {
+        if (k == BENCH_WARMUP) rec.start();
+        auto t0 = bench_clock::now();
+
+        size_t len = encode_message(INP_DATA, k+1, 0.0, ports, u_ptrs, &send_buf[0]);
+        size_t rlen;
+        if (shm) {
+            shm->send(&send_buf[0], len, IO_TIMEOUT);
+            if (!shm->recv(&recv_buf[0], recv_buf.size(), rlen, IO_TIMEOUT)) {
+                throw std::runtime_error("No reply from the receiver");
+            }
+        } else {
+            socket->send(&send_buf[0], len);
+            rlen = socket->recv(&recv_buf[0], recv_buf.size());
+        }
+        decode_header(&recv_buf[0], rlen);
+
+        if (k >= BENCH_WARMUP) rec.add(bench_clock::now()-t0);
+    }
+    rec.stop();
+
+    server.join();
+    rec.report(opt, "roundtrip", transport, width, size);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opt;
+    if (!parse_options(argc, argv, TRANSPORTS, BENCHES, opt)) {
+        return 1;
+    }
+
+    zmq::context_t ctx(1);
+    for (size_t width : bench_widths(opt)) {
+        bench_codec(opt, width);
+
+        if (!selected(opt.benches, "roundtrip")) continue;
+        for (auto &transport : opt.transports) {
+            try {
+                bench_roundtrip(opt, ctx, transport, width);
+            } catch (std::exception &e) {
+                std::cerr << "roundtrip " << transport << " width " << width << ": " << e.what() << std::endl;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Latency and throughput of the CoSimExample protocol, without MATLAB.
+//
+//  Benchmarks
+//    encode, decode   codec of an EWMA request with width channels,
+//                     (prev[N], current[N], beta, iteration)
+//    roundtrip        statcalclient request, statcalserver EWMA computation
+//                     and reply of (ewma[N], bias_corrected_ewma[N])
+//  Transports: tcp, ipc and inproc
+//
+//  The CoSimExample and CommExample message headers declare the same names,
+//  so each protocol has its own executable; see comm_bench.cpp for the other.
+//
+//  Build (from the repository root):
+//    g++ -O2 -std=c++14 -ICoSimExample/util -ICoSimExample/serverApp -Iutils/include -I<cppzmq> -I<libzmq>/include
+//        Benchmark/cosim_bench.cpp CoSimExample/util/statcal_util.cpp
+//        CoSimExample/serverApp/ewma_kernel.cpp -o cosim_bench -lzmq -lpthread
+//    cl /O2 /EHsc /ICoSimExample\util /ICoSimExample\serverApp /Iutils\include /I<cppzmq> /I<libzmq>\include
+//        Benchmark\cosim_bench.cpp CoSimExample\util\statcal_util.cpp
+//        CoSimExample\serverApp\ewma_kernel.cpp <libzmq>\lib\libzmq.lib
+//
+//  Run: cosim_bench [--max-width 1000000] [--format json|csv] ...
+//  Prints one line per benchmark, transport and width.
+//
+#include <zmq.hpp>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_util.hpp"
+#include "statcal_util.hpp"
+#include "ewma_kernel.hpp"
+
+#if defined(_WIN32)
+#include <process.h>
+#define bench_getpid _getpid
+#else
+#include <unistd.h>
+#define bench_getpid getpid
+#endif
+
+#define TRANSPORTS "tcp,ipc,inproc"
+#define BENCHES    "encode,decode,roundtrip"
+#define TCP_PORT   5598
+
+namespace {
+
+// EWMA request of n channels
+std::vector<double> ewma_request(const size_t n)
+{
+    std::vector<double> data(2*n+2);
+    for (size_t k = 0; k < n; k++) {
+        data[k]   = 0.5;
+        data[n+k] = static_cast<double>(k % 100);
+    }
+    data[2*n]   = 0.9;
+    data[2*n+1] = 3;
+    return data;
+}
+
+void bench_codec(const BenchOptions &opt, const size_t width)
+{
+    std::vector<double> data = ewma_request(width), decoded;
+    std::string ec;
+    encode_double_data(EWMA, 0, 1, data, ec);
+    const size_t size = ec.size();
+
+    if (selected(opt.benches, "encode")) {
+        LatencyRecorder rec(bench_iters(opt, size));
+        run_batched(opt, size, rec, [&]() {
+            encode_double_data(EWMA, 0, 1, data, ec);
+        });
+        rec.report(opt, "encode", "none", width, size);
+    }
+
+    if (selected(opt.benches, "decode")) {
+        LatencyRecorder rec(bench_iters(opt, size));
+        run_batched(opt, size, rec, [&]() {
+            decode_double_data(decode_header(ec.data()), ec.data(), decoded);
+        });
+        rec.report(opt, "decode", "none", width, size);
+    }
+}
+
+std::string transport_addr(const std::string &transport, const bool bind)
+{
+    if (transport == "tcp")    return bind ? "tcp://*:" + std::to_string(TCP_PORT) : "tcp://127.0.0.1:" + std::to_string(TCP_PORT);
+    if (transport == "ipc")    return "ipc:///tmp/cosim_bench_" + std::to_string(bench_getpid());
+    if (transport == "inproc") return "inproc://cosim_bench";
+    throw std::runtime_error("Unknown transport " + transport);
+}
+
+// Server side of the round trip, the EWMA request of statcalserver
+void serve(zmq::socket_t &socket, const int n)
+{
+    std::vector<double> data, md;
+    std::string reply_str;
+    zmq::message_t request;
+    for (int k = 0; k < n; k++) {
+        socket.recv(&request);
+        const char *str = static_cast<const char *>(request.data());
+        MsgHeader hdr = decode_header(str);
+        decode_double_data(hdr, str, data);
+
+        const size_t c = (data.size()-2)/2;
+        md.resize(2*c);
+        compute_ewma_batch(&data[0], &data[c], data[2*c], static_cast<int>(data[2*c+1]), &md[0], &md[c], c);
+
+        encode_double_data(REPLY, hdr.session, hdr.seq, md, reply_str);
+        socket.send(reply_str.data(), reply_str.size());
+    }
+}
+
+void bench_roundtrip(const BenchOptions &opt, zmq::context_t &ctx, const std::string &transport, const size_t width)
+{
+    std::vector<double> data = ewma_request(width), reply;
+    std::string ec;
+    encode_double_data(EWMA, 0, 0, data, ec);
+    const size_t size = ec.size();
+    const int n = bench_iters(opt, size);
+
+    int linger = 0;
+    zmq::socket_t server_socket(ctx, ZMQ_REP);
+    server_socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    server_socket.bind(transport_addr(transport, true).c_str());
+    std::thread server([&]() { serve(server_socket, BENCH_WARMUP+n); });
+
+    // Client side, as statcalclient
+    zmq::socket_t socket(ctx, ZMQ_REQ);
+    socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    socket.connect(transport_addr(transport, false).c_str());
+
+    zmq::message_t msg;
+    LatencyRecorder rec(n);
+    for (int k = 0; k < BENCH_WARMUP+n; k++) {
+        if (k == BENCH_WARMUP) rec.start();
+        auto t0 = bench_clock::now();
+
+        encode_double_data(EWMA, 0, k+1, data, ec);
+        socket.send(ec.data(), ec.size());
+        socket.recv(&msg);
+        const char *str = static_cast<const char *>(msg.data());
+        MsgHeader hdr = decode_header(str);
+        if (hdr.type != REPLY || hdr.seq != static_cast<unsigned int>(k+1)) {
+            throw std::runtime_error("Unexpected reply from the server");
+        }
+        decode_double_data(hdr, str, reply);
+
+        if (k >= BENCH_WARMUP) rec.add(bench_clock::now()-t0);
+    }
+    rec.stop();
+
+    server.join();
+    rec.report(opt, "roundtrip", transport, width, size);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opt;
+    if (!parse_options(argc, argv, TRANSPORTS, BENCHES, opt)) {
+        return 1;
+    }
+    std::cerr << "EWMA kernel: " << ewma_kernel_name() << std::endl;
+
+    zmq::context_t ctx(1);
+    for (size_t width : bench_widths(opt)) {
+        bench_codec(opt, width);
+
+        if (!selected(opt.benches, "roundtrip")) continue;
+        for (auto &transport : opt.transports) {
+            try {
+                bench_roundtrip(opt, ctx, transport, width);
+            } catch (std::exception &e) {
+                std::cerr << "roundtrip " << transport << " width " << width << ": " << e.what() << std::endl;
+            }
+        }
+    }
+    return 0;
+}
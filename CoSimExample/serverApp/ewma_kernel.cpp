@@ -0,0 +1,356 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Batched EWMA kernels for statcalserver with run-time dispatch between
+//  AVX-512, AVX2 and a portable scalar implementation.
+//
+#include <cmath>
+#include <cfloat>
+#include <cstddef>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define EWMA_X86_64
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#include "ewma_kernel.hpp"
+
+// MSVC emits AVX instructions for intrinsics without extra compiler flags,
+// GCC and Clang need the target enabled per function.
+#if defined(EWMA_X86_64) && !defined(_MSC_VER)
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// Multiply and add are kept separate (no FMA contraction) so that every
+// implementation returns bit-wise identical results.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+namespace {
+
+typedef void (*EwmaKernel)(const double *prev, const double *cv, const double beta, const double denom,
+                           double *ma, double *bc, const size_t n);
+typedef void (*ScanLocalKernel)(const double *u, double *ma, const size_t rows, const size_t n, const double beta);
+typedef void (*ScanCarryKernel)(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                                const double beta, const double beta_t0);
+
+// Portable implementation, also used for the tail of the vectorized loops
+void ewma_scalar(const double *prev, const double *cv, const double beta, const double denom,
+                 double *ma, double *bc, const size_t n)
+{
+    const double alpha = 1-beta;
+    for (size_t k = 0; k < n; k++) {
+        ma[k] = beta*prev[k]+alpha*cv[k];
+        bc[k] = ma[k]/denom;
+    }
+}
+
+// Next power of beta, flushed to zero before it gets denormal: far into a
+// series arithmetic on denormals would dominate the scan
+inline double next_power(const double w, const double beta)
+{
+    const double next = w*beta;
+    return next < DBL_MIN ? 0.0 : next;
+}
+
+// EWMA of a block of rows of n channels started from zero: row 0 is
+// (1-beta)*u, row r beta*row r-1+(1-beta)*u
+void scan_local_scalar(const double *u, double *ma, const size_t rows, const size_t n, const double beta)
+{
+    const double alpha = 1-beta;
+    for (size_t k = 0; k < n; k++) {
+        ma[k] = alpha*u[k];
+    }
+    for (size_t r = 1; r < rows; r++) {
+        const double *prev = ma+(r-1)*n;
+        const double *cv   = u+r*n;
+        double       *out  = ma+r*n;
+        for (size_t k = 0; k < n; k++) {
+            out[k] = beta*prev[k]+alpha*cv[k];
+        }
+    }
+}
+
+// Add the EWMA carried into a block, which decays by beta every row, and
+// bias correct it: row r gets w = beta^(r+1) times the carry and is divided
+// by 1-beta_t0*w. carry nullptr for the first block.
+void scan_carry_scalar(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                       const double beta, const double beta_t0)
+{
+    double w = beta;
+    double p = beta_t0 < DBL_MIN ? 0.0 : beta_t0*beta;
+    for (size_t r = 0; r < rows; r++, w = next_power(w, beta), p = next_power(p, beta)) {
+        double *m = ma+r*n;
+        double *b = bc+r*n;
+        const double denom = 1-p;
+        for (size_t k = 0; k < n; k++) {
+            if (carry) {
+                m[k] += w*carry[k];
+            }
+            b[k] = m[k]/denom;
+        }
+    }
+}
+
+#if defined(EWMA_X86_64)
+
+TARGET_AVX2
+void scan_local_avx2(const double *u, double *ma, const size_t rows, const size_t n, const double beta)
+{
+    const __m256d vbeta  = _mm256_set1_pd(beta);
+    const __m256d valpha = _mm256_set1_pd(1-beta);
+    const double alpha = 1-beta;
+
+    size_t k = 0;
+    for (; k+4 <= n; k += 4) {
+        _mm256_storeu_pd(ma+k, _mm256_mul_pd(valpha, _mm256_loadu_pd(u+k)));
+    }
+    for (; k < n; k++) {
+        ma[k] = alpha*u[k];
+    }
+    for (size_t r = 1; r < rows; r++) {
+        const double *prev = ma+(r-1)*n;
+        const double *cv   = u+r*n;
+        double       *out  = ma+r*n;
+        for (k = 0; k+4 <= n; k += 4) {
+            _mm256_storeu_pd(out+k, _mm256_add_pd(_mm256_mul_pd(vbeta, _mm256_loadu_pd(prev+k)),
+                                                  _mm256_mul_pd(valpha, _mm256_loadu_pd(cv+k))));
+        }
+        for (; k < n; k++) {
+            out[k] = beta*prev[k]+alpha*cv[k];
+        }
+    }
+}
+
+TARGET_AVX2
+void scan_carry_avx2(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                     const double beta, const double beta_t0)
+{
+    double w = beta;
+    double p = beta_t0 < DBL_MIN ? 0.0 : beta_t0*beta;
+    for (size_t r = 0; r < rows; r++, w = next_power(w, beta), p = next_power(p, beta)) {
+        double *m = ma+r*n;
+        double *b = bc+r*n;
+        const double denom = 1-p;
+        const __m256d vw = _mm256_set1_pd(w);
+        const __m256d vdenom = _mm256_set1_pd(denom);
+        size_t k = 0;
+        for (; k+4 <= n; k += 4) {
+            __m256d vm = _mm256_loadu_pd(m+k);
+            if (carry) {
+                vm = _mm256_add_pd(vm, _mm256_mul_pd(vw, _mm256_loadu_pd(carry+k)));
+                _mm256_storeu_pd(m+k, vm);
+            }
+            _mm256_storeu_pd(b+k, _mm256_div_pd(vm, vdenom));
+        }
+        for (; k < n; k++) {
+            if (carry) {
+                m[k] += w*carry[k];
+            }
+            b[k] = m[k]/denom;
+        }
+    }
+}
+
+TARGET_AVX512
+void scan_local_avx512(const double *u, double *ma, const size_t rows, const size_t n, const double beta)
+{
+    const __m512d vbeta  = _mm512_set1_pd(beta);
+    const __m512d valpha = _mm512_set1_pd(1-beta);
+    const double alpha = 1-beta;
+
+    size_t k = 0;
+    for (; k+8 <= n; k += 8) {
+        _mm512_storeu_pd(ma+k, _mm512_mul_pd(valpha, _mm512_loadu_pd(u+k)));
+    }
+    for (; k < n; k++) {
+        ma[k] = alpha*u[k];
+    }
+    for (size_t r = 1; r < rows; r++) {
+        const double *prev = ma+(r-1)*n;
+        const double *cv   = u+r*n;
+        double       *out  = ma+r*n;
+        for (k = 0; k+8 <= n; k += 8) {
+            _mm512_storeu_pd(out+k, _mm512_add_pd(_mm512_mul_pd(vbeta, _mm512_loadu_pd(prev+k)),
+                                                  _mm512_mul_pd(valpha, _mm512_loadu_pd(cv+k))));
+        }
+        for (; k < n; k++) {
+            out[k] = beta*prev[k]+alpha*cv[k];
+        }
+    }
+}
+
+TARGET_AVX512
+void scan_carry_avx512(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                       const double beta, const double beta_t0)
+{
+    double w = beta;
+    double p = beta_t0 < DBL_MIN ? 0.0 : beta_t0*beta;
+    for (size_t r = 0; r < rows; r++, w = next_power(w, beta), p = next_power(p, beta)) {
+        double *m = ma+r*n;
+        double *b = bc+r*n;
+        const double denom = 1-p;
+        const __m512d vw = _mm512_set1_pd(w);
+        const __m512d vdenom = _mm512_set1_pd(denom);
+        size_t k = 0;
+        for (; k+8 <= n; k += 8) {
+            __m512d vm = _mm512_loadu_pd(m+k);
+            if (carry) {
+                vm = _mm512_add_pd(vm, _mm512_mul_pd(vw, _mm512_loadu_pd(carry+k)));
+                _mm512_storeu_pd(m+k, vm);
+            }
+            _mm512_storeu_pd(b+k, _mm512_div_pd(vm, vdenom));
+        }
+        for (; k < n; k++) {
+            if (carry) {
+                m[k] += w*carry[k];
+            }
+            b[k] = m[k]/denom;
+        }
+    }
+}
+
+TARGET_AVX2
+void ewma_avx2(const double *prev, const double *cv, const double beta, const double denom,
+               double *ma, double *bc, const size_t n)
+{
+    const __m256d vbeta  = _mm256_set1_pd(beta);
+    const __m256d valpha = _mm256_set1_pd(1-beta);
+    const __m256d vdenom = _mm256_set1_pd(denom);
+
+    size_t k = 0;
+    for (; k+4 <= n; k += 4) {
+        __m256d vma = _mm256_add_pd(_mm256_mul_pd(vbeta, _mm256_loadu_pd(prev+k)),
+                                    _mm256_mul_pd(valpha, _mm256_loadu_pd(cv+k)));
+        _mm256_storeu_pd(ma+k, vma);
+        _mm256_storeu_pd(bc+k, _mm256_div_pd(vma, vdenom));
+    }
+    ewma_scalar(prev+k, cv+k, beta, denom, ma+k, bc+k, n-k);
+}
+
+TARGET_AVX512
+void ewma_avx512(const double *prev, const double *cv, const double beta, const double denom,
+                 double *ma, double *bc, const size_t n)
+{
+    const __m512d vbeta  = _mm512_set1_pd(beta);
+    const __m512d valpha = _mm512_set1_pd(1-beta);
+    const __m512d vdenom = _mm512_set1_pd(denom);
+
+    size_t k = 0;
+    for (; k+8 <= n; k += 8) {
+        __m512d vma = _mm512_add_pd(_mm512_mul_pd(vbeta, _mm512_loadu_pd(prev+k)),
+                                    _mm512_mul_pd(valpha, _mm512_loadu_pd(cv+k)));
+        _mm512_storeu_pd(ma+k, vma);
+        _mm512_storeu_pd(bc+k, _mm512_div_pd(vma, vdenom));
+    }
+    ewma_scalar(prev+k, cv+k, beta, denom, ma+k, bc+k, n-k);
+}
+
+#if defined(_MSC_VER)
+bool cpu_has_avx2()
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    // OSXSAVE and AVX, then make sure the OS saves the YMM registers
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 0x6) != 0x6) return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+bool cpu_has_avx512f()
+{
+    if (!cpu_has_avx2()) return false;
+
+    // The OS must also save the opmask and ZMM registers
+    if ((_xgetbv(0) & 0xe6) != 0xe6) return false;
+
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 16)) != 0;
+}
+#else
+bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+bool cpu_has_avx512f()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+#endif // EWMA_X86_64
+
+struct KernelEntry {
+    EwmaKernel      fcn;
+    ScanLocalKernel scan_local;
+    ScanCarryKernel scan_carry;
+    const char     *name;
+};
+
+KernelEntry select_kernel()
+{
+#if defined(EWMA_X86_64)
+    if (cpu_has_avx512f()) {
+        return {ewma_avx512, scan_local_avx512, scan_carry_avx512, "avx512"};
+    }
+    if (cpu_has_avx2()) {
+        return {ewma_avx2, scan_local_avx2, scan_carry_avx2, "avx2"};
+    }
+#endif
+    return {ewma_scalar, scan_local_scalar, scan_carry_scalar, "scalar"};
+}
+
+const KernelEntry & kernel()
+{
+    static const KernelEntry entry = select_kernel();
+    return entry;
+}
+
+} // anonymous namespace
+
+void compute_ewma_batch(const double *prev, const double *cv, const double beta, const int t,
+                        double *ma, double *bc, const size_t n)
+{
+    kernel().fcn(prev, cv, beta, 1-pow(beta,t), ma, bc, n);
+}
+
+void compute_ewma_batch_betapow(const double *prev, const double *cv, const double beta, const double beta_t,
+                                double *ma, double *bc, const size_t n)
+{
+    kernel().fcn(prev, cv, beta, 1-beta_t, ma, bc, n);
+}
+
+void ewma_scan_local(const double *u, double *ma, const size_t rows, const size_t n, const double beta)
+{
+    kernel().scan_local(u, ma, rows, n, beta);
+}
+
+void ewma_scan_carry(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                     const double beta, const double beta_t0)
+{
+    kernel().scan_carry(ma, bc, rows, n, carry, beta, beta_t0);
+}
+
+const char *ewma_kernel_name()
+{
+    return kernel().name;
+}
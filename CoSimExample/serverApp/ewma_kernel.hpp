@@ -0,0 +1,38 @@
+// Copyright 2018 The MathWorks, Inc.
+
+
+#ifndef EWMA_KERNEL_HPP
+#define EWMA_KERNEL_HPP
+
+#include <cstddef>
+
+// Compute EWMA and bias corrected EWMA for n independent channels which share
+// the same exponential weight and iteration number:
+//   ma[k] = beta*prev[k]+(1-beta)*cv[k]
+//   bc[k] = ma[k]/(1-beta^t)
+// The AVX-512, AVX2 or scalar implementation is picked at run time depending
+// on what the host CPU supports.
+void compute_ewma_batch(const double *prev, const double *cv, const double beta, const int t,
+                        double *ma, double *bc, const size_t n);
+
+// Same as compute_ewma_batch with beta^t supplied by the caller, e.g. a
+// running product kept across iterations instead of calling pow every step.
+void compute_ewma_batch_betapow(const double *prev, const double *cv, const double beta, const double beta_t,
+                                double *ma, double *bc, const size_t n);
+
+// Steps of the blocked scan computing a whole series, see ewma_scan.hpp. A
+// series is rows of n channels, one row per sample.
+// ewma_scan_local: EWMA of a block of rows as if it started from zero.
+void ewma_scan_local(const double *u, double *ma, const size_t rows, const size_t n, const double beta);
+
+// ewma_scan_carry: add carry, the EWMA of the row before the block, decayed
+// by beta^(r+1) to row r, and bias correct the rows, whose first sample is
+// iteration t0+1 with beta_t0 = beta^t0. carry is nullptr for the first
+// block of a series.
+void ewma_scan_carry(double *ma, double *bc, const size_t rows, const size_t n, const double *carry,
+                     const double beta, const double beta_t0);
+
+// Name of the implementation selected for this CPU ("avx512", "avx2" or "scalar")
+const char *ewma_kernel_name();
+
+#endif // EWMA_KERNEL_HPP
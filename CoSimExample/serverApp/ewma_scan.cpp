@@ -0,0 +1,378 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "ewma_scan.hpp"
+#include "ewma_kernel.hpp"
+
+// Series of fewer values are not worth starting threads for, and every
+// thread gets at least as many
+#define SCAN_PARALLEL_MIN  65536
+
+#if defined(_WIN32)
+#define PATH_SEP '\\'
+#else
+#define PATH_SEP '/'
+#endif
+
+namespace {
+
+// Run fcn(0) ... fcn(n-1) on n threads, the calling thread being one of them
+template <typename F>
+void parallel_blocks(const size_t n, F fcn)
+{
+    std::vector<std::thread> threads;
+    for (size_t b = 1; b < n; b++) {
+        threads.emplace_back(fcn, b);
+    }
+    fcn(0);
+    for (auto & t : threads) {
+        t.join();
+    }
+}
+
+// A file of doubles mapped into memory, read only or created writable
+class MappedSeriesFile {
+  public:
+    MappedSeriesFile() : addr(nullptr), len(0)
+#if defined(_WIN32)
+        , file(INVALID_HANDLE_VALUE), mapping(NULL)
+#else
+        , fd(-1)
+#endif
+    {
+    }
+
+    ~MappedSeriesFile()
+    {
+#if defined(_WIN32)
+        if (addr) UnmapViewOfFile(addr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (addr) munmap(addr, len);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    MappedSeriesFile(const MappedSeriesFile &) = delete;
+    MappedSeriesFile & operator=(const MappedSeriesFile &) = delete;
+
+    // Map the whole file, read only
+    void openRead(const std::string & path)
+    {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open the series " + path);
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            throw std::runtime_error("The series " + path + " is empty");
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        addr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map the series " + path);
+        }
+        len = static_cast<size_t>(size.QuadPart);
+#else
+        fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open the series " + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            throw std::runtime_error("The series " + path + " is empty");
+        }
+        map(path, static_cast<size_t>(st.st_size), PROT_READ);
+#endif
+    }
+
+    // Create the file of size bytes, replacing one of the same name, and map it
+    void create(const std::string & path, const size_t size)
+    {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not create the output " + path);
+        }
+        // The file grows with the mapping
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                     static_cast<DWORD>(size & 0xffffffffu), NULL);
+        addr = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map the output " + path);
+        }
+        len = size;
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create the output " + path + ": " + strerror(errno));
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            throw std::runtime_error("Could not size the output " + path + ": " + strerror(errno));
+        }
+        map(path, size, PROT_READ | PROT_WRITE);
+#endif
+    }
+
+    double *data() const { return static_cast<double *>(addr); }
+    size_t  size() const { return len; }
+
+    // True if path names the open file, also through another hard link
+    bool sameFile(const std::string & path) const
+    {
+#if defined(_WIN32)
+        HANDLE other = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (other == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        BY_HANDLE_FILE_INFORMATION a, b;
+        const bool same = GetFileInformationByHandle(file, &a) && GetFileInformationByHandle(other, &b) &&
+                          a.dwVolumeSerialNumber == b.dwVolumeSerialNumber &&
+                          a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+        CloseHandle(other);
+        return same;
+#else
+        struct stat a, b;
+        return fstat(fd, &a) == 0 && lstat(path.c_str(), &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#endif
+    }
+
+  private:
+    void  *addr;
+    size_t len;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+
+    void map(const std::string & path, const size_t size, const int prot)
+    {
+        void *p = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not map " + path + ": " + strerror(errno));
+        }
+        addr = p;
+        len = size;
+    }
+#endif
+};
+
+// Path of an existing directory with all links resolved
+std::string canonical_path(const std::string & path)
+{
+#if defined(_WIN32)
+    HANDLE dir = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    char buf[MAX_PATH];
+    DWORD n = 0;
+    if (dir != INVALID_HANDLE_VALUE) {
+        n = GetFinalPathNameByHandleA(dir, buf, MAX_PATH, FILE_NAME_NORMALIZED);
+        CloseHandle(dir);
+    }
+    if (n == 0 || n >= MAX_PATH) {
+        throw std::runtime_error("No such directory: " + path);
+    }
+    return std::string(buf, n);
+#else
+    char buf[PATH_MAX];
+    if (realpath(path.c_str(), buf) == nullptr) {
+        throw std::runtime_error("No such directory: " + path + ": " + strerror(errno));
+    }
+    return buf;
+#endif
+}
+
+// Path of a file of a job inside the data directory. The client names it
+// relative to the directory; absolute paths, drives and .. would reach files
+// outside of it, and so would links to directories outside of it. The
+// directory of the file is resolved, its last component is opened without
+// following links.
+std::string resolve_job_path(const std::string & data_dir, const std::string & rel)
+{
+    if (rel.empty() || rel[0] == '/' || rel[0] == '\\' || rel.find(':') != std::string::npos) {
+        throw std::runtime_error("EWMA file job paths must be relative to the data directory: " + rel);
+    }
+    size_t pos = 0;
+    while (pos <= rel.size()) {
+        size_t next = rel.find_first_of("/\\", pos);
+        if (next == std::string::npos) {
+            next = rel.size();
+        }
+        if (rel.compare(pos, next-pos, "..") == 0) {
+            throw std::runtime_error("EWMA file job paths must not leave the data directory: " + rel);
+        }
+        pos = next+1;
+    }
+
+    const std::string root = canonical_path(data_dir);
+    std::string path = root + PATH_SEP + rel;
+#if defined(_WIN32)
+    std::replace(path.begin(), path.end(), '/', '\\');
+#endif
+    const size_t sep = path.find_last_of(PATH_SEP);
+    const std::string dir = canonical_path(path.substr(0, sep));
+    if (dir != root && dir.compare(0, root.size()+1, root + PATH_SEP) != 0) {
+        throw std::runtime_error("EWMA file job paths must not leave the data directory: " + rel);
+    }
+    return dir + path.substr(sep);
+}
+
+} // anonymous namespace
+
+void compute_ewma_series(const double *u, double *ma, double *bc, const size_t samples, const size_t channels,
+                         const double beta, const unsigned int num_threads)
+{
+    if (samples == 0 || channels == 0) {
+        return;
+    }
+
+    // Blocks of whole samples, one per thread
+    size_t num_blocks = std::max<size_t>(1, samples*channels/SCAN_PARALLEL_MIN);
+    num_blocks = std::min<size_t>(num_blocks, std::max(1u, num_threads));
+    num_blocks = std::min(num_blocks, samples);
+
+    if (num_blocks == 1) {
+        ewma_scan_local(u, ma, samples, channels, beta);
+        ewma_scan_carry(ma, bc, samples, channels, nullptr, beta, 1.0);
+        return;
+    }
+
+    std::vector<size_t> start(num_blocks+1);
+    for (size_t b = 0; b <= num_blocks; b++) {
+        start[b] = samples*b/num_blocks;
+    }
+
+    parallel_blocks(num_blocks, [&](const size_t b) {
+        const size_t offset = start[b]*channels;
+        ewma_scan_local(u+offset, ma+offset, start[b+1]-start[b], channels, beta);
+    });
+
+    // carry[b] is the EWMA of the sample before block b
+    std::vector<double> carry(num_blocks*channels, 0.0);
+    for (size_t b = 1; b < num_blocks; b++) {
+        const double  decay = pow(beta, static_cast<double>(start[b]-start[b-1]));
+        const double *last  = ma+(start[b]-1)*channels;
+        const double *in    = &carry[(b-1)*channels];
+        double       *out   = &carry[b*channels];
+        for (size_t k = 0; k < channels; k++) {
+            out[k] = decay*in[k]+last[k];
+        }
+    }
+
+    parallel_blocks(num_blocks, [&](const size_t b) {
+        const size_t offset = start[b]*channels;
+        ewma_scan_carry(ma+offset, bc+offset, start[b+1]-start[b], channels,
+                        b == 0 ? nullptr : &carry[b*channels], beta, pow(beta, static_cast<double>(start[b])));
+    });
+}
+
+EwmaFileJob parse_ewma_file_job(const std::string & spec, const std::string & data_dir)
+{
+    if (data_dir.empty()) {
+        throw std::runtime_error("EWMA file jobs are disabled, start statcalserver with --data-dir");
+    }
+
+    EwmaFileJob job;
+    std::string query;
+    auto q = spec.find('?');
+    if (q != std::string::npos) {
+        query     = spec.substr(q+1);
+        job.input = spec.substr(0, q);
+    } else {
+        job.input = spec;
+    }
+    if (job.input.empty()) {
+        throw std::runtime_error("EWMA file job has no input file");
+    }
+
+    bool has_beta = false;
+    long channels = 0;
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        std::string opt = query.substr(0, amp);
+        query = (amp == std::string::npos) ? "" : query.substr(amp+1);
+
+        char *end = nullptr;
+        if (opt.compare(0, 5, "beta=") == 0) {
+            job.beta = strtod(opt.c_str()+5, &end);
+            has_beta = true;
+        } else if (opt.compare(0, 9, "channels=") == 0) {
+            channels = strtol(opt.c_str()+9, &end, 10);
+            if (channels < 1) end = nullptr;
+        } else if (opt.compare(0, 4, "out=") == 0) {
+            job.output = opt.substr(4);
+            continue;
+        } else {
+            throw std::runtime_error("Unknown EWMA file job option: " + opt);
+        }
+        if (!end || *end != '\0') {
+            throw std::runtime_error("EWMA file job option " + opt + " needs a number, channels one from 1");
+        }
+    }
+    if (!has_beta || channels == 0) {
+        throw std::runtime_error("EWMA file job must be: <input>?beta=B&channels=N[&out=<output>]");
+    }
+    job.channels = static_cast<size_t>(channels);
+    if (job.output.empty()) {
+        job.output = job.input+".ewma";
+    }
+    job.input  = resolve_job_path(data_dir, job.input);
+    job.output = resolve_job_path(data_dir, job.output);
+    if (job.output == job.input) {
+        throw std::runtime_error("EWMA file job output must not be its input");
+    }
+    return job;
+}
+
+size_t run_ewma_file_job(const EwmaFileJob & job, const unsigned int num_threads)
+{
+    MappedSeriesFile in;
+    in.openRead(job.input);
+
+    const size_t row = job.channels*sizeof(double);
+    if (in.size() % row != 0) {
+        throw std::runtime_error("Size of " + job.input + " is not a whole number of samples of " +
+                                 std::to_string(job.channels) + " channels");
+    }
+    const size_t samples = in.size()/row;
+
+    // Creating the output truncates it, which would clear the mapped input
+    if (in.sameFile(job.output)) {
+        throw std::runtime_error("EWMA file job output must not be its input");
+    }
+
+    MappedSeriesFile out;
+    out.create(job.output, 2*in.size());
+
+    const size_t n = samples*job.channels;
+    compute_ewma_series(in.data(), out.data(), out.data()+n, samples, job.channels, job.beta, num_threads);
+    return samples;
+}
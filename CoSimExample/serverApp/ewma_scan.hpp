@@ -0,0 +1,53 @@
+// Copyright 2018 The MathWorks, Inc.
+
+
+#ifndef EWMA_SCAN_HPP
+#define EWMA_SCAN_HPP
+
+#include <cstddef>
+#include <string>
+
+// EWMA of a whole series at once, for offline requests: T samples of n
+// channels, sample-major (u[t*n+k]), started from zero as a session is, so
+// that sample t is iteration t+1.
+//
+// The recurrence ma_t = beta*ma_{t-1}+(1-beta)*u_t is linear, so the series
+// is cut into one block per thread and scanned in three passes:
+//   1. every block is scanned from zero, in parallel
+//   2. the EWMA carried into each block is chained across the blocks,
+//      carry_b = beta^len_{b-1}*carry_{b-1}+local end of block b-1
+//   3. every block adds its carry decayed by beta^(r+1) to row r and is bias
+//      corrected, in parallel
+// The inner loops run over the channels with the SIMD kernels of
+// ewma_kernel.hpp. Results match a session stepped sample by sample up to
+// rounding, not bit for bit. Short series are scanned by the calling thread.
+void compute_ewma_series(const double *u, double *ma, double *bc, const size_t samples, const size_t channels,
+                         const double beta, const unsigned int num_threads);
+
+// A series in files: "<input>?beta=B&channels=N[&out=<output>]". The input
+// holds the raw doubles of the series, sample-major; the output, by default
+// the input path with ".ewma" appended, is written with ewma[T*N] followed
+// by bias_corrected_ewma[T*N]. Both are memory mapped.
+//
+// The paths come from clients, so they are taken relative to a data
+// directory the server was started with. Absolute paths and .. are rejected,
+// the directory of a file must be inside the data directory once links are
+// resolved, and on POSIX a file which is a symbolic link is not opened. The
+// output must not be the input, also not through a hard link. Without a data
+// directory there are no file jobs.
+struct EwmaFileJob {
+    std::string input;
+    std::string output;
+    double      beta;
+    size_t      channels;
+};
+
+// Throws std::runtime_error if the job is malformed, names a file outside of
+// data_dir or data_dir is empty
+EwmaFileJob parse_ewma_file_job(const std::string & spec, const std::string & data_dir);
+
+// Run the job, returns the number of samples. Throws std::runtime_error if a
+// file cannot be read or written.
+size_t run_ewma_file_job(const EwmaFileJob & job, const unsigned int num_threads);
+
+#endif // EWMA_SCAN_HPP
@@ -0,0 +1,440 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "stat_ops.hpp"
+#include "ewma_kernel.hpp"
+#include "statcal_util.hpp"
+
+// Largest window times channels of a sliding window session
+#define STAT_WINDOW_MAX      1048576
+
+// Range of the t-digest compression, the number of centroids is about as large
+#define TDIGEST_MIN_COMPRESSION   10
+#define TDIGEST_MAX_COMPRESSION   1000
+
+#define TDIGEST_PI  3.14159265358979323846
+
+void StatOperator::setParams(const double *)
+{
+    throw std::runtime_error("Parameters of this operator cannot be changed in a session");
+}
+
+StatOperatorRegistry & StatOperatorRegistry::instance()
+{
+    static StatOperatorRegistry r;
+    return r;
+}
+
+bool StatOperatorRegistry::add(const unsigned int id, const StatOperatorInfo & info)
+{
+    if (id < OP_USER || id > OP_MAX) {
+        throw std::runtime_error(std::string("Operator ") + info.name + " needs an id from " + std::to_string(OP_USER) +
+                                 " to " + std::to_string(OP_MAX) + ", not " + std::to_string(id));
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    return ops.emplace(id, info).second;
+}
+
+const StatOperatorInfo *StatOperatorRegistry::find(const unsigned int id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = ops.find(id);
+    return it == ops.end() ? nullptr : &it->second;
+}
+
+std::vector<unsigned int> StatOperatorRegistry::ids()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<unsigned int> v;
+    for (auto & op : ops) {
+        v.push_back(op.first);
+    }
+    return v;
+}
+
+namespace {
+
+// (beta), replies (ewma[N], bias_corrected_ewma[N]) as the sessions always
+// did: beta^t is a running product, restarted from the new beta when it
+// changes
+class EwmaOperator : public StatOperator {
+  public:
+    void reset(const double *params, const size_t n) override
+    {
+        prev.assign(n, 0.0);
+        beta   = params[0];
+        beta_t = 1.0;
+        iter   = 0;
+    }
+
+    void setParams(const double *params) override
+    {
+        beta   = params[0];
+        beta_t = pow(beta, iter);
+    }
+
+    void step(const double *u, double *out) override
+    {
+        const size_t n = prev.size();
+
+        iter++;
+        beta_t *= beta;
+
+        compute_ewma_batch_betapow(&prev[0], u, beta, beta_t, out, out+n, n);
+        std::copy(out, out+n, prev.begin());
+    }
+
+  private:
+    std::vector<double> prev;   // previous EWMA value of every channel
+    double       beta;
+    double       beta_t;        // beta^iter, updated incrementally
+    unsigned int iter;
+};
+
+// (), replies (mean[N], variance[N]) of all samples so far, Welford's
+// update. The variance is the sample variance, 0 after the first sample.
+class WelfordOperator : public StatOperator {
+  public:
+    void reset(const double *, const size_t n) override
+    {
+        count = 0;
+        mean.assign(n, 0.0);
+        m2.assign(n, 0.0);
+    }
+
+    void step(const double *u, double *out) override
+    {
+        const size_t n = mean.size();
+
+        count++;
+        const double inv = 1.0/static_cast<double>(count);
+        const double inv_var = count > 1 ? 1.0/static_cast<double>(count-1) : 0.0;
+        for (size_t k = 0; k < n; k++) {
+            const double d = u[k]-mean[k];
+            mean[k] += d*inv;
+            m2[k]   += d*(u[k]-mean[k]);
+            out[k]   = mean[k];
+            out[n+k] = m2[k]*inv_var;
+        }
+    }
+
+  private:
+    uint64_t            count;
+    std::vector<double> mean;
+    std::vector<double> m2;     // sum of squared differences from the mean
+};
+
+// Sample indices of a window whose values are monotonic, the front is the
+// minimum (or maximum) of the window. Every index enters and leaves once.
+class MonotonicQueue {
+  public:
+    void reset(const size_t window)
+    {
+        idx.assign(window, 0);
+        head = 0;
+        size = 0;
+    }
+
+    // Drop the indices which left the window, the ones whose value is beaten
+    // by the new sample, then add it. before(a, b) is true if a stays ahead
+    // of b.
+    template <typename Before, typename Value>
+    void push(const uint64_t t, const double x, Before before, Value value)
+    {
+        const size_t w = idx.size();
+        while (size > 0 && idx[head]+w <= t) {
+            head = (head+1) % w;
+            size--;
+        }
+        while (size > 0 && !before(value(idx[(head+size-1) % w]), x)) {
+            size--;
+        }
+        idx[(head+size) % w] = t;
+        size++;
+    }
+
+    uint64_t front() const { return idx[head]; }
+
+  private:
+    std::vector<uint64_t> idx;
+    size_t head;
+    size_t size;
+};
+
+// (W), replies (mean[N], min[N], max[N]) of the last W samples, or of all
+// while there are fewer. The sum is recomputed from the window every W
+// samples so that its rounding errors do not pile up.
+class WindowOperator : public StatOperator {
+  public:
+    void reset(const double *params, const size_t n) override
+    {
+        const double w = params[0];
+        if (w < 1 || w != floor(w) || w*n > STAT_WINDOW_MAX) {
+            throw std::runtime_error("Window must be a whole number of samples from 1, at most " +
+                                     std::to_string(STAT_WINDOW_MAX) + " over all channels");
+        }
+        window = static_cast<size_t>(w);
+        count  = 0;
+        values.assign(window*n, 0.0);
+        sum.assign(n, 0.0);
+        minq.resize(n);
+        maxq.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            minq[k].reset(window);
+            maxq[k].reset(window);
+        }
+    }
+
+    void step(const double *u, double *out) override
+    {
+        const size_t n = sum.size();
+        double *slot = &values[(count % window)*n];
+
+        for (size_t k = 0; k < n; k++) {
+            auto value = [this, n, k](const uint64_t i) { return values[(i % window)*n+k]; };
+            sum[k] += u[k]-slot[k];
+            slot[k] = u[k];
+            minq[k].push(count, u[k], [](const double a, const double b) { return a < b; }, value);
+            maxq[k].push(count, u[k], [](const double a, const double b) { return a > b; }, value);
+        }
+        count++;
+
+        if (count % window == 0) {
+            std::fill(sum.begin(), sum.end(), 0.0);
+            for (size_t r = 0; r < window; r++) {
+                for (size_t k = 0; k < n; k++) {
+                    sum[k] += values[r*n+k];
+                }
+            }
+        }
+
+        const double inv = 1.0/static_cast<double>(std::min<uint64_t>(count, window));
+        for (size_t k = 0; k < n; k++) {
+            out[k]     = sum[k]*inv;
+            out[n+k]   = values[(minq[k].front() % window)*n+k];
+            out[2*n+k] = values[(maxq[k].front() % window)*n+k];
+        }
+    }
+
+  private:
+    size_t                      window;
+    uint64_t                    count;    // samples so far
+    std::vector<double>         values;   // last window samples, sample t in row t % window
+    std::vector<double>         sum;      // of the samples in the window
+    std::vector<MonotonicQueue> minq;
+    std::vector<MonotonicQueue> maxq;
+};
+
+// (beta), replies (ewma[N], ewm_variance[N]), the exponentially weighted
+// mean and variance. Both start from the first sample, with variance 0.
+class EwmaVarOperator : public StatOperator {
+  public:
+    void reset(const double *params, const size_t n) override
+    {
+        setParams(params);
+        started = false;
+        mean.assign(n, 0.0);
+        var.assign(n, 0.0);
+    }
+
+    void setParams(const double *params) override
+    {
+        if (!(params[0] >= 0 && params[0] <= 1)) {
+            throw std::runtime_error("Beta of the EWMA variance must be in [0, 1]");
+        }
+        beta = params[0];
+    }
+
+    void step(const double *u, double *out) override
+    {
+        const size_t n = mean.size();
+
+        if (!started) {
+            std::copy(u, u+n, mean.begin());
+            started = true;
+        } else {
+            const double alpha = 1-beta;
+            for (size_t k = 0; k < n; k++) {
+                const double d    = u[k]-mean[k];
+                const double incr = alpha*d;
+                mean[k] += incr;
+                var[k]   = beta*(var[k]+d*incr);
+            }
+        }
+        std::copy(mean.begin(), mean.end(), out);
+        std::copy(var.begin(), var.end(), out+n);
+    }
+
+  private:
+    double              beta;
+    bool                started;
+    std::vector<double> mean;
+    std::vector<double> var;
+};
+
+// Merging t-digest of one channel with the k1 scale function. Samples are
+// added as centroids of weight 1 and the centroids are merged whenever
+// there are twice as many as the compression, so that a sample costs
+// O(compression) however many came before.
+class TDigest {
+  public:
+    void reset()
+    {
+        centroids.clear();
+        total = 0;
+    }
+
+    void add(const double x, const double compression)
+    {
+        if (total == 0) {
+            min = max = x;
+        }
+        min = std::min(min, x);
+        max = std::max(max, x);
+        total += 1;
+
+        auto pos = std::upper_bound(centroids.begin(), centroids.end(), x,
+                                    [](const double v, const Centroid & c) { return v < c.mean; });
+        centroids.insert(pos, Centroid{x, 1.0});
+        if (centroids.size() > 2*compression) {
+            compress(compression);
+        }
+    }
+
+    // Linear between the centers of the centroids, and from the extremes to
+    // the outer ones
+    double quantile(const double q) const
+    {
+        if (centroids.size() == 1) {
+            return centroids[0].mean;
+        }
+        const double target = q*total;
+        const Centroid & first = centroids.front();
+        const Centroid & last  = centroids.back();
+        if (target < first.weight/2) {
+            return min+(first.mean-min)*target/(first.weight/2);
+        }
+        if (target > total-last.weight/2) {
+            return max-(max-last.mean)*(total-target)/(last.weight/2);
+        }
+        double cum = first.weight/2;
+        for (size_t i = 0; i+1 < centroids.size(); i++) {
+            const double gap = (centroids[i].weight+centroids[i+1].weight)/2;
+            if (target <= cum+gap) {
+                return centroids[i].mean+(centroids[i+1].mean-centroids[i].mean)*(target-cum)/gap;
+            }
+            cum += gap;
+        }
+        return last.mean;
+    }
+
+  private:
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+
+    std::vector<Centroid> centroids;   // by mean
+    double total;
+    double min;
+    double max;
+
+    // k1 scale function and its inverse
+    static double k_of_q(const double q, const double compression)
+    {
+        return compression/(2*TDIGEST_PI)*asin(2*q-1);
+    }
+
+    static double q_of_k(const double k, const double compression)
+    {
+        const double a = std::min(std::max(2*TDIGEST_PI*k/compression, -TDIGEST_PI/2), TDIGEST_PI/2);
+        return (sin(a)+1)/2;
+    }
+
+    // Merge neighbours as long as a centroid spans at most one unit of k
+    void compress(const double compression)
+    {
+        std::vector<Centroid> merged;
+        merged.reserve(centroids.size());
+
+        double before = 0;   // weight left of cur
+        double limit = q_of_k(k_of_q(0, compression)+1, compression)*total;
+        Centroid cur = centroids[0];
+        for (size_t i = 1; i < centroids.size(); i++) {
+            const Centroid & c = centroids[i];
+            if (before+cur.weight+c.weight <= limit) {
+                cur.mean  += (c.mean-cur.mean)*c.weight/(cur.weight+c.weight);
+                cur.weight += c.weight;
+            } else {
+                merged.push_back(cur);
+                before += cur.weight;
+                limit = q_of_k(k_of_q(before/total, compression)+1, compression)*total;
+                cur = c;
+            }
+        }
+        merged.push_back(cur);
+        centroids.swap(merged);
+    }
+};
+
+// (compression, q), replies (quantile[N]), the q quantile of all samples so
+// far estimated by a t-digest of every channel
+class TDigestOperator : public StatOperator {
+  public:
+    void reset(const double *params, const size_t n) override
+    {
+        setParams(params);
+        digests.assign(n, TDigest());
+        for (auto & d : digests) {
+            d.reset();
+        }
+    }
+
+    void setParams(const double *params) override
+    {
+        if (!(params[0] >= TDIGEST_MIN_COMPRESSION && params[0] <= TDIGEST_MAX_COMPRESSION)) {
+            throw std::runtime_error("Compression of the t-digest must be in [" + std::to_string(TDIGEST_MIN_COMPRESSION) +
+                                     ", " + std::to_string(TDIGEST_MAX_COMPRESSION) + "]");
+        }
+        if (!(params[1] >= 0 && params[1] <= 1)) {
+            throw std::runtime_error("Quantile of the t-digest must be in [0, 1]");
+        }
+        compression = params[0];
+        q = params[1];
+    }
+
+    void step(const double *u, double *out) override
+    {
+        for (size_t k = 0; k < digests.size(); k++) {
+            digests[k].add(u[k], compression);
+            out[k] = digests[k].quantile(q);
+        }
+    }
+
+  private:
+    double               compression;
+    double               q;
+    std::vector<TDigest> digests;
+};
+
+template <typename T>
+std::unique_ptr<StatOperator> make_operator()
+{
+    return std::unique_ptr<StatOperator>(new T());
+}
+
+} // anonymous namespace
+
+StatOperatorRegistry::StatOperatorRegistry()
+{
+    ops.emplace(OP_EWMA,     StatOperatorInfo{"ewma",     1, 2, make_operator<EwmaOperator>});
+    ops.emplace(OP_WELFORD,  StatOperatorInfo{"welford",  0, 2, make_operator<WelfordOperator>});
+    ops.emplace(OP_WINDOW,   StatOperatorInfo{"window",   1, 3, make_operator<WindowOperator>});
+    ops.emplace(OP_EWMA_VAR, StatOperatorInfo{"ewma_var", 1, 2, make_operator<EwmaVarOperator>});
+    ops.emplace(OP_TDIGEST,  StatOperatorInfo{"tdigest",  2, 1, make_operator<TDigestOperator>});
+}
@@ -0,0 +1,77 @@
+// Copyright 2018 The MathWorks, Inc.
+
+
+#ifndef STAT_OPS_HPP
+#define STAT_OPS_HPP
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Streaming statistics computed in the sessions of statcalserver. A session
+// runs the operator named by the op of the request which opened it, see
+// StatOp in statcal_util.hpp:
+//   SESSION_OPEN, SESSION_RESET  (params[P], u[N])  reset, then step
+//   SESSION_DATA                 (u[N])             step
+//   SESSION_BETA                 (params[P], u[N])  setParams, then step
+// and every step is replied with the operator's outputs, numOutputs values
+// per channel, output-major: (out0[N], out1[N], ...).
+//
+// The cost of a step does not grow with the number of samples of the
+// session. Operators of a session are only used by the worker owning it.
+class StatOperator {
+  public:
+    virtual ~StatOperator() {}
+
+    // Start over for n channels from the parameters, throws
+    // std::runtime_error if they are out of range
+    virtual void reset(const double *params, const size_t n) = 0;
+
+    // New parameters, keeping the state. By default they cannot be changed.
+    virtual void setParams(const double *params);
+
+    // Add a sample of every channel and write the outputs
+    virtual void step(const double *u, double *out) = 0;
+};
+
+struct StatOperatorInfo {
+    const char  *name;
+    unsigned int num_params;
+    unsigned int num_outputs;   // per channel
+    std::function<std::unique_ptr<StatOperator>()> create;
+};
+
+// Operators by op id. The built-in ones, ids below OP_USER, come with the
+// registry; more are added with REGISTER_STAT_OPERATOR in any source linked
+// into the server, or with add() before the server starts, and need no
+// change of the request handling.
+class StatOperatorRegistry {
+  public:
+    static StatOperatorRegistry & instance();
+
+    // Operator of a user, id from OP_USER to OP_MAX, the range the message
+    // header holds. False if the id is taken, throws std::runtime_error if it
+    // is out of the range.
+    bool add(const unsigned int id, const StatOperatorInfo & info);
+
+    // nullptr if no operator has the id
+    const StatOperatorInfo *find(const unsigned int id);
+
+    std::vector<unsigned int> ids();
+
+  private:
+    std::mutex lock;
+    std::map<unsigned int, StatOperatorInfo> ops;
+
+    StatOperatorRegistry();
+};
+
+// Register Class, default constructible, as operator id
+#define REGISTER_STAT_OPERATOR(id, name, num_params, num_outputs, Class)                         \
+    static const bool Class##_registered = StatOperatorRegistry::instance().add(                \
+        id, {name, num_params, num_outputs, [] { return std::unique_ptr<StatOperator>(new Class()); }})
+
+#endif // STAT_OPS_HPP
@@ -4,12 +4,27 @@
 //  stats calculator client in C++
 //  Connects REQ socket to tcp://localhost:5555
 //
+//  Besides an example of every request it checks a bulk request against a
+//  session stepped through the same series, and the operators of sessions
+//  against statistics computed here. With a data directory, the one
+//  the server was started with, it also runs the series as a file job and
+//  checks that malformed file jobs are refused. The exit code is 1 if a
+//  check failed.
+//
 #include <zmq.hpp>
 #include <string>
 #include <iostream>
 #include <memory>
 #include <chrono>
 #include <cstring>
+#include <vector>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 #include "statcal_util.hpp"
 
@@ -18,8 +33,8 @@ using namespace std::chrono;
 #define REQUEST_TIMEOUT     2500    //  msecs, (> 1000!)
 #define REQUEST_RETRIES     3       //  Before we abandon
 
-// [int len][double][double]...[double]
-// [int -len][char][char]...[char]
+// [int type][int len][unsigned int session][unsigned int seq][double][double]...[double]
+// [int type][int -len][unsigned int session][unsigned int seq][char][char]...[char]
 
 std::unique_ptr<zmq::socket_t> CreateSocket(zmq::context_t &context, const std::string & socket_addr)
 {
@@ -38,6 +53,7 @@ void SendRequest(std::unique_ptr<zmq::socket_t> & socket_ptr,
                  const std::string & socket_addr,
                  const std::string request_str,
                  zmq::message_t & reply,
+                 const bool verbose = true,
                  int retries_left = REQUEST_RETRIES)
 {
     zmq::message_t request;
@@ -60,21 +76,26 @@ void SendRequest(std::unique_ptr<zmq::socket_t> & socket_ptr,
         if (items[0].revents & ZMQ_POLLIN) {
             
             socket_ptr->recv(&reply);
-            char *reply_str = static_cast<char*>(reply.data());
-            reply_str[reply.size()] = '\0';
+            const char *reply_str = static_cast<const char*>(reply.data());
+            if (!verbose) {
+                break;
+            }
 
-            int len = decode_header(reply_str);
-            if (len >= 0) {
+            MsgHeader hdr = decode_header(reply_str);
+            if (hdr.len >= 0) {
                 std::vector<double> data;
-                decode_double_data(len, reply_str, data);
-                std::cout << "Received: (len) " << len << "(data)";
-                for (auto & it : data) {
-                    std::cout << " " << it;
+                decode_double_data(hdr, reply_str, data);
+                std::cout << "Received: (session) " << hdr.session << " (len) " << hdr.len;
+                if (data.size() <= 16) {
+                    std::cout << " (data)";
+                    for (auto & it : data) {
+                        std::cout << " " << it;
+                    }
                 }
                 std::cout << std::endl;
             } else {
                 std::string str;
-                decode_str_data(reply_str, str);
+                decode_str_data(hdr, reply_str, str);
                 std::cout << "Received: " << str << std::endl;
             }
             break;
@@ -90,16 +111,371 @@ void SendRequest(std::unique_ptr<zmq::socket_t> & socket_ptr,
     }
 }
 
+// Doubles of a reply, empty for an error
+std::vector<double> ReplyData(const zmq::message_t & reply)
+{
+    const char *reply_str = static_cast<const char*>(reply.data());
+    MsgHeader hdr = decode_header(reply_str);
+    std::vector<double> data;
+    if (hdr.type == REPLY && hdr.len >= 0) {
+        decode_double_data(hdr, reply_str, data);
+    }
+    return data;
+}
+
+// Bulk request of a series against a session stepped through it. The
+// series is long enough for the server to scan it in several blocks.
+bool CheckBulk(std::unique_ptr<zmq::socket_t> & socket_ptr, zmq::context_t &context,
+               const std::string & socket_addr, const double beta, const size_t samples,
+               const size_t channels, std::vector<double> & series, std::vector<double> & bulk)
+{
+    std::string request_str;
+    zmq::message_t reply;
+
+    series.resize(samples*channels);
+    for (size_t k = 0; k < series.size(); k++) {
+        series[k] = sin(0.001*k)+static_cast<double>(k % 7);
+    }
+
+    std::vector<double> data{beta, static_cast<double>(channels)};
+    data.insert(data.end(), series.begin(), series.end());
+    encode_double_data(EWMA_BULK, 0, 10, data, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+    bulk = ReplyData(reply);
+    if (bulk.size() != 2*series.size()) {
+        std::cout << "Bulk check failed: no reply of " << samples << " samples" << std::endl;
+        return false;
+    }
+
+    double max_diff = 0.0;
+    unsigned int session = 0;
+    for (size_t t = 0; t < samples; t++) {
+        std::vector<double> u(series.begin()+t*channels, series.begin()+(t+1)*channels);
+        if (t == 0) {
+            u.insert(u.begin(), beta);
+        }
+        encode_double_data(t == 0 ? SESSION_OPEN : SESSION_DATA, session, 11, u, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+        if (t == 0) {
+            session = decode_header(static_cast<const char*>(reply.data())).session;
+        }
+        std::vector<double> md = ReplyData(reply);
+        if (md.size() != 2*channels) {
+            std::cout << "Bulk check failed: session step " << t << " failed" << std::endl;
+            return false;
+        }
+        for (size_t k = 0; k < channels; k++) {
+            const double *ma = &bulk[t*channels];
+            const double *bc = &bulk[series.size()+t*channels];
+            max_diff = std::max(max_diff, fabs(ma[k]-md[k])/(1+fabs(md[k])));
+            max_diff = std::max(max_diff, fabs(bc[k]-md[channels+k])/(1+fabs(md[channels+k])));
+        }
+    }
+    encode_double_data(SESSION_CLOSE, session, 12, {}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+
+    std::cout << "Bulk request of " << samples << " samples of " << channels
+              << " channels vs session: max relative difference " << max_diff << std::endl;
+    return max_diff < 1e-9;
+}
+
+// Sessions of the operators other than the EWMA stepped through a series of
+// two channels, against the statistics of the whole series computed here.
+// The t-digest median is only checked to be close to the exact one.
+bool CheckOperators(std::unique_ptr<zmq::socket_t> & socket_ptr, zmq::context_t &context,
+                    const std::string & socket_addr)
+{
+    const size_t samples = 2000;
+    const size_t channels = 2;
+    const size_t window = 50;
+    const double beta = 0.9;
+
+    std::vector<double> series(samples*channels);
+    for (size_t k = 0; k < series.size(); k++) {
+        series[k] = 10*sin(0.37*k)+static_cast<double>((k*7919) % 101)/10;
+    }
+
+    struct OpCheck {
+        StatOp              op;
+        const char         *name;
+        std::vector<double> params;
+        size_t              num_outputs;
+    };
+    const OpCheck checks[] = {
+        {OP_WELFORD,  "welford",  {},             2},
+        {OP_WINDOW,   "window",   {double(window)}, 3},
+        {OP_EWMA_VAR, "ewma_var", {beta},         2},
+        {OP_TDIGEST,  "tdigest",  {100, 0.5},     1},
+    };
+
+    std::string request_str;
+    zmq::message_t reply;
+    bool ok = true;
+    for (auto & c : checks) {
+        double max_diff = 0.0;
+        unsigned int session = 0;
+        std::vector<double> md;
+        std::vector<double> mean(channels, 0.0), var(channels, 0.0);
+        for (size_t t = 0; t < samples; t++) {
+            const double *u = &series[t*channels];
+            std::vector<double> data(u, u+channels);
+            if (t == 0) {
+                data.insert(data.begin(), c.params.begin(), c.params.end());
+            }
+            encode_op_data(t == 0 ? SESSION_OPEN : SESSION_DATA, c.op, session, 20, data, request_str);
+            SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+            if (t == 0) {
+                session = decode_header(static_cast<const char*>(reply.data())).session;
+            }
+            md = ReplyData(reply);
+            if (md.size() != c.num_outputs*channels) {
+                std::cout << "Operator check failed: " << c.name << " session step " << t << " failed" << std::endl;
+                return false;
+            }
+
+            for (size_t k = 0; k < channels; k++) {
+                std::vector<double> expected;
+                if (c.op == OP_WELFORD || c.op == OP_WINDOW) {
+                    // Two passes over the samples so far or in the window
+                    const size_t first = c.op == OP_WINDOW && t+1 > window ? t+1-window : 0;
+                    double sum = 0.0, lo = u[k], hi = u[k];
+                    for (size_t r = first; r <= t; r++) {
+                        sum += series[r*channels+k];
+                        lo = std::min(lo, series[r*channels+k]);
+                        hi = std::max(hi, series[r*channels+k]);
+                    }
+                    const double m = sum/(t+1-first);
+                    double ss = 0.0;
+                    for (size_t r = first; r <= t; r++) {
+                        ss += (series[r*channels+k]-m)*(series[r*channels+k]-m);
+                    }
+                    expected = c.op == OP_WELFORD ? std::vector<double>{m, t > 0 ? ss/t : 0.0}
+                                                  : std::vector<double>{m, lo, hi};
+                } else if (c.op == OP_EWMA_VAR) {
+                    if (t == 0) {
+                        mean[k] = u[k];
+                    } else {
+                        const double d = u[k]-mean[k];
+                        mean[k] += (1-beta)*d;
+                        var[k] = beta*(var[k]+(1-beta)*d*d);
+                    }
+                    expected = {mean[k], var[k]};
+                }
+                for (size_t j = 0; j < expected.size(); j++) {
+                    max_diff = std::max(max_diff, fabs(md[j*channels+k]-expected[j])/(1+fabs(expected[j])));
+                }
+            }
+        }
+        encode_double_data(SESSION_CLOSE, session, 21, {}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+
+        if (c.op == OP_TDIGEST) {
+            // Median of the whole series, to a hundredth of its range
+            for (size_t k = 0; k < channels; k++) {
+                std::vector<double> v;
+                for (size_t t = 0; t < samples; t++) {
+                    v.push_back(series[t*channels+k]);
+                }
+                std::sort(v.begin(), v.end());
+                const double median = (v[samples/2-1]+v[samples/2])/2;
+                max_diff = std::max(max_diff, fabs(md[k]-median)/(v.back()-v.front()));
+            }
+        }
+        const double tolerance = c.op == OP_TDIGEST ? 1e-2 : 1e-9;
+        std::cout << "Operator " << c.name << " vs direct computation: max relative difference " << max_diff << std::endl;
+        ok = ok && max_diff < tolerance;
+    }
+
+    // Parameters out of range are refused
+    encode_op_data(SESSION_OPEN, OP_WINDOW, 0, 22, {0.5, 1.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+    if (decode_header(static_cast<const char*>(reply.data())).type != ERROR_REPLY) {
+        std::cout << "Operator check failed: window of 0.5 samples was not refused" << std::endl;
+        ok = false;
+    }
+    encode_op_data(SESSION_OPEN, OP_USER+99, 0, 23, {1.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+    if (decode_header(static_cast<const char*>(reply.data())).type != ERROR_REPLY) {
+        std::cout << "Operator check failed: unknown operator was not refused" << std::endl;
+        ok = false;
+    }
+    // Ids beyond the 16 bits of the header are not sent as another operator
+    try {
+        encode_op_data(SESSION_OPEN, OP_MAX+1+OP_WELFORD, 0, 24, {1.0}, request_str);
+        std::cout << "Operator check failed: operator id beyond " << OP_MAX << " was encoded" << std::endl;
+        ok = false;
+    } catch (std::runtime_error &) {
+    }
+    return ok;
+}
+
+// Sequenced session requests, as the gateway block sends them: a request
+// sent again is answered with the same reply and does not step the session,
+// one ahead of a lost request is refused
+bool CheckResent(std::unique_ptr<zmq::socket_t> & socket_ptr, zmq::context_t &context,
+                 const std::string & socket_addr)
+{
+    const MsgType open = static_cast<MsgType>(SESSION_OPEN | MSG_SEQUENCED);
+    const MsgType data = static_cast<MsgType>(SESSION_DATA | MSG_SEQUENCED);
+    std::string request_str;
+    zmq::message_t reply;
+    bool ok = true;
+
+    encode_double_data(open, 0, 30, {0.5, 1.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    const unsigned int session = decode_header(static_cast<const char*>(reply.data())).session;
+
+    encode_double_data(data, session, 31, {3.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    const std::vector<double> first = ReplyData(reply);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    if (first.empty() || ReplyData(reply) != first) {
+        std::cout << "Resend check failed: request sent again was not answered as before" << std::endl;
+        ok = false;
+    }
+
+    encode_double_data(data, session, 33, {5.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    if (decode_header(static_cast<const char*>(reply.data())).type != ERROR_REPLY) {
+        std::cout << "Resend check failed: request ahead of a lost one was not refused" << std::endl;
+        ok = false;
+    }
+
+    encode_double_data(data, session, 32, {3.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    const std::vector<double> md = ReplyData(reply);
+
+    // The same samples in a session stepped once each
+    encode_double_data(SESSION_OPEN, 0, 35, {0.5, 1.0}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    const unsigned int expected = decode_header(static_cast<const char*>(reply.data())).session;
+    for (int k = 0; k < 2; k++) {
+        encode_double_data(SESSION_DATA, expected, 36, {3.0}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    }
+    if (md.empty() || ReplyData(reply) != md) {
+        std::cout << "Resend check failed: session was not stepped once per request" << std::endl;
+        ok = false;
+    }
+
+    encode_double_data(SESSION_CLOSE, session, 34, {}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    encode_double_data(SESSION_CLOSE, expected, 37, {}, request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply, false);
+    return ok;
+}
+
+// A file job which must be answered with an error
+bool ExpectFileJobError(std::unique_ptr<zmq::socket_t> & socket_ptr, zmq::context_t &context,
+                        const std::string & socket_addr, const std::string & spec)
+{
+    std::string request_str;
+    zmq::message_t reply;
+
+    encode_str_data(EWMA_FILE, 0, 13, spec.c_str(), request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+    if (decode_header(static_cast<const char*>(reply.data())).type != ERROR_REPLY) {
+        std::cout << "File job check failed: " << spec << " was not refused" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The series of CheckBulk as a file job in the server's data directory,
+// whose output must match the bulk reply, and malformed jobs
+bool CheckFileJob(std::unique_ptr<zmq::socket_t> & socket_ptr, zmq::context_t &context,
+                  const std::string & socket_addr, const std::string & data_dir, const double beta,
+                  const size_t channels, const std::vector<double> & series, const std::vector<double> & bulk)
+{
+    const std::string name = "statcal_gateway_series.bin";
+    {
+        std::ofstream in(data_dir+"/"+name, std::ios::binary | std::ios::trunc);
+        in.write(reinterpret_cast<const char*>(&series[0]), series.size()*sizeof(double));
+        if (!in) {
+            std::cout << "File job check failed: could not write " << data_dir << "/" << name << std::endl;
+            return false;
+        }
+    }
+
+    std::string request_str;
+    zmq::message_t reply;
+    const std::string spec = name+"?beta="+std::to_string(beta)+"&channels="+std::to_string(channels);
+    encode_str_data(EWMA_FILE, 0, 14, spec.c_str(), request_str);
+    SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+    std::vector<double> shape = ReplyData(reply);
+    if (shape.size() != 2 || shape[0]*shape[1] != static_cast<double>(series.size())) {
+        std::cout << "File job check failed: " << spec << std::endl;
+        return false;
+    }
+
+    std::vector<double> out(bulk.size());
+    std::ifstream result(data_dir+"/"+name+".ewma", std::ios::binary);
+    result.read(reinterpret_cast<char*>(&out[0]), out.size()*sizeof(double));
+    if (!result || result.peek() != EOF || out != bulk) {
+        std::cout << "File job check failed: output differs from the bulk reply" << std::endl;
+        return false;
+    }
+
+    const char *malformed[] = {
+        "?beta=0.9&channels=1",                               // no input
+        "statcal_gateway_series.bin?beta=x&channels=1",       // beta not a number
+        "statcal_gateway_series.bin?beta=0.9",                // no channels
+        "statcal_gateway_series.bin?beta=0.9&channels=0",
+        "statcal_gateway_series.bin?beta=0.9&channels=1&n=1", // unknown option
+        "statcal_gateway_missing.bin?beta=0.9&channels=1",    // no such file
+        "../statcal_gateway_series.bin?beta=0.9&channels=1",  // outside of the data directory
+        "/etc/passwd?beta=0.9&channels=1",
+        "statcal_gateway_series.bin?beta=0.9&channels=1&out=../x.ewma",
+        "statcal_gateway_series.bin?beta=0.9&channels=1&out=statcal_gateway_series.bin", // output is the input
+        "statcal_gateway_series.bin?beta=0.9&channels=1&out=./statcal_gateway_series.bin",
+    };
+    bool ok = true;
+    for (auto & spec : malformed) {
+        ok = ExpectFileJobError(socket_ptr, context, socket_addr, spec) && ok;
+    }
+
+#if !defined(_WIN32)
+    // The output must not be the input through a hard link, nor leave the
+    // data directory through a link to a directory
+    const std::string hard = data_dir+"/statcal_gateway_hard.bin";
+    const std::string outside = data_dir+"/statcal_gateway_outside";
+    unlink(hard.c_str());
+    unlink(outside.c_str());
+    if (link((data_dir+"/"+name).c_str(), hard.c_str()) == 0) {
+        ok = ExpectFileJobError(socket_ptr, context, socket_addr, name+"?beta=0.9&channels=1&out=statcal_gateway_hard.bin") && ok;
+        unlink(hard.c_str());
+    }
+    if (symlink("..", outside.c_str()) == 0) {
+        ok = ExpectFileJobError(socket_ptr, context, socket_addr,
+                                name+"?beta=0.9&channels=1&out=statcal_gateway_outside/statcal_gateway_escaped.ewma") && ok;
+        ok = ExpectFileJobError(socket_ptr, context, socket_addr,
+                                "statcal_gateway_outside/"+name+"?beta=0.9&channels=1") && ok;
+        unlink(outside.c_str());
+    }
+#endif
+
+    // Refused jobs leave the input as it was
+    std::vector<double> kept(series.size());
+    std::ifstream input(data_dir+"/"+name, std::ios::binary);
+    input.read(reinterpret_cast<char*>(&kept[0]), kept.size()*sizeof(double));
+    if (!input || kept != series) {
+        std::cout << "File job check failed: a refused job changed the input" << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
 int main (int argc, char *argv[])
 {
-    if (argc != 3) {
-         std::cerr << "Error: stats client should be launched using statcal_gateway <host> <port_number>" << std::endl;
+    if (argc != 3 && argc != 4) {
+         std::cerr << "Error: stats client should be launched using statcal_gateway <host> <port_number> [<data_dir>]" << std::endl;
         return 1;
     }
 
     std::string host = argv[1];
     std::string port = argv[2];
     std::string socket_addr = "tcp://"+host+":"+port;
+    std::string data_dir = argc == 4 ? argv[3] : "";
 
     //  Prepare our context and socket
     zmq::context_t context (1);
@@ -107,24 +483,64 @@ int main (int argc, char *argv[])
     
     std::string request_str;
     zmq::message_t reply;
+    bool ok = true;
 
     high_resolution_clock::time_point t1 = high_resolution_clock::now();
     
     try {
         auto socket_ptr = CreateSocket(context, socket_addr);
 
+        // Stateless request: (prev, current, beta, iteration)
         std::vector<double> data{0, 4.32, 0.99, 1};
-        encode_double_data(data, request_str);
+        encode_double_data(EWMA, 0, 1, data, request_str);
         SendRequest(socket_ptr, context, socket_addr, request_str, reply);
-        encode_str_data("terminate", request_str);
+
+        // Session: (beta, current) to open, then only the new sample
+        encode_double_data(SESSION_OPEN, 0, 2, {0.99, 4.32}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+        unsigned int session = decode_header(static_cast<const char*>(reply.data())).session;
+        encode_double_data(SESSION_DATA, session, 3, {5.1}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+        // Start the session over, as a model does in its next run
+        encode_double_data(SESSION_RESET, session, 4, {0.99, 4.32}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+        encode_double_data(SESSION_CLOSE, session, 5, {}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+
+        // Whole series in one request, inline and as a file job
+        const double beta = 0.99;
+        const size_t channels = 8;
+        std::vector<double> series, bulk;
+        ok = CheckBulk(socket_ptr, context, socket_addr, beta, 20000, channels, series, bulk) && ok;
+        if (!data_dir.empty()) {
+            ok = ok && CheckFileJob(socket_ptr, context, socket_addr, data_dir, beta, channels, series, bulk);
+        } else {
+            // Refused unless the server was started with a data directory
+            ok = ExpectFileJobError(socket_ptr, context, socket_addr, "series.bin?beta=0.9&channels=1") && ok;
+        }
+
+        // Other statistics than the EWMA, one session per operator
+        ok = CheckOperators(socket_ptr, context, socket_addr) && ok;
+        ok = CheckResent(socket_ptr, context, socket_addr) && ok;
+
+        // Counters and latency histograms of the server
+        encode_double_data(STATS, 0, 6, {}, request_str);
+        SendRequest(socket_ptr, context, socket_addr, request_str, reply);
+        std::unique_ptr<ServerStats> stats(new ServerStats);
+        decode_stats_data(decode_header(static_cast<const char*>(reply.data())),
+                          static_cast<const char*>(reply.data()), *stats);
+        print_stats(std::cout, *stats);
+
+        encode_double_data(TERMINATE, 0, 7, {}, request_str);
         SendRequest(socket_ptr, context, socket_addr, request_str, reply);
     } catch (std::exception &e) {
         std::cout << "Exception: " << e.what() << std::endl;
+        ok = false;
     }
     
     high_resolution_clock::time_point t2 = high_resolution_clock::now();
     double dif = duration_cast<nanoseconds>( t2 - t1 ).count()/1e9;
     printf ("Elasped time is %lf seconds.\n", dif );
     
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -6,28 +6,373 @@
 //  Computes EWMA (Exponentially Weighted Moving Average) and returns the raw both
 //  bias-corrected and non-bias-corrected EWMA values to the client.
 //
+//  A request may carry N independent channels sharing beta and the iteration
+//  number: (prev_value[N], current_value[N], beta, current_iteration_number).
+//  The reply is then (ewma[N], bias_corrected_ewma[N]). N=1 is the original
+//  four-value request.
+//
+//  In session mode the server keeps the previous EWMA values, the iteration
+//  number and a running beta^t for the client. The client opens the session
+//  with (beta, current_value[N]) and then only sends current_value[N] every
+//  step, plus beta when it changes. A client running the same model again,
+//  e.g. between Fast Restart runs, starts its session over with
+//  (beta, current_value[N]) instead of closing it and opening another.
+//
+//  A session may compute another statistic than the EWMA: the op in the
+//  header of SESSION_OPEN names an operator of the registry in stat_ops.hpp,
+//  e.g. Welford mean and variance, sliding window mean/min/max, EWMA variance
+//  or a t-digest quantile, each with its own parameters in place of beta.
+//  Several statistics of a signal are several sessions of one server.
+//
+//  Requests are accepted by a ROUTER socket and forwarded to a pool of worker
+//  threads over inproc sockets. Every worker owns the sessions it opened and
+//  all requests of a session are routed to the same worker, so the session
+//  state needs no locking and the samples of a session stay in order.
+//
+//  A client resending the requests it got no reply to marks them
+//  MSG_SEQUENCED. The worker then steps each of its sessions once per seq and
+//  answers a request sent again with the reply it kept, see statcal_util.hpp.
+//
+//  Every worker records how long requests waited in its queue and how long
+//  they took to handle. A STATS request is answered by the broker itself
+//  with these histograms merged over the workers, plus request counters.
+//
+//  Offline series are computed in one request instead of one per sample.
+//  EWMA_BULK carries (beta, N, current_value[T*N]), sample-major, and is
+//  replied (ewma[T*N], bias_corrected_ewma[T*N]) as a session stepped through
+//  the T samples would be, up to rounding. EWMA_FILE names files the server
+//  maps instead, for series too long for a message; it is only served with
+//  --data-dir, inside which the files must lie. The worker handling such a
+//  request computes the series with a blocked parallel scan over up to
+//  --scan-threads threads, see ewma_scan.hpp, and serves none of its other
+//  requests, e.g. of the sessions it owns, until the series is done. By
+//  default the CPUs are split between the workers.
+//
 #include <zmq.hpp>
 #include <string>
 #include <iostream>
 #include <vector>
 #include <utility>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
 #include <cmath>
+#include <climits>
+#include <chrono>
+#include <mutex>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "statcal_util.hpp"
+#include "ewma_kernel.hpp"
+#include "ewma_scan.hpp"
+#include "stat_ops.hpp"
 
-const char *TERMINATE  = "terminate";
 const char *SHUTTINGDOWN = "shutting down";
 
-// Compute Exponentially Weighted Moving Average
-std::pair<double, double> compute_ewma(const double prev, const double cv, const double beta, const int t)
+// State kept by the server for one client session, that of the operator it
+// was opened with
+struct Session {
+    const StatOperatorInfo       *info;
+    size_t                        channels;
+    std::unique_ptr<StatOperator> stat;
+    // Requests of a client sending MSG_SEQUENCED: the last seq stepped and
+    // the last replies, for the requests it sends again
+    unsigned int                  last_seq = 0;
+    std::deque<std::pair<unsigned int, std::string>> replies;
+};
+
+// Counters and histograms of one worker, read by the broker for STATS
+struct WorkerStats {
+    std::mutex       lock;
+    uint64_t         requests = 0;
+    uint64_t         errors = 0;
+    uint64_t         open_sessions = 0;
+    LatencyHistogram queue_wait;
+    LatencyHistogram compute;
+};
+
+// class StatCalculator decodes requests, computes the statistics and keeps
+// the state of the open sessions
+class StatCalculator {
+  public:
+    // Session ids are first_session, first_session+stride, ...
+    // Bulk requests are computed on up to scan_threads threads, the files of
+    // EWMA_FILE requests are in data_dir, none if empty
+    StatCalculator(const unsigned int first_session = 1, const unsigned int stride = 1,
+                   const unsigned int scan_threads = 1, const std::string & data_dir = "") :
+        next_session(first_session), session_stride(stride), num_scan_threads(scan_threads),
+        file_job_dir(data_dir)
+    {
+    }
+
+    // Returns false when the client asked the server to terminate
+    bool handleRequest(const char *data_str, const size_t size, std::string & reply_str);
+
+    size_t numSessions() const { return sessions.size(); }
+
+  private:
+    std::unordered_map<unsigned int, Session> sessions;
+    unsigned int next_session;
+    unsigned int session_stride;
+    unsigned int num_scan_threads;
+    std::string  file_job_dir;
+
+    Session & findSession(const unsigned int id);
+    Session startSession(const unsigned int op, const std::vector<double> & data, std::vector<double> & md);
+    void sessionStep(Session & s, const double *u, std::vector<double> & md);
+    bool answerResent(const MsgHeader & hdr, std::string & reply_str);
+    void keepReply(const MsgHeader & hdr, const unsigned int session, const std::string & reply_str);
+    void handleFileJob(const MsgHeader & hdr, const char *data_str, const size_t size, std::string & reply_str);
+};
+
+// Look up an open session
+Session & StatCalculator::findSession(const unsigned int id)
+{
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+        throw std::runtime_error("Unknown session, open a new session first");
+    }
+    return it->second;
+}
+
+// Start a session of operator op from (params[P], current_value[N]) and
+// process its first sample. Nothing is kept if that fails.
+Session StatCalculator::startSession(const unsigned int op, const std::vector<double> & data, std::vector<double> & md)
+{
+    Session s;
+    s.info = StatOperatorRegistry::instance().find(op);
+    if (s.info == nullptr) {
+        throw std::runtime_error("Unknown operator " + std::to_string(op));
+    }
+    if (data.size() <= s.info->num_params) {
+        throw std::runtime_error("Session of " + std::string(s.info->name) + " must be started with: " +
+                                 std::to_string(s.info->num_params) + " parameter(s) and current_data[N]");
+    }
+    s.channels = data.size()-s.info->num_params;
+    s.stat = s.info->create();
+    s.stat->reset(&data[0], s.channels);
+
+    sessionStep(s, &data[s.info->num_params], md);
+    return s;
+}
+
+// Advance the session by one sample and compute the outputs of its operator,
+// e.g. (ewma[N], bias_corrected_ewma[N])
+void StatCalculator::sessionStep(Session & s, const double *u, std::vector<double> & md)
+{
+    md.resize(s.info->num_outputs*s.channels);
+    s.stat->step(u, &md[0]);
+}
+
+// A sequenced request the session has already stepped, sent again because
+// its reply was lost, is answered with the reply kept. One after a request
+// the server has not seen is refused, the client sends both again. Returns
+// false for the next request of the session, to be handled as usual.
+bool StatCalculator::answerResent(const MsgHeader & hdr, std::string & reply_str)
+{
+    auto it = sessions.find(hdr.session);
+    if (it == sessions.end() || hdr.type == SESSION_OPEN || hdr.type == SESSION_CLOSE) {
+        return false;
+    }
+    const Session & s = it->second;
+    if (hdr.seq <= s.last_seq) {
+        for (auto & r : s.replies) {
+            if (r.first == hdr.seq) {
+                reply_str = r.second;
+                return true;
+            }
+        }
+        encode_str_data(ERROR_REPLY, hdr.session, hdr.seq, "Request sent again after its reply was dropped", reply_str);
+        return true;
+    }
+    if (hdr.type != SESSION_RESET && hdr.seq != s.last_seq+1) {
+        encode_str_data(ERROR_REPLY, hdr.session, hdr.seq, "Request arrived ahead of an earlier one of the session", reply_str);
+        return true;
+    }
+    return false;
+}
+
+// Keep the reply of a sequenced session request, the last
+// SESSION_REPLIES_KEPT of a session
+void StatCalculator::keepReply(const MsgHeader & hdr, const unsigned int session, const std::string & reply_str)
+{
+    auto it = sessions.find(session);
+    if (it == sessions.end()) {
+        return;
+    }
+    Session & s = it->second;
+    s.last_seq = hdr.seq;
+    s.replies.emplace_back(hdr.seq, reply_str);
+    if (s.replies.size() > SESSION_REPLIES_KEPT) {
+        s.replies.pop_front();
+    }
+}
+
+// Compute the series of files named by an EWMA_FILE request, the only
+// request with a char payload, and reply (T, N)
+void StatCalculator::handleFileJob(const MsgHeader & hdr, const char *data_str, const size_t size, std::string & reply_str)
 {
-    // EWMA
-    double ma = beta*prev+(1-beta)*cv;
+    if (hdr.len >= 0 || size != MSG_HEADER_SIZE-hdr.len) {
+        encode_str_data(ERROR_REPLY, hdr.session, hdr.seq, "Malformed request", reply_str);
+        return;
+    }
 
-    // Bias corrected EWMA
-    double bc = ma/(1-pow(beta,t));
+    std::string spec;
+    decode_str_data(hdr, data_str, spec);
 
-    return std::make_pair(ma, bc);
+    try {
+        EwmaFileJob job = parse_ewma_file_job(spec, file_job_dir);
+        const size_t samples = run_ewma_file_job(job, num_scan_threads);
+        encode_double_data(REPLY, hdr.session, hdr.seq,
+                           {static_cast<double>(samples), static_cast<double>(job.channels)}, reply_str);
+    } catch (std::exception &e) {
+        encode_str_data(ERROR_REPLY, hdr.session, hdr.seq, e.what(), reply_str);
+    }
+}
+
+// StatCalculator class method handleRequest
+bool StatCalculator::handleRequest(const char *data_str, const size_t size, std::string & reply_str)
+{
+    if (size < MSG_HEADER_SIZE) {
+        encode_str_data(ERROR_REPLY, 0, 0, "Malformed request", reply_str);
+        return true;
+    }
+
+    MsgHeader hdr = decode_header(data_str);
+    if (hdr.type == EWMA_FILE) {
+        handleFileJob(hdr, data_str, size, reply_str);
+        return true;
+    }
+    if (hdr.len < 0 || size != MSG_HEADER_SIZE+hdr.len*sizeof(double)) {
+        encode_str_data(ERROR_REPLY, hdr.session, hdr.seq, "Malformed request", reply_str);
+        return true;
+    }
+    const bool sequenced = (hdr.flags & MSG_SEQUENCED) != 0;
+    if (sequenced && answerResent(hdr, reply_str)) {
+        return true;
+    }
+
+    std::vector<double> data;
+    decode_double_data(hdr, data_str, data);
+
+    std::vector<double> md;
+    unsigned int session = hdr.session;
+
+    try {
+        switch (hdr.type) {
+          case EWMA: {
+              if (hdr.op != OP_EWMA) {
+                  throw std::runtime_error("Only sessions run other operators than the EWMA");
+              }
+              if (data.size() < 4 || data.size() % 2 != 0) {
+                  throw std::runtime_error("Data passed to statcalserver must be: prev_data[N], current_data[N], beta and current iteration number");
+              }
+
+              // Number of channels in this request
+              const size_t n = (data.size()-2)/2;
+              const double beta = data[2*n];
+              const int    iter = static_cast<int>(data[2*n+1]);
+
+              md.resize(2*n);
+              compute_ewma_batch(&data[0], &data[n], beta, iter, &md[0], &md[n], n);
+              break;
+          }
+          case EWMA_BULK: {
+              if (hdr.op != OP_EWMA) {
+                  throw std::runtime_error("Only sessions run other operators than the EWMA");
+              }
+              if (data.size() < 3) {
+                  throw std::runtime_error("Bulk data passed to statcalserver must be: beta, number of channels N and current_data[T*N]");
+              }
+              const double beta = data[0];
+              const double channels = data[1];
+              if (channels < 1 || channels != floor(channels) || fmod(data.size()-2, channels) != 0) {
+                  throw std::runtime_error("Bulk data must hold whole samples of N channels");
+              }
+              const size_t n = static_cast<size_t>(channels);
+              const size_t samples = (data.size()-2)/n;
+              if (2*samples*n > static_cast<size_t>(INT_MAX)) {
+                  throw std::runtime_error("Bulk reply too long for a message, send an EWMA_FILE request");
+              }
+
+              md.resize(2*samples*n);
+              compute_ewma_series(&data[2], &md[0], &md[samples*n], samples, n, beta, num_scan_threads);
+              break;
+          }
+          case SESSION_OPEN: {
+              Session s = startSession(hdr.op, data, md);
+              session = next_session;
+              next_session += session_stride;
+
+              sessions[session] = std::move(s);
+              break;
+          }
+          case SESSION_RESET: {
+              if (session == 0) {
+                  throw std::runtime_error("Session must be reset with its id");
+              }
+              Session s = startSession(hdr.op, data, md);
+              // A session the server does not know, e.g. after it was
+              // restarted, is opened again under the client's id. Ids of
+              // this worker are not handed out twice.
+              if (sessions.find(session) == sessions.end() && session >= next_session) {
+                  next_session = session+session_stride;
+              }
+              sessions[session] = std::move(s);
+              break;
+          }
+          case SESSION_DATA: {
+              Session & s = findSession(session);
+              if (data.size() != s.channels) {
+                  throw std::runtime_error("Number of channels does not match the open session");
+              }
+              sessionStep(s, &data[0], md);
+              break;
+          }
+          case SESSION_BETA: {
+              // New parameters of the operator, e.g. beta of the EWMA,
+              // followed by the next sample
+              Session & s = findSession(session);
+              const size_t num_params = s.info->num_params;
+              if (data.size() != s.channels+num_params) {
+                  throw std::runtime_error("Number of channels does not match the open session");
+              }
+              if (num_params > 0) {
+                  s.stat->setParams(&data[0]);
+              }
+              sessionStep(s, &data[num_params], md);
+              break;
+          }
+          case SESSION_CLOSE:
+              sessions.erase(session);
+              break;
+          case TERMINATE:
+              encode_str_data(REPLY, 0, hdr.seq, SHUTTINGDOWN, reply_str);
+              return false;
+          default:
+              throw std::runtime_error("Unknown request type");
+        }
+    } catch (std::exception &e) {
+        encode_str_data(ERROR_REPLY, session, hdr.seq, e.what(), reply_str);
+        return true;
+    }
+
+    encode_double_data(REPLY, session, hdr.seq, md, reply_str);
+    if (sequenced) {
+        keepReply(hdr, session, reply_str);
+    }
+    return true;
 }
 
 void send_reply(zmq::socket_t & socket, const std::string &reply_str)
@@ -37,65 +382,313 @@ void send_reply(zmq::socket_t & socket, const std::string &reply_str)
     socket.send(reply);
 }
 
-// statcalserver <port_number>
-int main (int argc, char *argv[]) {
+// Receive all frames of a multipart message
+void recv_multipart(zmq::socket_t & socket, std::vector<zmq::message_t> & frames)
+{
+    frames.clear();
+    do {
+        frames.emplace_back();
+        socket.recv(&frames.back());
+    } while (frames.back().more());
+}
 
-    if (argc != 2) {
-        std::cerr << "Error: stats calculator should be launched using statcalserver <port_number>" << std::endl;
-        return 1;
+void send_multipart(zmq::socket_t & socket, std::vector<zmq::message_t> & frames)
+{
+    for (size_t k = 0; k < frames.size(); k++) {
+        socket.send(frames[k], k+1 < frames.size() ? ZMQ_SNDMORE : 0);
+    }
+}
+
+// Pin the calling thread to one CPU
+bool set_thread_affinity(const int cpu)
+{
+#if defined(_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+#elif defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0;
+#else
+    return false;
+#endif
+}
+
+// Worker thread serving the requests the broker routes to it. Worker k of n
+// opens sessions k+n, k+2n, ... so that session % n identifies the worker.
+// The broker appends the time it received the request as a second frame.
+void worker_main(zmq::context_t & context, const std::string & addr,
+                 const unsigned int index, const unsigned int num_workers, const int cpu,
+                 const unsigned int scan_threads, const std::string & data_dir, WorkerStats & stats)
+{
+    if (cpu >= 0 && !set_thread_affinity(cpu)) {
+        std::cerr << "Warning: worker " << index << " could not be pinned to CPU " << cpu << std::endl;
     }
 
-    // std::string host = argv[1];
-    std::string port = argv[1];    
-    std::string socket_addr = "tcp://*:"+port;
-    
-    //  Prepare our context and socket
-    zmq::context_t context (1);
     zmq::socket_t socket (context, ZMQ_REP);
-    
-    socket.bind(socket_addr.c_str());
+    socket.connect(addr.c_str());
 
+    StatCalculator calculator(index+num_workers, num_workers, scan_threads, data_dir);
+
+    zmq::message_t request, frame;
     while (true) {
-        zmq::message_t request;
-        
-        // Wait for next request from client
         socket.recv (&request);
-        
-        char *data_str = static_cast<char*>(request.data());
-        data_str[request.size()] = '\0';
-
-        int len = decode_header(data_str);
-        
-        // Check received data header to determine if it's a string or array of double values
-        if (len >= 0) {
-            std::vector<double> data;
-            decode_double_data(len, data_str, data);
-            if (data.size() > 4) {
-                std::cerr << "Data passed to statcalserver must be: prev_data, current_data, beta and current iteration number" << std::endl;
-                return 1;
+        const auto t_recv = std::chrono::steady_clock::now();
+
+        // Time the broker received the request, the broker's own TERMINATE has none
+        int64_t queued_at = 0;
+        bool timed = false;
+        if (request.more()) {
+            do {
+                socket.recv (&frame);
+            } while (frame.more());
+            if (frame.size() == sizeof(queued_at)) {
+                memcpy(&queued_at, frame.data(), sizeof(queued_at));
+                timed = true;
             }
+        }
 
-            std::vector<double> md(2,0);
-            std::tie(md[0], md[1]) = compute_ewma(data[0], data[1], data[2], static_cast<int>(data[3]));
-            
-            std::string reply_str;
-            encode_double_data(md, reply_str);
-            
-            // Send reply back to client
-            send_reply(socket, reply_str);
-        } else {
-            std::string d_str;
-            decode_str_data(data_str, d_str);
-
-            // Terminate server if client sends "terminate"
-            if (strcmp(d_str.c_str(), TERMINATE) == 0) {
-                std::string reply_str;
-                encode_str_data(SHUTTINGDOWN, reply_str);
-                send_reply(socket, reply_str);
+        std::string reply_str;
+        bool keep_running = calculator.handleRequest(static_cast<const char*>(request.data()), request.size(), reply_str);
+        const auto t_done = std::chrono::steady_clock::now();
+        send_reply(socket, reply_str);
+
+        {
+            std::lock_guard<std::mutex> guard(stats.lock);
+            stats.requests++;
+            if (decode_header(reply_str.data()).type == ERROR_REPLY) {
+                stats.errors++;
+            }
+            stats.open_sessions = calculator.numSessions();
+            if (timed) {
+                stats.queue_wait.record(t_recv.time_since_epoch()-std::chrono::steady_clock::duration(queued_at));
+            }
+            stats.compute.record(t_done-t_recv);
+        }
+
+        if (!keep_running) {
+            break;
+        }
+    }
+}
+
+// Ask every worker to finish. Replies still in flight for other clients are
+// passed on before the workers exit.
+void stop_workers(zmq::socket_t & frontend, std::vector<std::unique_ptr<zmq::socket_t>> & backends)
+{
+    std::string request_str;
+    encode_double_data(TERMINATE, 0, 0, {}, request_str);
+
+    std::vector<zmq::message_t> frames;
+    for (auto & backend : backends) {
+        frames.clear();
+        frames.emplace_back();
+        frames.emplace_back(request_str.data(), request_str.size());
+        send_multipart(*backend, frames);
+
+        while (true) {
+            recv_multipart(*backend, frames);
+            if (frames.size() == 2 && frames[0].size() == 0) {
                 break;
             }
+            send_multipart(frontend, frames);
         }
     }
-     
+}
+
+// Counters and histograms of all workers
+void collect_stats(std::vector<std::unique_ptr<WorkerStats>> & worker_stats, ServerStats & stats)
+{
+    stats.num_workers   = static_cast<unsigned int>(worker_stats.size());
+    stats.requests      = 0;
+    stats.errors        = 0;
+    stats.open_sessions = 0;
+    stats.queue_wait.reset();
+    stats.compute.reset();
+    for (auto & w : worker_stats) {
+        std::lock_guard<std::mutex> guard(w->lock);
+        stats.requests      += w->requests;
+        stats.errors        += w->errors;
+        stats.open_sessions += w->open_sessions;
+        stats.queue_wait.merge(w->queue_wait);
+        stats.compute.merge(w->compute);
+    }
+}
+
+// Forward requests from the clients to the workers and the replies back to the clients
+void run_broker(zmq::socket_t & frontend, std::vector<std::unique_ptr<zmq::socket_t>> & backends,
+                std::vector<std::unique_ptr<WorkerStats>> & worker_stats)
+{
+    const size_t num_workers = backends.size();
+
+    std::vector<zmq::pollitem_t> items;
+    items.push_back({(void*)frontend, 0, ZMQ_POLLIN, 0});
+    for (auto & backend : backends) {
+        items.push_back({(void*)*backend, 0, ZMQ_POLLIN, 0});
+    }
+
+    size_t next_worker = 0;
+    std::vector<zmq::message_t> frames;
+    std::unique_ptr<ServerStats> stats(new ServerStats);
+
+    while (true) {
+        zmq::poll (&items[0], items.size(), -1);
+
+        // Replies carry the envelope of the client they are for
+        for (size_t k = 0; k < num_workers; k++) {
+            if (items[k+1].revents & ZMQ_POLLIN) {
+                recv_multipart(*backends[k], frames);
+                send_multipart(frontend, frames);
+            }
+        }
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            recv_multipart(frontend, frames);
+
+            MsgHeader hdr = {EWMA, 0, 0, 0, 0, 0};
+            if (frames.back().size() >= MSG_HEADER_SIZE) {
+                hdr = decode_header(static_cast<const char*>(frames.back().data()));
+            }
+
+            // Terminate server if client sends TERMINATE
+            if (hdr.type == TERMINATE) {
+                stop_workers(frontend, backends);
+
+                std::string reply_str;
+                encode_str_data(REPLY, 0, hdr.seq, SHUTTINGDOWN, reply_str);
+                frames.back().rebuild(reply_str.data(), reply_str.size());
+                send_multipart(frontend, frames);
+                return;
+            }
+
+            if (hdr.type == STATS) {
+                std::string reply_str;
+                collect_stats(worker_stats, *stats);
+                encode_stats_data(hdr.seq, *stats, reply_str);
+                frames.back().rebuild(reply_str.data(), reply_str.size());
+                send_multipart(frontend, frames);
+                continue;
+            }
+
+            // Requests of a session go to the worker which owns it, the
+            // others are spread round-robin
+            size_t worker;
+            if (hdr.session != 0) {
+                worker = hdr.session % num_workers;
+            } else {
+                worker = next_worker;
+                next_worker = (next_worker+1) % num_workers;
+            }
+            const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+            frames.emplace_back(&now, sizeof(now));
+            send_multipart(*backends[worker], frames);
+        }
+    }
+}
+
+void print_usage()
+{
+    std::cerr << "Error: stats calculator should be launched using statcalserver <port_number> "
+              << "[--workers <number_of_threads>] [--affinity <cpu>[,<cpu>...]] "
+              << "[--scan-threads <number_of_threads>] [--data-dir <directory>]" << std::endl;
+}
+
+// statcalserver <port_number> [--workers <n>] [--affinity <cpu>[,<cpu>...]] [--scan-threads <n>]
+//               [--data-dir <directory>]
+int main (int argc, char *argv[]) {
+
+    if (argc < 2 || argc % 2 != 0) {
+        print_usage();
+        return 1;
+    }
+
+    // std::string host = argv[1];
+    std::string port = argv[1];
+    std::string socket_addr = "tcp://*:"+port;
+
+    unsigned int num_workers = 1;
+    unsigned int scan_threads = 0;
+    std::string data_dir;
+    std::vector<int> cpus;
+
+    try {
+        for (int k = 2; k < argc; k += 2) {
+            std::string opt = argv[k];
+            std::string val = argv[k+1];
+            if (opt == "--workers") {
+                int n = std::stoi(val);
+                if (n < 1) {
+                    throw std::invalid_argument(val);
+                }
+                num_workers = static_cast<unsigned int>(n);
+            } else if (opt == "--scan-threads") {
+                // Threads of a bulk request, by default the CPUs over the workers
+                int n = std::stoi(val);
+                if (n < 1) {
+                    throw std::invalid_argument(val);
+                }
+                scan_threads = static_cast<unsigned int>(n);
+            } else if (opt == "--data-dir") {
+                // EWMA_FILE requests name files in this directory
+                data_dir = val;
+            } else if (opt == "--affinity") {
+                // Workers are pinned to the listed CPUs in turn
+                size_t pos = 0;
+                while (pos < val.size()) {
+                    size_t next = val.find(',', pos);
+                    if (next == std::string::npos) {
+                        next = val.size();
+                    }
+                    cpus.push_back(std::stoi(val.substr(pos, next-pos)));
+                    pos = next+1;
+                }
+            } else {
+                throw std::invalid_argument(opt);
+            }
+        }
+    } catch (std::exception &) {
+        print_usage();
+        return 1;
+    }
+
+    if (scan_threads == 0) {
+        scan_threads = std::max(1u, std::thread::hardware_concurrency()/num_workers);
+    }
+
+    //  Prepare our context and sockets
+    zmq::context_t context (1);
+    zmq::socket_t frontend (context, ZMQ_ROUTER);
+    frontend.bind(socket_addr.c_str());
+
+    std::vector<std::unique_ptr<zmq::socket_t>> backends;
+    std::vector<std::unique_ptr<WorkerStats>> worker_stats;
+    std::vector<std::thread> workers;
+    for (unsigned int k = 0; k < num_workers; k++) {
+        std::string worker_addr = "inproc://statcal-worker-"+std::to_string(k);
+
+        // inproc endpoints must be bound before the worker connects
+        backends.emplace_back(new zmq::socket_t(context, ZMQ_DEALER));
+        backends.back()->bind(worker_addr.c_str());
+
+        int cpu = cpus.empty() ? -1 : cpus[k % cpus.size()];
+        worker_stats.emplace_back(new WorkerStats);
+        workers.emplace_back(worker_main, std::ref(context), worker_addr, k, num_workers, cpu,
+                             scan_threads, data_dir, std::ref(*worker_stats.back()));
+    }
+
+    std::cout << "Stats calculator server listening on port " << port
+              << " with " << num_workers << " worker(s) (EWMA kernel: " << ewma_kernel_name() << ")" << std::endl;
+    std::cout << "Operators:";
+    for (unsigned int id : StatOperatorRegistry::instance().ids()) {
+        std::cout << " " << StatOperatorRegistry::instance().find(id)->name << " (" << id << ")";
+    }
+    std::cout << std::endl;
+
+    run_broker(frontend, backends, worker_stats);
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
     return 0;
 }
@@ -0,0 +1,39 @@
+% Copyright 2018 The MathWorks, Inc.
+
+function makeInfo = rtwmakecfg()
+% RTWMAKECFG Sources, include paths and libraries of the code generated
+% from statcalsfcngateway.tlc, for code generation and Rapid Accelerator.
+% The gateway's connection code is compiled into the model behind the C
+% interface of statcal_runtime.h.
+
+sfunDir = fileparts(mfilename('fullpath'));
+utilDir = fullfile(fileparts(sfunDir),'util');
+rootDir = fileparts(fileparts(sfunDir));
+
+makeInfo.includePath = {sfunDir,...
+    utilDir,...
+    fullfile(rootDir,'utils','include'),...
+    fullfile(rootDir,'cppzmq'),...
+    fullfile(rootDir,'libzmq','include')};
+
+makeInfo.sourcePath = {sfunDir, utilDir};
+
+makeInfo.sources = {'statcal_runtime.cpp',...
+    'statcalclient.cpp',...
+    'statcal_util.cpp'};
+
+% libzmq as built for Windows, see readme.mlx, elsewhere as built with CMake
+% in libzmq/build or else installed on the system
+if ispc
+    makeInfo.linkLibsObjs = {fullfile(rootDir,'libzmq','bin','x64','Release','v140','dynamic','libzmq.lib')};
+else
+    if ismac
+        zmqLib = fullfile(rootDir,'libzmq','build','lib','libzmq.dylib');
+    else
+        zmqLib = fullfile(rootDir,'libzmq','build','lib','libzmq.so');
+    end
+    if ~exist(zmqLib,'file')
+        zmqLib = '-lzmq';
+    end
+    makeInfo.linkLibsObjs = {zmqLib,'-lpthread'};
+end
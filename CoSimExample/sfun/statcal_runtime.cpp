@@ -0,0 +1,150 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#define STATCAL_RUNTIME_BUILD
+
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "statcal_runtime.h"
+#include "statcalclient.hpp"
+#include "async_log.hpp"
+
+struct StatcalGateway {
+    void               *zm;
+    std::string         host;    // host parameter, for the release of a broker's server
+    int                 width;
+    std::vector<double> prev;    // EWMA of the last step, DWork 0 of the block
+    unsigned int        iter;    // DWork 1
+    double              beta;    // of the last step
+    bool                started;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+const char *no_gateway = "No gateway, creating it failed.";
+
+int fail(const char *what)
+{
+    last_error = what;
+    return STATCAL_ERROR;
+}
+
+} // anonymous namespace
+
+const char *statcal_last_error(void)
+{
+    return last_error.c_str();
+}
+
+void statcal_gateway_config_init(StatcalGatewayConfig *config)
+{
+    config->host = "localhost";
+    config->port = "5555";
+    config->pipeline_depth = 1;
+    config->log_level = nullptr;
+}
+
+int statcal_gateway_create(const StatcalGatewayConfig *config, int width, StatcalGateway **gw)
+{
+    if (config == nullptr || gw == nullptr) {
+        return fail("No configuration or handle given.");
+    }
+    if (width < 1) {
+        return fail("The gateway needs at least one channel.");
+    }
+    *gw = nullptr;
+
+    const std::string host = config->host ? config->host : "";
+    try {
+        // The logger runs from create to destroy, as from setup to cleanup
+        // of the block. It is stopped on failure even if it did not start at
+        // the level of the configuration.
+        AsyncLog::instance().start(AsyncLog::parseLevel(config->log_level, AsyncLog::envLevel()));
+        SFUN_LOG(LEVEL_INFO, "Opening connection with server");
+
+        const std::string connStr = gateway_address(host, config->port ? config->port : "");
+        const unsigned int depth = config->pipeline_depth > 0 ? config->pipeline_depth : 1;
+        if (depth > 1) {
+            SFUN_LOG(LEVEL_INFO, "Keeping %u requests in flight, output is delayed by %u steps", depth, depth);
+        }
+        *gw = new StatcalGateway{setupruntimeresources_wrapper(connStr, depth), host, width,
+                                 std::vector<double>(width), 0, 0.0, false};
+    } catch (std::exception &e) {
+        AsyncLog::instance().stop();
+        return fail(e.what());
+    }
+    return STATCAL_OK;
+}
+
+int statcal_gateway_start(StatcalGateway *gw)
+{
+    if (gw == nullptr) {
+        return fail(no_gateway);
+    }
+    try {
+        start_wrapper(gw->zm, &gw->prev[0], gw->width, &gw->iter);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return STATCAL_OK;
+}
+
+int statcal_gateway_outputs(StatcalGateway *gw, double *y, const double *init, int init_len)
+{
+    if (gw == nullptr) {
+        return fail(no_gateway);
+    }
+    try {
+        outputs_wrapper(gw->zm, y, gw->width, init, init_len, &gw->prev[0]);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return STATCAL_OK;
+}
+
+int statcal_gateway_update(StatcalGateway *gw, const double *u, double beta)
+{
+    if (gw == nullptr) {
+        return fail(no_gateway);
+    }
+    // A tuned parameter, as mdlProcessParameters sees it
+    if (gw->started && beta != gw->beta) {
+        processparameters_wrapper(gw->zm);
+    }
+    gw->beta = beta;
+    gw->started = true;
+    try {
+        update_wrapper(gw->zm, &gw->iter, u, gw->width, &beta);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return STATCAL_OK;
+}
+
+int statcal_gateway_terminate(StatcalGateway *gw)
+{
+    if (gw == nullptr) {
+        return fail(no_gateway);
+    }
+    try {
+        terminate_wrapper(gw->zm, gw->width);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return STATCAL_OK;
+}
+
+void statcal_gateway_destroy(StatcalGateway *gw)
+{
+    if (gw == nullptr) {
+        return;
+    }
+    SFUN_LOG(LEVEL_INFO, "Closing connection with server");
+    cleanupruntimeresouces_wrapper(gw->zm);
+    release_gateway_address(gw->host);
+    delete gw;
+    AsyncLog::instance().stop();
+}
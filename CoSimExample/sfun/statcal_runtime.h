@@ -0,0 +1,91 @@
+/* Copyright 2018 The MathWorks, Inc. */
+
+#ifndef STATCAL_RUNTIME_H
+#define STATCAL_RUNTIME_H
+
+/*
+ * C interface of the co-simulation gateway block, for the code generated
+ * from statcalsfcngateway.tlc (Rapid Accelerator, code generation) and for
+ * programs outside of Simulink. A handle does what the block's S-function
+ * does with the same connection code, including the request pipeline and
+ * the servers of a port broker.
+ *
+ * Every function returning int returns STATCAL_OK, or STATCAL_ERROR and
+ * leaves the message in statcal_last_error(). No function throws.
+ *
+ * Lifetime, as the block's methods:
+ *   create     mdlSetupRuntimeResources, once
+ *   start      mdlStart, before the first step of every run
+ *   outputs    mdlOutputs, then update in mdlUpdate, every step
+ *   terminate  mdlTerminate, after the last step of every run
+ *   destroy    mdlCleanupRuntimeResources, once
+ * The EWMA of the last step and the iteration count, DWorks of the block,
+ * are kept in the handle.
+ *
+ * Build a static or shared library from statcal_runtime.cpp,
+ * statcalclient.cpp and ../util/statcal_util.cpp, with the include paths
+ * of the S-function, and link it with libzmq. Define STATCAL_RUNTIME_SHARED
+ * when building and using it as a DLL.
+ */
+
+#if defined(_WIN32) && defined(STATCAL_RUNTIME_SHARED)
+#  if defined(STATCAL_RUNTIME_BUILD)
+#    define STATCAL_API __declspec(dllexport)
+#  else
+#    define STATCAL_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define STATCAL_API __attribute__((visibility("default")))
+#else
+#  define STATCAL_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATCAL_OK      0
+#define STATCAL_ERROR  -1
+
+/* Block parameters of the gateway block, but for the tunable ones, which
+ * are passed with every step */
+typedef struct {
+    const char  *host;            /* host parameter, also "broker://name" */
+    const char  *port;
+    unsigned int pipeline_depth;  /* requests in flight, up to 32, the output lags the input by as many steps */
+    const char  *log_level;       /* NULL or "" for the level of ZMQ_SFUN_LOG_LEVEL, the same
+                                     for all gateways open at a time */
+} StatcalGatewayConfig;
+
+typedef struct StatcalGateway StatcalGateway;
+
+/* Message of the last call of this thread which returned STATCAL_ERROR */
+STATCAL_API const char *statcal_last_error(void);
+
+STATCAL_API void statcal_gateway_config_init(StatcalGatewayConfig *config);
+
+/* width channels, the width of the block's input and output */
+STATCAL_API int  statcal_gateway_create(const StatcalGatewayConfig *config, int width, StatcalGateway **gw);
+
+/* Start a run, the session of the last one is kept and starts over */
+STATCAL_API int  statcal_gateway_start(StatcalGateway *gw);
+
+/* Output the reply to the request of pipeline_depth steps ago into y, the
+ * initial value, a scalar (init_len 1) or one per channel, until then */
+STATCAL_API int  statcal_gateway_outputs(StatcalGateway *gw, double *y, const double *init, int init_len);
+
+/* Send the request of the step, u has one element per channel. A beta
+ * other than the one of the last step goes to the server session. */
+STATCAL_API int  statcal_gateway_update(StatcalGateway *gw, const double *u, double beta);
+
+/* Wait for the replies still in flight and print the statistics of the run */
+STATCAL_API int  statcal_gateway_terminate(StatcalGateway *gw);
+
+/* Close the session and the connection. NULL is ignored. */
+STATCAL_API void statcal_gateway_destroy(StatcalGateway *gw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATCAL_RUNTIME_H */
@@ -4,113 +4,357 @@
 #include <zmq.hpp>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <iostream>
 #include <memory>
-#include <zmq.hpp>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <sstream>
 
 #include "statcal_util.hpp"
 #include "statcalclient.hpp"
+#include "async_log.hpp"
+#include "shared_context.hpp"
+#include "endpoint_broker.hpp"
 
 namespace {
 
 #define REQUEST_TIMEOUT 2500 //  msecs (> 1000)
 #define REQUEST_RETRIES  3 //  Number of tries before we abandon
 
-const char *DELIMITERS = " ,"; // <space> or ","
+// Where the time of a step goes, printed at the end of the simulation
+struct ClientStats {
+    LatencyHistogram encode;       // building the request
+    LatencyHistogram send;         // handing it to the socket
+    LatencyHistogram wait;         // blocked waiting for a reply
+    LatencyHistogram decode;       // unpacking the reply into the outputs
+    LatencyHistogram round_trip;   // from sending a request to receiving its reply
+
+    void reset()
+    {
+        encode.reset();
+        send.reset();
+        wait.reset();
+        decode.reset();
+        round_trip.reset();
+    }
+
+    void print(std::ostream & os) const
+    {
+        LatencyHistogram::printHeader(os, "Client (us)");
+        encode.print(os, "encode");
+        send.print(os, "send");
+        wait.print(os, "wait");
+        decode.print(os, "decode");
+        round_trip.print(os, "round trip");
+        os.flush();
+    }
+};
 
-// class ZmqMgr for managing socket connection with the server
+// class ZmqMgr for managing socket connection with the server. Up to
+// pipeline_depth requests are kept in flight on a DEALER socket; replies are
+// matched to their request by sequence number. When no reply comes in time
+// the socket is connected again and every request in flight is sent again in
+// order. The session requests are MSG_SEQUENCED, so the server does not step
+// the session twice for them; a SESSION_OPEN sent again may leave a second
+// session open on the server until it exits.
 class ZmqMgr {
   public:
-    ZmqMgr(const std::string &addr) : context(1), socket_addr(addr)
+    ZmqMgr(const std::string &addr, const unsigned int depth) :
+        socket_addr(addr), pipeline_depth(depth), next_seq(1), session(0), beta_changed(false)
     {
+        if (depth > SESSION_REPLIES_KEPT) {
+            throw std::runtime_error("At most " + std::to_string(SESSION_REPLIES_KEPT) +
+                                     " requests can be kept in flight, the server keeps as many replies");
+        }
     }
 
     ~ZmqMgr() {}
 
-    void sendRequest(const std::string & request_str);
+    // Sequence number to put in the next request
+    unsigned int nextSeq() { return next_seq++; }
 
+    void sendRequest(std::string request_str, const unsigned int seq);
+
+    // Reply to the oldest request in flight, it stays in flight
+    zmq::message_t & peekReply(int retries_left = REQUEST_RETRIES);
+
+    // Remove the reply to the oldest request in flight
     void retrieveReply(zmq::message_t & reply, int retries_left = REQUEST_RETRIES);
+
+    size_t numInFlight() const { return in_flight.size(); }
+    unsigned int getPipelineDepth() const { return pipeline_depth; }
+
+    // Forget requests and replies left over from a previous simulation
+    void resetPipeline()
+    {
+        in_flight.clear();
+        sent_at.clear();
+        requests.clear();
+        pending.clear();
+        stats.reset();
+    }
+
+    ClientStats & getStats() { return stats; }
+
+    // Session opened on the server for this block, 0 when there is none
+    unsigned int getSession() const { return session; }
+    void setSession(const unsigned int id) { session = id; }
+
+    // Exponential weight was changed and must be sent with the next sample
+    bool isBetaChanged() const { return beta_changed; }
+    void setBetaChanged(const bool changed) { beta_changed = changed; }
     
   private:
+    SharedContext context;
     std::string socket_addr;
-    zmq::context_t context;
     std::unique_ptr<zmq::socket_t> socket_ptr;
+    unsigned int pipeline_depth;
+    unsigned int next_seq;
+    std::deque<unsigned int> in_flight;               // sequence numbers, oldest first
+    std::deque<std::chrono::steady_clock::time_point> sent_at;  // send time of each request in flight
+    std::deque<std::string> requests;                 // each request in flight, to send it again
+    std::map<unsigned int, zmq::message_t> pending;   // replies received ahead of their turn
+    unsigned int session;
+    bool beta_changed;
+    ClientStats stats;
 
     std::unique_ptr<zmq::socket_t> createSocket();
+    void sendFrames(const std::string & request_str);
+    void resendInFlight();
 };
 
-// Helper function to send a request with input arguments to the server
-void sendRequest_helper(void *zm, const double prev, const double u, const double beta, const unsigned int iter)
+// Throw the error message sent by the server, if any
+void checkReply(const zmq::message_t & reply)
+{
+    const char *reply_str = static_cast<const char*>(reply.data());
+
+    MsgHeader hdr = decode_header(reply_str);
+    if (hdr.type == ERROR_REPLY) {
+        std::string msg;
+        decode_str_data(hdr, reply_str, msg);
+        throw std::runtime_error("Stats calculator server error: " + msg);
+    }
+}
+
+// Helper function to send a request with input arguments to the server.
+// The server keeps the EWMA state of the session, so only the new sample of
+// every channel is sent. The first step opens the session, or starts it over
+// in the runs after the first, and beta is only sent again after it was
+// changed.
+void sendRequest_helper(void *zm, const double *u, const int width, const double beta, const unsigned int iter)
 {
-    std::vector<double> uVec = {prev, u, beta, static_cast<double>(iter)};
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+
+    MsgType type = SESSION_DATA;
+    if (iter == 1) {
+        type = zmp->getSession() == 0 ? SESSION_OPEN : SESSION_RESET;
+    } else if (zmp->getSession() == 0) {
+        // The session id is needed before anything else can be sent. With a
+        // pipeline the open request may still be in flight, wait for it.
+        zmq::message_t & reply = zmp->peekReply();
+        checkReply(reply);
+        zmp->setSession(decode_header(static_cast<const char*>(reply.data())).session);
+    }
+    if (type == SESSION_DATA && zmp->isBetaChanged()) {
+        type = SESSION_BETA;
+    }
+
+    std::vector<double> uVec;
+    uVec.reserve(width+1);
+    if (type != SESSION_DATA) {
+        uVec.push_back(beta);
+    }
+    uVec.insert(uVec.end(), u, u+width);
+
+    const unsigned int seq = zmp->nextSeq();
     std::string request_str;
-    encode_double_data(uVec, request_str);
+    {
+        LatencyTimer timer(zmp->getStats().encode);
+        encode_double_data(static_cast<MsgType>(type | MSG_SEQUENCED), zmp->getSession(), seq, uVec, request_str);
+    }
 
-    reinterpret_cast<ZmqMgr *>(zm)->sendRequest(request_str);
+    zmp->sendRequest(std::move(request_str), seq);
+    zmp->setBetaChanged(false);
 }
 
 // Helper function to retrieve reply from the server and parse its results
-std::pair<double, double> retrieveReply_helper(void *zm)
+// [mv[0..w-1], bcmv[0..w-1]]
+void retrieveReply_helper(void *zm, const int width, double *mv_ptr, double *bcmv_ptr)
 {
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
     zmq::message_t reply;
 
-    reinterpret_cast<ZmqMgr *>(zm)->retrieveReply(reply);
+    zmp->retrieveReply(reply);
+    checkReply(reply);
+
+    LatencyTimer timer(zmp->getStats().decode);
+    const char *reply_str = static_cast<const char*>(reply.data());
+
+    MsgHeader hdr = decode_header(reply_str);
+    if (hdr.len != 2*width) {
+        throw std::runtime_error("Unexpected number of values received from stats calculator server");
+    }
 
-    char *reply_str = static_cast<char*>(reply.data());
-    
     std::vector<double> data;
-    int len = decode_header(reply_str);
-    decode_double_data(len, reply_str, data);
+    decode_double_data(hdr, reply_str, data);
+    zmp->setSession(hdr.session);
+
+    std::copy(data.begin(), data.begin()+width, mv_ptr);
+    std::copy(data.begin()+width, data.end(), bcmv_ptr);
+}
+
+// Helper function to release the session state on the server
+void closeSession_helper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    if (zmp->getSession() == 0) {
+        return;
+    }
+
+    const unsigned int seq = zmp->nextSeq();
+    std::string request_str;
+    encode_double_data(SESSION_CLOSE, zmp->getSession(), seq, {}, request_str);
+    zmp->sendRequest(request_str, seq);
+
+    zmq::message_t reply;
+    zmp->retrieveReply(reply);
+    zmp->setSession(0);
+}
+
+// Helper function to ask the server for its counters and histograms. Servers
+// without STATS answer with an error, which is only reported.
+void printServerStats_helper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
 
-    return std::make_pair(data[0], data[1]);
+    const unsigned int seq = zmp->nextSeq();
+    std::string request_str;
+    encode_double_data(STATS, 0, seq, {}, request_str);
+
+    try {
+        zmp->sendRequest(request_str, seq);
+        zmq::message_t reply;
+        zmp->retrieveReply(reply, 1);
+        checkReply(reply);
+
+        const char *reply_str = static_cast<const char*>(reply.data());
+        std::unique_ptr<ServerStats> stats(new ServerStats);
+        decode_stats_data(decode_header(reply_str), reply_str, *stats);
+        if (AsyncLog::instance().enabled(LEVEL_INFO)) {
+            std::ostringstream os;
+            print_stats(os, *stats);
+            AsyncLog::instance().writeLines(LEVEL_INFO, os.str());
+        }
+    } catch (std::exception &e) {
+        zmp->resetPipeline();
+        SFUN_LOG(LEVEL_WARN, "Server statistics not available: %s", e.what());
+    }
 }
 
 // ZmqMgr class method sendRequest
-void ZmqMgr::sendRequest(const std::string & request_str)
+void ZmqMgr::sendRequest(std::string request_str, const unsigned int seq)
 {
     if (!socket_ptr) {
         socket_ptr = createSocket();
     }
-    zmq::message_t request;
-    request.rebuild(request_str.size());
-    memset(request.data(), 0, request_str.size());    
+    LatencyTimer timer(stats.send);
+    sendFrames(request_str);
+    timer.stop();
+
+    in_flight.push_back(seq);
+    sent_at.push_back(std::chrono::steady_clock::now());
+    SFUN_LOG(LEVEL_TRACE, "Sent request %u, %llu bytes", seq, static_cast<unsigned long long>(request_str.size()));
+    requests.push_back(std::move(request_str));
+}
+
+// ZmqMgr class method sendFrames
+void ZmqMgr::sendFrames(const std::string & request_str)
+{
+    zmq::message_t request(request_str.size());
     memcpy(request.data (), request_str.c_str(), request_str.size());
-    
-    // std::cout << "Sending " << request_str << std::endl;
+
+    // Empty delimiter frame, as a REQ socket would add
+    zmq::message_t delimiter;
+    socket_ptr->send(delimiter, ZMQ_SNDMORE);
     socket_ptr->send(request);
 }
 
-// ZmqMgr class method retrieveReply
-void ZmqMgr::retrieveReply(zmq::message_t & reply, int retries_left)
+// Send every request in flight again on a new socket, the replies still on
+// their way to the old one are lost with it
+void ZmqMgr::resendInFlight()
 {
-    assert(socket_ptr);
-    
-    while (retries_left) {
+    socket_ptr = createSocket();
+    pending.clear();
+    for (auto & request_str : requests) {
+        sendFrames(request_str);
+    }
+}
+
+// ZmqMgr class method peekReply
+zmq::message_t & ZmqMgr::peekReply(int retries_left)
+{
+    assert(socket_ptr && !in_flight.empty());
+
+    const unsigned int seq = in_flight.front();
+    auto it = pending.find(seq);
+    if (it != pending.end()) {
+        return it->second;
+    }
+
+    LatencyTimer timer(stats.wait);
+    while (it == pending.end()) {
         //  Poll socket for a reply, with timeout
         zmq::pollitem_t items[] = { {*socket_ptr, 0, ZMQ_POLLIN, 0 } };
         zmq::poll (&items[0], 1, REQUEST_TIMEOUT);
         
         //  If we got a reply, process it
         if (items[0].revents & ZMQ_POLLIN) {
-            
-            socket_ptr->recv(&reply);
-            char *reply_str = static_cast<char*>(reply.data());
-            reply_str[reply.size()] = '\0';
-            
-            // std::cout << "Received: " << reply_str << std::endl;
-            break;
+            // Skip the delimiter, the payload is the last frame
+            zmq::message_t reply;
+            do {
+                socket_ptr->recv(&reply);
+            } while (reply.more());
+
+            if (reply.size() < MSG_HEADER_SIZE) {
+                continue;
+            }
+
+            // Keep replies to requests still in flight, drop stale ones
+            const unsigned int rseq = decode_header(static_cast<const char*>(reply.data())).seq;
+            auto f = std::find(in_flight.begin(), in_flight.end(), rseq);
+            if (f != in_flight.end()) {
+                stats.round_trip.record(std::chrono::steady_clock::now()-sent_at[f-in_flight.begin()]);
+                pending[rseq] = std::move(reply);
+            }
+            it = pending.find(seq);
+            SFUN_LOG(LEVEL_TRACE, "Reply to request %u received", rseq);
         } else if (--retries_left == 0) {
             throw std::runtime_error("Server connection timed out");
         } else {
-            std::cout << "No response from server, retrying … " << std::endl;
+            SFUN_LOG(LEVEL_WARN, "No response from server, sending %llu requests again",
+                     static_cast<unsigned long long>(in_flight.size()));
+            resendInFlight();
         }
     }
+    return it->second;
+}
+
+// ZmqMgr class method retrieveReply
+void ZmqMgr::retrieveReply(zmq::message_t & reply, int retries_left)
+{
+    reply = std::move(peekReply(retries_left));
+    pending.erase(in_flight.front());
+    in_flight.pop_front();
+    sent_at.pop_front();
+    requests.pop_front();
 }
 
 // ZmqMgr class method createSocket
 std::unique_ptr<zmq::socket_t> ZmqMgr::createSocket()
 {
-    std::unique_ptr<zmq::socket_t> s_ptr(new zmq::socket_t(context, ZMQ_REQ));
+    std::unique_ptr<zmq::socket_t> s_ptr(new zmq::socket_t(context, ZMQ_DEALER));
 
     s_ptr->connect(socket_addr.c_str());
     int linger = 0;
@@ -123,52 +367,117 @@ std::unique_ptr<zmq::socket_t> ZmqMgr::createSocket()
 } // anonymous namespace
 
 // Wrapper functions
-void *setupruntimeresources_wrapper(const std::string & connStr)
+std::string gateway_address(const std::string &host, const std::string &port)
 {
-    return reinterpret_cast<void *>(new ZmqMgr(connStr));
+    std::string serverHostStr = host;
+    std::string serverPortStr = port;
+    if (EndpointBroker::isBrokerAddress(host)) {
+        serverPortStr = EndpointBroker::server(host);
+        serverHostStr = "localhost";
+    }
+
+    std::string connStr = "tcp://";
+    connStr += serverHostStr;
+    connStr += ":";
+    connStr += serverPortStr;
+
+    return connStr;
+}
+
+void release_gateway_address(const std::string &host)
+{
+    if (EndpointBroker::isBrokerAddress(host)) {
+        try {
+            EndpointBroker::release(host);
+        } catch (std::exception &e) {
+            SFUN_LOG(LEVEL_WARN, "%s", e.what());
+        }
+    }
+}
+
+void *setupruntimeresources_wrapper(const std::string & connStr, const unsigned int depth)
+{
+    return reinterpret_cast<void *>(new ZmqMgr(connStr, depth));
 }
 
-void start_wrapper(double *prev_ptr, unsigned int *iter_ptr)
+void start_wrapper(void *zm, double *prev_ptr, const int width, unsigned int *iter_ptr)
 {
-    *prev_ptr = 0.0;
+    std::fill(prev_ptr, prev_ptr+width, 0.0);
     *iter_ptr = 0;
+    reinterpret_cast<ZmqMgr *>(zm)->resetPipeline();
 }
 
-void outputs_wrapper(void *zm, unsigned int *iter_ptr, double *y_ptr, double *init_ptr, double *prev_ptr)
+void outputs_wrapper(void *zm, double *y_ptr, const int width,
+                     const double *init_ptr, const int init_len, double *prev_ptr)
 {
-    if (*iter_ptr > 0) {
-        double mv, bcmv;
-        std::tie(mv, bcmv) = retrieveReply_helper(zm);
-        
-        *prev_ptr = mv;
-        *y_ptr    = bcmv;
-        
+    // Output the reply to the request sent pipeline_depth steps ago, the
+    // initial value until the pipeline is full
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    if (zmp->numInFlight() >= zmp->getPipelineDepth()) {
+        retrieveReply_helper(zm, width, prev_ptr, y_ptr);
     } else {
-        *y_ptr = *init_ptr;
+        // Scalar initial value is applied to every element
+        for (int k=0; k<width; k++) {
+            y_ptr[k] = init_ptr[init_len == 1 ? 0 : k];
+        }
     }
 }
 
-void update_wrapper(void *zm, unsigned int *iter_ptr, const double *u_ptr, const double *beta_ptr, const double *prev_ptr)
+void update_wrapper(void *zm, unsigned int *iter_ptr, const double *u_ptr, const int width,
+                    const double *beta_ptr)
 {
     (*iter_ptr)++;
-    sendRequest_helper(zm, *prev_ptr, *u_ptr, *beta_ptr, *iter_ptr);
+    sendRequest_helper(zm, u_ptr, width, *beta_ptr, *iter_ptr);
+}
+
+void processparameters_wrapper(void *zm)
+{
+    if (zm) {
+        reinterpret_cast<ZmqMgr *>(zm)->setBetaChanged(true);
+    }
 }
 
 
 
-void terminate_wrapper(void *zm, unsigned int *iter_ptr)
+void terminate_wrapper(void *zm, const int width)
 {
-    // Retrieve the reply for the last request from mdlUpdate
-    if (*iter_ptr > 0) {
-        double mv, bcmv;
-        std::tie(mv, bcmv) = retrieveReply_helper(zm);
+    // Retrieve the replies for the requests still in the pipeline
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    if (zmp->numInFlight() > 0) {
+        std::vector<double> mv(width), bcmv(width);
+        while (zmp->numInFlight() > 0) {
+            retrieveReply_helper(zm, width, &mv[0], &bcmv[0]);
+        }
 
-        std::cout << "Last results:  " << mv << " " << bcmv << std::endl;
+        // Eight channels per line, the logger cuts long lines
+        if (AsyncLog::instance().enabled(LEVEL_DEBUG)) {
+            std::ostringstream os;
+            os << "Last results:";
+            for (int k=0; k<width; k++) {
+                os << ((k % 8 == 0 && k > 0) ? "\n " : " ") << mv[k] << " " << bcmv[k];
+            }
+            AsyncLog::instance().writeLines(LEVEL_DEBUG, os.str());
+        }
     }
+
+    if (AsyncLog::instance().enabled(LEVEL_INFO)) {
+        std::ostringstream os;
+        zmp->getStats().print(os);
+        AsyncLog::instance().writeLines(LEVEL_INFO, os.str());
+    }
+    printServerStats_helper(zm);
 }
 
 void cleanupruntimeresouces_wrapper(void *zm)
 {
+    // The session is kept across Fast Restart runs and released here. Replies
+    // to the requests of a failed run are not waited for.
+    try {
+        reinterpret_cast<ZmqMgr *>(zm)->resetPipeline();
+        closeSession_helper(zm);
+    } catch (std::exception &e) {
+        SFUN_LOG(LEVEL_WARN, "Session not closed: %s", e.what());
+    }
     delete reinterpret_cast<ZmqMgr *>(zm);
 }
 
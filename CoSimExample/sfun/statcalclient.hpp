@@ -4,15 +4,30 @@
 #ifndef STATCAL_CLIENT_HPP
 #define STATCAL_CLIENT_HPP
 
-void *setupruntimeresources_wrapper(const std::string & connStr);
+#include <string>
 
-void start_wrapper(double *prev_ptr, unsigned int *iter_ptr);
+// Address of the server of the block's host and port parameters. With a
+// host broker://<name> the server is one of the port broker's pool, which
+// the blocks of the name share until release_gateway_address.
+std::string gateway_address(const std::string &host, const std::string &port);
 
-void outputs_wrapper(void *zm, unsigned int *iter_ptr, double *y_ptr, double *init_ptr, double *prev_ptr);
+// Give the server of a broker://<name> host back to the pool, its session
+// was closed
+void release_gateway_address(const std::string &host);
 
-void update_wrapper(void *zm, unsigned int *iter_ptr, const double *u_ptr, const double *beta_ptr, const double *prev_ptr);
+void *setupruntimeresources_wrapper(const std::string & connStr, const unsigned int depth);
 
-void terminate_wrapper(void *zm, unsigned int *iter_ptr);
+void start_wrapper(void *zm, double *prev_ptr, const int width, unsigned int *iter_ptr);
+
+void outputs_wrapper(void *zm, double *y_ptr, const int width,
+                     const double *init_ptr, const int init_len, double *prev_ptr);
+
+void update_wrapper(void *zm, unsigned int *iter_ptr, const double *u_ptr, const int width,
+                    const double *beta_ptr);
+
+void processparameters_wrapper(void *zm);
+
+void terminate_wrapper(void *zm, const int width);
 
 void cleanupruntimeresouces_wrapper(void *zm);
 
@@ -12,18 +12,54 @@
 #include <memory>
 
 #include "statcalclient.hpp"
+#include "statcal_util.hpp"
 #include "simstruc.h"
+#include "async_log.hpp"
 
 #define HOST_NAME_P  0
 #define PORT_NUM_P   1
 #define BETA_P       2
 #define INIT_VALUE_P 3
 #define STEP_SIZE_P  4
-#define NUM_PRMS     5
+#define PIPELINE_DEPTH_P 5 // optional
+#define LOG_LEVEL_P  6 // optional
+#define NUM_REQ_PRMS 5
+#define NUM_PRMS     7
 
 #define RTP_BETA     0
 #define RTP_INIT_VAL 1
 
+// Parameters after the first NUM_REQ_PRMS are optional so that blocks saved
+// with fewer parameters keep working
+static bool hasParam(SimStruct *S, int idx)
+{
+    return idx < ssGetSFcnParamsCount(S);
+}
+
+auto Mx_Deleter = [](char *m) { mxFree(m); };
+using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
+
+// Number of requests kept in flight, 1 unless given by the optional parameter
+static unsigned int pipeline_depth(SimStruct *S)
+{
+    if (!hasParam(S, PIPELINE_DEPTH_P)) {
+        return 1;
+    }
+    double *v = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,PIPELINE_DEPTH_P)));
+    return static_cast<unsigned int>(*v);
+}
+
+// Log level named by the optional parameter, the one of the environment
+// variable if the block does not have it or it is empty
+static LogLevel log_level(SimStruct *S)
+{
+    if (!hasParam(S, LOG_LEVEL_P) || !mxIsChar(ssGetSFcnParam(S,LOG_LEVEL_P))) {
+        return AsyncLog::envLevel();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,LOG_LEVEL_P)), Mx_Deleter);
+    return AsyncLog::parseLevel(str.get(), AsyncLog::envLevel());
+}
+
 #define MDL_CHECK_PARAMETERS
 #if defined(MDL_CHECK_PARAMETERS) && defined(MATLAB_MEX_FILE)
 // mdlCheckParameters
@@ -55,9 +91,9 @@ static void mdlCheckParameters(SimStruct *S)
     }
 
     if (!mxIsDouble(ssGetSFcnParam(S,INIT_VALUE_P)) ||
-        mxGetNumberOfElements(ssGetSFcnParam(S,INIT_VALUE_P)) != 1 ||
+        mxGetNumberOfElements(ssGetSFcnParam(S,INIT_VALUE_P)) < 1 ||
         mxIsComplex(ssGetSFcnParam(S,INIT_VALUE_P))) {
-        ssSetErrorStatus(S,"Initial value for output should be a real scalar of double data type.");
+        ssSetErrorStatus(S,"Initial value for output should be a real scalar or vector of double data type.");
         return;
     }
     
@@ -73,6 +109,35 @@ static void mdlCheckParameters(SimStruct *S)
         ssSetErrorStatus(S,"Communication interval parameter must be a positive real scalar of double data type.");
         return;
     }
+
+    if (hasParam(S, PIPELINE_DEPTH_P)) {
+        isValid = mxIsDouble(ssGetSFcnParam(S,PIPELINE_DEPTH_P)) &&
+            mxGetNumberOfElements(ssGetSFcnParam(S,PIPELINE_DEPTH_P)) == 1 &&
+            !mxIsComplex(ssGetSFcnParam(S,PIPELINE_DEPTH_P));
+
+        if (isValid) {
+            double *v = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,PIPELINE_DEPTH_P)));
+            // The requests in flight are sent again on timeout, the server
+            // keeps as many replies
+            if (*v < 1 || *v > SESSION_REPLIES_KEPT || *v != static_cast<unsigned int>(*v)) isValid = false;
+        }
+        if (!isValid) {
+            ssSetErrorStatus(S,"Pipeline depth parameter must be an integer from 1 to 32.");
+            return;
+        }
+    }
+
+    if (hasParam(S, LOG_LEVEL_P)) {
+        isValid = mxIsChar(ssGetSFcnParam(S,LOG_LEVEL_P));
+        if (isValid) {
+            mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,LOG_LEVEL_P)), Mx_Deleter);
+            isValid = AsyncLog::isLevelName(str.get());
+        }
+        if (!isValid) {
+            ssSetErrorStatus(S,"Log level parameter must be one of 'off', 'error', 'warn', 'info', 'debug' and 'trace', or '' for the level of the " LOG_LEVEL_ENV " environment variable.");
+            return;
+        }
+    }
     return;
 }
 #endif // MDL_CHECK_PARAMETERS
@@ -83,7 +148,8 @@ static void mdlCheckParameters(SimStruct *S)
 static void mdlInitializeSizes(SimStruct *S)
 {
     // Register the number of expected parameters
-    ssSetNumSFcnParams(S, NUM_PRMS);
+    int_T nPrms = ssGetSFcnParamsCount(S);
+    ssSetNumSFcnParams(S, (nPrms >= NUM_REQ_PRMS && nPrms <= NUM_PRMS) ? nPrms : NUM_PRMS);
 
 #if defined(MATLAB_MEX_FILE)
     if (ssGetNumSFcnParams(S) == ssGetSFcnParamsCount(S)) {
@@ -101,10 +167,18 @@ static void mdlInitializeSizes(SimStruct *S)
     ssSetSFcnParamTunable(S, BETA_P, true);
     ssSetSFcnParamTunable(S, INIT_VALUE_P, true);
     ssSetSFcnParamTunable(S, STEP_SIZE_P, false);
+    if (hasParam(S, PIPELINE_DEPTH_P)) {
+        ssSetSFcnParamTunable(S, PIPELINE_DEPTH_P, false);
+    }
+    if (hasParam(S, LOG_LEVEL_P)) {
+        ssSetSFcnParamTunable(S, LOG_LEVEL_P, false);
+    }
 
+    // Each element of the input signal is an independent EWMA channel. All
+    // channels are sent to the server in a single batched request.
     if (!ssSetNumInputPorts(S, 1)) return;
     
-    ssSetInputPortWidth(S, 0, 1);
+    ssSetInputPortWidth(S, 0, DYNAMICALLY_SIZED);
     ssSetInputPortDataType(S, 0, SS_DOUBLE);
     ssSetInputPortComplexSignal(S, 0, COMPLEX_NO);
     ssSetInputPortRequiredContiguous(S, 0, 1);
@@ -113,7 +187,7 @@ static void mdlInitializeSizes(SimStruct *S)
     
     if (!ssSetNumOutputPorts(S, 1)) return;
     
-    ssSetOutputPortWidth(S, 0, 1);
+    ssSetOutputPortWidth(S, 0, DYNAMICALLY_SIZED);
     ssSetOutputPortDataType(S, 0, SS_DOUBLE);
     ssSetOutputPortComplexSignal(S, 0, COMPLEX_NO);   
 
@@ -124,7 +198,8 @@ static void mdlInitializeSizes(SimStruct *S)
     ssSetSimStateCompliance(S, USE_DEFAULT_SIM_STATE);
     
     ssSetOptions(S,
-                 SS_OPTION_EXCEPTION_FREE_CODE);
+                 SS_OPTION_EXCEPTION_FREE_CODE |
+                 SS_OPTION_USE_TLC_WITH_ACCELERATOR);
     
     ssSetModelReferenceNormalModeSupport(S, MDL_START_AND_MDL_PROCESS_PARAMS_OK);
 }
@@ -142,19 +217,55 @@ static void mdlInitializeSampleTimes(SimStruct *S)
     ssSetModelReferenceSampleTimeDefaultInheritance(S);
 }
 
+#if defined(MATLAB_MEX_FILE)
+#define MDL_SET_INPUT_PORT_WIDTH
+// mdlSetInputPortWidth
+// Output has the same number of channels as the input
+static void mdlSetInputPortWidth(SimStruct *S, int_T port, int_T inputPortWidth)
+{
+    ssSetInputPortWidth(S, port, inputPortWidth);
+    ssSetOutputPortWidth(S, 0, inputPortWidth);
+}
+
+#define MDL_SET_OUTPUT_PORT_WIDTH
+// mdlSetOutputPortWidth
+//
+static void mdlSetOutputPortWidth(SimStruct *S, int_T port, int_T outputPortWidth)
+{
+    ssSetOutputPortWidth(S, port, outputPortWidth);
+    ssSetInputPortWidth(S, 0, outputPortWidth);
+}
+
+#define MDL_SET_DEFAULT_PORT_WIDTH
+// mdlSetDefaultPortWidth
+// Single channel when the width cannot be inherited
+static void mdlSetDefaultPortWidth(SimStruct *S)
+{
+    ssSetInputPortWidth(S, 0, 1);
+    ssSetOutputPortWidth(S, 0, 1);
+}
+#endif // MATLAB_MEX_FILE
+
 #define MDL_SET_WORK_WIDTHS
 #if defined(MDL_SET_WORK_WIDTHS) && defined(MATLAB_MEX_FILE)
 // mdlSetWorkWidths
 //
 static void mdlSetWorkWidths(SimStruct *S)
 {
+    int_T width = ssGetInputPortWidth(S, 0);
+    int_T initLen = static_cast<int_T>(mxGetNumberOfElements(ssGetSFcnParam(S,INIT_VALUE_P)));
+    if (initLen != 1 && initLen != width) {
+        ssSetErrorStatus(S,"Initial value for output must be a scalar or have the same number of elements as the input signal.");
+        return;
+    }
+
     // Declare the DWorks vectors
     ssSetNumPWork(S, 1);
    
     ssSetNumDWork(S, 2);
 
-    // Previous EWMA value
-    ssSetDWorkWidth(S, 0, 1);
+    // Previous EWMA value of every channel
+    ssSetDWorkWidth(S, 0, width);
     ssSetDWorkDataType(S, 0,SS_DOUBLE );
 
     // Current number of iterations
@@ -175,34 +286,50 @@ static void mdlProcessParameters(SimStruct *S)
 {
     // Update Run-Time parameters
     ssUpdateAllTunableParamsAsRunTimeParams(S);
+
+    // New exponential weight is sent to the server session with the next sample
+    processparameters_wrapper(ssGetPWorkValue(S,0));
 }
 #endif // MDL_PROCESS_PARAMETERS
 
 #define GET_ZM_PTR(S) ssGetPWorkValue(S,0)
 
-auto Mx_Deleter = [](char *m) { mxFree(m); };
-using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
+static std::string host_name(const SimStruct *S)
+{
+    mxCharUnqiuePtr hostStr(mxArrayToString(ssGetSFcnParam(S,HOST_NAME_P)), Mx_Deleter);
+    return hostStr.get();
+}
 
 static std::string host_and_port_addr(const SimStruct *S)
 {
-    mxCharUnqiuePtr hostStr(mxArrayToString(ssGetSFcnParam(S,HOST_NAME_P)), Mx_Deleter);
     mxCharUnqiuePtr portStr(mxArrayToString(ssGetSFcnParam(S,PORT_NUM_P)), Mx_Deleter);
-    
-    std::string connStr = "tcp://";
-    connStr += hostStr.get();
-    connStr += ":";
-    connStr += portStr.get();
-
-    return connStr;
+    return gateway_address(host_name(S), portStr.get());
 }
 
 #define MDL_SETUP_RUNTIME_RESOURCES
 // Called at the beginning of one or multiple simulations.
 void mdlSetupRuntimeResources(SimStruct *S)
 {
-    std::cout << "Opening connection with server" << std::endl;
-    std::string connStr = host_and_port_addr(S);
-    ssSetPWorkValue(S, 0, setupruntimeresources_wrapper(connStr));
+    std::string connStr;
+    try {
+        // Messages of the steps are printed by the logger's thread from here
+        // on. The cleanup stops it also if another block runs it at another
+        // level.
+        AsyncLog::instance().start(log_level(S));
+        SFUN_LOG(LEVEL_INFO, "Opening connection with server");
+        connStr = host_and_port_addr(S);
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
+
+    // With a pipeline of K requests in flight the output lags the input by K steps
+    unsigned int depth = pipeline_depth(S);
+    if (depth > 1) {
+        SFUN_LOG(LEVEL_INFO, "Keeping %u requests in flight, output is delayed by %u steps", depth, depth);
+    }
+    ssSetPWorkValue(S, 0, setupruntimeresources_wrapper(connStr, depth));
 }
 
 
@@ -214,8 +341,10 @@ static void mdlStart(SimStruct *S)
 {
     double *prev = reinterpret_cast<double *>(ssGetDWork(S,0));
     unsigned int *iter = reinterpret_cast<unsigned int *>(ssGetDWork(S,1));
-    // Initialize previous states and iteration counter
-    start_wrapper(prev, iter);
+    // Initialize previous states and iteration counter. The connection and
+    // the server session of the last run are kept, the first step starts
+    // the session over.
+    start_wrapper(GET_ZM_PTR(S), prev, ssGetInputPortWidth(S,0), iter);
 }
 
 // mdlOutputs
@@ -223,12 +352,12 @@ static void mdlStart(SimStruct *S)
 static void mdlOutputs(SimStruct *S, int_T tid)
 {
     double   *y_ptr = reinterpret_cast<double *>(ssGetOutputPortSignal(S,0));
-    unsigned int *iter_ptr = reinterpret_cast<unsigned int *>(ssGetDWork(S,1));
     double *prev_ptr   = reinterpret_cast<double *>(ssGetDWork(S,0));
 
     double *init_ptr   = reinterpret_cast<double *>((ssGetRunTimeParamInfo(S,RTP_INIT_VAL))->data);
+    int init_len = static_cast<int>(mxGetNumberOfElements(ssGetSFcnParam(S,INIT_VALUE_P)));
     try {
-        outputs_wrapper(GET_ZM_PTR(S), iter_ptr, y_ptr, init_ptr, prev_ptr);
+        outputs_wrapper(GET_ZM_PTR(S), y_ptr, ssGetOutputPortWidth(S,0), init_ptr, init_len, prev_ptr);
     } catch (std::exception &e) {
         static std::string errstr(e.what());
         ssSetErrorStatus(S, errstr.c_str());
@@ -241,12 +370,17 @@ static void mdlOutputs(SimStruct *S, int_T tid)
 //
 static void mdlUpdate(SimStruct *S, int_T tid)
 {
-    const double   *prev_ptr = reinterpret_cast<double *>(ssGetDWork(S,0));
     const double   *u_ptr    = reinterpret_cast<const double *>(ssGetInputPortSignal(S,0));
     unsigned int   *iter_ptr = reinterpret_cast<unsigned int *>(ssGetDWork(S,1));
     const double   *beta_ptr = reinterpret_cast<double *>((ssGetRunTimeParamInfo(S,RTP_BETA))->data);
     
-    update_wrapper(GET_ZM_PTR(S), iter_ptr, u_ptr, beta_ptr, prev_ptr);                  
+    try {
+        update_wrapper(GET_ZM_PTR(S), iter_ptr, u_ptr, ssGetInputPortWidth(S,0), beta_ptr);
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
 }
 
 #define MDL_CLEANUP_RUNTIME_RESOURCES
@@ -254,8 +388,12 @@ static void mdlUpdate(SimStruct *S, int_T tid)
 // at the end of each subsequent Fast Restart.
 static void mdlCleanupRuntimeResources(SimStruct *S)
 {
-    std::cout << "Closing connection with server" << std::endl;
-    cleanupruntimeresouces_wrapper(GET_ZM_PTR(S));
+    SFUN_LOG(LEVEL_INFO, "Closing connection with server");
+    if (GET_ZM_PTR(S)) {
+        cleanupruntimeresouces_wrapper(GET_ZM_PTR(S));
+        release_gateway_address(host_name(S));
+    }
+    AsyncLog::instance().stop();
 }
 
 
@@ -264,9 +402,8 @@ static void mdlCleanupRuntimeResources(SimStruct *S)
 // Called at the end of every simulation. Called at the end of every Fast Restart.
 static void mdlTerminate(SimStruct *S)
 {
-    unsigned int *iter_ptr = reinterpret_cast<unsigned int *>(ssGetDWork(S,1));
     try {
-        terminate_wrapper(GET_ZM_PTR(S), iter_ptr);
+        terminate_wrapper(GET_ZM_PTR(S), ssGetInputPortWidth(S,0));
     } catch (std::exception &e) {
         static std::string errstr(e.what());
         ssSetErrorStatus(S, errstr.c_str());
@@ -274,6 +411,34 @@ static void mdlTerminate(SimStruct *S)
     }
 }
 
+// Char parameter as the TLC file puts it into a C string literal
+static std::string rtw_string(SimStruct *S, int idx)
+{
+    if (!hasParam(S, idx) || !mxIsChar(ssGetSFcnParam(S,idx))) {
+        return std::string();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,idx)), Mx_Deleter);
+    return str.get();
+}
+
+#define MDL_RTW
+#if defined(MDL_RTW) && defined(MATLAB_MEX_FILE)
+// mdlRTW
+// Parameters of the block for statcalsfcngateway.tlc, which calls the C
+// interface of statcal_runtime.h in generated code and the accelerator
+// modes. Beta and the initial value are written as run-time parameters.
+static void mdlRTW(SimStruct *S)
+{
+    if (!ssWriteRTWParamSettings(S, 4,
+                                 SSWRITE_VALUE_QSTR, "Host", rtw_string(S, HOST_NAME_P).c_str(),
+                                 SSWRITE_VALUE_QSTR, "Port", rtw_string(S, PORT_NUM_P).c_str(),
+                                 SSWRITE_VALUE_NUM,  "PipelineDepth", static_cast<real_T>(pipeline_depth(S)),
+                                 SSWRITE_VALUE_QSTR, "LogLevel", rtw_string(S, LOG_LEVEL_P).c_str())) {
+        return; // An error occurred, which will be reported by Simulink
+    }
+}
+#endif // MDL_RTW
+
 #ifdef  MATLAB_MEX_FILE    // Is this file being compiled as a MEX-file?
 #include "simulink.c"      // MEX-file interface mechanism
 #else
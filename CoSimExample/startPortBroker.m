@@ -0,0 +1,11 @@
+% Copyright 2018 The MathWorks, Inc.
+
+%% Launch the port broker with a pool of stats calculator servers
+% Blocks whose host parameter is 'broker://<name>' get their port from the
+% broker instead of the block dialog, and the stats calculator blocks one of
+% the servers of the pool, which are started ahead of the simulations.
+p = simulinkproject;
+poolSize = '4';
+server = fullfile(p.RootFolder,'CoSimExample','serverApp','statcalserver.exe');
+system([fullfile(p.RootFolder,'utils','portbroker','portbroker.exe') ...
+    ' --server "' server '" --pool ' poolSize ' & '])
@@ -4,48 +4,129 @@
 #include <vector>
 #include <cstring>
 #include <string>
+#include <stdexcept>
 
-// [int len][double][double]...[double]
-// [int -len][char][char]...[char]
+#include "statcal_util.hpp"
 
-int decode_header(const char *str)
+// [int type][int len][unsigned int session][unsigned int seq][double][double]...[double]
+// [int type][int -len][unsigned int session][unsigned int seq][char][char]...[char]
+
+namespace {
+
+void encode_header(const MsgType type, const int len, const unsigned int session, const unsigned int seq,
+                   std::string & ec, const unsigned int op = 0)
+{
+    if (op > OP_MAX) {
+        throw std::runtime_error("Operator " + std::to_string(op) + " does not fit the message header");
+    }
+    const int type_op = static_cast<int>(type | (op << 16));
+    std::memcpy(&ec[0], &type_op, sizeof(int));
+    std::memcpy(&ec[sizeof(int)], &len, sizeof(int));
+    std::memcpy(&ec[2*sizeof(int)], &session, sizeof(unsigned int));
+    std::memcpy(&ec[2*sizeof(int)+sizeof(unsigned int)], &seq, sizeof(unsigned int));
+}
+
+} // anonymous namespace
+
+MsgHeader decode_header(const char *str)
 {
-    int len;
-    std::memcpy(&len, str, sizeof(int));
-    return len;
+    MsgHeader hdr;
+    unsigned int type_op;
+    std::memcpy(&type_op, str, sizeof(int));
+    hdr.type  = static_cast<MsgType>(type_op & 0xffff & ~MSG_SEQUENCED);
+    hdr.flags = type_op & MSG_SEQUENCED;
+    hdr.op   = type_op >> 16;
+    std::memcpy(&hdr.len, str+sizeof(int), sizeof(int));
+    std::memcpy(&hdr.session, str+2*sizeof(int), sizeof(unsigned int));
+    std::memcpy(&hdr.seq, str+2*sizeof(int)+sizeof(unsigned int), sizeof(unsigned int));
+    return hdr;
 }
 
-void encode_double_data(const std::vector<double> & data, std::string & ec)
+void encode_double_data(const MsgType type, const unsigned int session, const unsigned int seq,
+                        const std::vector<double> & data, std::string & ec)
 {
     size_t len  = data.size();
     size_t rlen = sizeof(double)*len;
 
-    ec.resize(sizeof(int)+rlen, 0);
-    std::memcpy(&ec[0], &len, sizeof(int));
+    ec.resize(MSG_HEADER_SIZE+rlen, 0);
+    encode_header(type, static_cast<int>(len), session, seq, ec);
 
-    std::memcpy(&ec[sizeof(int)], &data[0], sizeof(double)*len);
+    if (len > 0) {
+        std::memcpy(&ec[MSG_HEADER_SIZE], &data[0], rlen);
+    }
 }
 
-void encode_str_data(const char *data, std::string & ec)
+void encode_op_data(const MsgType type, const unsigned int op, const unsigned int session, const unsigned int seq,
+                    const std::vector<double> & data, std::string & ec)
+{
+    size_t len  = data.size();
+    size_t rlen = sizeof(double)*len;
+
+    ec.resize(MSG_HEADER_SIZE+rlen, 0);
+    encode_header(type, static_cast<int>(len), session, seq, ec, op);
+
+    if (len > 0) {
+        std::memcpy(&ec[MSG_HEADER_SIZE], &data[0], rlen);
+    }
+}
+
+void encode_str_data(const MsgType type, const unsigned int session, const unsigned int seq,
+                     const char *data, std::string & ec)
 {
     int len = strlen(data);
     size_t rlen = len*sizeof(char);
 
-    ec.resize(rlen+sizeof(int), 0);
+    ec.resize(MSG_HEADER_SIZE+rlen, 0);
+    encode_header(type, -len, session, seq, ec);
 
-    len = -len;
-    std::memcpy(&ec[0], &len, sizeof(int));
-    std::memcpy(&ec[sizeof(int)], data, rlen);
+    std::memcpy(&ec[MSG_HEADER_SIZE], data, rlen);
 }
 
 
-void decode_double_data(const int len, const char *str, std::vector<double> & data)
+void decode_double_data(const MsgHeader & hdr, const char *str, std::vector<double> & data)
+{
+    data.resize(hdr.len, 0);
+    if (hdr.len > 0) {
+        std::memcpy(&data[0], str+MSG_HEADER_SIZE, hdr.len*sizeof(double));
+    }
+}
+
+void decode_str_data(const MsgHeader & hdr, const char *str, std::string &s)
 {
-    data.resize(len, 0);
-    std::memcpy(&data[0], str+sizeof(int), len*sizeof(double)); 
+    s.assign(str+MSG_HEADER_SIZE, -hdr.len);
+}
+
+void encode_stats_data(const unsigned int seq, const ServerStats & stats, std::string & ec)
+{
+    std::vector<double> data = {static_cast<double>(stats.num_workers), static_cast<double>(stats.requests),
+                                static_cast<double>(stats.errors), static_cast<double>(stats.open_sessions)};
+    stats.queue_wait.serialize(data);
+    stats.compute.serialize(data);
+    encode_double_data(REPLY, 0, seq, data, ec);
+}
+
+void decode_stats_data(const MsgHeader & hdr, const char *str, ServerStats & stats)
+{
+    std::vector<double> data;
+    decode_double_data(hdr, str, data);
+
+    size_t pos = 4;
+    if (data.size() < pos ||
+        !stats.queue_wait.deserialize(data, pos) || !stats.compute.deserialize(data, pos)) {
+        throw std::runtime_error("Malformed statistics reply");
+    }
+    stats.num_workers   = static_cast<unsigned int>(data[0]);
+    stats.requests      = static_cast<uint64_t>(data[1]);
+    stats.errors        = static_cast<uint64_t>(data[2]);
+    stats.open_sessions = static_cast<uint64_t>(data[3]);
 }
 
-void decode_str_data(const char *str, std::string &s)
+void print_stats(std::ostream & os, const ServerStats & stats)
 {
-    s = str+sizeof(int);
+    os << "Server: " << stats.num_workers << " worker(s), " << stats.requests << " requests, "
+       << stats.errors << " errors, " << stats.open_sessions << " open sessions\n";
+    LatencyHistogram::printHeader(os, "Server (us)");
+    stats.queue_wait.print(os, "queue wait");
+    stats.compute.print(os, "compute");
+    os.flush();
 }
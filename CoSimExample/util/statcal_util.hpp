@@ -4,13 +4,93 @@
 #ifndef STATCAL_UTIL_HPP
 #define STATCAL_UTIL_HPP
 
+#include <ostream>
+
+#include "latency_histogram.hpp"
+
+// [int type][int len][unsigned int session][unsigned int seq][double][double]...[double]
+// [int type][int -len][unsigned int session][unsigned int seq][char][char]...[char]
+// The message type is in the low 16 bits of type, the operator of a session
+// request (StatOp) in the high 16 bits, 0 for the EWMA.
+// A session request with MSG_SEQUENCED set in type promises that the client
+// numbers the requests of the session one by one from the SESSION_OPEN or
+// SESSION_RESET on and sends them again when their replies do not come. The
+// server then steps the session once per seq, answers the requests sent again
+// with the replies it kept, up to SESSION_REPLIES_KEPT of them, and refuses a
+// request whose predecessor it has not seen.
+
+typedef enum {
+    EWMA = 1,       // (prev[N], u[N], beta, iteration), stateless
+    SESSION_OPEN,   // (beta, u[N]), opens a session and processes its first sample, (params[P], u[N]) for other operators
+    SESSION_DATA,   // (u[N])
+    SESSION_BETA,   // (beta, u[N]), new exponential weight followed by the next sample
+    SESSION_CLOSE,  // ()
+    TERMINATE,      // (), shuts the server down
+    REPLY,          // (ewma[N], bias_corrected_ewma[N]) or () for control messages
+    ERROR_REPLY,    // (char[]) error message
+    STATS,          // (), server replies with its counters and histograms, see ServerStats
+    SESSION_RESET,  // (beta, u[N]), starts the open session over and processes its first sample
+    EWMA_BULK,      // (beta, N, u[T*N]), whole series of T samples, replied (ewma[T*N], bias_corrected_ewma[T*N])
+    EWMA_FILE,      // (char[]) "<input>?beta=B&channels=N[&out=<output>]", series in files, replied (T, N)
+} MsgType;
+
+#define MSG_SEQUENCED        0x8000
+#define SESSION_REPLIES_KEPT 32 // most requests a sequenced client keeps in flight
+
+// Operators of sessions, the op of SESSION_OPEN and SESSION_RESET; the other
+// requests of a session run the operator it was opened with. Each takes P
+// parameters ahead of the first sample, (params[P], u[N]), also for
+// SESSION_BETA, and replies its outputs for every channel.
+typedef enum {
+    OP_EWMA = 0,    // (beta), replies (ewma[N], bias_corrected_ewma[N])
+    OP_WELFORD,     // (), replies (mean[N], variance[N]) of all samples
+    OP_WINDOW,      // (W), replies (mean[N], min[N], max[N]) of the last W samples
+    OP_EWMA_VAR,    // (beta), replies (ewma[N], ewm_variance[N])
+    OP_TDIGEST,     // (compression, q), replies (quantile[N]), the estimated q quantile of all samples
+    OP_USER = 256,  // first id of operators registered by users, see stat_ops.hpp
+    OP_MAX = 0xffff, // last id, the header has 16 bits for it
+} StatOp;
+
+struct MsgHeader {
+    MsgType      type;
+    int          len;     // number of double values, negative for number of chars
+    unsigned int session; // 0 when the message is not part of a session
+    unsigned int seq;     // request sequence number, echoed in the reply
+    unsigned int op;      // operator of a session request, see StatOp
+    unsigned int flags;   // MSG_SEQUENCED or 0
+};
+
+// Server counters and latency histograms, the reply to STATS
+struct ServerStats {
+    unsigned int     num_workers;
+    uint64_t         requests;       // handled by the workers, STATS not included
+    uint64_t         errors;         // answered with ERROR_REPLY
+    uint64_t         open_sessions;
+    LatencyHistogram queue_wait;     // from the broker receiving a request to a worker taking it
+    LatencyHistogram compute;        // request handling in the worker
+};
+
+const size_t MSG_HEADER_SIZE = 2*sizeof(int)+2*sizeof(unsigned int);
+
 void convert2double(char *data_str, std::vector<double> & data);
 std::string convert2str(const std::vector<double> & data);
 
-int decode_header(const char *str);
-void encode_double_data(const std::vector<double> & data, std::string & ec);
-void encode_str_data(const char *data, std::string & ec);
-void decode_double_data(const int len, const char *str, std::vector<double> & data);
-void decode_str_data(const char *str, std::string & s);
+MsgHeader decode_header(const char *str);
+void encode_double_data(const MsgType type, const unsigned int session, const unsigned int seq,
+                        const std::vector<double> & data, std::string & ec);
+// Session request running operator op
+void encode_op_data(const MsgType type, const unsigned int op, const unsigned int session, const unsigned int seq,
+                    const std::vector<double> & data, std::string & ec);
+void encode_str_data(const MsgType type, const unsigned int session, const unsigned int seq,
+                     const char *data, std::string & ec);
+void decode_double_data(const MsgHeader & hdr, const char *str, std::vector<double> & data);
+void decode_str_data(const MsgHeader & hdr, const char *str, std::string & s);
+
+// STATS reply as doubles: [num_workers, requests, errors, open_sessions,
+// queue_wait histogram, compute histogram]. decode_stats_data throws
+// std::runtime_error if the reply is malformed.
+void encode_stats_data(const unsigned int seq, const ServerStats & stats, std::string & ec);
+void decode_stats_data(const MsgHeader & hdr, const char *str, ServerStats & stats);
+void print_stats(std::ostream & os, const ServerStats & stats);
 
 #endif
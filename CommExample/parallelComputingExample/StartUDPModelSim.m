@@ -1,4 +1,4 @@
-function StartUDPModelSim(mdlname)
+function StartUDPModelSim(mdlname, scope)
 % Copyright 2018 The MathWorks, Inc.
 
 if ~iscell(mdlname)
@@ -7,18 +7,26 @@ end
 
 numsim = numel(mdlname);
 
+% Blocks with the host 'broker://<name>' get the port of the name in this
+% scope from the port broker, see startPortBroker. The models of one call
+% talk to each other and share it, other calls run side by side.
+if nargin < 2
+    scope = char(java.util.UUID.randomUUID);
+end
+
 % Change this to minimum of nummodels and default
 p = parpool(numsim);
 
 for idx = 1:numsim
-    F(idx) = parfeval(p, @SingleSim, 0, mdlname{idx}); %#ok<AGROW>
+    F(idx) = parfeval(p, @SingleSim, 0, mdlname{idx}, scope); %#ok<AGROW>
 end
 wait(F)
 
 
 end
 
-function SingleSim(mdl)
+function SingleSim(mdl, scope)
+    setenv('COSIM_SCOPE', scope);
     % NOTE: Replace with load_system to avoid opening windows
     open_system(mdl);
     set_param(mdl,'SimulationCommand','Start');    
@@ -0,0 +1,130 @@
+/* Copyright 2018 The MathWorks, Inc. */
+
+/*
+ *  Test driver of the C interface of the transmit and receive blocks, see
+ *  comm_runtime.h. Runs a transmitter and a receiver in one thread, each
+ *  step sending a sample and receiving it, and checks that the samples
+ *  arrive unchanged and in order. The receiver steps after the transmitter,
+ *  so the transmitter must not wait for its reply: the connection streams
+ *  (ack interval > 0) or sends datagrams (udp://).
+ *
+ *  utils/buildCommExample.m builds the runtime library and the test into
+ *  CommExample/sfun/comm_runtime. By hand (from the repository root), the
+ *  runtime library first:
+ *    g++ -O2 -std=c++14 -c -Iutils/include -I<cppzmq> -I<libzmq>/include
+ *        CommExample/sfun/comm_runtime.cpp CommExample/sfun/mdlclient.cpp
+ *        CommExample/sfun/mdlserver.cpp CommExample/sfun/statcal_util.cpp
+ *        CommExample/sfun/shm_ring.cpp CommExample/sfun/udp_link.cpp
+ *        CommExample/sfun/msg_log.cpp CommExample/sfun/mux_link.cpp
+ *    ar rcs libcomm_runtime.a *.o
+ *    gcc -O2 -ICommExample/sfun CommExample/sfun/comm_loopback.c
+ *        -o comm_loopback libcomm_runtime.a -lzmq -lstdc++ -lpthread -lrt
+ *
+ *  Run:
+ *    comm_loopback [host] [port] [steps] [ack interval] [runs]
+ *    defaults localhost 5599 10000 16 2, e.g.
+ *    comm_loopback shm://loopback 1 100000 64
+ *    comm_loopback udp://localhost 5599 1000 0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "comm_runtime.h"
+
+#define WIDTH 4
+
+static int check(int status, const char *what)
+{
+    if (status == COMM_ERROR) {
+        fprintf(stderr, "%s: %s\n", what, comm_last_error());
+    }
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    const char  *host  = argc > 1 ? argv[1] : "localhost";
+    const char  *port  = argc > 2 ? argv[2] : "5599";
+    const long   steps = argc > 3 ? atol(argv[3]) : 10000;
+    const unsigned int ack = argc > 4 ? (unsigned int)atoi(argv[4]) : 16;
+    const int    runs  = argc > 5 ? atoi(argv[5]) : 2;
+
+    CommPort ports[2] = { {COMM_DOUBLE, WIDTH}, {COMM_INT32, 1} };
+    double   u_data[WIDTH], y_data[WIDTH];
+    int      u_count, y_count;
+    const void *inputs[2];
+    void       *outputs[2];
+    CommTransmitterConfig tx_config;
+    CommReceiverConfig    rx_config;
+    CommTransmitter *tx = NULL;
+    CommReceiver    *rx = NULL;
+    long k, errors = 0;
+    int  run, i, status = 0;
+
+    if (ack == 0 && strncmp(host, "udp://", 6) != 0) {
+        fprintf(stderr, "The transmitter would wait for the reply of a receiver which steps after it, "
+                        "please give an ack interval > 0 or a udp:// host.\n");
+        return 2;
+    }
+
+    inputs[0]  = u_data;
+    inputs[1]  = &u_count;
+    outputs[0] = y_data;
+    outputs[1] = &y_count;
+
+    comm_receiver_config_init(&rx_config);
+    rx_config.host = host;
+    rx_config.port = port;
+    rx_config.timeout = 5.0;
+
+    comm_transmitter_config_init(&tx_config);
+    tx_config.host = host;
+    tx_config.port = port;
+    tx_config.timeout = 5.0;
+    tx_config.ack_interval = ack;
+
+    /* The receiver first, it creates shared memory and answers the handshake */
+    if (check(comm_receiver_create(&rx_config, ports, 2, &rx), "receiver") != COMM_OK ||
+        check(comm_transmitter_create(&tx_config, ports, 2, &tx), "transmitter") != COMM_OK) {
+        comm_receiver_destroy(rx);
+        return 1;
+    }
+
+    for (run = 0; run < runs && errors == 0 && status != COMM_ERROR; run++) {
+        if (check(comm_transmitter_start(tx), "start") != COMM_OK ||
+            check(comm_receiver_start(rx), "start") != COMM_OK) {
+            break;
+        }
+        for (k = 0; k < steps; k++) {
+            for (i = 0; i < WIDTH; i++) {
+                u_data[i] = k + 0.25*i;
+            }
+            u_count = (int)k;
+            status = check(comm_transmitter_step(tx, inputs, k*0.001), "transmit");
+            if (status != COMM_OK) {
+                break;
+            }
+            status = check(comm_receiver_step(rx, outputs), "receive");
+            if (status != COMM_OK) {
+                break;
+            }
+            for (i = 0; i < WIDTH; i++) {
+                if (y_data[i] != u_data[i]) {
+                    errors++;
+                }
+            }
+            if (y_count != u_count) {
+                errors++;
+            }
+        }
+        check(comm_transmitter_terminate(tx), "terminate");
+        check(comm_receiver_terminate(rx), "terminate");
+        printf("run %d: %ld steps, %ld mismatches\n", run+1, k, errors);
+    }
+
+    comm_transmitter_destroy(tx);
+    comm_receiver_destroy(rx);
+    return (errors == 0 && status != COMM_ERROR) ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#define COMM_RUNTIME_BUILD
+
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "comm_runtime.h"
+#include "statcal_util.hpp"
+#include "mdlclient.hpp"
+#include "mdlserver.hpp"
+#include "async_log.hpp"
+
+struct CommTransmitter {
+    void       *zm;
+    double      timeout;   // msecs
+    std::string host;      // to give a broker port back
+};
+
+struct CommReceiver {
+    void       *zm;
+    double      timeout;   // msecs
+    std::string host;      // to give a broker port back
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+int fail(const char *what)
+{
+    last_error = what;
+    return COMM_ERROR;
+}
+
+const char *no_transmitter = "No transmitter, creating it failed.";
+const char *no_receiver    = "No receiver, creating it failed.";
+
+const char *str_or_empty(const char *s)
+{
+    return s ? s : "";
+}
+
+// Ports as the connection code takes them, throws for a type or width no
+// block port can have
+std::vector<PortSpec> port_specs(const CommPort *ports, const int num_ports)
+{
+    if (ports == nullptr || num_ports < 1) {
+        throw std::runtime_error("At least one port is needed.");
+    }
+    std::vector<PortSpec> specs;
+    for (int k = 0; k < num_ports; k++) {
+        if (ports[k].type < COMM_DOUBLE || ports[k].type > COMM_BOOLEAN || ports[k].width < 1) {
+            throw std::runtime_error("Port " + std::to_string(k+1) + " needs a data type out of CommDataType and a positive width.");
+        }
+        specs.push_back({static_cast<DataType>(ports[k].type), ports[k].width});
+    }
+    return specs;
+}
+
+// The logger runs from create to destroy of every handle, as from setup to
+// cleanup of every block. Throws if another handle runs it at another level,
+// it must be stopped all the same.
+void start_log(const char *level)
+{
+    AsyncLog::instance().start(AsyncLog::parseLevel(level, AsyncLog::envLevel()));
+}
+
+} // anonymous namespace
+
+const char *comm_last_error(void)
+{
+    return last_error.c_str();
+}
+
+void comm_transmitter_config_init(CommTransmitterConfig *config)
+{
+    config->host = "localhost";
+    config->port = "5555";
+    config->timeout = 10.0;
+    config->ack_interval = 0;
+    config->keyframe_interval = 0;
+    config->channel = 0;
+    config->frame_size = 1;
+    config->record_file = nullptr;
+    config->log_level = nullptr;
+}
+
+int comm_transmitter_create(const CommTransmitterConfig *config, const CommPort *ports,
+                            int num_ports, CommTransmitter **tx)
+{
+    if (config == nullptr || tx == nullptr) {
+        return fail("No configuration or handle given.");
+    }
+    *tx = nullptr;
+    try {
+        start_log(config->log_level);
+        const std::string host = str_or_empty(config->host);
+        const std::string connStr = transmit_address(host, str_or_empty(config->port));
+        void *zm = nullptr;
+        try {
+            zm = setupruntimeresources_wrapper(connStr, config->ack_interval, config->keyframe_interval,
+                                               port_specs(ports, num_ports), config->channel,
+                                               config->frame_size > 0 ? config->frame_size : 1,
+                                               str_or_empty(config->record_file));
+        } catch (...) {
+            release_transmit_address(host);
+            throw;
+        }
+        *tx = new CommTransmitter{zm, config->timeout*1000, host};
+    } catch (std::exception &e) {
+        AsyncLog::instance().stop();
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+int comm_transmitter_start(CommTransmitter *tx)
+{
+    if (tx == nullptr) {
+        return fail(no_transmitter);
+    }
+    try {
+        start_wrapper(tx->zm, tx->timeout);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+int comm_transmitter_step(CommTransmitter *tx, const void *const *inputs, double time)
+{
+    if (tx == nullptr) {
+        return fail(no_transmitter);
+    }
+    try {
+        transmit_outputs_wrapper(tx->zm, inputs, time, tx->timeout);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+int comm_transmitter_terminate(CommTransmitter *tx)
+{
+    if (tx == nullptr) {
+        return fail(no_transmitter);
+    }
+    try {
+        terminate_wrapper(tx->zm);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+void comm_transmitter_destroy(CommTransmitter *tx)
+{
+    if (tx == nullptr) {
+        return;
+    }
+    SFUN_LOG(LEVEL_INFO, "Closing connection");
+    try {
+        cleanupruntimeresouces_wrapper(tx->zm);
+    } catch (std::exception &e) {
+        SFUN_LOG(LEVEL_WARN, "%s", e.what());
+    }
+    release_transmit_address(tx->host);
+    delete tx;
+    AsyncLog::instance().stop();
+}
+
+void comm_receiver_config_init(CommReceiverConfig *config)
+{
+    config->host = "localhost";
+    config->port = "5555";
+    config->timeout = 10.0;
+    config->channel = 0;
+    config->frame_size = 1;
+    config->record_file = nullptr;
+    config->log_level = nullptr;
+}
+
+int comm_receiver_create(const CommReceiverConfig *config, const CommPort *ports,
+                         int num_ports, CommReceiver **rx)
+{
+    if (config == nullptr || rx == nullptr) {
+        return fail("No configuration or handle given.");
+    }
+    *rx = nullptr;
+    try {
+        start_log(config->log_level);
+        SFUN_LOG(LEVEL_INFO, "Starting connection");
+        const std::string host = str_or_empty(config->host);
+        const std::string connStr = receive_address(host, str_or_empty(config->port));
+        void *zm = nullptr;
+        try {
+            zm = receive_setupruntimeresources_wrapper(connStr, port_specs(ports, num_ports), config->channel,
+                                                       config->frame_size > 0 ? config->frame_size : 1,
+                                                       str_or_empty(config->record_file));
+        } catch (...) {
+            release_receive_address(host);
+            throw;
+        }
+        *rx = new CommReceiver{zm, config->timeout*1000, host};
+    } catch (std::exception &e) {
+        AsyncLog::instance().stop();
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+int comm_receiver_start(CommReceiver *rx)
+{
+    if (rx == nullptr) {
+        return fail(no_receiver);
+    }
+    try {
+        receive_start_wrapper(rx->zm);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+int comm_receiver_step(CommReceiver *rx, void *const *outputs)
+{
+    if (rx == nullptr) {
+        return fail(no_receiver);
+    }
+    try {
+        return receive_outputs_wrapper(rx->zm, outputs, rx->timeout) ? COMM_OK : COMM_STOP;
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+}
+
+int comm_receiver_terminate(CommReceiver *rx)
+{
+    if (rx == nullptr) {
+        return fail(no_receiver);
+    }
+    try {
+        receive_terminate_wrapper(rx->zm);
+    } catch (std::exception &e) {
+        return fail(e.what());
+    }
+    return COMM_OK;
+}
+
+void comm_receiver_destroy(CommReceiver *rx)
+{
+    if (rx == nullptr) {
+        return;
+    }
+    SFUN_LOG(LEVEL_INFO, "Closing connection");
+    receive_cleanupruntimeresouces_wrapper(rx->zm);
+    release_receive_address(rx->host);
+    delete rx;
+    AsyncLog::instance().stop();
+}
@@ -0,0 +1,144 @@
+/* Copyright 2018 The MathWorks, Inc. */
+
+#ifndef COMM_RUNTIME_H
+#define COMM_RUNTIME_H
+
+/*
+ * C interface of the transmit and receive blocks, for the code generated
+ * from their TLC files (Rapid Accelerator, code generation) and for
+ * programs outside of Simulink. A handle does what the block's S-function
+ * does, with the same parameters and the same connection code: the
+ * transports, channels, frames and recording of the blocks work the same.
+ *
+ * Every function returning int returns COMM_OK, or COMM_ERROR and leaves
+ * the message in comm_last_error(); comm_receiver_step also returns
+ * COMM_STOP at the end of the transmitter's run. No function throws.
+ *
+ * Lifetime, as the block's methods:
+ *   create     mdlSetupRuntimeResources, once
+ *   start      mdlStart, before the first step of every run
+ *   step       mdlOutputs
+ *   terminate  mdlTerminate, after the last step of every run
+ *   destroy    mdlCleanupRuntimeResources, once
+ * A receiver answers handshakes from create on, so that the transmitters'
+ * start does not wait for its first step.
+ *
+ * Build a static or shared library from comm_runtime.cpp, mdlclient.cpp,
+ * mdlserver.cpp, statcal_util.cpp, shm_ring.cpp, udp_link.cpp,
+ * msg_log.cpp and mux_link.cpp, with the include paths of the S-functions,
+ * and link it with libzmq. Define COMM_RUNTIME_SHARED when building and
+ * using it as a DLL, see comm_loopback.c for an example.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(COMM_RUNTIME_SHARED)
+#  if defined(COMM_RUNTIME_BUILD)
+#    define COMM_API __declspec(dllexport)
+#  else
+#    define COMM_API __declspec(dllimport)
+#  endif
+#elif defined(__GNUC__)
+#  define COMM_API __attribute__((visibility("default")))
+#else
+#  define COMM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMM_OK      0
+#define COMM_STOP    1  /* the run ended, stop the model */
+#define COMM_ERROR  -1
+
+/* Data types of the ports, numbered as Simulink's built-in types */
+typedef enum {
+    COMM_DOUBLE = 0,
+    COMM_SINGLE,
+    COMM_INT8,
+    COMM_UINT8,
+    COMM_INT16,
+    COMM_UINT16,
+    COMM_INT32,
+    COMM_UINT32,
+    COMM_BOOLEAN
+} CommDataType;
+
+typedef struct {
+    int type;    /* CommDataType */
+    int width;   /* elements */
+} CommPort;
+
+/* Block parameters of the transmit block. Pointers may be NULL for the
+ * defaults, which comm_transmitter_config_init fills in. */
+typedef struct {
+    const char  *host;               /* host parameter, e.g. "localhost", "shm://ring", "udp://host" */
+    const char  *port;
+    double       timeout;            /* seconds */
+    unsigned int ack_interval;       /* 0 request/reply, K streams with an ACK every K samples */
+    unsigned int keyframe_interval;  /* 0 dense, K delta coded with a keyframe every K samples */
+    unsigned int channel;            /* 0 a connection of its own */
+    unsigned int frame_size;         /* samples per message */
+    const char  *record_file;        /* messages sent are recorded to it, NULL or "" for none */
+    const char  *log_level;          /* NULL or "" for the level of ZMQ_SFUN_LOG_LEVEL, the same
+                                        for all handles open at a time */
+} CommTransmitterConfig;
+
+/* Block parameters of the receive block */
+typedef struct {
+    const char  *host;               /* host parameter, also "replay://file" */
+    const char  *port;
+    double       timeout;            /* seconds */
+    unsigned int channel;
+    unsigned int frame_size;
+    const char  *record_file;
+    const char  *log_level;
+} CommReceiverConfig;
+
+typedef struct CommTransmitter CommTransmitter;
+typedef struct CommReceiver    CommReceiver;
+
+/* Message of the last call of this thread which returned COMM_ERROR */
+COMM_API const char *comm_last_error(void);
+
+COMM_API void comm_transmitter_config_init(CommTransmitterConfig *config);
+
+/* ports lists the data type and width of each input, in port order */
+COMM_API int  comm_transmitter_create(const CommTransmitterConfig *config, const CommPort *ports,
+                                      int num_ports, CommTransmitter **tx);
+
+/* Handshake with the receiver, before the first step of a run */
+COMM_API int  comm_transmitter_start(CommTransmitter *tx);
+
+/* inputs[k] points at the data of port k, time is the simulation time */
+COMM_API int  comm_transmitter_step(CommTransmitter *tx, const void *const *inputs, double time);
+
+/* End the run with the receiver, the connection is kept for the next one */
+COMM_API int  comm_transmitter_terminate(CommTransmitter *tx);
+
+/* Shut the receiver down and close the connection. NULL is ignored. */
+COMM_API void comm_transmitter_destroy(CommTransmitter *tx);
+
+COMM_API void comm_receiver_config_init(CommReceiverConfig *config);
+
+/* ports lists the data type and width of each output, in port order */
+COMM_API int  comm_receiver_create(const CommReceiverConfig *config, const CommPort *ports,
+                                   int num_ports, CommReceiver **rx);
+
+/* Start a run over: a replay is rewound, a recording starts a new run */
+COMM_API int  comm_receiver_start(CommReceiver *rx);
+
+/* outputs[k] points at the data of port k. Returns COMM_STOP, with the
+ * outputs unchanged, when the transmitter ended its run or a replay its log. */
+COMM_API int  comm_receiver_step(CommReceiver *rx, void *const *outputs);
+
+COMM_API int  comm_receiver_terminate(CommReceiver *rx);
+
+COMM_API void comm_receiver_destroy(CommReceiver *rx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMM_RUNTIME_H */
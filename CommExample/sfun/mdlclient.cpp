@@ -8,103 +8,660 @@
 #include <zmq.hpp>
 #include <cstdlib>
 #include <future>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <thread>
 //#include <unistd.h>
 
 // #include "mdlclient.hpp"
 #include "statcal_util.hpp"
+#include "shm_ring.hpp"
+#include "udp_link.hpp"
+#include "msg_log.hpp"
+#include "latency_histogram.hpp"
+#include "async_log.hpp"
+#include "shared_context.hpp"
+#include "rtt_estimator.hpp"
+#include "mux_link.hpp"
+#include "endpoint_broker.hpp"
 
 namespace {
 
-#define REQUEST_RETRIES  3 //  Number of tries before we abandon
+#define REQUEST_FLUSH_TIMEOUT 2500 // msecs to deliver streamed data at cleanup
+#define REQUEST_PINGS    3  // round trips to warm up the connection before the first step
 
-// class ZmqMgr for managing socket connection with the server
+// Where the time of a step goes, printed at the end of the simulation
+struct TransmitStats {
+    LatencyHistogram encode;       // building the message, dense or delta coded
+    LatencyHistogram send;         // handing it to the socket or ring
+    LatencyHistogram wait;         // blocked waiting for a reply or an ACK
+    LatencyHistogram round_trip;   // request/reply: from encoding to the reply
+    unsigned long    resends;      // requests sent again after a lost reply
+
+    TransmitStats() : resends(0) {}
+
+    void reset()
+    {
+        encode.reset();
+        send.reset();
+        wait.reset();
+        round_trip.reset();
+        resends = 0;
+    }
+
+    void print(std::ostream & os) const
+    {
+        LatencyHistogram::printHeader(os, "Transmit (us)");
+        encode.print(os, "encode");
+        send.print(os, "send");
+        wait.print(os, "wait");
+        round_trip.print(os, "round trip");
+        if (resends > 0) {
+            os << "  " << resends << " request(s) sent again\n";
+        }
+        os.flush();
+    }
+};
+
+// class ZmqMgr for managing socket connection with the server. Messages are
+// encoded into and received from buffers allocated once at setup, so that
+// steps do not allocate; over a socket, zmq_send copies a message longer
+// than 33 bytes to the heap, see the allocation check in sfunhost.cpp.
+// A shm:// address replaces the socket by a shared
+// memory channel to a receiver on the same host, a udp:// address by
+// datagrams sent without waiting for replies. A block with a channel
+// shares the connection of its address with the other blocks of the MEX
+// file, see mux_link.hpp.
 class ZmqMgr {
   public:
-    ZmqMgr(const std::string &addr) : context(1), socket_addr(addr)
+    ZmqMgr(const std::string &addr, const unsigned int interval, const unsigned int keyframe,
+           const std::vector<PortSpec> &port_specs, const unsigned int mux_channel, const unsigned int frame) :
+        socket_addr(addr), channel(mux_channel), timeout(0), use_shm(is_shm_address(addr)), use_udp(is_udp_address(addr)), send_timeout(0),
+        ack_interval(interval), num_streamed(0), acks_pending(0),
+        keyframe_interval(keyframe), seq(0), last_size(0), handshake_done(false), can_resend(true), can_reset(false), reset_pending(false), last_reply_size(0),
+        ports(port_specs), msg_ports(frame_ports(port_specs, frame)), frame_size(frame), frame_pos(0), frame_time(0.0),
+        send_buf(encoded_size(msg_ports, keyframe > 0)), recv_buf(conn_size(port_specs))
+    {
+        if (keyframe_interval > 0) {
+            delta_ref.resize(data_size(msg_ports));
+            delta_changed.resize(max_width(msg_ports));
+        }
+        if (frame_size > 1) {
+            for (auto &p : ports) {
+                frame_buf.emplace_back(dtype_size(p.type)*p.width*frame_size);
+            }
+            for (auto &b : frame_buf) {
+                frame_ptrs.push_back(b.data());
+            }
+        }
+    }
+
+    ~ZmqMgr()
     {
+        if (mux) {
+            mux->detach(channel);
+        }
     }
 
-    ~ZmqMgr() {}
+    // Create the socket, or attach to the receiver's shared memory waiting
+    // up to the retry budget for it to appear
+    void connect(int request_timeout);
+
+    bool isConnected() const { return socket_ptr || shm || udp || mux; }
+
+    bool isShm() const { return use_shm; }
+
+    bool isUdp() const { return use_udp; }
+
+    // Exchange CONN with the receiver, once per connection, and warm up the
+    // connection with a few round trips which also seed the timeout
+    void handshake(int request_timeout);
+
+    void sendRequest(const char *buf, const size_t size);
+
+    // Tell the receiver that the run is over, so that it ends its run too
+    // and the next one starts over on the same connection
+    void endRun();
+
+    // Receive the reply to the RESET of the last run, waiting up to wait
+    // msecs for it. Returns false if it did not come.
+    bool awaitReset(int wait);
+
+    // Give up on the reply to the RESET of the last run
+    void dropReset();
+
+    // Encode a message without data, e.g. SHUTDOWN
+    void sendControl(const MsgType type)
+    {
+        if (mux) {
+            // Sent on its own, the other channels may have stopped already
+            std::vector<char> buf(header_size());
+            mux->post(channel, &buf[0], encode_message(type, 0, 0.0, {}, nullptr, &buf[0]));
+            return;
+        }
+        sendRequest(&send_buf[0], encode_message(type, 0, 0.0, {}, nullptr, &send_buf[0]));
+    }
+
+    // Send a request and wait for its reply in recv_buf
+    void exchange(const size_t size, int request_timeout);
+
+    // Encode the input ports straight into the send buffer, delta coded
+    // against the previous message if keyframes are enabled
+    void sendData(const MsgType type, const void *const *u_ptrs, const double time)
+    {
+        if (mux) {
+            // The previous message may still wait for the batch of its step
+            mux->flush(channel, timeout);
+        }
+        ++seq;
+        size_t size;
+        LatencyTimer timer(stats.encode);
+        if (keyframe_interval > 0) {
+            const bool keyframe = (seq-1) % keyframe_interval == 0;
+            size = encode_delta_message(type, seq, time, msg_ports, u_ptrs, keyframe,
+                                        &delta_ref[0], &delta_changed[0], &send_buf[0]);
+        } else {
+            size = encode_message(type, seq, time, msg_ports, u_ptrs, &send_buf[0]);
+        }
+        timer.stop();
+        sendRequest(&send_buf[0], size);
+        SFUN_LOG(LEVEL_TRACE, "Sent message %llu, %llu bytes",
+                 static_cast<unsigned long long>(seq), static_cast<unsigned long long>(size));
+        if (log) {
+            // Recorded dense, so that a replay can start anywhere
+            log->commit(seq, time, encode_message(type, seq, time, msg_ports, u_ptrs, log->reserve(send_buf.size())));
+        }
+    }
+
+    // Record the messages sent from here on to the file
+    void record(const std::string &path)
+    {
+        log = MessageLogWriter::create(path);
+    }
+
+    void retrieveReply(int request_timeout, int retries_left = REQUEST_RETRIES);
+
+    // Streaming mode: queue the data and return without waiting for the receiver
+    void streamData(const void *const *u_ptrs, const double time, int request_timeout);
+
+    bool isStreaming() const { return ack_interval > 0; }
+
+    bool isMultiplexed() const { return mux != nullptr; }
+
+    // Frame mode: copy the sample into the frame, returns true once it holds
+    // frame_size samples and is to be sent
+    bool addToFrame(const void *const *u_ptrs, const double time)
+    {
+        if (frame_pos == 0) {
+            frame_time = time;
+        }
+        for (size_t k = 0; k < ports.size(); k++) {
+            const size_t n = dtype_size(ports[k].type)*ports[k].width;
+            std::memcpy(&frame_buf[k][frame_pos*n], u_ptrs[k], n);
+        }
+        if (++frame_pos < frame_size) {
+            return false;
+        }
+        frame_pos = 0;
+        return true;
+    }
 
-    void sendRequest(const std::string & request_str);
+    unsigned int frameSize() const { return frame_size; }
 
-    void retrieveReply(std::vector<double> & yout, int request_timeout, int retries_left = REQUEST_RETRIES);
+    // Samples of the full frame by port, and the time of its first sample
+    const void *const *framePtrs() const { return frame_ptrs.data(); }
+
+    double frameTime() const { return frame_time; }
+
+    // Wait for queued data to reach the receiver before the socket is closed
+    void flushOnClose(int request_timeout)
+    {
+        if (socket_ptr) {
+            socket_ptr->setsockopt (ZMQ_LINGER, &request_timeout, sizeof (request_timeout));
+        }
+    }
     
     void resetSocketPtr()
     {
         socket_ptr.reset(nullptr);
     }
 
+    TransmitStats & getStats() { return stats; }
+
   private:
+    SharedContext context;
     std::string socket_addr;
-    zmq::context_t context;
     std::unique_ptr<zmq::socket_t>  socket_ptr;
+    std::unique_ptr<ShmChannel>     shm;
+    std::unique_ptr<UdpChannel>     udp;
+    std::shared_ptr<MuxTransmitLink> mux;
+    std::unique_ptr<MessageLogWriter> log;
+    unsigned int channel;        // 0 for a connection of the block's own
+    int  timeout;                // msecs, the block's timeout, set by handshake
+    bool use_shm;
+    bool use_udp;
+    int  send_timeout;           // msecs to wait for room in the shared memory ring
+    unsigned int ack_interval;   // 0 for request/reply
+    unsigned long num_streamed;
+    unsigned int acks_pending;
+    unsigned int keyframe_interval; // 0 sends every message dense
+    uint64_t     seq;            // number of data messages sent
+    size_t       last_size;      // size of the last message in send_buf
+    bool         handshake_done;
+    bool         can_resend;     // receiver answers MSG_RESEND copies
+    bool         can_reset;      // receiver answers RESET
+    bool         reset_pending;  // the reply to the RESET of the last run is outstanding
+    size_t       last_reply_size; // size of the last reply in recv_buf
+    std::chrono::steady_clock::time_point sent_at;  // time the last message was sent
+    RttEstimator rtt;
+    std::vector<PortSpec> ports;         // of one sample
+    std::vector<PortSpec> msg_ports;     // of a message, frame_size samples
+    unsigned int frame_size;             // samples per message
+    unsigned int frame_pos;              // samples in the frame so far
+    double       frame_time;
+    std::vector<std::vector<char>> frame_buf;
+    std::vector<const void *>      frame_ptrs;
+    std::vector<char>   send_buf;
+    std::vector<char>   recv_buf;
+    std::vector<char>     delta_ref;      // values of the previous message
+    std::vector<uint32_t> delta_changed;
+    TransmitStats stats;
     
     std::unique_ptr<zmq::socket_t> createSocket();
+    void resendRequest();
+    void waitAck(int request_timeout, int retries_left = REQUEST_RETRIES);
+    bool pollPayload(int request_timeout, size_t &size);
+    size_t recvPayload();
 };
 
 // ZmqMgr class method sendRequest
-void ZmqMgr::sendRequest(const std::string & request_str)
+void ZmqMgr::sendRequest(const char *buf, const size_t size)
 {
-    if (!socket_ptr) {
-        socket_ptr = createSocket();
+    if (!isConnected()) {
+        connect(0);
+    }
+
+    last_size = size;
+    LatencyTimer timer(stats.send);
+    if (mux) {
+        mux->submit(channel, buf, size, timeout);
+        return;
+    }
+    if (shm) {
+        if (!shm->send(buf, size, send_timeout)) {
+            throw std::runtime_error("Connection timed out. The receiver stopped reading the shared memory channel.");
+        }
+        return;
+    }
+    if (udp) {
+        udp->send(buf, size, decode_header(buf, size).type != STREAM_DATA);
+        return;
     }
-    zmq::message_t request;
-    request.rebuild(request_str.size());
-    memset(request.data(), 0, request_str.size());    
-    memcpy(request.data (), request_str.c_str(), request_str.size());
     
     //std::cout << "Sending " << request_str << std::endl;
-    socket_ptr->send(request);
+    if (isStreaming()) {
+        // Empty delimiter frame, as a REQ socket would add
+        socket_ptr->send("", 0, ZMQ_SNDMORE);
+    }
+    socket_ptr->send(buf, size);
+    sent_at = std::chrono::steady_clock::now();
+}
+
+// ZmqMgr class method resendRequest
+// A REQ socket cannot send before it received the reply, so the lost one is
+// replaced by a new socket which sends the last request again (lazy pirate).
+// The receiver answers a copy flagged MSG_RESEND of the message it consumed
+// last without consuming it again.
+void ZmqMgr::resendRequest()
+{
+    socket_ptr = createSocket();
+    set_message_flags(&send_buf[0], MSG_RESEND);
+    if (isStreaming()) {
+        socket_ptr->send("", 0, ZMQ_SNDMORE);
+    }
+    socket_ptr->send(&send_buf[0], last_size);
+    stats.resends++;
+}
+
+// ZmqMgr class method handshake
+void ZmqMgr::handshake(int request_timeout)
+{
+    timeout = request_timeout;
+    connect(request_timeout);
+    if (udp) {
+        // Nothing comes back over UDP. The receiver checks the ports of the
+        // handshake, sent like the end of a run, and reports a mismatch.
+        frame_pos = 0;
+        udp->send(&send_buf[0], encode_conn_message(0, ports, &send_buf[0]), true);
+        stats.reset();
+        return;
+    }
+    // A receiver which kept running answered the RESET of the last run long
+    // ago, one which was restarted since never will
+    if (!awaitReset(rtt.timeout(request_timeout))) {
+        SFUN_LOG(LEVEL_DEBUG, "The receiver did not answer the end of the last run");
+        dropReset();
+    }
+    if (mux) {
+        // send_buf is reused below, the last message must have gone out
+        mux->flush(channel, request_timeout);
+    }
+    // A run starts with an empty frame; the samples of an unfinished frame
+    // at the end of the last run were not sent
+    frame_pos = 0;
+
+    if (!handshake_done) {
+        unsigned int features = FEATURE_RESEND | FEATURE_RESET;
+        if (isStreaming()) features |= FEATURE_STREAM;
+        if (keyframe_interval > 0) features |= FEATURE_DELTA;
+        if (frame_size > 1) features |= FEATURE_FRAME;
+
+        using std::chrono::steady_clock;
+        const steady_clock::time_point deadline = steady_clock::now()+std::chrono::milliseconds(REQUEST_RETRIES*request_timeout);
+        MsgHeader hdr;
+        for (;;) {
+            exchange(encode_conn_message(features, ports, &send_buf[0], frame_size), request_timeout);
+            hdr = decode_header(&recv_buf[0], last_reply_size);
+            // Over a shared connection, CONN without ports or features
+            // means no receive block opened the channel yet
+            if (!mux || hdr.type != CONN || hdr.num_ports > 0 || hdr.flags != 0) {
+                break;
+            }
+            if (steady_clock::now() >= deadline) {
+                throw std::runtime_error("No receive block uses channel " + std::to_string(channel) + " of " + socket_addr +
+                                         ". Please ensure that the receive block with this channel is running.");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(REQUEST_MIN_RTO));
+        }
+        if (hdr.type != CONN) {
+            throw std::runtime_error("The receiver did not answer the connection request.");
+        }
+        const std::string mismatch = compare_ports(ports, decode_conn_message(hdr, &recv_buf[0], last_reply_size));
+        if (!mismatch.empty()) {
+            throw std::runtime_error("Data widths or types of the transmitter and the receiver differ: " + mismatch);
+        }
+        const unsigned int missing = features & ~hdr.flags & ~(FEATURE_RESEND | FEATURE_RESET);
+        if (missing) {
+            throw std::runtime_error(std::string("The receiver does not support ") +
+                                     ((missing & FEATURE_STREAM) ? "streaming" :
+                                      (missing & FEATURE_DELTA) ? "delta coding" : "frames") +
+                                     ". Please rebuild the transmit and receive blocks from the same sources.");
+        }
+        if (conn_frame_size(hdr) != frame_size) {
+            throw std::runtime_error("Frame sizes of the transmitter (" + std::to_string(frame_size) +
+                                     ") and the receiver (" + std::to_string(conn_frame_size(hdr)) + ") differ.");
+        }
+        can_resend = (hdr.flags & FEATURE_RESEND) != 0;
+        can_reset = (hdr.flags & FEATURE_RESET) != 0;
+        handshake_done = true;
+    }
+
+    for (int k = 0; k < REQUEST_PINGS; k++) {
+        exchange(encode_message(PING, 0, 0.0, {}, nullptr, &send_buf[0]), request_timeout);
+    }
+    stats.reset();
+}
+
+// ZmqMgr class method exchange
+void ZmqMgr::exchange(const size_t size, int request_timeout)
+{
+    if (mux) {
+        mux->submit(channel, &send_buf[0], size, request_timeout);
+        mux->flush(channel, request_timeout);
+        last_reply_size = mux->reply(channel, &recv_buf[0], recv_buf.size());
+        return;
+    }
+    sendRequest(&send_buf[0], size);
+    retrieveReply(request_timeout);
+}
+
+// ZmqMgr class method endRun
+// RESET follows the last data of the run, so its reply, which comes after
+// the outstanding ACKs, tells that the receiver consumed all of it. The next
+// run starts again at message 1, which is a keyframe, with an empty frame.
+// The reply is collected by the next run, or at cleanup: a receiver whose
+// run ended at the same stop time is gone already and never answers.
+void ZmqMgr::endRun()
+{
+    if (log) {
+        log->newRun();
+    }
+    const bool sent = seq > 0;
+    seq = 0;
+    num_streamed = 0;
+    acks_pending = 0;
+    frame_pos = 0;
+    if (!sent || !isConnected()) {
+        return;
+    }
+    if (udp) {
+        sendControl(RESET);
+        return;
+    }
+    if (!can_reset) {
+        return;
+    }
+
+    if (mux) {
+        // The last message may still wait for the batch of its step
+        mux->flush(channel, timeout);
+        sendControl(RESET);
+        return;
+    }
+
+    sendRequest(&send_buf[0], encode_message(RESET, 0, 0.0, {}, nullptr, &send_buf[0]));
+    reset_pending = true;
+}
+
+// ZmqMgr class method awaitReset
+bool ZmqMgr::awaitReset(int wait)
+{
+    if (!reset_pending) {
+        return true;
+    }
+
+    using std::chrono::steady_clock;
+    using std::chrono::milliseconds;
+    const steady_clock::time_point deadline = steady_clock::now()+milliseconds(wait);
+    size_t size;
+    for (;;) {
+        const int remaining = static_cast<int>(std::max<long long>(0,
+            std::chrono::duration_cast<milliseconds>(deadline-steady_clock::now()).count()));
+        if (!pollPayload(remaining, size)) {
+            return false;
+        }
+        // Skip the ACKs of the last run
+        if (decode_header(&recv_buf[0], size).type == RESET) {
+            reset_pending = false;
+            return true;
+        }
+    }
+}
+
+// ZmqMgr class method dropReset
+void ZmqMgr::dropReset()
+{
+    if (reset_pending && socket_ptr) {
+        // A late reply must not be taken for the answer to the next request
+        socket_ptr = createSocket();
+    }
+    reset_pending = false;
+}
+
+// ZmqMgr class method connect
+void ZmqMgr::connect(int request_timeout)
+{
+    if (isConnected()) {
+        return;
+    }
+
+    if (channel > 0) {
+        mux = MuxTransmitLink::attach(socket_addr, channel, recv_buf.size());
+        SFUN_LOG(LEVEL_INFO, "Starting connection on channel %u", channel);
+    } else if (use_shm) {
+        send_timeout = REQUEST_RETRIES*request_timeout;
+        shm = ShmChannel::open(socket_addr, send_buf.size(), send_timeout);
+        SFUN_LOG(LEVEL_INFO, "Starting connection");
+    } else if (use_udp) {
+        udp = UdpChannel::connect(socket_addr, send_buf.size());
+        SFUN_LOG(LEVEL_INFO, "Sending over UDP");
+    } else {
+        socket_ptr = createSocket();
+        SFUN_LOG(LEVEL_INFO, "Starting connection");
+    }
+}
+
+// ZmqMgr class method pollPayload
+// Wait up to request_timeout msecs for a message and receive it into recv_buf
+bool ZmqMgr::pollPayload(int request_timeout, size_t &size)
+{
+    if (shm) {
+        if (!shm->recv(&recv_buf[0], recv_buf.size(), size, request_timeout)) {
+            return false;
+        }
+        return true;
+    }
+
+    zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 } };
+    zmq::poll (&items[0], 1, request_timeout);
+    if (items[0].revents & ZMQ_POLLIN) {
+        size = recvPayload();
+        return true;
+    }
+    return false;
+}
+
+// ZmqMgr class method recvPayload
+// Receive the last frame of a message into recv_buf and return its size
+size_t ZmqMgr::recvPayload()
+{
+    size_t size;
+    int more;
+    size_t more_size = sizeof(more);
+    do {
+        size = socket_ptr->recv(&recv_buf[0], recv_buf.size());
+        socket_ptr->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    } while (more);
+
+    if (size > recv_buf.size()) {
+        throw std::runtime_error("Received a message of unexpected size. Please ensure that the data widths and types of the transmitter and the receiver match.");
+    }
+    return size;
+}
+
+// ZmqMgr class method streamData
+// Every ack_interval-th sample asks the receiver for an ACK. Before the next
+// one is sent the previous ACK must have arrived, which bounds how far the
+// transmitter can run ahead of the receiver.
+void ZmqMgr::streamData(const void *const *u_ptrs, const double time, int request_timeout)
+{
+    const bool sync = (++num_streamed % ack_interval) == 0;
+    if (sync && acks_pending > 0) {
+        waitAck(request_timeout);
+    }
+
+    sendData(sync ? STREAM_SYNC : STREAM_DATA, u_ptrs, time);
+
+    if (sync) {
+        acks_pending++;
+    }
+}
+
+// ZmqMgr class method waitAck
+void ZmqMgr::waitAck(int request_timeout, int retries_left)
+{
+    assert(isConnected());
+
+    size_t size;
+    LatencyTimer timer(stats.wait);
+    while (acks_pending > 0 && retries_left) {
+        if (pollPayload(request_timeout, size)) {
+            MsgHeader hdr = decode_header(&recv_buf[0], size);
+            if (hdr.type == ACK) {
+                acks_pending--;
+            }
+        } else if (--retries_left == 0) {
+            throw std::runtime_error("Connection timed out waiting for the receiver to acknowledge streamed data. Please ensure that the receiver side is running. If it is slower than the transmitter, you can increase timeout parameter value from the block dialog.");
+        } else {
+            SFUN_LOG(LEVEL_WARN, "No acknowledgement, try again");
+        }
+    }
 }
 
 // ZmqMgr class method retrieveReply
-    void ZmqMgr::retrieveReply(std::vector<double> & yout, int request_timeout, int retries_left)
+// Over a socket the request is sent again whenever no reply arrived within
+// the retransmission timeout. The run fails once no reply arrived for
+// retries_left times the block's timeout, as it did without resending.
+void ZmqMgr::retrieveReply(int request_timeout, int retries_left)
 {
-    assert(socket_ptr);
+    assert(isConnected());
     
-    while (retries_left) {
-        zmq::message_t reply;
-        
-        //  Poll socket for a reply, with timeout
-        zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 } };
-        zmq::poll (&items[0], 1, request_timeout);
-        
-        //  If we got a reply, process it
-        if (items[0].revents & ZMQ_POLLIN) {
-            
-            socket_ptr->recv(&reply);
-            char *reply_str = static_cast<char*>(reply.data());
-            reply_str[reply.size()] = '\0';
-
-            int len;
-            MsgType type;
-            std::tie(type, len) = decode_header(reply_str);
-            if (len > 0) {
-                decode_data(len, reply_str, yout);
-                for (auto & it : yout) {
-                    std::cout << " " << it;
-                }
-                std::cout << std::endl;
+    size_t size;
+    LatencyTimer timer(stats.wait);
+    if (shm) {
+        while (retries_left) {
+            //  Wait for a reply, with timeout, and process it
+            if (pollPayload(request_timeout, size)) {
+                decode_header(&recv_buf[0], size);
+                last_reply_size = size;
+                break;
+            } else if (--retries_left == 0) {
+                throw std::runtime_error("Connection timed out. Please ensure that the transmitter side is running and two sides are not in a locked state due to unintended execution orders. If you have a long running algorithm, you can increase timeout parameter value from the block dialog.");
+            } else {
+                SFUN_LOG(LEVEL_WARN, "No response, try again");
             }
-            break;
-        } else if (--retries_left == 0) {
+        }
+        return;
+    }
+
+    using std::chrono::steady_clock;
+    using std::chrono::milliseconds;
+    const steady_clock::time_point deadline = sent_at+milliseconds(retries_left*request_timeout);
+    bool resent = false;
+    for (;;) {
+        const int remaining = static_cast<int>(std::max<long long>(0,
+            std::chrono::duration_cast<milliseconds>(deadline-steady_clock::now()).count()));
+        const int wait = can_resend ? std::min(rtt.timeout(request_timeout), remaining) : remaining;
+        if (pollPayload(wait, size)) {
+            MsgHeader hdr = decode_header(&recv_buf[0], size);
+            last_reply_size = size;
+            if (!resent) {
+                rtt.sample(std::chrono::duration<double, std::milli>(steady_clock::now()-sent_at).count());
+            }
+            SFUN_LOG(LEVEL_TRACE, "Reply to message %llu received", static_cast<unsigned long long>(hdr.seq));
+            return;
+        }
+        if (steady_clock::now() >= deadline || !can_resend) {
+            // A new socket lets the SHUTDOWN at cleanup through
+            socket_ptr.reset(nullptr);
             throw std::runtime_error("Connection timed out. Please ensure that the transmitter side is running and two sides are not in a locked state due to unintended execution orders. If you have a long running algorithm, you can increase timeout parameter value from the block dialog.");
-        } else {
-            std::cout << "No response, try again" << std::endl;
         }
+        rtt.timedOut();
+        SFUN_LOG(LEVEL_WARN, "No response to message %llu, sending it again", static_cast<unsigned long long>(seq));
+        resendRequest();
+        resent = true;
     }
 }
 
 // ZmqMgr class method createSocket
 std::unique_ptr<zmq::socket_t> ZmqMgr::createSocket()
 {
-    std::unique_ptr<zmq::socket_t> s_ptr(new zmq::socket_t(context, ZMQ_REQ));
+    std::unique_ptr<zmq::socket_t> s_ptr(new zmq::socket_t(context, isStreaming() ? ZMQ_DEALER : ZMQ_REQ));
+
+    if (isStreaming()) {
+        // Credits keep at most two ACK intervals in flight, anything above
+        // that in the queues means the receiver went away
+        int hwm = 2*ack_interval+2;
+        s_ptr->setsockopt (ZMQ_SNDHWM, &hwm, sizeof (hwm));
+        s_ptr->setsockopt (ZMQ_RCVHWM, &hwm, sizeof (hwm));
+    }
 
     s_ptr->connect(socket_addr.c_str());
     int linger = 0;
     s_ptr->setsockopt (ZMQ_LINGER, &linger, sizeof (linger));
-    std::cout << "Starting connection" << std::endl;
         
     return s_ptr;
 }
@@ -113,16 +670,88 @@ std::unique_ptr<zmq::socket_t> ZmqMgr::createSocket()
 
 void shutdown_server(ZmqMgr *zmp)
 {
-    std::string request_str;
-    auto type = SHUTDOWN;
-    encode_data(type, {}, request_str);
-    zmp->sendRequest(request_str);
+    // Shared memory is only there once the receiver runs, if it was never
+    // reached there is nobody to shut down
+    if (zmp->isShm() && !zmp->isConnected()) {
+        return;
+    }
+
+    // A REQ socket without the reply to the RESET of the run sends SHUTDOWN
+    // on a new one; the receiver may have stopped together with the run
+    if (!zmp->isStreaming() && !zmp->awaitReset(0)) {
+        zmp->dropReset();
+    }
+    zmp->sendControl(SHUTDOWN);
+}
+
+// The receiver of a broker://<name> host runs on this host
+std::string transmit_address(const std::string &host, const std::string &port)
+{
+    if (is_shm_address(host)) {
+        return shm_address(host, port);
+    }
+    if (is_udp_address(host)) {
+        return udp_address(host, port);
+    }
+    std::string serverHostStr = host;
+    std::string serverPortStr = port;
+    if (EndpointBroker::isBrokerAddress(host)) {
+        serverPortStr = EndpointBroker::port(host);
+        serverHostStr = "localhost";
+    }
+
+    std::string connStr = "tcp://";
+    connStr += serverHostStr;
+    connStr += ":";
+    connStr += serverPortStr;
+
+    return connStr;
+}
+
+void release_transmit_address(const std::string &host)
+{
+    if (EndpointBroker::isBrokerAddress(host)) {
+        try {
+            EndpointBroker::releasePort(host);
+        } catch (std::exception &e) {
+            SFUN_LOG(LEVEL_WARN, "%s", e.what());
+        }
+    }
+}
+
+void *setupruntimeresources_wrapper(const std::string &connStr, const unsigned int ack_interval,
+                                    const unsigned int keyframe_interval, const std::vector<PortSpec> &ports,
+                                    const unsigned int channel, const unsigned int frame_size,
+                                    const std::string &record_path)
+{
+    if (channel > 0 && (ack_interval > 0 || is_shm_address(connStr) || is_udp_address(connStr))) {
+        throw std::runtime_error("Only request/reply blocks connecting over tcp can share a connection on a channel.");
+    }
+    if (is_udp_address(connStr) && (ack_interval > 0 || keyframe_interval > 0 || frame_size > 1)) {
+        // Each of them relies on every message arriving
+        throw std::runtime_error("UDP sends every sample on its own without replies, please set the ACK interval and "
+                                 "the keyframe interval to 0 and the frame size to 1.");
+    }
+    std::unique_ptr<ZmqMgr> zmp(new ZmqMgr(connStr, ack_interval, keyframe_interval, ports, channel, frame_size));
+    if (!record_path.empty()) {
+        zmp->record(record_path);
+    }
+    if (frame_size > 1) {
+        SFUN_LOG(LEVEL_INFO, "Sending frames of %u samples, the receiver outputs each sample %u steps later",
+                 frame_size, frame_size-1);
+    }
+    // Sockets connect in the background. Shared memory only exists once the
+    // receiver ran its setup, which may come after this one.
+    if (!zmp->isShm()) {
+        zmp->connect(0);
+    }
+    return reinterpret_cast<void *>(zmp.release());
 }
 
-void *setupruntimeresources_wrapper(const std::string &connStr)
+void start_wrapper(void *zm, const double request_timeout)
 {
-    auto zmp = new ZmqMgr(connStr);
-    return reinterpret_cast<void *>(zmp);
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    zmp->handshake(request_timeout);
 }
 
 void cleanupruntimeresouces_wrapper(void *zm)
@@ -130,22 +759,64 @@ void cleanupruntimeresouces_wrapper(void *zm)
     auto zmp = reinterpret_cast<ZmqMgr *>(zm);
     if (zmp) {
         shutdown_server(zmp);
+        if (zmp->isStreaming()) {
+            zmp->flushOnClose(REQUEST_FLUSH_TIMEOUT);
+        }
         delete zmp;
     }
 }
 
-void transmit_outputs_wrapper(void *zm, const double *u_ptr, const int w, const double request_timeout)
+void transmit_outputs_wrapper(void *zm, const void *const *u_ptrs, const double time, const double request_timeout)
 {
-    std::vector<double> yout;
-    std::string request_str;
-    std::vector<double> uv(w,0);
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    zmp->connect(request_timeout);
+
+    const void *const *data = u_ptrs;
+    double data_time = time;
+    if (zmp->frameSize() > 1) {
+        if (!zmp->addToFrame(u_ptrs, time)) {
+            return;
+        }
+        data = zmp->framePtrs();
+        data_time = zmp->frameTime();
+    }
 
-    for (int k=0; k<w; k++) {
-        uv[k] = *(u_ptr++);
+    if (zmp->isStreaming()) {
+        zmp->streamData(data, data_time, request_timeout);
+        return;
+    }
+
+    if (zmp->isUdp()) {
+        // Sent and forgotten, the receiver takes the newest sample
+        zmp->sendData(STREAM_DATA, data, data_time);
+        return;
+    }
+
+    LatencyTimer timer(zmp->getStats().round_trip);
+    zmp->sendData(INP_DATA, data, data_time);
+    if (zmp->isMultiplexed()) {
+        // The last block of the step sends the batch and waits for its reply
+        return;
+    }
+    zmp->retrieveReply(request_timeout);
+}
+
+void terminate_wrapper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqMgr *>(zm);
+    if (zmp) {
+        // The receiver keeps its connection for the next Fast Restart run,
+        // SHUTDOWN is only sent at cleanup
+        try {
+            zmp->endRun();
+        } catch (std::exception &e) {
+            SFUN_LOG(LEVEL_WARN, "%s", e.what());
+        }
+        if (AsyncLog::instance().enabled(LEVEL_INFO)) {
+            std::ostringstream os;
+            zmp->getStats().print(os);
+            AsyncLog::instance().writeLines(LEVEL_INFO, os.str());
+        }
+        zmp->getStats().reset();
     }
-    
-    auto type = INP_DATA;
-    encode_data(type, uv, request_str);
-    reinterpret_cast<ZmqMgr *>(zm)->sendRequest(request_str);
-    reinterpret_cast<ZmqMgr *>(zm)->retrieveReply(yout, request_timeout);
 }
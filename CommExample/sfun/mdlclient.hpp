@@ -1,8 +1,46 @@
 // Copyright 2018 The MathWorks, Inc.
 
-void *setupruntimeresources_wrapper(const std::string &connStr);
+// Address the transmitter of the block's host and port parameters sends its
+// data to: tcp, shm://, udp:// or broker://<name>
+std::string transmit_address(const std::string &host, const std::string &port);
+
+// Give the port of a broker://<name> host back to the broker, once the
+// transmitter of transmit_address is closed
+void release_transmit_address(const std::string &host);
+
+// ack_interval 0 sends every sample as a request and waits for the reply.
+// ack_interval K > 0 streams the samples and asks for an acknowledgement
+// every K samples; the transmitter runs at most 2K samples ahead.
+// keyframe_interval 0 sends every sample dense. keyframe_interval K > 0 sends
+// only the elements changed since the previous sample, when that is smaller,
+// and all of them every K samples.
+// ports lists the data type and width of each input port, in port order.
+// channel 0 gives the block a connection of its own. Blocks with channels
+// 1, 2, ... share one connection to connStr and send the data of a step as
+// one batch; they must wait for replies (ack_interval 0) and use tcp.
+// Throws std::runtime_error otherwise.
+// frame_size K > 1 buffers K samples and sends them as one message every K
+// steps; the receiver, given the same frame size, outputs them K-1 steps late.
+// A udp:// connStr sends every sample on its own without waiting, and needs
+// ack_interval and keyframe_interval 0 and frame_size 1.
+// A record_path records the messages sent to a log, see msg_log.hpp.
+void *setupruntimeresources_wrapper(const std::string &connStr, const unsigned int ack_interval,
+                                    const unsigned int keyframe_interval, const std::vector<PortSpec> &ports,
+                                    const unsigned int channel, const unsigned int frame_size,
+                                    const std::string &record_path = std::string());
+
+// Connect if not yet done, check with the receiver that both sides agree on
+// the ports and features, and warm up the connection, so that the first step
+// costs as much as any other. Throws std::runtime_error if they disagree.
+void start_wrapper(void *zm, const double request_timeout);
 
 void cleanupruntimeresouces_wrapper(void *zm);
 
-void transmit_outputs_wrapper(void *zm, const double *u_ptr, const int w, const double request_timeout);
+// u_ptrs[k] points at the signal of input port k, time is the simulation time.
+void transmit_outputs_wrapper(void *zm, const void *const *u_ptrs, const double time, const double request_timeout);
+
+// End the run with the receiver, which stops its run too and starts the next
+// one over, and print the step latency histograms of the simulation and
+// start new ones
+void terminate_wrapper(void *zm);
 
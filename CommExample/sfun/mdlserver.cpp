@@ -0,0 +1,750 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <zmq.hpp>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "statcal_util.hpp"
+#include "shm_ring.hpp"
+#include "udp_link.hpp"
+#include "msg_log.hpp"
+#include "latency_histogram.hpp"
+#include "async_log.hpp"
+#include "shared_context.hpp"
+#include "mux_link.hpp"
+#include "endpoint_broker.hpp"
+#include "mdlserver.hpp"
+
+namespace {
+
+// Where the time of a step goes, printed at the end of the simulation
+struct ReceiveStats {
+    LatencyHistogram wait;     // blocked waiting for the next message
+    LatencyHistogram decode;   // checking and unpacking it into the outputs
+    LatencyHistogram reply;    // sending the reply or ACK
+    UdpStats        *udp;      // messages lost or skipped, of a UDP channel
+
+    ReceiveStats() : udp(nullptr) {}
+
+    void reset()
+    {
+        wait.reset();
+        decode.reset();
+        reply.reset();
+        if (udp) {
+            udp->reset();
+        }
+    }
+
+    void print(std::ostream & os) const
+    {
+        LatencyHistogram::printHeader(os, "Receive (us)");
+        wait.print(os, "wait");
+        decode.print(os, "decode");
+        reply.print(os, "reply");
+        if (udp) {
+            udp->print(os);
+        }
+        os.flush();
+    }
+};
+
+#define RESPONDER_POLL_INTERVAL 1    // msecs, shared memory has nothing to wake the responder
+#define RESPONDER_SEND_TIMEOUT  1000 // msecs to wait for room in the shared memory ring
+
+// class ZmqServer receives the transmitter's data on a ROUTER socket, which
+// serves both request/reply (REQ) and streaming (DEALER) transmitters.
+// Messages are received into a buffer allocated once at setup and decoded
+// straight into the output port, so that steps do not allocate. A shm://
+// address replaces the socket by a shared memory channel, which the receiver
+// creates.
+//
+// CONN and PING are answered whenever they arrive: during the steps by
+// receiveRequest, and while the model does not step, from setup to the
+// first step and between Fast Restart runs, by a responder thread. The
+// transmitter's handshake therefore never waits for this model to step.
+//
+// A udp:// address receives datagrams, which the transmitter sends without
+// waiting for replies, see udp_link.hpp. Each step outputs the newest sample
+// which arrived and skips older ones; a step without new data keeps or
+// zeroes the outputs, or fails, as the address's loss option says.
+// loss=error outputs every sample in order instead. The transmitter sends
+// its ports at the start of every run and a mismatch fails this block;
+// messages too large for its ports are dropped and counted.
+//
+// A replay:// address reads the messages of a log recorded by a transmit or
+// receive block instead, as fast as the model steps, and ends the run at the
+// end of the replay; see msg_log.hpp. Either block records the messages of
+// its data with the optional record file parameter.
+//
+// A block with a channel shares the port with the other receive blocks of
+// the MEX file; the link of the port receives its messages into recv_buf
+// and answers CONN and PING, see mux_link.hpp.
+//
+// RESET from the transmitter at the end of its run ends the run of this
+// model too, unless no data of this run arrived yet, and restarts the
+// stream; the connection stays for the next Fast Restart run. Between runs
+// the responder answers it.
+//
+// In frame mode a message carries frame_size samples, which are decoded into
+// a frame buffer and put on the outputs one per step. The transmitter sends
+// a frame in the step of its last sample, which is when it is received, so
+// the outputs lag the transmitter by frame_size-1 steps and are zero until
+// the first frame arrived.
+class ZmqServer {
+  public:
+    ZmqServer(const std::string &addr, const std::vector<PortSpec> &port_specs, const unsigned int mux_channel,
+              const unsigned int frame) :
+        socket_addr(addr), channel(mux_channel), last_type(CONN), last_seq(0), run_data(false), ports(port_specs),
+        msg_ports(frame_ports(port_specs, frame)), frame_size(frame), frame_step(0),
+        recv_buf(std::max(encoded_size(msg_ports, true), conn_size(port_specs))),
+        reply_buf(header_size()), ack_buf(header_size()), ping_buf(header_size()), reset_buf(header_size()),
+        conn_buf(conn_size(port_specs)),
+        delta_ref(data_size(msg_ports)), has_delta_ref(false), stashed_size(0), stop_responder(false)
+    {
+        encode_message(INP_DATA, 0, 0.0, {}, nullptr, &reply_buf[0]);
+        encode_message(ACK, 0, 0.0, {}, nullptr, &ack_buf[0]);
+        encode_message(PING, 0, 0.0, {}, nullptr, &ping_buf[0]);
+        encode_message(RESET, 0, 0.0, {}, nullptr, &reset_buf[0]);
+        encode_conn_message(FEATURES_ALL, ports, &conn_buf[0], frame_size);
+
+        if (frame_size > 1) {
+            for (auto &p : ports) {
+                frame_buf.emplace_back(dtype_size(p.type)*p.width*frame_size);
+            }
+            for (auto &b : frame_buf) {
+                frame_ptrs.push_back(b.data());
+            }
+        }
+
+        if (channel > 0) {
+            if (is_shm_address(socket_addr) || is_udp_address(socket_addr) || is_replay_address(socket_addr)) {
+                throw std::runtime_error("Only blocks connecting over tcp can share a connection on a channel.");
+            }
+            mux = MuxReceiveLink::attach(socket_addr, channel, &recv_buf[0], recv_buf.size(), conn_buf);
+        } else if (is_shm_address(socket_addr)) {
+            shm = ShmChannel::create(socket_addr, recv_buf.size());
+        } else if (is_udp_address(socket_addr)) {
+            if (frame_size > 1) {
+                throw std::runtime_error("UDP receives every sample on its own, please set the frame size to 1.");
+            }
+            udp = UdpChannel::bind(socket_addr, recv_buf.size());
+            stats.udp = &udp->getStats();
+        } else if (is_replay_address(socket_addr)) {
+            replay = MessageLogReader::open(socket_addr);
+        } else {
+            socket_ptr.reset(new zmq::socket_t(context, ZMQ_ROUTER));
+            socket_ptr->bind(socket_addr.c_str());
+
+            // Wakes the responder thread when the model starts stepping
+            const std::string wake_addr = "inproc://responder-wake-"+std::to_string(reinterpret_cast<uintptr_t>(this));
+            wake_rx.reset(new zmq::socket_t(context, ZMQ_PAIR));
+            wake_rx->bind(wake_addr.c_str());
+            wake_tx.reset(new zmq::socket_t(context, ZMQ_PAIR));
+            wake_tx->connect(wake_addr.c_str());
+            int linger = 0;
+            wake_rx->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            wake_tx->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+        }
+    }
+
+    ~ZmqServer()
+    {
+        resetSocketPtr();
+    }
+
+    // Answer CONN and PING from a thread until stopResponder. Not while a
+    // message the responder received waits for the next step.
+    void startResponder()
+    {
+        if (mux) {
+            mux->startResponder();
+            return;
+        }
+        if (udp || replay) {
+            // Nothing to answer, no transmitter waits for replies
+            return;
+        }
+        if (responder.joinable() || stashed_size > 0) {
+            return;
+        }
+        stop_responder = false;
+        responder_error.clear();
+        responder = std::thread([this]() { respond(); });
+    }
+
+    // Take the connection back from the responder thread. Throws what went
+    // wrong there, e.g. a message of another protocol version.
+    void stopResponder()
+    {
+        if (mux) {
+            mux->stopResponder();
+            return;
+        }
+        if (!responder.joinable()) {
+            return;
+        }
+        stop_responder = true;
+        if (wake_tx) {
+            wake_tx->send("", 0);
+        }
+        responder.join();
+        if (!responder_error.empty()) {
+            throw std::runtime_error(responder_error);
+        }
+    }
+
+    unsigned int frameSize() const { return frame_size; }
+
+    // A run starts without a frame and without data, a replay from its start
+    void restart()
+    {
+        frame_step = 0;
+        run_data = false;
+        if (replay) {
+            replay->rewind();
+        }
+        if (log) {
+            log->newRun();
+        }
+    }
+
+    // Record the messages received from here on to the file
+    void record(const std::string &path)
+    {
+        log = MessageLogWriter::create(path);
+    }
+
+    // Frame mode: put the next sample of the frame on the outputs, zeros
+    // until the first frame is due. Returns false if the next frame is due,
+    // receiveRequest receives it and outputs its first sample.
+    bool nextSample(void *const *y_ptrs)
+    {
+        const unsigned int lag = frame_size-1;
+        if (frame_step < lag) {
+            for (size_t k = 0; k < ports.size(); k++) {
+                std::memset(y_ptrs[k], 0, dtype_size(ports[k].type)*ports[k].width);
+            }
+            frame_step++;
+            return true;
+        }
+        const unsigned int pos = static_cast<unsigned int>((frame_step-lag) % frame_size);
+        if (pos == 0) {
+            return false;
+        }
+        outputSample(y_ptrs, pos);
+        frame_step++;
+        return true;
+    }
+
+    // Receive the next message and decode its ports into y_ptrs[k]
+    MsgType receiveRequest(void *const *y_ptrs, int request_timeout,
+                           int retries_left = 3)
+    {
+        stopResponder();
+        if (udp) {
+            return receiveDatagram(y_ptrs, request_timeout);
+        }
+        if (replay) {
+            return replayMessage(y_ptrs);
+        }
+
+        MsgType type = CONN;
+        size_t size;
+        LatencyTimer wait_timer(stats.wait);
+        while (retries_left) {
+            //  Wait for a request, with timeout, and process it. The
+            //  responder thread may have received it already.
+            if (stashed_size > 0 || pollPayload(request_timeout, size)) {
+                if (stashed_size > 0) {
+                    size = stashed_size;
+                    stashed_size = 0;
+                }
+                wait_timer.stop();
+                LatencyTimer decode_timer(stats.decode);
+                MsgHeader hdr = decode_header(&recv_buf[0], size);
+                type = hdr.type;
+                if (mux && type != INP_DATA) {
+                    // Only the header is used, the buffer may take the next batch
+                    mux->consumed(channel);
+                }
+                if (answerControl(hdr, size, request_timeout)) {
+                    if (type == RESET && run_data) {
+                        last_type = type;
+                        return type;
+                    }
+                    continue;
+                }
+                if (type == INP_DATA && (hdr.flags & MSG_RESEND) && hdr.seq == last_seq && last_seq > 0) {
+                    // The transmitter lost the reply to the message output
+                    // last, answer it again and keep waiting for new data
+                    SFUN_LOG(LEVEL_DEBUG, "Message %llu received again, replying again",
+                             static_cast<unsigned long long>(hdr.seq));
+                    sendReply(request_timeout);
+                    continue;
+                }
+                if (type == INP_DATA || type == STREAM_DATA || type == STREAM_SYNC) {
+                    // A transmitter starting over begins again at 1
+                    if (hdr.seq != last_seq+1 && hdr.seq != 1) {
+                        throw std::runtime_error("Lost data: expected message " + std::to_string(last_seq+1) +
+                                                 ", received message " + std::to_string(hdr.seq) + ".");
+                    }
+                    void *const *data = frame_size > 1 ? frame_ptrs.data() : y_ptrs;
+                    if (hdr.flags & MSG_DELTA) {
+                        decode_delta_message(hdr, msg_ports, &recv_buf[0], size, &delta_ref[0], has_delta_ref);
+                        unpack_ports(msg_ports, &delta_ref[0], data);
+                    } else {
+                        decode_message(hdr, msg_ports, &recv_buf[0], size, data);
+                    }
+                    if (frame_size > 1) {
+                        outputSample(y_ptrs, 0);
+                        frame_step++;
+                    }
+                    if (log) {
+                        recordData(hdr, data);
+                    }
+                    last_seq = hdr.seq;
+                    run_data = true;
+                    SFUN_LOG(LEVEL_TRACE, "Received message %llu, %llu bytes",
+                             static_cast<unsigned long long>(hdr.seq), static_cast<unsigned long long>(size));
+                }
+                last_type = type;
+                return type;
+            } else if (--retries_left == 0) {
+                throw std::runtime_error("Connection timed out. Please ensure that the transmitter side is running and two sides are not in a locked state due to unintended execution orders. If you have a long running algorithm, you can increase timeout parameter value from the block dialog.");
+            } else {
+                SFUN_LOG(LEVEL_WARN, "No request received, try again");
+            }
+        }
+        return type;
+    }
+
+    // Reply to the last request. A REQ transmitter waits for a reply to every
+    // request, a streaming transmitter only for STREAM_SYNC.
+    void sendReply(int request_timeout)
+    {
+        if (mux) {
+            // The link answers the batch once all of its blocks consumed their data
+            LatencyTimer timer(stats.reply);
+            if (last_type == INP_DATA) {
+                mux->consumed(channel);
+            }
+            return;
+        }
+        const std::vector<char> *buf;
+        if (last_type == INP_DATA) {
+            buf = &reply_buf;
+        } else if (last_type == STREAM_SYNC) {
+            buf = &ack_buf;
+        } else {
+            return;
+        }
+
+        LatencyTimer timer(stats.reply);
+        sendMessage(*buf, buf->size(), request_timeout);
+    }
+
+    void resetSocketPtr()
+    {
+        try {
+            stopResponder();
+        } catch (std::exception &) {
+            // Closing anyway
+        }
+        if (mux) {
+            mux->detach(channel);
+            mux.reset();
+        }
+        socket_ptr.reset(nullptr);
+        shm.reset(nullptr);
+        stats.udp = nullptr;
+        udp.reset(nullptr);
+        replay.reset(nullptr);
+        log.reset(nullptr);
+    }
+
+    ReceiveStats & getStats() { return stats; }
+    
+  private:
+    SharedContext  context;
+    std::string    socket_addr;
+    std::unique_ptr<zmq::socket_t>  socket_ptr;
+    std::unique_ptr<ShmChannel>     shm;
+    std::unique_ptr<UdpChannel>     udp;
+    std::unique_ptr<MessageLogReader> replay;
+    std::unique_ptr<MessageLogWriter> log;
+    std::shared_ptr<MuxReceiveLink> mux;
+    unsigned int   channel;    // 0 for a connection of the block's own
+    zmq::message_t peer;       // identity of the transmitter
+    MsgType        last_type;
+    uint64_t       last_seq;   // sequence number of the last data message
+    bool           run_data;   // data arrived in this run
+    std::vector<PortSpec> ports;         // of one sample
+    std::vector<PortSpec> msg_ports;     // of a message, frame_size samples
+    unsigned int      frame_size;
+    uint64_t          frame_step;        // steps of this run
+    std::vector<std::vector<char>> frame_buf;
+    std::vector<void *>            frame_ptrs;
+    std::vector<char> recv_buf;
+    std::vector<char> reply_buf;
+    std::vector<char> ack_buf;
+    std::vector<char> ping_buf;
+    std::vector<char> reset_buf;
+    std::vector<char> conn_buf;    // this side's ports and features
+    std::vector<char> delta_ref;   // port values of a delta coded stream
+    bool              has_delta_ref;
+    ReceiveStats      stats;
+    size_t            stashed_size;  // message the responder received and left in recv_buf
+    std::thread       responder;
+    std::atomic<bool> stop_responder;
+    std::string       responder_error;
+    std::unique_ptr<zmq::socket_t> wake_rx;
+    std::unique_ptr<zmq::socket_t> wake_tx;
+
+    // Output the newest sample which arrived over UDP within the loss wait,
+    // or apply the loss policy. With loss=error every sample is output in
+    // order and a lost one fails the run.
+    MsgType receiveDatagram(void *const *y_ptrs, int request_timeout)
+    {
+        const int wait = udp->lossWait() >= 0 ? udp->lossWait() : request_timeout;
+        size_t size;
+        LatencyTimer wait_timer(stats.wait);
+        for (;;) {
+            if (!udp->recvLatest(&recv_buf[0], recv_buf.size(), size, wait)) {
+                wait_timer.stop();
+                udp->getStats().held++;
+                if (udp->lossPolicy() == UDP_LOSS_ERROR) {
+                    throw std::runtime_error("No data received over UDP for " + std::to_string(wait) +
+                                             " ms. Please ensure that the transmitter side is running, or choose another loss option.");
+                }
+                if (udp->lossPolicy() == UDP_LOSS_ZERO) {
+                    for (size_t k = 0; k < ports.size(); k++) {
+                        std::memset(y_ptrs[k], 0, dtype_size(ports[k].type)*ports[k].width);
+                    }
+                }
+                last_type = STREAM_DATA;
+                return STREAM_DATA;
+            }
+            wait_timer.stop();
+            LatencyTimer decode_timer(stats.decode);
+            MsgHeader hdr = decode_header(&recv_buf[0], size);
+            if (hdr.type == CONN) {
+                // Nothing can be answered, the transmitter keeps sending
+                const std::string mismatch = compare_ports(decode_conn_message(hdr, &recv_buf[0], size), ports);
+                if (!mismatch.empty()) {
+                    throw std::runtime_error("Data widths or types of the transmitter and the receiver differ: " + mismatch);
+                }
+                SFUN_LOG(LEVEL_INFO, "Transmitter connected");
+                continue;
+            }
+            if (hdr.type == RESET) {
+                last_seq = 0;
+                SFUN_LOG(LEVEL_INFO, "Transmitter finished its run");
+                if (run_data) {
+                    last_type = RESET;
+                    return RESET;
+                }
+                continue;
+            }
+            if (hdr.type != STREAM_DATA) {
+                last_type = hdr.type;
+                return hdr.type;
+            }
+            if (hdr.seq != last_seq+1 && hdr.seq != 1 && last_seq > 0) {
+                if (udp->lossPolicy() == UDP_LOSS_ERROR) {
+                    throw std::runtime_error("Lost data: expected message " + std::to_string(last_seq+1) +
+                                             ", received message " + std::to_string(hdr.seq) + ".");
+                }
+                SFUN_LOG(LEVEL_DEBUG, "Skipped to message %llu, %llu message(s) lost or stale",
+                         static_cast<unsigned long long>(hdr.seq), static_cast<unsigned long long>(hdr.seq-last_seq-1));
+            }
+            decode_message(hdr, msg_ports, &recv_buf[0], size, y_ptrs);
+            if (log) {
+                recordData(hdr, y_ptrs);
+            }
+            last_seq = hdr.seq;
+            run_data = true;
+            last_type = STREAM_DATA;
+            return STREAM_DATA;
+        }
+    }
+
+    // Output the next message of the replayed log, SHUTDOWN at its end
+    MsgType replayMessage(void *const *y_ptrs)
+    {
+        const char *msg;
+        size_t size;
+        if (!replay->next(msg, size)) {
+            SFUN_LOG(LEVEL_INFO, "End of the replay");
+            last_type = SHUTDOWN;
+            return SHUTDOWN;
+        }
+        LatencyTimer decode_timer(stats.decode);
+        MsgHeader hdr = decode_header(msg, size);
+        void *const *data = frame_size > 1 ? frame_ptrs.data() : y_ptrs;
+        decode_message(hdr, msg_ports, msg, size, data);
+        if (frame_size > 1) {
+            outputSample(y_ptrs, 0);
+            frame_step++;
+        }
+        last_seq = hdr.seq;
+        run_data = true;
+        last_type = STREAM_DATA;
+        return STREAM_DATA;
+    }
+
+    // Record the decoded data of a message, dense, so that a replay can
+    // start anywhere
+    void recordData(const MsgHeader &hdr, void *const *data)
+    {
+        char *p = log->reserve(recv_buf.size());
+        log->commit(hdr.seq, hdr.time, encode_message(hdr.type, hdr.seq, hdr.time, msg_ports, data, p));
+    }
+
+    // Copy sample pos of the frame to the outputs
+    void outputSample(void *const *y_ptrs, const unsigned int pos)
+    {
+        for (size_t k = 0; k < ports.size(); k++) {
+            const size_t n = dtype_size(ports[k].type)*ports[k].width;
+            std::memcpy(y_ptrs[k], &frame_buf[k][pos*n], n);
+        }
+    }
+
+    void sendMessage(const std::vector<char> &buf, const size_t size, int request_timeout)
+    {
+        if (shm) {
+            if (!shm->send(&buf[0], size, request_timeout)) {
+                throw std::runtime_error("Connection timed out. The transmitter stopped reading the shared memory channel.");
+            }
+            return;
+        }
+        socket_ptr->send(peer.data(), peer.size(), ZMQ_SNDMORE);
+        socket_ptr->send("", 0, ZMQ_SNDMORE);
+        socket_ptr->send(&buf[0], size);
+    }
+
+    // Answer CONN with this side's ports and features, PING, and RESET,
+    // after which the next message is 1 and a keyframe. Returns false for any
+    // other message.
+    bool answerControl(const MsgHeader &hdr, const size_t size, int request_timeout)
+    {
+        if (hdr.type == PING) {
+            sendMessage(ping_buf, ping_buf.size(), request_timeout);
+            return true;
+        }
+        if (hdr.type == RESET) {
+            last_seq = 0;
+            has_delta_ref = false;
+            SFUN_LOG(LEVEL_INFO, "Transmitter finished its run");
+            if (!mux) {
+                // The link answers the batch of a channel
+                sendMessage(reset_buf, reset_buf.size(), request_timeout);
+            }
+            return true;
+        }
+        if (hdr.type != CONN) {
+            return false;
+        }
+        // A mismatch is reported by the transmitter, which then stops
+        const std::string mismatch = compare_ports(decode_conn_message(hdr, &recv_buf[0], size), ports);
+        if (!mismatch.empty()) {
+            SFUN_LOG(LEVEL_WARN, "Transmitter connected with other ports: %s", mismatch.c_str());
+        } else if (conn_frame_size(hdr) != frame_size) {
+            SFUN_LOG(LEVEL_WARN, "Transmitter connected with frames of %u samples, this block expects %u",
+                     conn_frame_size(hdr), frame_size);
+        } else {
+            SFUN_LOG(LEVEL_INFO, "Transmitter connected");
+        }
+        sendMessage(conn_buf, conn_buf.size(), request_timeout);
+        return true;
+    }
+
+    void respond()
+    {
+        try {
+            while (!stop_responder) {
+                size_t size;
+                if (shm) {
+                    if (!shm->recv(&recv_buf[0], recv_buf.size(), size, RESPONDER_POLL_INTERVAL)) {
+                        continue;
+                    }
+                } else {
+                    zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 },
+                                                {(void*)*wake_rx, 0, ZMQ_POLLIN, 0 } };
+                    zmq::poll (&items[0], 2, -1);
+                    if (items[1].revents & ZMQ_POLLIN) {
+                        zmq::message_t msg;
+                        wake_rx->recv(&msg);
+                        continue;
+                    }
+                    if (!(items[0].revents & ZMQ_POLLIN)) {
+                        continue;
+                    }
+                    socket_ptr->recv(&peer);
+                    size = recvPayload();
+                }
+
+                // Data is left for the first step, and nothing after it is
+                // read before then
+                if (!answerControl(decode_header(&recv_buf[0], size), size, RESPONDER_SEND_TIMEOUT)) {
+                    stashed_size = size;
+                    return;
+                }
+            }
+        } catch (std::exception &e) {
+            responder_error = e.what();
+        }
+    }
+
+    // Wait up to request_timeout msecs for a message and receive it into recv_buf
+    bool pollPayload(int request_timeout, size_t &size)
+    {
+        if (mux) {
+            size = mux->take(channel, request_timeout);
+            return size > 0;
+        }
+        if (shm) {
+            if (!shm->recv(&recv_buf[0], recv_buf.size(), size, request_timeout)) {
+                return false;
+            }
+            return true;
+        }
+
+        zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 } };
+        zmq::poll (&items[0], 1, request_timeout);
+        if (items[0].revents & ZMQ_POLLIN) {
+            // [identity][empty][payload], identity addresses the reply
+            socket_ptr->recv(&peer);
+            size = recvPayload();
+            return true;
+        }
+        return false;
+    }
+
+    // Receive the last frame of a message into recv_buf and return its size
+    size_t recvPayload()
+    {
+        size_t size;
+        int more;
+        size_t more_size = sizeof(more);
+        do {
+            size = socket_ptr->recv(&recv_buf[0], recv_buf.size());
+            socket_ptr->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        } while (more);
+
+        if (size > recv_buf.size()) {
+            throw std::runtime_error("Received a message of unexpected size. Please ensure that the data widths and types of the transmitter and the receiver match.");
+        }
+        return size;
+    }
+};
+
+} // anonymous namespace
+
+// The receiver binds the port on all interfaces; a broker://<name> host
+// takes the port the broker handed out for the name
+std::string receive_address(const std::string &host, const std::string &port)
+{
+    if (is_shm_address(host)) {
+        return shm_address(host, port);
+    }
+    if (is_udp_address(host)) {
+        return udp_address(host, port);
+    }
+    if (is_replay_address(host)) {
+        // The port is not used
+        return host;
+    }
+    std::string serverPortStr = port;
+    if (EndpointBroker::isBrokerAddress(host)) {
+        serverPortStr = EndpointBroker::port(host);
+    }
+
+    std::string connStr = "tcp://*";
+    connStr += ":";
+    connStr += serverPortStr;
+
+    return connStr;
+}
+
+void release_receive_address(const std::string &host)
+{
+    if (EndpointBroker::isBrokerAddress(host)) {
+        try {
+            EndpointBroker::releasePort(host);
+        } catch (std::exception &e) {
+            SFUN_LOG(LEVEL_WARN, "%s", e.what());
+        }
+    }
+}
+
+void *receive_setupruntimeresources_wrapper(const std::string &connStr, const std::vector<PortSpec> &ports,
+                                            const unsigned int channel, const unsigned int frame_size,
+                                            const std::string &record_path)
+{
+    std::unique_ptr<ZmqServer> zmp(new ZmqServer(connStr, ports, channel, frame_size));
+    if (!record_path.empty()) {
+        zmp->record(record_path);
+    }
+    zmp->startResponder();
+    return reinterpret_cast<void *>(zmp.release());
+}
+
+void receive_start_wrapper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqServer *>(zm);
+    if (zmp) {
+        zmp->restart();
+    }
+}
+
+bool receive_outputs_wrapper(void *zm, void *const *y_ptrs, const double request_timeout)
+{
+    auto zmp = reinterpret_cast<ZmqServer *>(zm);
+
+    // Between frames the outputs come from the last one
+    if (zmp->frameSize() > 1 && zmp->nextSample(y_ptrs)) {
+        return true;
+    }
+
+    MsgType r = zmp->receiveRequest(y_ptrs, static_cast<int>(request_timeout));
+    if (r == SHUTDOWN || r == RESET) {
+        return false;
+    } else if (r != INP_DATA && r != STREAM_DATA && r != STREAM_SYNC) {
+        throw std::runtime_error("Expecting input data request");
+    }
+
+    zmp->sendReply(static_cast<int>(request_timeout));
+    return true;
+}
+
+void receive_terminate_wrapper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqServer *>(zm);
+    if (zmp) {
+        if (AsyncLog::instance().enabled(LEVEL_INFO)) {
+            std::ostringstream os;
+            zmp->getStats().print(os);
+            AsyncLog::instance().writeLines(LEVEL_INFO, os.str());
+        }
+        zmp->getStats().reset();
+
+        // Keep answering handshakes until the next Fast Restart run or cleanup
+        zmp->startResponder();
+    }
+}
+
+void receive_cleanupruntimeresouces_wrapper(void *zm)
+{
+    auto zmp = reinterpret_cast<ZmqServer *>(zm);
+    if (zmp) {
+        zmp->resetSocketPtr();
+        delete zmp;
+    }
+}
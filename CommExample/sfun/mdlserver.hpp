@@ -0,0 +1,43 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef MDL_SERVER_HPP
+#define MDL_SERVER_HPP
+
+#include <string>
+#include <vector>
+
+// Address the receiver of the block's host and port parameters takes its
+// data on: tcp, shm://, udp://, replay:// or broker://<name>
+std::string receive_address(const std::string &host, const std::string &port);
+
+// Give the port of a broker://<name> host back to the broker, once the
+// receiver of receive_address is closed
+void release_receive_address(const std::string &host);
+
+// ports lists the data type and width of each output port, in port order.
+// channel 0 gives the block a connection of its own, channels 1, 2, ...
+// share the port of connStr with the other receive blocks of the process.
+// frame_size K > 1 receives K samples per message and outputs them one per
+// step, K-1 steps late. A record_path records the messages received to a
+// log, see msg_log.hpp. Handshakes are answered from here on.
+// Throws std::runtime_error if the address cannot be bound or opened.
+void *receive_setupruntimeresources_wrapper(const std::string &connStr, const std::vector<PortSpec> &ports,
+                                            const unsigned int channel, const unsigned int frame_size,
+                                            const std::string &record_path = std::string());
+
+// Start a run: without a frame and without data, a replay from its start
+void receive_start_wrapper(void *zm);
+
+// y_ptrs[k] points at the signal of output port k. Receives the data of the
+// step and replies to it. Returns false if the transmitter ended its run or
+// the replay its log, the run stops then; throws std::runtime_error if no
+// data arrives within request_timeout msecs or the data is not as expected.
+bool receive_outputs_wrapper(void *zm, void *const *y_ptrs, const double request_timeout);
+
+// Print the step latency histograms of the run and start new ones, and
+// answer handshakes until the next run
+void receive_terminate_wrapper(void *zm);
+
+void receive_cleanupruntimeresouces_wrapper(void *zm);
+
+#endif // MDL_SERVER_HPP
@@ -0,0 +1,447 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include "msg_log.hpp"
+#include "async_log.hpp"
+
+#define LOG_MAGIC          0x474c4d43u // "CMLG"
+#define LOG_VERSION        1
+#define LOG_HEADER_SIZE    64
+#define LOG_RECORD_HEADER  24
+#define LOG_INDEX_ENTRY    24
+#define LOG_INDEX_INTERVAL 64                 // records between index entries of a run
+#define LOG_GROW_SIZE      (64*1024*1024)     // bytes the file grows by when full
+
+namespace {
+
+template <typename T>
+void put(char *buf, const size_t offset, const T value)
+{
+    std::memcpy(buf+offset, &value, sizeof(T));
+}
+
+template <typename T>
+T get(const char *buf, const size_t offset)
+{
+    T value;
+    std::memcpy(&value, buf+offset, sizeof(T));
+    return value;
+}
+
+uint64_t padded(const uint64_t size)
+{
+    return (size+7) & ~static_cast<uint64_t>(7);
+}
+
+bool index_before(const LogIndexEntry &e, const uint32_t run, const double time)
+{
+    return e.run < run || (e.run == run && e.time < time);
+}
+
+} // anonymous namespace
+
+// A file mapped into memory, writable and growing, or read only
+class MappedLogFile {
+  public:
+    MappedLogFile() : addr(nullptr), len(0)
+#if defined(_WIN32)
+        , file(INVALID_HANDLE_VALUE), mapping(NULL)
+#else
+        , fd(-1)
+#endif
+    {
+    }
+
+    ~MappedLogFile()
+    {
+        unmap();
+#if defined(_WIN32)
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    // Create the file, empty, replacing one of the same name
+    void create(const std::string &p)
+    {
+        path = p;
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not create the log " + path);
+        }
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create the log " + path + ": " + strerror(errno));
+        }
+#endif
+    }
+
+    // Map the whole file, read only
+    void openRead(const std::string &p)
+    {
+        path = p;
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Could not open the log " + path);
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            throw std::runtime_error("The log " + path + " is empty");
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        addr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map the log " + path);
+        }
+        len = static_cast<size_t>(size.QuadPart);
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open the log " + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            throw std::runtime_error("The log " + path + " is empty");
+        }
+        map(static_cast<size_t>(st.st_size), PROT_READ);
+#endif
+    }
+
+    // Size a writable file and map all of it
+    void resize(const size_t size)
+    {
+        unmap();
+#if defined(_WIN32)
+        // The file grows with the mapping
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                     static_cast<DWORD>(size & 0xffffffffu), NULL);
+        addr = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map the log " + path);
+        }
+        len = size;
+#else
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            throw std::runtime_error("Could not grow the log " + path + ": " + strerror(errno));
+        }
+        map(size, PROT_READ | PROT_WRITE);
+#endif
+    }
+
+    // Unmap a writable file and cut it to size
+    void truncate(const size_t size)
+    {
+        unmap();
+#if defined(_WIN32)
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(size);
+        SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+        SetEndOfFile(file);
+#else
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            SFUN_LOG(LEVEL_WARN, "Could not trim the log %s", path.c_str());
+        }
+#endif
+    }
+
+    char  *data() const { return static_cast<char *>(addr); }
+    size_t size() const { return len; }
+    const std::string & name() const { return path; }
+
+  private:
+    std::string path;
+    void  *addr;
+    size_t len;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+
+    void unmap()
+    {
+        if (addr) UnmapViewOfFile(addr);
+        if (mapping) CloseHandle(mapping);
+        addr = nullptr;
+        mapping = NULL;
+        len = 0;
+    }
+#else
+    int fd;
+
+    void map(const size_t size, const int prot)
+    {
+        void *p = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not map the log " + path + ": " + strerror(errno));
+        }
+        addr = p;
+        len  = size;
+    }
+
+    void unmap()
+    {
+        if (addr) munmap(addr, len);
+        addr = nullptr;
+        len = 0;
+    }
+#endif
+};
+
+bool is_replay_address(const std::string &addr)
+{
+    return addr.compare(0, 9, "replay://") == 0;
+}
+
+MessageLogWriter::MessageLogWriter(std::unique_ptr<MappedLogFile> f) :
+    file(std::move(f)), data_end(LOG_HEADER_SIZE), num_records(0), run_records(0), run(1)
+{
+}
+
+std::unique_ptr<MessageLogWriter> MessageLogWriter::create(const std::string &path)
+{
+    std::unique_ptr<MappedLogFile> f(new MappedLogFile());
+    f->create(path);
+    f->resize(LOG_GROW_SIZE);
+
+    char *h = f->data();
+    std::memset(h, 0, LOG_HEADER_SIZE);
+    put<uint32_t>(h, 0, LOG_MAGIC);
+    put<uint32_t>(h, 4, LOG_VERSION);
+    put<uint64_t>(h, 8, LOG_HEADER_SIZE);
+    put<uint32_t>(h, 40, LOG_INDEX_INTERVAL);
+    SFUN_LOG(LEVEL_INFO, "Recording the messages to %s", path.c_str());
+    return std::unique_ptr<MessageLogWriter>(new MessageLogWriter(std::move(f)));
+}
+
+MessageLogWriter::~MessageLogWriter()
+{
+    try {
+        close();
+    } catch (std::exception &e) {
+        SFUN_LOG(LEVEL_WARN, "The index of the log %s was not written: %s", file->name().c_str(), e.what());
+    }
+}
+
+char *MessageLogWriter::reserve(const size_t max_size)
+{
+    const uint64_t need = data_end+LOG_RECORD_HEADER+padded(max_size);
+    if (need > file->size()) {
+        file->resize(static_cast<size_t>(std::max<uint64_t>(need, file->size()+LOG_GROW_SIZE)));
+    }
+    return file->data()+data_end+LOG_RECORD_HEADER;
+}
+
+void MessageLogWriter::commit(const uint64_t seq, const double time, const size_t size)
+{
+    char *r = file->data()+data_end;
+    put<uint32_t>(r, 0, static_cast<uint32_t>(size));
+    put<uint32_t>(r, 4, run);
+    put<uint64_t>(r, 8, seq);
+    put<double>(r, 16, time);
+    if (run_records % LOG_INDEX_INTERVAL == 0) {
+        index.push_back({data_end, time, run});
+    }
+    data_end += LOG_RECORD_HEADER+padded(size);
+    num_records++;
+    run_records++;
+
+    // The records up to data end are readable even if the log is never closed
+    put<uint64_t>(file->data(), 8, data_end);
+    put<uint64_t>(file->data(), 16, num_records);
+}
+
+void MessageLogWriter::newRun()
+{
+    if (run_records > 0) {
+        run++;
+        run_records = 0;
+    }
+}
+
+void MessageLogWriter::close()
+{
+    if (!file->data()) {
+        return;
+    }
+    const uint64_t end = data_end+index.size()*LOG_INDEX_ENTRY;
+    if (end > file->size()) {
+        file->resize(static_cast<size_t>(end));
+    }
+    char *d = file->data();
+    for (size_t k = 0; k < index.size(); k++) {
+        char *e = d+data_end+k*LOG_INDEX_ENTRY;
+        put<uint64_t>(e, 0, index[k].offset);
+        put<double>(e, 8, index[k].time);
+        put<uint32_t>(e, 16, index[k].run);
+        put<uint32_t>(e, 20, 0);
+    }
+    put<uint64_t>(d, 24, data_end);
+    put<uint64_t>(d, 32, index.size());
+    SFUN_LOG(LEVEL_INFO, "Recorded %llu message(s) of %u run(s) to %s", static_cast<unsigned long long>(num_records),
+             run_records > 0 ? run : run-1, file->name().c_str());
+    file->truncate(static_cast<size_t>(end));
+}
+
+MessageLogReader::MessageLogReader(std::unique_ptr<MappedLogFile> f) :
+    file(std::move(f)), data_end(0), pos(0), run(1), from(-std::numeric_limits<double>::infinity()),
+    to(std::numeric_limits<double>::infinity())
+{
+}
+
+MessageLogReader::~MessageLogReader()
+{
+}
+
+std::unique_ptr<MessageLogReader> MessageLogReader::open(const std::string &addr)
+{
+    if (!is_replay_address(addr)) {
+        throw std::runtime_error("Replay address must start with replay://");
+    }
+    std::string path = addr.substr(9);
+    std::string query;
+    auto q = path.find('?');
+    if (q != std::string::npos) {
+        query = path.substr(q+1);
+        path  = path.substr(0, q);
+    }
+    if (path.empty()) {
+        throw std::runtime_error("Replay address has no file.");
+    }
+
+    std::unique_ptr<MappedLogFile> f(new MappedLogFile());
+    f->openRead(path);
+    std::unique_ptr<MessageLogReader> r(new MessageLogReader(std::move(f)));
+
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        std::string opt = query.substr(0, amp);
+        query = (amp == std::string::npos) ? "" : query.substr(amp+1);
+
+        char *end = nullptr;
+        if (opt.compare(0, 4, "run=") == 0) {
+            long n = strtol(opt.c_str()+4, &end, 10);
+            if (n < 1) end = nullptr;
+            r->run = static_cast<uint32_t>(n);
+        } else if (opt.compare(0, 5, "from=") == 0) {
+            r->from = strtod(opt.c_str()+5, &end);
+        } else if (opt.compare(0, 3, "to=") == 0) {
+            r->to = strtod(opt.c_str()+3, &end);
+        } else {
+            throw std::runtime_error("Unknown replay address option: " + opt);
+        }
+        if (!end || *end != '\0') {
+            throw std::runtime_error("Replay address option " + opt + " needs a number, run one from 1.");
+        }
+    }
+
+    const char *h = r->file->data();
+    if (r->file->size() < LOG_HEADER_SIZE || get<uint32_t>(h, 0) != LOG_MAGIC) {
+        throw std::runtime_error(path + " is not a message log.");
+    }
+    if (get<uint32_t>(h, 4) != LOG_VERSION) {
+        throw std::runtime_error("The log " + path + " was written by another version of the blocks.");
+    }
+    r->data_end = std::min<uint64_t>(get<uint64_t>(h, 8), r->file->size());
+    r->buildIndex();
+
+    auto first = std::lower_bound(r->index.begin(), r->index.end(), r->run,
+                                  [](const LogIndexEntry &e, const uint32_t run) { return e.run < run; });
+    if (first == r->index.end() || first->run != r->run) {
+        throw std::runtime_error("The log " + path + " has no run " + std::to_string(r->run) + ".");
+    }
+    r->rewind();
+    SFUN_LOG(LEVEL_INFO, "Replaying run %u of %s", r->run, path.c_str());
+    return r;
+}
+
+// Read the index written when the log was closed, or scan the records of a
+// log which was not
+void MessageLogReader::buildIndex()
+{
+    const char *d = file->data();
+    const uint64_t index_offset = get<uint64_t>(d, 24);
+    const uint64_t count = get<uint64_t>(d, 32);
+    if (index_offset == data_end && index_offset+count*LOG_INDEX_ENTRY <= file->size()) {
+        index.resize(static_cast<size_t>(count));
+        for (size_t k = 0; k < index.size(); k++) {
+            const char *e = d+index_offset+k*LOG_INDEX_ENTRY;
+            index[k] = {get<uint64_t>(e, 0), get<double>(e, 8), get<uint32_t>(e, 16)};
+        }
+        return;
+    }
+
+    SFUN_LOG(LEVEL_WARN, "The log %s was not closed, rebuilding its index", file->name().c_str());
+    uint32_t last_run = 0;
+    uint64_t run_records = 0;
+    for (uint64_t p = LOG_HEADER_SIZE; p+LOG_RECORD_HEADER <= data_end; ) {
+        const uint64_t size = get<uint32_t>(d+p, 0);
+        if (p+LOG_RECORD_HEADER+size > data_end) {
+            break;
+        }
+        const uint32_t r = get<uint32_t>(d+p, 4);
+        if (r != last_run) {
+            last_run = r;
+            run_records = 0;
+        }
+        if (run_records++ % LOG_INDEX_INTERVAL == 0) {
+            index.push_back({p, get<double>(d+p, 16), r});
+        }
+        p += LOG_RECORD_HEADER+padded(size);
+    }
+}
+
+// The index entry before the first one at or after from, the record it
+// points at is at most an index interval before the first message
+void MessageLogReader::rewind()
+{
+    auto it = std::lower_bound(index.begin(), index.end(), 0,
+                               [this](const LogIndexEntry &e, int) { return index_before(e, run, from); });
+    if (it != index.begin() && std::prev(it)->run == run) {
+        --it;
+    }
+    pos = (it != index.end() && it->run == run) ? it->offset : data_end;
+
+    const char *d = file->data();
+    while (pos+LOG_RECORD_HEADER <= data_end && get<uint32_t>(d+pos, 4) == run && get<double>(d+pos, 16) < from) {
+        pos += LOG_RECORD_HEADER+padded(get<uint32_t>(d+pos, 0));
+    }
+}
+
+bool MessageLogReader::next(const char *&msg, size_t &size)
+{
+    if (pos+LOG_RECORD_HEADER > data_end) {
+        return false;
+    }
+    const char *r = file->data()+pos;
+    size = get<uint32_t>(r, 0);
+    if (pos+LOG_RECORD_HEADER+size > data_end || get<uint32_t>(r, 4) != run || get<double>(r, 16) > to) {
+        return false;
+    }
+    msg = r+LOG_RECORD_HEADER;
+    pos += LOG_RECORD_HEADER+padded(size);
+    return true;
+}
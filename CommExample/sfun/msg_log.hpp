@@ -0,0 +1,103 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef MSG_LOG_HPP
+#define MSG_LOG_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Recording of the data messages of a Comm block to a memory-mapped file,
+// and replay of a recording by a receive block in place of the transmitter,
+// as fast as the model steps.
+//
+// File layout, little endian as on the host:
+//   header   [uint32 magic][uint32 version][uint64 data end][uint64 records]
+//            [uint64 index offset][uint64 index entries][uint32 index interval]
+//            padded to 64 bytes
+//   records  [uint32 size][uint32 run][uint64 seq][double time] and a message
+//            of size bytes, dense as encode_message writes it, padded to 8
+//   index    [uint64 record offset][double time][uint32 run][uint32 reserved]
+//            for the first record of every run and every index interval-th
+// Runs are numbered from 1, a new one starts with every Fast Restart run
+// which recorded data. The header is updated with every record and the
+// index written when the log is closed; a log which was not closed, e.g.
+// after a crash, is read up to its last record and its index rebuilt.
+//
+// Replay address: replay://<path>[?run=N][&from=T][&to=T]
+//   run=N   recorded run to replay, default 1
+//   from=T  start at the first message at or after simulation time T
+//   to=T    end after the last message at or before simulation time T
+
+// True if the address replays a log
+bool is_replay_address(const std::string &addr);
+
+class MappedLogFile;
+
+struct LogIndexEntry {
+    uint64_t offset;
+    double   time;
+    uint32_t run;
+};
+
+class MessageLogWriter {
+  public:
+    // Create the log, replacing a file of the same name
+    static std::unique_ptr<MessageLogWriter> create(const std::string &path);
+
+    // Writes the index and trims the file
+    ~MessageLogWriter();
+
+    // Room for a message of up to max_size bytes, to be filled in and
+    // committed before the next call
+    char *reserve(const size_t max_size);
+
+    // Append the message written into the reserved room
+    void commit(const uint64_t seq, const double time, const size_t size);
+
+    // Records from here on belong to the next run, if this one has any
+    void newRun();
+
+  private:
+    MessageLogWriter(std::unique_ptr<MappedLogFile> f);
+
+    std::unique_ptr<MappedLogFile> file;
+    std::vector<LogIndexEntry> index;
+    uint64_t     data_end;
+    uint64_t     num_records;
+    uint64_t     run_records;    // of the current run
+    uint32_t     run;
+
+    void close();
+};
+
+class MessageLogReader {
+  public:
+    // Open the log of a replay address and go to its first message
+    static std::unique_ptr<MessageLogReader> open(const std::string &addr);
+
+    ~MessageLogReader();
+
+    // Go back to the first message of the replay, e.g. for the next Fast
+    // Restart run
+    void rewind();
+
+    // Point msg at the next message of the replay. Returns false at its end.
+    bool next(const char *&msg, size_t &size);
+
+  private:
+    MessageLogReader(std::unique_ptr<MappedLogFile> f);
+
+    std::unique_ptr<MappedLogFile> file;
+    std::vector<LogIndexEntry> index;
+    uint64_t data_end;
+    uint64_t pos;          // offset of the next record
+    uint32_t run;
+    double   from;
+    double   to;
+
+    void buildIndex();
+};
+
+#endif // MSG_LOG_HPP
@@ -0,0 +1,577 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "mux_link.hpp"
+#include "async_log.hpp"
+
+#define MUX_LINGER 2500 // msecs to deliver the last SHUTDOWN when the link is closed
+
+namespace {
+
+using std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+// Links of this MEX file by address, alive while a block uses them
+template <class Link>
+struct Registry {
+    std::mutex lock;
+    std::map<std::string, std::weak_ptr<Link>> links;
+
+    std::shared_ptr<Link> find(const std::string &addr)
+    {
+        std::shared_ptr<Link> link = links[addr].lock();
+        if (!link) {
+            link = std::make_shared<Link>(addr);
+            links[addr] = link;
+        }
+        return link;
+    }
+};
+
+template <class Link>
+Registry<Link> & registry()
+{
+    static Registry<Link> r;
+    return r;
+}
+
+int remaining_msecs(const steady_clock::time_point deadline)
+{
+    return static_cast<int>(std::max<long long>(0,
+        std::chrono::duration_cast<milliseconds>(deadline-steady_clock::now()).count()));
+}
+
+bool has_more(zmq::socket_t &socket)
+{
+    int more;
+    size_t more_size = sizeof(more);
+    socket.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    return more != 0;
+}
+
+void drain(zmq::socket_t &socket)
+{
+    zmq::message_t frame;
+    while (has_more(socket)) {
+        socket.recv(&frame);
+    }
+}
+
+uint32_t recv_channel(zmq::socket_t &socket)
+{
+    uint32_t channel;
+    if (socket.recv(&channel, sizeof(channel)) != sizeof(channel) || !has_more(socket)) {
+        throw std::runtime_error("Received a malformed batch of channel messages.");
+    }
+    return channel;
+}
+
+} // anonymous namespace
+
+/*====================*
+ * MuxTransmitLink    *
+ *====================*/
+
+MuxTransmitLink::MuxTransmitLink(const std::string &addr) :
+    socket_addr(addr), num_queued(0), batch_seq(0),
+    batch_hdr(header_size()), reply_hdr(header_size()), resends(0)
+{
+    socket_ptr.reset(new zmq::socket_t(context, ZMQ_DEALER));
+    socket_ptr->connect(socket_addr.c_str());
+    int linger = MUX_LINGER;
+    socket_ptr->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    SFUN_LOG(LEVEL_DEBUG, "Multiplexed connection to %s", socket_addr.c_str());
+}
+
+MuxTransmitLink::~MuxTransmitLink()
+{
+    if (resends > 0) {
+        SFUN_LOG(LEVEL_INFO, "%lu batch(es) to %s sent again", resends, socket_addr.c_str());
+    }
+}
+
+std::shared_ptr<MuxTransmitLink> MuxTransmitLink::attach(const std::string &addr, const uint32_t channel,
+                                                         const size_t reply_capacity)
+{
+    Registry<MuxTransmitLink> &r = registry<MuxTransmitLink>();
+    std::lock_guard<std::mutex> guard(r.lock);
+    std::shared_ptr<MuxTransmitLink> link = r.find(addr);
+
+    std::lock_guard<std::mutex> link_guard(link->lock);
+    if (link->channels.count(channel)) {
+        throw std::runtime_error("Channel " + std::to_string(channel) + " to " + addr +
+                                 " is used by two transmit blocks.");
+    }
+    Channel &ch = link->channels[channel];
+    ch.buf = nullptr;
+    ch.size = 0;
+    ch.queued = false;
+    ch.reply.resize(reply_capacity);
+    ch.reply_size = 0;
+    return link;
+}
+
+void MuxTransmitLink::detach(const uint32_t channel)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = channels.find(channel);
+    if (it == channels.end()) {
+        return;
+    }
+    if (it->second.queued) {
+        num_queued--;
+    }
+    channels.erase(it);
+}
+
+void MuxTransmitLink::submit(const uint32_t channel, const char *buf, const size_t size, int request_timeout)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Channel &ch = channels.at(channel);
+    if (ch.queued) {
+        exchange(request_timeout);
+    }
+    ch.buf = buf;
+    ch.size = size;
+    ch.queued = true;
+    if (++num_queued == channels.size()) {
+        exchange(request_timeout);
+    }
+}
+
+void MuxTransmitLink::flush(const uint32_t channel, int request_timeout)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (channels.at(channel).queued) {
+        exchange(request_timeout);
+    }
+}
+
+void MuxTransmitLink::post(const uint32_t channel, const char *buf, const size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Channel &ch = channels.at(channel);
+    if (ch.queued) {
+        ch.queued = false;
+        num_queued--;
+    }
+    encode_message(BATCH, ++batch_seq, 0.0, {}, nullptr, &batch_hdr[0]);
+    socket_ptr->send("", 0, ZMQ_SNDMORE);
+    socket_ptr->send(&batch_hdr[0], batch_hdr.size(), ZMQ_SNDMORE);
+    socket_ptr->send(&channel, sizeof(channel), ZMQ_SNDMORE);
+    socket_ptr->send(buf, size);
+}
+
+size_t MuxTransmitLink::reply(const uint32_t channel, char *buf, const size_t capacity)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    const Channel &ch = channels.at(channel);
+    const size_t size = std::min(ch.reply_size, capacity);
+    std::memcpy(buf, ch.reply.data(), size);
+    return size;
+}
+
+// Empty delimiter frame as a REQ socket would add, the batch header and the
+// queued messages in channel order
+void MuxTransmitLink::sendBatch()
+{
+    socket_ptr->send("", 0, ZMQ_SNDMORE);
+    socket_ptr->send(&batch_hdr[0], batch_hdr.size(), num_queued > 0 ? ZMQ_SNDMORE : 0);
+    size_t left = num_queued;
+    for (auto &c : channels) {
+        if (!c.second.queued) continue;
+        socket_ptr->send(&c.first, sizeof(c.first), ZMQ_SNDMORE);
+        socket_ptr->send(c.second.buf, c.second.size, --left > 0 ? ZMQ_SNDMORE : 0);
+    }
+}
+
+void MuxTransmitLink::unqueue()
+{
+    for (auto &c : channels) {
+        c.second.queued = false;
+    }
+    num_queued = 0;
+}
+
+// Send the batch and wait for its reply, sending it again whenever none
+// arrived within the retransmission timeout. Called with the lock held.
+void MuxTransmitLink::exchange(int request_timeout)
+{
+    encode_message(BATCH, ++batch_seq, 0.0, {}, nullptr, &batch_hdr[0]);
+    sendBatch();
+
+    const steady_clock::time_point sent_at = steady_clock::now();
+    const steady_clock::time_point deadline = sent_at+milliseconds(REQUEST_RETRIES*request_timeout);
+    bool resent = false;
+    for (;;) {
+        const int wait = std::min(rtt.timeout(request_timeout), remaining_msecs(deadline));
+        zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 } };
+        zmq::poll (&items[0], 1, wait);
+        if (items[0].revents & ZMQ_POLLIN) {
+            if (!recvReply()) {
+                continue;
+            }
+            if (!resent) {
+                rtt.sample(std::chrono::duration<double, std::milli>(steady_clock::now()-sent_at).count());
+            }
+            SFUN_LOG(LEVEL_TRACE, "Reply to batch %llu received", static_cast<unsigned long long>(batch_seq));
+            unqueue();
+            return;
+        }
+        if (steady_clock::now() >= deadline) {
+            unqueue();
+            throw std::runtime_error("Connection timed out. Please ensure that the receiver side is running, that it has a receive block for every channel, and that two sides are not in a locked state due to unintended execution orders. If you have a long running algorithm, you can increase timeout parameter value from the block dialog.");
+        }
+        rtt.timedOut();
+        SFUN_LOG(LEVEL_WARN, "No response to batch %llu, sending it again", static_cast<unsigned long long>(batch_seq));
+        set_message_flags(&batch_hdr[0], MSG_RESEND);
+        sendBatch();
+        resends++;
+        resent = true;
+    }
+}
+
+// Receive a reply, returns false for a late reply to an earlier batch
+bool MuxTransmitLink::recvReply()
+{
+    zmq::message_t delimiter;
+    socket_ptr->recv(&delimiter);
+    const size_t size = socket_ptr->recv(&reply_hdr[0], reply_hdr.size());
+    const MsgHeader hdr = decode_header(&reply_hdr[0], std::min(size, reply_hdr.size()));
+    if (hdr.type != BATCH || hdr.seq != batch_seq) {
+        drain(*socket_ptr);
+        return false;
+    }
+
+    while (has_more(*socket_ptr)) {
+        const uint32_t channel = recv_channel(*socket_ptr);
+        auto it = channels.find(channel);
+        if (it == channels.end()) {
+            drain(*socket_ptr);
+            break;
+        }
+        Channel &ch = it->second;
+        ch.reply_size = socket_ptr->recv(ch.reply.data(), ch.reply.size());
+        if (ch.reply_size > ch.reply.size()) {
+            drain(*socket_ptr);
+            throw std::runtime_error("Received a message of unexpected size. Please ensure that the data widths and types of the transmitter and the receiver match.");
+        }
+    }
+    return true;
+}
+
+/*====================*
+ * MuxReceiveLink     *
+ *====================*/
+
+MuxReceiveLink::MuxReceiveLink(const std::string &addr) :
+    socket_addr(addr), batch_seq(0), outstanding(0), receiving(false),
+    batch_reply(header_size()), ping_buf(header_size()), closed_buf(conn_size({})), stop_responder(false)
+{
+    socket_ptr.reset(new zmq::socket_t(context, ZMQ_ROUTER));
+    socket_ptr->bind(socket_addr.c_str());
+
+    // Wakes the responder thread when the blocks start stepping
+    const std::string wake_addr = "inproc://mux-wake-"+std::to_string(reinterpret_cast<uintptr_t>(this));
+    wake_rx.reset(new zmq::socket_t(context, ZMQ_PAIR));
+    wake_rx->bind(wake_addr.c_str());
+    wake_tx.reset(new zmq::socket_t(context, ZMQ_PAIR));
+    wake_tx->connect(wake_addr.c_str());
+    int linger = 0;
+    wake_rx->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    wake_tx->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+
+    encode_message(PING, 0, 0.0, {}, nullptr, &ping_buf[0]);
+    encode_conn_message(0, {}, &closed_buf[0]);
+    SFUN_LOG(LEVEL_DEBUG, "Multiplexed connection on %s", socket_addr.c_str());
+}
+
+MuxReceiveLink::~MuxReceiveLink()
+{
+    try {
+        stopResponder();
+    } catch (std::exception &) {
+        // Closing anyway
+    }
+}
+
+std::shared_ptr<MuxReceiveLink> MuxReceiveLink::attach(const std::string &addr, const uint32_t channel,
+                                                       char *buf, const size_t capacity,
+                                                       const std::vector<char> &conn_reply)
+{
+    Registry<MuxReceiveLink> &r = registry<MuxReceiveLink>();
+    std::lock_guard<std::mutex> guard(r.lock);
+    std::shared_ptr<MuxReceiveLink> link = r.find(addr);
+
+    std::lock_guard<std::mutex> link_guard(link->lock);
+    if (link->channels.count(channel)) {
+        throw std::runtime_error("Channel " + std::to_string(channel) + " on " + addr +
+                                 " is used by two receive blocks.");
+    }
+    Channel &ch = link->channels[channel];
+    ch.buf = buf;
+    ch.capacity = capacity;
+    ch.conn_reply = &conn_reply;
+    ch.size = 0;
+    ch.type = CONN;
+    ch.needs_reply = false;
+    return link;
+}
+
+void MuxReceiveLink::detach(const uint32_t channel)
+{
+    // The responder may be receiving into the channel's buffer
+    stopResponder();
+    bool others;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = channels.find(channel);
+        if (it != channels.end()) {
+            if (it->second.size > 0 || it->second.needs_reply) {
+                outstanding--;
+            }
+            channels.erase(it);
+        }
+        others = !channels.empty();
+    }
+    if (others) {
+        startResponder();
+    }
+}
+
+size_t MuxReceiveLink::take(const uint32_t channel, int timeout)
+{
+    stopResponder();
+
+    const steady_clock::time_point deadline = steady_clock::now()+milliseconds(timeout);
+    std::unique_lock<std::mutex> lk(lock);
+    Channel &ch = channels.at(channel);
+    for (;;) {
+        if (ch.size > 0) {
+            const size_t size = ch.size;
+            ch.size = 0;
+            ch.needs_reply = true;
+            return size;
+        }
+        if (steady_clock::now() >= deadline) {
+            return 0;
+        }
+        if (receiving || outstanding > 0) {
+            // Another block reads the socket, or the batch still has data
+            // of other blocks which must be consumed before the next one
+            changed.wait_until(lk, deadline);
+            continue;
+        }
+        receive(lk, remaining_msecs(deadline), false);
+    }
+}
+
+void MuxReceiveLink::consumed(const uint32_t channel)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Channel &ch = channels.at(channel);
+    if (!ch.needs_reply) {
+        return;
+    }
+    ch.needs_reply = false;
+    if (--outstanding == 0) {
+        sendReply();
+        changed.notify_all();
+    }
+}
+
+void MuxReceiveLink::startResponder()
+{
+    std::lock_guard<std::mutex> guard(responder_lock);
+    if (responder.joinable()) {
+        return;
+    }
+    stop_responder = false;
+    responder_error.clear();
+    responder = std::thread([this]() { respond(); });
+}
+
+// Throws what went wrong in the responder thread
+void MuxReceiveLink::stopResponder()
+{
+    std::lock_guard<std::mutex> guard(responder_lock);
+    if (!responder.joinable()) {
+        return;
+    }
+    stop_responder = true;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        changed.notify_all();
+    }
+    wake_tx->send("", 0);
+    responder.join();
+    if (!responder_error.empty()) {
+        throw std::runtime_error(responder_error);
+    }
+}
+
+void MuxReceiveLink::respond()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    try {
+        while (!stop_responder) {
+            // Data is left for the blocks, and nothing after it is read
+            // before they consumed it
+            if (receiving || outstanding > 0) {
+                changed.wait(lk);
+                continue;
+            }
+            receive(lk, -1, true);
+        }
+    } catch (std::exception &e) {
+        responder_error = e.what();
+    }
+}
+
+// Read the socket, with the lock released, for the thread which set receiving
+bool MuxReceiveLink::receive(std::unique_lock<std::mutex> &lk, int timeout, bool wakeable)
+{
+    receiving = true;
+    lk.unlock();
+    bool got;
+    try {
+        got = receiveBatch(timeout, wakeable);
+    } catch (...) {
+        lk.lock();
+        receiving = false;
+        changed.notify_all();
+        throw;
+    }
+    lk.lock();
+    receiving = false;
+
+    if (got) {
+        for (auto &a : arrived) {
+            Channel &ch = channels.at(a.first);
+            ch.type = decode_header(ch.buf, a.second).type;
+            if (wakeable && ch.type == RESET) {
+                // The responder runs while the blocks do not step, their
+                // run ended already
+                continue;
+            }
+            ch.size = a.second;
+            outstanding++;
+        }
+        if (outstanding == 0) {
+            sendReply();
+        }
+    }
+    changed.notify_all();
+    return got;
+}
+
+// Receive a batch into the buffers of its channels, with the lock released.
+// Returns true if it is a new batch, whose data is listed in arrived and
+// whose CONN and PING answers are listed in replies.
+bool MuxReceiveLink::receiveBatch(int timeout, bool wakeable)
+{
+    zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 },
+                                {(void*)*wake_rx, 0, ZMQ_POLLIN, 0 } };
+    zmq::poll (&items[0], wakeable ? 2 : 1, timeout);
+    if (wakeable && (items[1].revents & ZMQ_POLLIN)) {
+        zmq::message_t msg;
+        wake_rx->recv(&msg);
+    }
+    if (!(items[0].revents & ZMQ_POLLIN)) {
+        return false;
+    }
+
+    // [identity][empty][BATCH header][channel][message]...
+    socket_ptr->recv(&peer);
+    zmq::message_t frame;
+    socket_ptr->recv(&frame);
+    socket_ptr->recv(&frame);
+    const MsgHeader hdr = decode_header(static_cast<const char *>(frame.data()), frame.size());
+    if (hdr.type != BATCH) {
+        drain(*socket_ptr);
+        throw std::runtime_error("Received a message without a channel on a multiplexed port. Please give the transmit blocks of this port a channel too.");
+    }
+    if ((hdr.flags & MSG_RESEND) && hdr.seq == batch_seq) {
+        // The transmitter lost the reply to the batch handed out last,
+        // answer it again if it was answered already
+        drain(*socket_ptr);
+        SFUN_LOG(LEVEL_DEBUG, "Batch %llu received again", static_cast<unsigned long long>(hdr.seq));
+        std::lock_guard<std::mutex> guard(lock);
+        if (outstanding == 0) {
+            sendReply();
+        }
+        return false;
+    }
+
+    arrived.clear();
+    replies.clear();
+    while (has_more(*socket_ptr)) {
+        const uint32_t channel = recv_channel(*socket_ptr);
+        Channel *ch = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = channels.find(channel);
+            if (it != channels.end()) ch = &it->second;
+        }
+        if (ch == nullptr) {
+            // Only CONN can come before the block of the channel opened it
+            socket_ptr->recv(&frame);
+            const MsgHeader mh = decode_header(static_cast<const char *>(frame.data()), frame.size());
+            if (mh.type == PING) {
+                replies.push_back({channel, &ping_buf});
+            } else if (mh.type == CONN) {
+                replies.push_back({channel, &closed_buf});
+            } else if (mh.type == SHUTDOWN || mh.type == RESET) {
+                // The transmitter of a channel which never opened stops
+            } else {
+                drain(*socket_ptr);
+                throw std::runtime_error("Received data for channel " + std::to_string(channel) +
+                                         ", which no receive block on " + socket_addr + " uses.");
+            }
+            continue;
+        }
+
+        const size_t size = socket_ptr->recv(ch->buf, ch->capacity);
+        if (size > ch->capacity) {
+            drain(*socket_ptr);
+            throw std::runtime_error("Received a message of unexpected size. Please ensure that the data widths and types of the transmitter and the receiver match.");
+        }
+        const MsgHeader mh = decode_header(ch->buf, size);
+        if (mh.type == PING) {
+            replies.push_back({channel, &ping_buf});
+        } else if (mh.type == CONN) {
+            // A mismatch is reported by the transmitter, which then stops
+            const std::string mismatch = compare_ports(decode_conn_message(mh, ch->buf, size),
+                                                       decode_conn_message(decode_header(ch->conn_reply->data(), ch->conn_reply->size()),
+                                                                           ch->conn_reply->data(), ch->conn_reply->size()));
+            if (mismatch.empty()) {
+                SFUN_LOG(LEVEL_INFO, "Transmitter connected on channel %u", channel);
+            } else {
+                SFUN_LOG(LEVEL_WARN, "Transmitter connected on channel %u with other ports: %s", channel, mismatch.c_str());
+            }
+            replies.push_back({channel, ch->conn_reply});
+        } else {
+            arrived.push_back({channel, size});
+        }
+    }
+    batch_seq = hdr.seq;
+    return true;
+}
+
+// Answer the batch handed out last. Called with the lock held by the thread
+// which finished it; nobody reads the socket until it is answered.
+void MuxReceiveLink::sendReply()
+{
+    encode_message(BATCH, batch_seq, 0.0, {}, nullptr, &batch_reply[0]);
+    socket_ptr->send(peer.data(), peer.size(), ZMQ_SNDMORE);
+    socket_ptr->send("", 0, ZMQ_SNDMORE);
+    socket_ptr->send(&batch_reply[0], batch_reply.size(), replies.empty() ? 0 : ZMQ_SNDMORE);
+    for (size_t k = 0; k < replies.size(); k++) {
+        const std::vector<char> &buf = *replies[k].second;
+        socket_ptr->send(&replies[k].first, sizeof(replies[k].first), ZMQ_SNDMORE);
+        socket_ptr->send(buf.data(), buf.size(), k+1 < replies.size() ? ZMQ_SNDMORE : 0);
+    }
+}
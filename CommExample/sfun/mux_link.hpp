@@ -0,0 +1,177 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef MUX_LINK_HPP
+#define MUX_LINK_HPP
+
+#include <zmq.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "statcal_util.hpp"
+#include "shared_context.hpp"
+#include "rtt_estimator.hpp"
+
+// Blocks of a MEX file which are given a channel number talk to their peer
+// over one connection per address instead of a socket each: the transmit
+// blocks of an address share a MuxTransmitLink, the receive blocks of a port
+// a MuxReceiveLink, and messages are routed by channel.
+//
+// Every step, each transmit block queues its message on the link and the
+// last one to do so sends all of them as one batch and waits for its reply,
+// so a step costs one round trip however many blocks there are:
+//   [BATCH header, seq = batch number][channel][message][channel][message]...
+// A block queueing again before the others did sends the batch as it is,
+// e.g. with blocks of different sample times. The receiving link hands each
+// receive block its message and answers the batch with a BATCH header once
+// all data of the batch was consumed. It answers CONN and PING itself, with
+// one [channel][reply] pair per request; CONN for a channel no receive block
+// opened yet is answered with a CONN without ports or features.
+// The RESET a transmit block posts at the end of its run reaches its
+// receive block if that one still steps, and is dropped if its run ended.
+//
+// A lost reply is handled as for a single block: the whole batch is sent
+// again flagged MSG_RESEND, and the receiving link answers a repeat of the
+// batch it answered last without handing it out again.
+
+class MuxTransmitLink {
+  public:
+    // Link to addr, shared by all channels to it, created for the first.
+    // Replies to the channel's requests, CONN and PING, are received into a
+    // buffer of reply_capacity bytes.
+    static std::shared_ptr<MuxTransmitLink> attach(const std::string &addr, const uint32_t channel,
+                                                   const size_t reply_capacity);
+
+    ~MuxTransmitLink();
+
+    // Leave the link, dropping a message of the channel still queued
+    void detach(const uint32_t channel);
+
+    // Queue a message of the channel; buf must not change until it was sent.
+    // Sends the batch and waits up to REQUEST_RETRIES times request_timeout
+    // msecs for its reply once all channels queued a message.
+    void submit(const uint32_t channel, const char *buf, const size_t size, int request_timeout);
+
+    // Send the batch and wait for its reply if it holds a message of the channel
+    void flush(const uint32_t channel, int request_timeout);
+
+    // Send a message of the channel on its own without waiting for a reply,
+    // e.g. SHUTDOWN at cleanup. A queued message of the channel is dropped.
+    void post(const uint32_t channel, const char *buf, const size_t size);
+
+    // Copy the reply to the channel's last CONN or PING into buf, returns its size
+    size_t reply(const uint32_t channel, char *buf, const size_t capacity);
+
+    // Made by attach
+    explicit MuxTransmitLink(const std::string &addr);
+
+  private:
+    struct Channel {
+        const char       *buf;        // queued message
+        size_t            size;
+        bool              queued;
+        std::vector<char> reply;
+        size_t            reply_size;
+    };
+
+    SharedContext  context;
+    std::string    socket_addr;
+    std::unique_ptr<zmq::socket_t> socket_ptr;
+    std::mutex     lock;
+    std::map<uint32_t, Channel> channels;
+    size_t         num_queued;
+    uint64_t       batch_seq;
+    std::vector<char> batch_hdr;
+    std::vector<char> reply_hdr;
+    RttEstimator   rtt;
+    unsigned long  resends;
+
+    void sendBatch();
+    void exchange(int request_timeout);
+    bool recvReply();
+    void unqueue();
+
+    MuxTransmitLink(const MuxTransmitLink &) = delete;
+    MuxTransmitLink & operator=(const MuxTransmitLink &) = delete;
+};
+
+class MuxReceiveLink {
+  public:
+    // Link bound to addr, shared by all channels on it, created for the
+    // first. Messages of the channel are received into buf, which holds
+    // capacity bytes, and CONN is answered with conn_reply. buf and
+    // conn_reply must stay until detach.
+    static std::shared_ptr<MuxReceiveLink> attach(const std::string &addr, const uint32_t channel,
+                                                  char *buf, const size_t capacity,
+                                                  const std::vector<char> &conn_reply);
+
+    ~MuxReceiveLink();
+
+    void detach(const uint32_t channel);
+
+    // Wait up to timeout msecs for the next message of the channel. Returns
+    // its size, it is in the channel's buffer, or 0 if none arrived.
+    size_t take(const uint32_t channel, int timeout);
+
+    // The channel is done with the message it took, and the next batch may
+    // be received into its buffer; the batch is answered once all of its
+    // messages were consumed
+    void consumed(const uint32_t channel);
+
+    // Answer CONN and PING from a thread while the blocks do not step, as
+    // a single receive block does
+    void startResponder();
+    void stopResponder();
+
+    // Made by attach
+    explicit MuxReceiveLink(const std::string &addr);
+
+  private:
+    struct Channel {
+        char             *buf;
+        size_t            capacity;
+        const std::vector<char> *conn_reply;
+        size_t            size;         // of the message waiting in buf, 0 if none
+        MsgType           type;
+        bool              needs_reply;  // message taken and not yet consumed
+    };
+
+    SharedContext  context;
+    std::string    socket_addr;
+    std::unique_ptr<zmq::socket_t> socket_ptr;
+    std::unique_ptr<zmq::socket_t> wake_rx;
+    std::unique_ptr<zmq::socket_t> wake_tx;
+    zmq::message_t peer;          // identity of the transmitting link
+    std::mutex     lock;
+    std::condition_variable changed;
+    std::map<uint32_t, Channel> channels;
+    uint64_t       batch_seq;     // batch handed out last
+    size_t         outstanding;   // its messages not yet consumed
+    bool           receiving;     // a thread reads the socket
+    std::vector<std::pair<uint32_t, const std::vector<char> *>> replies; // to CONN and PING of the batch
+    std::vector<std::pair<uint32_t, size_t>> arrived;  // data of the batch, by channel
+    std::vector<char> batch_reply;
+    std::vector<char> ping_buf;
+    std::vector<char> closed_buf; // CONN of a channel no block opened
+    std::mutex     responder_lock;
+    std::thread    responder;
+    std::atomic<bool> stop_responder;
+    std::string    responder_error;
+
+    bool receiveBatch(int timeout, bool wakeable);
+    bool receive(std::unique_lock<std::mutex> &lk, int timeout, bool wakeable);
+    void sendReply();
+    void respond();
+
+    MuxReceiveLink(const MuxReceiveLink &) = delete;
+    MuxReceiveLink & operator=(const MuxReceiveLink &) = delete;
+};
+
+#endif // MUX_LINK_HPP
@@ -0,0 +1,53 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef RTT_ESTIMATOR_HPP
+#define RTT_ESTIMATOR_HPP
+
+#include <algorithm>
+#include <cmath>
+
+#define REQUEST_RETRIES  3 //  Number of tries before we abandon
+#define REQUEST_MIN_RTO  10 // msecs, shortest wait before a request is sent again
+#define REQUEST_MAX_BACKOFF 64
+
+// Retransmission timeout derived from the measured round trip times as TCP
+// does it (RFC 6298): SRTT+4*RTTVAR, doubled after every timeout. Round
+// trips of requests which were sent again are not measured, their reply may
+// belong to either copy. Until the first reply the block's timeout is used.
+class RttEstimator {
+  public:
+    RttEstimator() : srtt(0), rttvar(0), backoff(1), has_sample(false) {}
+
+    void sample(const double rtt)
+    {
+        if (has_sample) {
+            rttvar = 0.75*rttvar+0.25*std::fabs(srtt-rtt);
+            srtt   = 0.875*srtt+0.125*rtt;
+        } else {
+            srtt   = rtt;
+            rttvar = rtt/2;
+            has_sample = true;
+        }
+        backoff = 1;
+    }
+
+    void timedOut() { backoff = std::min(2*backoff, REQUEST_MAX_BACKOFF); }
+
+    // msecs to wait for a reply before sending the request again
+    int timeout(const int max_timeout) const
+    {
+        if (!has_sample) {
+            return max_timeout;
+        }
+        const double rto = std::max<double>(REQUEST_MIN_RTO, srtt+4*rttvar)*backoff;
+        return static_cast<int>(std::min<double>(rto, max_timeout));
+    }
+
+  private:
+    double srtt;     // msecs
+    double rttvar;   // msecs
+    int    backoff;
+    bool   has_sample;
+};
+
+#endif // RTT_ESTIMATOR_HPP
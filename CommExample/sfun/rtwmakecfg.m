@@ -0,0 +1,46 @@
+% Copyright 2018 The MathWorks, Inc.
+
+function makeInfo = rtwmakecfg()
+% RTWMAKECFG Sources, include paths and libraries of the code generated
+% from sfcn_transmit.tlc and sfcn_receive.tlc, for code generation and
+% Rapid Accelerator. The blocks' connection code is compiled into the model
+% behind the C interface of comm_runtime.h.
+
+sfunDir = fileparts(mfilename('fullpath'));
+rootDir = fileparts(fileparts(sfunDir));
+
+makeInfo.includePath = {sfunDir,...
+    fullfile(rootDir,'utils','include'),...
+    fullfile(rootDir,'cppzmq'),...
+    fullfile(rootDir,'libzmq','include')};
+
+makeInfo.sourcePath = {sfunDir};
+
+makeInfo.sources = {'comm_runtime.cpp',...
+    'mdlclient.cpp',...
+    'mdlserver.cpp',...
+    'statcal_util.cpp',...
+    'shm_ring.cpp',...
+    'udp_link.cpp',...
+    'msg_log.cpp',...
+    'mux_link.cpp'};
+
+% libzmq as built for Windows, see readme.mlx, elsewhere as built with CMake
+% in libzmq/build or else installed on the system
+if ispc
+    makeInfo.linkLibsObjs = {fullfile(rootDir,'libzmq','bin','x64','Release','v140','dynamic','libzmq.lib')};
+else
+    if ismac
+        zmqLib = fullfile(rootDir,'libzmq','build','lib','libzmq.dylib');
+    else
+        zmqLib = fullfile(rootDir,'libzmq','build','lib','libzmq.so');
+    end
+    if ~exist(zmqLib,'file')
+        zmqLib = '-lzmq';
+    end
+    makeInfo.linkLibsObjs = {zmqLib,'-lpthread'};
+    if ~ismac
+        % shm_open of the shm:// transport
+        makeInfo.linkLibsObjs{end+1} = '-lrt';
+    end
+end
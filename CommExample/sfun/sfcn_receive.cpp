@@ -5,17 +5,21 @@
  * Abstract:
  */
 
-#include <zmq.hpp>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <memory>
+#include <cstring>
+#include <sstream>
 
 #define S_FUNCTION_NAME  sfcn_receive
 #define S_FUNCTION_LEVEL 2
 
 #include "simstruc.h"
 #include "statcal_util.hpp"
+#include "mdlserver.hpp"
+#include "async_log.hpp"
 
 /*================*
  * Build checking *
@@ -23,10 +27,16 @@
 
 #define HOST_NAME_P  0
 #define PORT_NUM_P   1
-#define DATA_WIDTH_P 2
+#define DATA_WIDTH_P 2 // one output port per element
 #define STEP_SIZE_P  3
 #define TIMEOUT_P    4
-#define NUM_PRMS     5
+#define DATA_TYPES_P 5 // optional
+#define LOG_LEVEL_P  6 // optional
+#define CHANNEL_P    7 // optional
+#define FRAME_SIZE_P 8 // optional
+#define RECORD_P     9 // optional
+#define NUM_REQ_PRMS 5
+#define NUM_PRMS     10
 
 static bool isPositiveRealDoubleParam(const mxArray *p)
 {
@@ -41,68 +51,135 @@ static bool isPositiveRealDoubleParam(const mxArray *p)
     return isValid;
 }
 
+// Vector of positive integers, e.g. port widths
+static bool isPositiveIntVectorParam(const mxArray *p)
+{
+    bool isValid = (mxIsDouble(p) &&
+                    mxGetNumberOfElements(p) >= 1 &&
+                    !mxIsComplex(p));
 
-class ZmqServer {
-  public:
-    ZmqServer(const std::string &addr) : context(1), socket_addr(addr)
-    {
-        socket_ptr.reset(new zmq::socket_t(context, ZMQ_REP));
-        socket_ptr->bind(socket_addr.c_str());
-    }
-
-    ~ZmqServer() {}
-
-    MsgType receiveRequest(std::vector<double> &u, int request_timeout,
-                           int retries_left = 3)
-    {
-        MsgType type = CONN;
-        while (retries_left) {
-            zmq::message_t request;
-            //  Poll socket for a reply, with timeout
-            zmq::pollitem_t items[] = { {(void*)*socket_ptr, 0, ZMQ_POLLIN, 0 } };
-            zmq::poll (&items[0], 1, request_timeout);
-            
-            //  If we got a reply, process it
-            if (items[0].revents & ZMQ_POLLIN) {
-                
-                socket_ptr->recv(&request);
-                char *data_str = static_cast<char*>(request.data());
-                data_str[request.size()] = '\0';
-                
-                int ulen;                
-                std::tie(type, ulen) = decode_header(data_str);
-                decode_data(ulen, data_str, u);
-                return type;
-            } else if (--retries_left == 0) {
-                throw std::runtime_error("Connection timed out. Please ensure that the transmitter side is running and two sides are not in a locked state due to unintended execution orders. If you have a long running algorithm, you can increase timeout parameter value from the block dialog.");
-            } else {
-                std::cout << "No request received, try again" << std::endl;
-            }
+    if (isValid) {
+        double *v = reinterpret_cast<double *>(mxGetData(p));
+        for (size_t k = 0; k < mxGetNumberOfElements(p); k++) {
+            if (v[k] < 1 || v[k] != static_cast<int>(v[k])) isValid = false;
         }
-        return type;
     }
+    return isValid;
+}
 
-    void sendReply()
-    {
-        std::string reply_str;
-        encode_data(INP_DATA, {}, reply_str);
-        zmq::message_t reply(reply_str.size());
-        memcpy(reply.data (), reply_str.c_str(), reply_str.size());
-        socket_ptr->send(reply);
+static bool isNonNegativeIntParam(const mxArray *p)
+{
+    bool isValid = isPositiveRealDoubleParam(p);
+    if (isValid) {
+        double *v = reinterpret_cast<double *>(mxGetData(p));
+        if (*v != static_cast<unsigned int>(*v)) isValid = false;
     }
+    return isValid;
+}
 
-    void resetSocketPtr()
-    {
-        socket_ptr.reset(nullptr);
-    }
-    
-  private:
-    zmq::context_t context;
-    std::string    socket_addr;
-    std::unique_ptr<zmq::socket_t>  socket_ptr;
-    
+// Parameters after the first NUM_REQ_PRMS are optional so that blocks saved
+// with fewer parameters keep working
+static bool hasParam(SimStruct *S, int idx)
+{
+    return idx < ssGetSFcnParamsCount(S);
+}
+
+auto Mx_Deleter = [](char *m) { mxFree(m); };
+using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
+
+static const struct {
+    const char *name;
+    DTypeId     id;
+} dataTypeNames[] = {
+    {"double", SS_DOUBLE}, {"single", SS_SINGLE},
+    {"int8",   SS_INT8},   {"uint8",  SS_UINT8},
+    {"int16",  SS_INT16},  {"uint16", SS_UINT16},
+    {"int32",  SS_INT32},  {"uint32", SS_UINT32},
+    {"boolean", SS_BOOLEAN},
 };
 
+// Data type of output port k. The optional data types parameter is a type
+// name for all ports or a cell array with one name per port, default double.
+static bool outputDataType(SimStruct *S, int_T k, DTypeId &id)
+{
+    id = SS_DOUBLE;
+    if (!hasParam(S, DATA_TYPES_P)) {
+        return true;
+    }
+
+    const mxArray *p = ssGetSFcnParam(S,DATA_TYPES_P);
+    const mxArray *name = p;
+    if (mxIsCell(p)) {
+        size_t n = mxGetNumberOfElements(p);
+        if (n != 1 && static_cast<size_t>(k) >= n) {
+            return false;
+        }
+        name = mxGetCell(p, n == 1 ? 0 : k);
+    }
+    if (name == nullptr || !mxIsChar(name)) {
+        return false;
+    }
+
+    mxCharUnqiuePtr str(mxArrayToString(name), Mx_Deleter);
+    for (auto &t : dataTypeNames) {
+        if (std::strcmp(str.get(), t.name) == 0) {
+            id = t.id;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Log level named by the optional parameter, the one of the environment
+// variable if the block does not have it or it is empty
+static LogLevel log_level(SimStruct *S)
+{
+    if (!hasParam(S, LOG_LEVEL_P) || !mxIsChar(ssGetSFcnParam(S,LOG_LEVEL_P))) {
+        return AsyncLog::envLevel();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,LOG_LEVEL_P)), Mx_Deleter);
+    return AsyncLog::parseLevel(str.get(), AsyncLog::envLevel());
+}
+
+static bool isLogLevelParam(const mxArray *p)
+{
+    if (!mxIsChar(p)) {
+        return false;
+    }
+    mxCharUnqiuePtr str(mxArrayToString(p), Mx_Deleter);
+    return AsyncLog::isLevelName(str.get());
+}
+
+// 0 (a connection of the block's own) unless the optional parameter gives
+// the block a channel of the connection shared with other blocks
+static unsigned int channel(SimStruct *S)
+{
+    if (!hasParam(S, CHANNEL_P)) {
+        return 0;
+    }
+    return static_cast<unsigned int>(*reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,CHANNEL_P))));
+}
+
+// Samples per message, 1 unless frames are enabled by the optional parameter
+static unsigned int frame_size(SimStruct *S)
+{
+    if (!hasParam(S, FRAME_SIZE_P)) {
+        return 1;
+    }
+    return std::max(1u, static_cast<unsigned int>(*reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,FRAME_SIZE_P)))));
+}
+
+// File the received messages are recorded to, none unless the optional
+// parameter names one
+static std::string record_path(SimStruct *S)
+{
+    if (!hasParam(S, RECORD_P)) {
+        return std::string();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,RECORD_P)), Mx_Deleter);
+    return str.get();
+}
+
 #define MDL_CHECK_PARAMETERS
 #if defined(MDL_CHECK_PARAMETERS) && defined(MATLAB_MEX_FILE)
 /* Function: mdlCheckParameters =============================================
@@ -121,9 +198,9 @@ static void mdlCheckParameters(SimStruct *S)
         return;
     }
 
-    bool isValid = isPositiveRealDoubleParam(ssGetSFcnParam(S,DATA_WIDTH_P));
+    bool isValid = isPositiveIntVectorParam(ssGetSFcnParam(S,DATA_WIDTH_P));
     if (!isValid) {
-        ssSetErrorStatus(S,"Data width parameter must be a positive scalar.");
+        ssSetErrorStatus(S,"Data width parameter must be a positive integer, or a vector of them with one element per output port.");
         return;
     }
 
@@ -139,6 +216,40 @@ static void mdlCheckParameters(SimStruct *S)
         return;
     }
 
+    if (hasParam(S, DATA_TYPES_P)) {
+        const mxArray *p = ssGetSFcnParam(S,DATA_TYPES_P);
+        size_t nPorts = mxGetNumberOfElements(ssGetSFcnParam(S,DATA_WIDTH_P));
+        isValid = mxIsChar(p) ||
+            (mxIsCell(p) && (mxGetNumberOfElements(p) == 1 || mxGetNumberOfElements(p) == nPorts));
+        DTypeId id;
+        for (size_t k = 0; isValid && k < nPorts; k++) {
+            isValid = outputDataType(S, static_cast<int_T>(k), id);
+        }
+        if (!isValid) {
+            ssSetErrorStatus(S,"Data types parameter must be a data type name, or a cell array with one per output port, out of double, single, int8, uint8, int16, uint16, int32, uint32 and boolean.");
+            return;
+        }
+    }
+
+    if (hasParam(S, LOG_LEVEL_P) && !isLogLevelParam(ssGetSFcnParam(S,LOG_LEVEL_P))) {
+        ssSetErrorStatus(S,"Log level parameter must be one of 'off', 'error', 'warn', 'info', 'debug' and 'trace', or '' for the level of the " LOG_LEVEL_ENV " environment variable.");
+        return;
+    }
+
+    if (hasParam(S, CHANNEL_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,CHANNEL_P))) {
+        ssSetErrorStatus(S,"Channel parameter must be a non-negative integer, 0 for a connection of the block's own.");
+        return;
+    }
+
+    if (hasParam(S, FRAME_SIZE_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,FRAME_SIZE_P))) {
+        ssSetErrorStatus(S,"Frame size parameter must be a non-negative integer, 0 or 1 to receive every sample on its own.");
+        return;
+    }
+
+    if (hasParam(S, RECORD_P) && !mxIsChar(ssGetSFcnParam(S,RECORD_P))) {
+        ssSetErrorStatus(S,"Record file parameter must be a char array, '' to not record.");
+        return;
+    }
     
     return;
 }
@@ -151,7 +262,8 @@ static void mdlCheckParameters(SimStruct *S)
  */
 static void mdlInitializeSizes(SimStruct *S)
 {
-    ssSetNumSFcnParams(S, NUM_PRMS);
+    int_T nPrms = ssGetSFcnParamsCount(S);
+    ssSetNumSFcnParams(S, (nPrms >= NUM_REQ_PRMS && nPrms <= NUM_PRMS) ? nPrms : NUM_PRMS);
 
 #if defined(MATLAB_MEX_FILE)
     if (ssGetNumSFcnParams(S) == ssGetSFcnParamsCount(S)) {
@@ -169,13 +281,36 @@ static void mdlInitializeSizes(SimStruct *S)
     ssSetSFcnParamTunable(S, PORT_NUM_P, false);
     ssSetSFcnParamTunable(S, STEP_SIZE_P, false);
     ssSetSFcnParamTunable(S, TIMEOUT_P, false);
+    if (hasParam(S, DATA_TYPES_P)) {
+        ssSetSFcnParamTunable(S, DATA_TYPES_P, false);
+    }
+    if (hasParam(S, LOG_LEVEL_P)) {
+        ssSetSFcnParamTunable(S, LOG_LEVEL_P, false);
+    }
+    if (hasParam(S, CHANNEL_P)) {
+        ssSetSFcnParamTunable(S, CHANNEL_P, false);
+    }
+    if (hasParam(S, FRAME_SIZE_P)) {
+        ssSetSFcnParamTunable(S, FRAME_SIZE_P, false);
+    }
+    if (hasParam(S, RECORD_P)) {
+        ssSetSFcnParamTunable(S, RECORD_P, false);
+    }
     
     if (!ssSetNumInputPorts(S, 0)) return;
 
-    if (!ssSetNumOutputPorts(S, 1)) return;
+    const mxArray *dataWidthP = ssGetSFcnParam(S,DATA_WIDTH_P);
+    int_T nPorts = static_cast<int_T>(mxGetNumberOfElements(dataWidthP));
+    double *widths = reinterpret_cast<double *>(mxGetData(dataWidthP));
+
+    if (!ssSetNumOutputPorts(S, nPorts)) return;
 
-    double *dataWidthP = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,DATA_WIDTH_P)));
-    ssSetOutputPortWidth(S, 0, static_cast<int>(*dataWidthP));
+    for (int_T k = 0; k < nPorts; k++) {
+        DTypeId id;
+        outputDataType(S, k, id);
+        ssSetOutputPortWidth(S, k, static_cast<int>(widths[k]));
+        ssSetOutputPortDataType(S, k, id);
+    }
     
     ssSetNumSampleTimes(S, 1);
     
@@ -202,55 +337,85 @@ static void mdlInitializeSampleTimes(SimStruct *S)
     ssSetModelReferenceSampleTimeDefaultInheritance(S);
 }
 
+// PWork 0 holds the connection, PWork 1..n the output signal pointers which
+// are handed to the connection every step
 #define MDL_SET_WORK_WIDTHS
 #if defined(MDL_SET_WORK_WIDTHS) && defined(MATLAB_MEX_FILE)
 static void mdlSetWorkWidths(SimStruct *S)
 {
-    ssSetNumPWork(S, 1);
+    ssSetNumPWork(S, 1+ssGetNumOutputPorts(S));
 }
 #endif // MDL_SET_WORK_WIDTHS
 
-#define GET_ZM_PTR(S) reinterpret_cast<ZmqServer *>(ssGetPWorkValue(S,0))
-
-auto Mx_Deleter = [](char *m) { mxFree(m); };
-using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
+#define GET_ZM_PTR(S) ssGetPWorkValue(S,0)
 
-static std::string host_and_port_addr(const SimStruct *S)
+static std::string host_param(const SimStruct *S)
 {
     mxCharUnqiuePtr hostStr(mxArrayToString(ssGetSFcnParam(S,HOST_NAME_P)), Mx_Deleter);
-    std::string serverHostStr = hostStr.get();
+    return hostStr.get();
+}
 
+static std::string host_and_port_addr(const SimStruct *S)
+{
     mxCharUnqiuePtr portStr(mxArrayToString(ssGetSFcnParam(S,PORT_NUM_P)), Mx_Deleter);
-    std::string serverPortStr = portStr.get();
-    
-    std::string connStr = "tcp://*";
-    // connStr += serverHostStr;
-    connStr += ":";
-    connStr += serverPortStr;
-
-    return connStr;
+    return receive_address(host_param(S), portStr.get());
 }
 
 #define MDL_SETUP_RUNTIME_RESOURCES
 void mdlSetupRuntimeResources(SimStruct *S)
 {
-    std::cout << "Starting connection" << std::endl;
+    // Messages of the steps are printed by the logger's thread from here on.
+    // The cleanup stops it also if another block runs it at another level.
+    try {
+        AsyncLog::instance().start(log_level(S));
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
+    SFUN_LOG(LEVEL_INFO, "Starting connection");
 
-    std::string connStr = host_and_port_addr(S);
+    std::vector<PortSpec> ports;
+    for (int_T k = 0; k < ssGetNumOutputPorts(S); k++) {
+        ports.push_back({static_cast<DataType>(ssGetOutputPortDataType(S,k)), ssGetOutputPortWidth(S,k)});
+    }
 
-    auto zmq = new ZmqServer(connStr);
-    
-    ssSetPWorkValue(S, 0, zmq);
+    if (frame_size(S) > 1) {
+        double *stepSizeP = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,STEP_SIZE_P)));
+        SFUN_LOG(LEVEL_INFO, "Receiving frames of %u samples, the outputs lag the transmitter by %u steps (%g s)",
+                 frame_size(S), frame_size(S)-1, (frame_size(S)-1)*(*stepSizeP));
+    }
+
+    try {
+        std::string connStr = host_and_port_addr(S);
+        try {
+            ssSetPWorkValue(S, 0, receive_setupruntimeresources_wrapper(connStr, ports, channel(S), frame_size(S), record_path(S)));
+        } catch (...) {
+            release_receive_address(host_param(S));
+            throw;
+        }
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
 }
 
 #define MDL_START /* to indicate that the S-function has mdlStart method */
 
 /* mdlStart ==========================================================
  * Abstract:
- *   Allocate and initialize run-time data and cache the pointer in the PWork.
+ *   Start the run over, the connection is kept across Fast Restart runs.
  */
 static void mdlStart(SimStruct *S)
 {
+    try {
+        receive_start_wrapper(GET_ZM_PTR(S));
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
 }
 
 /* Function: mdlOutputs =======================================================
@@ -259,46 +424,33 @@ static void mdlStart(SimStruct *S)
  */
 static void mdlOutputs(SimStruct *S, int_T tid)
 {    
-    std::string fcnName;
-    std::vector<double> uv;
-    std::string fcn;
     double *timeout_ptr = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,TIMEOUT_P)));
 
-    auto zmq = GET_ZM_PTR(S);
-    MsgType r;
-    
+    for (int_T k = 0; k < ssGetNumOutputPorts(S); k++) {
+        ssSetPWorkValue(S, 1+k, ssGetOutputPortSignal(S,k));
+    }
+
     try {
-        r = zmq->receiveRequest(uv, (*timeout_ptr)*1000);
+        if (!receive_outputs_wrapper(GET_ZM_PTR(S), ssGetPWork(S)+1, (*timeout_ptr)*1000)) {
+            ssSetStopRequested(S, 1);
+        }
     } catch (std::exception &e) {
         static std::string errstr(e.what());
         ssSetErrorStatus(S, errstr.c_str());
         return;
     }
-    
-    if (r == SHUTDOWN) {
-        ssSetStopRequested(S, 1);
-        return;
-    } else if (r != INP_DATA) {
-        ssSetErrorStatus(S, "Expecting input data request");
-        return;
-    }
-
-    auto y = ssGetOutputPortRealSignal(S,0);
-    
-    std::memcpy(y, &uv[0], sizeof(double)*ssGetOutputPortWidth(S,0));
-    
-    zmq->sendReply();
 }
 
 #define MDL_CLEANUP_RUNTIME_RESOURCES
 static void mdlCleanupRuntimeResources(SimStruct *S)
 {
-    std::cout << "Closing connection" << std::endl;
-    auto zmq = GET_ZM_PTR(S);
-    if (zmq) {
-        zmq->resetSocketPtr();
-        delete zmq;
+    SFUN_LOG(LEVEL_INFO, "Closing connection");
+    receive_cleanupruntimeresouces_wrapper(GET_ZM_PTR(S));
+    // Without a connection setup failed and gave the port back already
+    if (GET_ZM_PTR(S)) {
+        release_receive_address(host_param(S));
     }
+    AsyncLog::instance().stop();
 }
 
 /* Function: mdlTerminate =====================================================
@@ -307,7 +459,45 @@ static void mdlCleanupRuntimeResources(SimStruct *S)
  */
 static void mdlTerminate(SimStruct *S)
 {
+    receive_terminate_wrapper(GET_ZM_PTR(S));
+}
+
+// Char parameter as the TLC file puts it into a C string literal. Paths
+// keep working with forward slashes, which need no escaping.
+static std::string rtw_string(SimStruct *S, int idx)
+{
+    if (!hasParam(S, idx) || !mxIsChar(ssGetSFcnParam(S,idx))) {
+        return std::string();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,idx)), Mx_Deleter);
+    std::string s = str.get();
+    std::replace(s.begin(), s.end(), '\\', '/');
+    return s;
+}
+
+#define MDL_RTW
+#if defined(MDL_RTW) && defined(MATLAB_MEX_FILE)
+/* Function: mdlRTW ===========================================================
+ * Abstract:
+ *    Parameters of the block for sfcn_receive.tlc, which calls the C
+ *    interface of comm_runtime.h in generated code and the accelerator modes.
+ */
+static void mdlRTW(SimStruct *S)
+{
+    double *timeout_ptr = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,TIMEOUT_P)));
+
+    if (!ssWriteRTWParamSettings(S, 7,
+                                 SSWRITE_VALUE_QSTR, "Host", rtw_string(S, HOST_NAME_P).c_str(),
+                                 SSWRITE_VALUE_QSTR, "Port", rtw_string(S, PORT_NUM_P).c_str(),
+                                 SSWRITE_VALUE_NUM,  "Timeout", *timeout_ptr,
+                                 SSWRITE_VALUE_NUM,  "Channel", static_cast<real_T>(channel(S)),
+                                 SSWRITE_VALUE_NUM,  "FrameSize", static_cast<real_T>(frame_size(S)),
+                                 SSWRITE_VALUE_QSTR, "RecordFile", rtw_string(S, RECORD_P).c_str(),
+                                 SSWRITE_VALUE_QSTR, "LogLevel", rtw_string(S, LOG_LEVEL_P).c_str())) {
+        return; /* An error occurred, which will be reported by Simulink */
+    }
 }
+#endif /* MDL_RTW */
 
 #ifdef  MATLAB_MEX_FILE    /* Is this file being compiled as a MEX-file? */
 #include "simulink.c"      /* MEX-file interface mechanism */
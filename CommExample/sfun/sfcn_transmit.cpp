@@ -8,19 +8,30 @@
 #define S_FUNCTION_NAME  sfcn_transmit
 #define S_FUNCTION_LEVEL 2
 
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 #include "simstruc.h"
+#include "statcal_util.hpp"
 #include "mdlclient.hpp"
+#include "async_log.hpp"
 
 #define HOST_NAME_P  0
 #define PORT_NUM_P   1
-#define DATA_WIDTH_P 2
+#define DATA_WIDTH_P 2 // one input port per element
 #define STEP_SIZE_P  3
 #define TIMEOUT_P    4
-#define NUM_PRMS     5
+#define ACK_INTERVAL_P 5 // optional
+#define KEYFRAME_INTERVAL_P 6 // optional
+#define LOG_LEVEL_P  7 // optional
+#define CHANNEL_P    8 // optional
+#define FRAME_SIZE_P 9 // optional
+#define RECORD_P     10 // optional
+#define NUM_REQ_PRMS 5
+#define NUM_PRMS     11
 
 static bool isPositiveRealDoubleParam(const mxArray *p)
 {
@@ -35,6 +46,114 @@ static bool isPositiveRealDoubleParam(const mxArray *p)
     return isValid;
 }
 
+// Vector of positive integers, e.g. port widths
+static bool isPositiveIntVectorParam(const mxArray *p)
+{
+    bool isValid = (mxIsDouble(p) &&
+                    mxGetNumberOfElements(p) >= 1 &&
+                    !mxIsComplex(p));
+
+    if (isValid) {
+        double *v = reinterpret_cast<double *>(mxGetData(p));
+        for (size_t k = 0; k < mxGetNumberOfElements(p); k++) {
+            if (v[k] < 1 || v[k] != static_cast<int>(v[k])) isValid = false;
+        }
+    }
+    return isValid;
+}
+
+// Data types which are sent in their native size
+static bool isSupportedDataType(DTypeId id)
+{
+    return id >= SS_DOUBLE && id <= SS_BOOLEAN;
+}
+
+// Parameters after the first NUM_REQ_PRMS are optional so that blocks saved
+// with fewer parameters keep working
+static bool hasParam(SimStruct *S, int idx)
+{
+    return idx < ssGetSFcnParamsCount(S);
+}
+
+auto Mx_Deleter = [](char *m) { mxFree(m); };
+using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
+
+static bool isNonNegativeIntParam(const mxArray *p)
+{
+    bool isValid = isPositiveRealDoubleParam(p);
+    if (isValid) {
+        double *v = reinterpret_cast<double *>(mxGetData(p));
+        if (*v != static_cast<unsigned int>(*v)) isValid = false;
+    }
+    return isValid;
+}
+
+// Value of an optional integer parameter, 0 if the block does not have it
+static unsigned int optionalIntParam(SimStruct *S, int idx)
+{
+    if (!hasParam(S, idx)) {
+        return 0;
+    }
+    double *v = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,idx)));
+    return static_cast<unsigned int>(*v);
+}
+
+// 0 (request/reply) unless streaming is enabled by the optional parameter
+static unsigned int ack_interval(SimStruct *S)
+{
+    return optionalIntParam(S, ACK_INTERVAL_P);
+}
+
+// 0 (dense) unless delta coding is enabled by the optional parameter
+static unsigned int keyframe_interval(SimStruct *S)
+{
+    return optionalIntParam(S, KEYFRAME_INTERVAL_P);
+}
+
+// 0 (a connection of the block's own) unless the optional parameter gives
+// the block a channel of the connection shared with other blocks
+static unsigned int channel(SimStruct *S)
+{
+    return optionalIntParam(S, CHANNEL_P);
+}
+
+// Samples per message, 1 unless frames are enabled by the optional parameter
+static unsigned int frame_size(SimStruct *S)
+{
+    return std::max(1u, optionalIntParam(S, FRAME_SIZE_P));
+}
+
+// File the sent messages are recorded to, none unless the optional
+// parameter names one
+static std::string record_path(SimStruct *S)
+{
+    if (!hasParam(S, RECORD_P)) {
+        return std::string();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,RECORD_P)), Mx_Deleter);
+    return str.get();
+}
+
+// Log level named by the optional parameter, the one of the environment
+// variable if the block does not have it or it is empty
+static LogLevel log_level(SimStruct *S)
+{
+    if (!hasParam(S, LOG_LEVEL_P) || !mxIsChar(ssGetSFcnParam(S,LOG_LEVEL_P))) {
+        return AsyncLog::envLevel();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,LOG_LEVEL_P)), Mx_Deleter);
+    return AsyncLog::parseLevel(str.get(), AsyncLog::envLevel());
+}
+
+static bool isLogLevelParam(const mxArray *p)
+{
+    if (!mxIsChar(p)) {
+        return false;
+    }
+    mxCharUnqiuePtr str(mxArrayToString(p), Mx_Deleter);
+    return AsyncLog::isLevelName(str.get());
+}
+
 #define MDL_CHECK_PARAMETERS
 #if defined(MDL_CHECK_PARAMETERS) && defined(MATLAB_MEX_FILE)
 /* Function: mdlCheckParameters =============================================
@@ -53,9 +172,9 @@ static void mdlCheckParameters(SimStruct *S)
         return;
     }
     
-    bool isValid = isPositiveRealDoubleParam(ssGetSFcnParam(S,DATA_WIDTH_P));
+    bool isValid = isPositiveIntVectorParam(ssGetSFcnParam(S,DATA_WIDTH_P));
     if (!isValid) {
-        ssSetErrorStatus(S,"Data width parameter must be a positive scalar.");
+        ssSetErrorStatus(S,"Data width parameter must be a positive integer, or a vector of them with one element per input port.");
         return;
     }
 
@@ -71,6 +190,36 @@ static void mdlCheckParameters(SimStruct *S)
         return;
     }
 
+    if (hasParam(S, ACK_INTERVAL_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,ACK_INTERVAL_P))) {
+        ssSetErrorStatus(S,"Acknowledgement interval parameter must be a non-negative integer, 0 to wait for a reply every step.");
+        return;
+    }
+
+    if (hasParam(S, KEYFRAME_INTERVAL_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,KEYFRAME_INTERVAL_P))) {
+        ssSetErrorStatus(S,"Keyframe interval parameter must be a non-negative integer, 0 to send all data every step.");
+        return;
+    }
+
+    if (hasParam(S, LOG_LEVEL_P) && !isLogLevelParam(ssGetSFcnParam(S,LOG_LEVEL_P))) {
+        ssSetErrorStatus(S,"Log level parameter must be one of 'off', 'error', 'warn', 'info', 'debug' and 'trace', or '' for the level of the " LOG_LEVEL_ENV " environment variable.");
+        return;
+    }
+
+    if (hasParam(S, CHANNEL_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,CHANNEL_P))) {
+        ssSetErrorStatus(S,"Channel parameter must be a non-negative integer, 0 for a connection of the block's own.");
+        return;
+    }
+
+    if (hasParam(S, FRAME_SIZE_P) && !isNonNegativeIntParam(ssGetSFcnParam(S,FRAME_SIZE_P))) {
+        ssSetErrorStatus(S,"Frame size parameter must be a non-negative integer, 0 or 1 to send every sample on its own.");
+        return;
+    }
+
+    if (hasParam(S, RECORD_P) && !mxIsChar(ssGetSFcnParam(S,RECORD_P))) {
+        ssSetErrorStatus(S,"Record file parameter must be a char array, '' to not record.");
+        return;
+    }
+
     return;
 }
 #endif /* MDL_CHECK_PARAMETERS */
@@ -81,7 +230,8 @@ static void mdlCheckParameters(SimStruct *S)
  */
 static void mdlInitializeSizes(SimStruct *S)
 {    /* Register the number of expected parameters */
-    ssSetNumSFcnParams(S, NUM_PRMS);
+    int_T nPrms = ssGetSFcnParamsCount(S);
+    ssSetNumSFcnParams(S, (nPrms >= NUM_REQ_PRMS && nPrms <= NUM_PRMS) ? nPrms : NUM_PRMS);
 
 #if defined(MATLAB_MEX_FILE)
     if (ssGetNumSFcnParams(S) == ssGetSFcnParamsCount(S)) {
@@ -99,17 +249,40 @@ static void mdlInitializeSizes(SimStruct *S)
     ssSetSFcnParamTunable(S, PORT_NUM_P, false);
     ssSetSFcnParamTunable(S, STEP_SIZE_P, false);
     ssSetSFcnParamTunable(S, TIMEOUT_P, false);
+    if (hasParam(S, ACK_INTERVAL_P)) {
+        ssSetSFcnParamTunable(S, ACK_INTERVAL_P, false);
+    }
+    if (hasParam(S, KEYFRAME_INTERVAL_P)) {
+        ssSetSFcnParamTunable(S, KEYFRAME_INTERVAL_P, false);
+    }
+    if (hasParam(S, LOG_LEVEL_P)) {
+        ssSetSFcnParamTunable(S, LOG_LEVEL_P, false);
+    }
+    if (hasParam(S, CHANNEL_P)) {
+        ssSetSFcnParamTunable(S, CHANNEL_P, false);
+    }
+    if (hasParam(S, FRAME_SIZE_P)) {
+        ssSetSFcnParamTunable(S, FRAME_SIZE_P, false);
+    }
+    if (hasParam(S, RECORD_P)) {
+        ssSetSFcnParamTunable(S, RECORD_P, false);
+    }
     
-    if (!ssSetNumInputPorts(S, 1)) return;
+    const mxArray *dataWidthP = ssGetSFcnParam(S,DATA_WIDTH_P);
+    int_T nPorts = static_cast<int_T>(mxGetNumberOfElements(dataWidthP));
+    double *widths = reinterpret_cast<double *>(mxGetData(dataWidthP));
 
-    double *dataWidthP = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,DATA_WIDTH_P)));
-    
-    ssSetInputPortWidth(S, 0, static_cast<int>(*dataWidthP));
-    ssSetInputPortDataType(S, 0, SS_DOUBLE);
-    ssSetInputPortComplexSignal(S, 0, COMPLEX_NO);
-    ssSetInputPortRequiredContiguous(S, 0, 1);
+    if (!ssSetNumInputPorts(S, nPorts)) return;
+
+    // Data types are inherited and sent without conversion
+    for (int_T k = 0; k < nPorts; k++) {
+        ssSetInputPortWidth(S, k, static_cast<int>(widths[k]));
+        ssSetInputPortDataType(S, k, DYNAMICALLY_TYPED);
+        ssSetInputPortComplexSignal(S, k, COMPLEX_NO);
+        ssSetInputPortRequiredContiguous(S, k, 1);
 
-    ssSetInputPortDirectFeedThrough(S, 0, 1);
+        ssSetInputPortDirectFeedThrough(S, k, 1);
+    }
     
     if (!ssSetNumOutputPorts(S, 0)) return;
     
@@ -119,7 +292,8 @@ static void mdlInitializeSizes(SimStruct *S)
     ssSetSimStateCompliance(S, USE_DEFAULT_SIM_STATE);
     
     ssSetOptions(S,
-                 SS_OPTION_EXCEPTION_FREE_CODE);
+                 SS_OPTION_EXCEPTION_FREE_CODE |
+                 SS_OPTION_USE_TLC_WITH_ACCELERATOR);
     
     ssSetModelReferenceNormalModeSupport(S, MDL_START_AND_MDL_PROCESS_PARAMS_OK);
 }
@@ -133,40 +307,104 @@ static void mdlInitializeSampleTimes(SimStruct *S)
     ssSetModelReferenceSampleTimeDefaultInheritance(S);
 }
 
+#if defined(MATLAB_MEX_FILE)
+#define MDL_SET_INPUT_PORT_DATA_TYPE
+static void mdlSetInputPortDataType(SimStruct *S, int_T port, DTypeId id)
+{
+    if (!isSupportedDataType(id)) {
+        ssSetErrorStatus(S, "Input signals must be double, single, int8, uint8, int16, uint16, int32, uint32 or boolean.");
+        return;
+    }
+    ssSetInputPortDataType(S, port, id);
+}
+
+#define MDL_SET_DEFAULT_PORT_DATA_TYPES
+static void mdlSetDefaultPortDataTypes(SimStruct *S)
+{
+    for (int_T k = 0; k < ssGetNumInputPorts(S); k++) {
+        if (ssGetInputPortDataType(S, k) == DYNAMICALLY_TYPED) {
+            ssSetInputPortDataType(S, k, SS_DOUBLE);
+        }
+    }
+}
+#endif
+
+// PWork 0 holds the connection, PWork 1..n the input signal pointers which
+// are handed to the connection every step
 #define MDL_SET_WORK_WIDTHS
 #if defined(MDL_SET_WORK_WIDTHS) && defined(MATLAB_MEX_FILE)
 static void mdlSetWorkWidths(SimStruct *S)
 {
-    ssSetNumPWork(S, 1);
+    ssSetNumPWork(S, 1+ssGetNumInputPorts(S));
 }
 #endif // MDL_SET_WORK_WIDTHS
 
 #define GET_ZM_PTR(S) ssGetPWorkValue(S,0)
 
-auto Mx_Deleter = [](char *m) { mxFree(m); };
-using mxCharUnqiuePtr = std::unique_ptr<char, decltype(Mx_Deleter)>;
-
-static std::string host_and_port_addr(const SimStruct *S)
+static std::string host_param(const SimStruct *S)
 {
     mxCharUnqiuePtr hostStr(mxArrayToString(ssGetSFcnParam(S,HOST_NAME_P)), Mx_Deleter);
-    std::string serverHostStr = hostStr.get();
+    return hostStr.get();
+}
 
+static std::string host_and_port_addr(const SimStruct *S)
+{
     mxCharUnqiuePtr portStr(mxArrayToString(ssGetSFcnParam(S,PORT_NUM_P)), Mx_Deleter);
-    std::string serverPortStr = portStr.get();
-    
-    std::string connStr = "tcp://";
-    connStr += serverHostStr;
-    connStr += ":";
-    connStr += serverPortStr;
-
-    return connStr;
+    return transmit_address(host_param(S), portStr.get());
 }
 
 #define MDL_SETUP_RUNTIME_RESOURCES
 void mdlSetupRuntimeResources(SimStruct *S)
 {
-    auto connStr = host_and_port_addr(S);
-    ssSetPWorkValue(S, 0, setupruntimeresources_wrapper(connStr));
+    // Messages of the steps are printed by the logger's thread from here on.
+    // The cleanup stops it also if another block runs it at another level.
+    try {
+        AsyncLog::instance().start(log_level(S));
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
+
+    std::vector<PortSpec> ports;
+    for (int_T k = 0; k < ssGetNumInputPorts(S); k++) {
+        ports.push_back({static_cast<DataType>(ssGetInputPortDataType(S,k)), ssGetInputPortWidth(S,k)});
+    }
+    try {
+        auto connStr = host_and_port_addr(S);
+        try {
+            ssSetPWorkValue(S, 0, setupruntimeresources_wrapper(connStr, ack_interval(S), keyframe_interval(S), ports, channel(S), frame_size(S), record_path(S)));
+        } catch (...) {
+            release_transmit_address(host_param(S));
+            throw;
+        }
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
+}
+
+#define MDL_START /* to indicate that the S-function has mdlStart method */
+
+/* mdlStart ==========================================================
+ * Abstract:
+ *   Handshake with the receiver before the first step. This is not done in
+ *   mdlSetupRuntimeResources: a model with both transmit and receive blocks
+ *   must finish the setup of its receive blocks, which answer handshakes
+ *   from then on, before waiting for a peer model which may do the same.
+ */
+static void mdlStart(SimStruct *S)
+{
+    double *timeout_ptr = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,TIMEOUT_P)));
+
+    try {
+        start_wrapper(GET_ZM_PTR(S), *timeout_ptr*1000);
+    } catch (std::exception &e) {
+        static std::string errstr(e.what());
+        ssSetErrorStatus(S, errstr.c_str());
+        return;
+    }
 }
 
 /* Function: mdlOutputs =======================================================
@@ -175,11 +413,14 @@ void mdlSetupRuntimeResources(SimStruct *S)
  */
 static void mdlOutputs(SimStruct *S, int_T tid)
 {
-    const double *u_ptr = reinterpret_cast<const double *>(ssGetInputPortSignal(S,0));
     double *timeout_ptr = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,TIMEOUT_P)));
+
+    for (int_T k = 0; k < ssGetNumInputPorts(S); k++) {
+        ssSetPWorkValue(S, 1+k, const_cast<void *>(ssGetInputPortSignal(S,k)));
+    }
     
     try {
-        transmit_outputs_wrapper(GET_ZM_PTR(S), u_ptr, ssGetInputPortWidth(S,0), *timeout_ptr*1000);
+        transmit_outputs_wrapper(GET_ZM_PTR(S), ssGetPWork(S)+1, ssGetT(S), *timeout_ptr*1000);
     } catch (std::exception &e) {
         static std::string errstr(e.what());
         ssSetErrorStatus(S, errstr.c_str());
@@ -190,14 +431,18 @@ static void mdlOutputs(SimStruct *S, int_T tid)
 #define MDL_CLEANUP_RUNTIME_RESOURCES
 static void mdlCleanupRuntimeResources(SimStruct *S)
 {
-    std::cout << "Closing connection" << std::endl;
+    SFUN_LOG(LEVEL_INFO, "Closing connection");
     try {
         cleanupruntimeresouces_wrapper(GET_ZM_PTR(S));
     } catch (std::exception &e) {
         static std::string errstr(e.what());
         ssSetErrorStatus(S, errstr.c_str());
-        return;
     }
+    // Without a connection setup failed and gave the port back already
+    if (GET_ZM_PTR(S)) {
+        release_transmit_address(host_param(S));
+    }
+    AsyncLog::instance().stop();
 }
 
 /* Function: mdlTerminate =====================================================
@@ -206,7 +451,47 @@ static void mdlCleanupRuntimeResources(SimStruct *S)
  */
 static void mdlTerminate(SimStruct *S)
 {
+    terminate_wrapper(GET_ZM_PTR(S));
+}
+
+// Char parameter as the TLC file puts it into a C string literal. Paths
+// keep working with forward slashes, which need no escaping.
+static std::string rtw_string(SimStruct *S, int idx)
+{
+    if (!hasParam(S, idx) || !mxIsChar(ssGetSFcnParam(S,idx))) {
+        return std::string();
+    }
+    mxCharUnqiuePtr str(mxArrayToString(ssGetSFcnParam(S,idx)), Mx_Deleter);
+    std::string s = str.get();
+    std::replace(s.begin(), s.end(), '\\', '/');
+    return s;
+}
+
+#define MDL_RTW
+#if defined(MDL_RTW) && defined(MATLAB_MEX_FILE)
+/* Function: mdlRTW ===========================================================
+ * Abstract:
+ *    Parameters of the block for sfcn_transmit.tlc, which calls the C
+ *    interface of comm_runtime.h in generated code and the accelerator modes.
+ */
+static void mdlRTW(SimStruct *S)
+{
+    double *timeout_ptr = reinterpret_cast<double *>(mxGetData(ssGetSFcnParam(S,TIMEOUT_P)));
+
+    if (!ssWriteRTWParamSettings(S, 9,
+                                 SSWRITE_VALUE_QSTR, "Host", rtw_string(S, HOST_NAME_P).c_str(),
+                                 SSWRITE_VALUE_QSTR, "Port", rtw_string(S, PORT_NUM_P).c_str(),
+                                 SSWRITE_VALUE_NUM,  "Timeout", *timeout_ptr,
+                                 SSWRITE_VALUE_NUM,  "AckInterval", static_cast<real_T>(ack_interval(S)),
+                                 SSWRITE_VALUE_NUM,  "KeyframeInterval", static_cast<real_T>(keyframe_interval(S)),
+                                 SSWRITE_VALUE_NUM,  "Channel", static_cast<real_T>(channel(S)),
+                                 SSWRITE_VALUE_NUM,  "FrameSize", static_cast<real_T>(frame_size(S)),
+                                 SSWRITE_VALUE_QSTR, "RecordFile", rtw_string(S, RECORD_P).c_str(),
+                                 SSWRITE_VALUE_QSTR, "LogLevel", rtw_string(S, LOG_LEVEL_P).c_str())) {
+        return; /* An error occurred, which will be reported by Simulink */
+    }
 }
+#endif /* MDL_RTW */
 
 #ifdef  MATLAB_MEX_FILE    /* Is this file being compiled as a MEX-file? */
 #include "simulink.c"      /* MEX-file interface mechanism */
@@ -0,0 +1,505 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <stdexcept>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#define SHM_HAVE_FUTEX
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "shm_ring.hpp"
+
+#define SHM_MAGIC          0x53484d52u // "SHMR", written last when the segment is ready
+#define SHM_VERSION        1
+#define SHM_DEFAULT_SLOTS  64
+#define SHM_SPIN_COUNT     4000  // polls before sleeping when wait=futex
+#define SHM_CACHE_LINE     64
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared memory rings need lock-free 32 bit atomics");
+
+namespace {
+
+// Index of a ring, incremented by one side and waited on by the other.
+// Counters run freely and wrap, the slot is index % num_slots.
+struct alignas(SHM_CACHE_LINE) RingIndex {
+    std::atomic<uint32_t> value;
+    std::atomic<uint32_t> waiters;  // peers sleeping in the kernel on value
+};
+
+struct RingCtl {
+    RingIndex head;  // next slot to write, advanced by the producer
+    RingIndex tail;  // next slot to read, advanced by the consumer
+};
+
+struct ShmAddress {
+    std::string  name;
+    bool         spin;
+    unsigned int slots;
+};
+
+inline void cpu_relax()
+{
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Sleep until idx changes from seen or the wait time passes
+void block_on(RingIndex &idx, const uint32_t seen, const std::chrono::nanoseconds wait)
+{
+#if defined(SHM_HAVE_FUTEX)
+    idx.waiters.fetch_add(1);
+    if (idx.value.load() == seen) {
+        timespec ts;
+        ts.tv_sec  = static_cast<time_t>(wait.count()/1000000000);
+        ts.tv_nsec = static_cast<long>(wait.count()%1000000000);
+        // Not FUTEX_PRIVATE, the peer is another process
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&idx.value), FUTEX_WAIT, seen, &ts, nullptr, 0);
+    }
+    idx.waiters.fetch_sub(1);
+#else
+    (void)idx; (void)seen; (void)wait;
+    std::this_thread::yield();
+#endif
+}
+
+void wake(RingIndex &idx)
+{
+#if defined(SHM_HAVE_FUTEX)
+    if (idx.waiters.load() > 0) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&idx.value), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+#else
+    (void)idx;
+#endif
+}
+
+// Wait until idx changes from seen, negative timeout waits forever as zmq::poll
+bool wait_for_change(RingIndex &idx, const uint32_t seen, const bool spin, const int timeout)
+{
+    // Spinning only helps if the peer runs on another core
+    static const int spin_count = std::thread::hardware_concurrency() > 1 ? SHM_SPIN_COUNT : 0;
+    for (int k = 0; k < spin_count; k++) {
+        if (idx.value.load(std::memory_order_acquire) != seen) return true;
+        cpu_relax();
+    }
+
+    using clock = std::chrono::steady_clock;
+    const auto deadline = clock::now() + std::chrono::milliseconds(timeout);
+    while (idx.value.load(std::memory_order_acquire) == seen) {
+        auto now = clock::now();
+        if (timeout >= 0 && now >= deadline) return false;
+
+        if (spin) {
+            // Keep polling, but let the peer run if both share a core
+            std::this_thread::yield();
+        } else {
+            auto wait = (timeout >= 0) ? deadline-now : std::chrono::milliseconds(100);
+            block_on(idx, seen, std::chrono::duration_cast<std::chrono::nanoseconds>(wait));
+        }
+    }
+    return true;
+}
+
+int64_t current_pid()
+{
+#if defined(_WIN32)
+    return static_cast<int64_t>(GetCurrentProcessId());
+#else
+    return static_cast<int64_t>(getpid());
+#endif
+}
+
+bool process_alive(const int64_t pid)
+{
+#if defined(_WIN32)
+    // Named mappings go away with their last handle, so they are never stale
+    (void)pid;
+    return true;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+bool is_power_of_two(unsigned long v)
+{
+    return v > 0 && (v & (v-1)) == 0;
+}
+
+// shm://<name>:<port>[?wait=futex|spin][&slots=N]
+ShmAddress parse_shm_address(const std::string &addr)
+{
+    const std::string scheme = "shm://";
+    if (addr.compare(0, scheme.size(), scheme) != 0) {
+        throw std::runtime_error("Shared memory address must start with shm://");
+    }
+
+    std::string rest = addr.substr(scheme.size());
+    std::string query;
+    auto q = rest.find('?');
+    if (q != std::string::npos) {
+        query = rest.substr(q+1);
+        rest  = rest.substr(0, q);
+    }
+
+    for (char c : rest) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' && c != ':') {
+            throw std::runtime_error("Shared memory name may only contain letters, digits, '_' and '-'.");
+        }
+    }
+    if (rest.empty() || rest[0] == ':') {
+        throw std::runtime_error("Shared memory address has no name.");
+    }
+    std::replace(rest.begin(), rest.end(), ':', '_');
+
+    ShmAddress a;
+#if defined(_WIN32)
+    a.name = "Local\\" + rest;
+#else
+    a.name = "/" + rest;
+#endif
+    a.spin  = false;
+    a.slots = SHM_DEFAULT_SLOTS;
+
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        std::string opt = query.substr(0, amp);
+        query = (amp == std::string::npos) ? "" : query.substr(amp+1);
+
+        if (opt == "wait=spin") {
+            a.spin = true;
+        } else if (opt == "wait=futex") {
+            a.spin = false;
+        } else if (opt.compare(0, 6, "slots=") == 0) {
+            unsigned long n = strtoul(opt.c_str()+6, nullptr, 10);
+            if (!is_power_of_two(n) || n > (1u << 20)) {
+                throw std::runtime_error("Shared memory slots option must be a power of two.");
+            }
+            a.slots = static_cast<unsigned int>(n);
+        } else {
+            throw std::runtime_error("Unknown shared memory address option: " + opt);
+        }
+    }
+    return a;
+}
+
+size_t slot_stride(const size_t slot_size)
+{
+    size_t s = sizeof(uint64_t)+slot_size;
+    return (s+SHM_CACHE_LINE-1)/SHM_CACHE_LINE*SHM_CACHE_LINE;
+}
+
+} // anonymous namespace
+
+// Layout of the segment, followed by the slots of ring 0 and then ring 1.
+// Each slot is [uint64 size][message], padded to a cache line.
+struct ShmChannel::Segment {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    int64_t  creator;   // process id of the receiver
+    RingCtl  ring[2];   // 0: transmitter to receiver, 1: receiver to transmitter
+
+    static size_t total_size(const size_t slot_size, const size_t num_slots)
+    {
+        return sizeof(Segment)+2*num_slots*slot_stride(slot_size);
+    }
+
+    char *slot(const int r, const uint32_t idx)
+    {
+        const size_t stride = slot_stride(slot_size);
+        char *base = reinterpret_cast<char *>(this)+sizeof(Segment);
+        return base+(static_cast<size_t>(r)*num_slots+(idx & (num_slots-1)))*stride;
+    }
+};
+
+// class MappedRegion owns a named shared memory mapping
+class ShmChannel::MappedRegion {
+  public:
+    MappedRegion() : addr(nullptr), len(0), owner(false)
+#if defined(_WIN32)
+        , mapping(NULL)
+#endif
+    {
+    }
+
+    ~MappedRegion()
+    {
+#if defined(_WIN32)
+        if (addr) UnmapViewOfFile(addr);
+        if (mapping) CloseHandle(mapping);
+#else
+        if (addr) munmap(addr, len);
+        if (owner) shm_unlink(name.c_str());
+#endif
+    }
+
+    // Create the segment, zero filled
+    void create(const std::string &n, const size_t size)
+    {
+        name = n;
+#if defined(_WIN32)
+        // A mapping still held open by a transmitter from an earlier run is
+        // reused, it goes away with its last handle
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                     static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                     static_cast<DWORD>(size & 0xffffffffu), name.c_str());
+        if (mapping == NULL) {
+            throw std::runtime_error("Could not create shared memory " + name);
+        }
+        addr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map shared memory " + name);
+        }
+        len = size;
+        std::memset(addr, 0, size);
+#else
+        // A segment left over by an earlier run is replaced, a transmitter
+        // still attached to it keeps the old memory
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create shared memory " + name + ": " + strerror(errno));
+        }
+        owner = true;
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not size shared memory " + name + ": " + strerror(errno));
+        }
+        map(fd, size);
+#endif
+    }
+
+    // Attach to an existing segment, false if it does not exist yet
+    bool open(const std::string &n)
+    {
+        name = n;
+#if defined(_WIN32)
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        if (mapping == NULL) {
+            return false;
+        }
+        addr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (addr == NULL) {
+            throw std::runtime_error("Could not map shared memory " + name);
+        }
+        MEMORY_BASIC_INFORMATION info;
+        VirtualQuery(addr, &info, sizeof(info));
+        len = info.RegionSize;
+        return true;
+#else
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Segment))) {
+            // Created but not sized yet
+            close(fd);
+            return false;
+        }
+        map(fd, static_cast<size_t>(st.st_size));
+        return true;
+#endif
+    }
+
+    void  *data() const { return addr; }
+    size_t size() const { return len; }
+
+  private:
+    std::string name;
+    void  *addr;
+    size_t len;
+    bool   owner;
+#if defined(_WIN32)
+    HANDLE mapping;
+#else
+    void map(int fd, const size_t size)
+    {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Could not map shared memory " + name + ": " + strerror(errno));
+        }
+        addr = p;
+        len  = size;
+    }
+#endif
+};
+
+bool is_shm_address(const std::string &addr)
+{
+    return addr.compare(0, 6, "shm://") == 0;
+}
+
+std::string shm_address(const std::string &host, const std::string &port)
+{
+    auto q = host.find('?');
+    if (q == std::string::npos) {
+        return host + ":" + port;
+    }
+    return host.substr(0, q) + ":" + port + host.substr(q);
+}
+
+ShmChannel::ShmChannel(std::unique_ptr<MappedRegion> r, const bool is_receiver, const bool spin_wait) :
+    region(std::move(r)), tx(is_receiver ? 1 : 0), rx(is_receiver ? 0 : 1), spin(spin_wait), owner(is_receiver)
+{
+    seg = reinterpret_cast<Segment *>(region->data());
+}
+
+ShmChannel::~ShmChannel()
+{
+    if (owner) {
+        // Tell transmitters still attached that the receiver is gone
+        seg->magic.store(0, std::memory_order_release);
+    }
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::create(const std::string &addr, const size_t max_msg_size)
+{
+    ShmAddress a = parse_shm_address(addr);
+
+    std::unique_ptr<MappedRegion> r(new MappedRegion());
+    r->create(a.name, Segment::total_size(max_msg_size, a.slots));
+
+    Segment *seg = reinterpret_cast<Segment *>(r->data());
+    seg->magic.store(0, std::memory_order_relaxed);
+    seg->version   = SHM_VERSION;
+    seg->slot_size = static_cast<uint32_t>(max_msg_size);
+    seg->num_slots = a.slots;
+    seg->creator   = current_pid();
+    for (auto &ring : seg->ring) {
+        ring.head.value.store(0);
+        ring.head.waiters.store(0);
+        ring.tail.value.store(0);
+        ring.tail.waiters.store(0);
+    }
+    // Publish the segment once it is fully set up
+    seg->magic.store(SHM_MAGIC, std::memory_order_release);
+
+    return std::unique_ptr<ShmChannel>(new ShmChannel(std::move(r), true, a.spin));
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::open(const std::string &addr, const size_t max_msg_size, const int timeout)
+{
+    ShmAddress a = parse_shm_address(addr);
+
+    using clock = std::chrono::steady_clock;
+    const auto deadline = clock::now() + std::chrono::milliseconds(timeout);
+    std::unique_ptr<MappedRegion> r;
+    Segment *seg = nullptr;
+
+    while (true) {
+        if (!r) {
+            std::unique_ptr<MappedRegion> attempt(new MappedRegion());
+            if (attempt->open(a.name)) {
+                r = std::move(attempt);
+                seg = reinterpret_cast<Segment *>(r->data());
+            }
+        }
+        if (seg && seg->magic.load(std::memory_order_acquire) == SHM_MAGIC) {
+            if (process_alive(seg->creator)) {
+                break;
+            }
+            // Left over by a receiver that was killed, wait for the new one
+            r.reset();
+            seg = nullptr;
+        }
+        if (timeout >= 0 && clock::now() >= deadline) {
+            throw std::runtime_error("Connection timed out. Please ensure that the receiver side is running and uses the same shared memory address " + addr + ".");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (seg->version != SHM_VERSION) {
+        throw std::runtime_error("Shared memory segment was created by an incompatible receiver.");
+    }
+    if (seg->slot_size < max_msg_size ||
+        r->size() < Segment::total_size(seg->slot_size, seg->num_slots)) {
+        throw std::runtime_error("Data width of the receiver does not match the data width of the transmitter.");
+    }
+
+    return std::unique_ptr<ShmChannel>(new ShmChannel(std::move(r), false, a.spin));
+}
+
+bool ShmChannel::send(const char *buf, const size_t size, const int timeout)
+{
+    if (size > seg->slot_size) {
+        throw std::runtime_error("Message does not fit into a shared memory slot.");
+    }
+
+    RingCtl &ring = seg->ring[tx];
+    const uint32_t head = ring.head.value.load(std::memory_order_relaxed);
+    uint32_t tail = ring.tail.value.load(std::memory_order_acquire);
+    while (head-tail >= seg->num_slots) {
+        if (!wait_for_change(ring.tail, tail, spin, timeout)) {
+            return false;
+        }
+        tail = ring.tail.value.load(std::memory_order_acquire);
+    }
+
+    char *slot = seg->slot(tx, head);
+    uint64_t len = size;
+    std::memcpy(slot, &len, sizeof(len));
+    std::memcpy(slot+sizeof(len), buf, size);
+
+    // Sequentially consistent so that the waiters check in wake cannot be
+    // reordered before it
+    ring.head.value.store(head+1);
+    wake(ring.head);
+    return true;
+}
+
+bool ShmChannel::recv(char *buf, const size_t capacity, size_t &size, const int timeout)
+{
+    RingCtl &ring = seg->ring[rx];
+    const uint32_t tail = ring.tail.value.load(std::memory_order_relaxed);
+    if (ring.head.value.load(std::memory_order_acquire) == tail) {
+        if (!wait_for_change(ring.head, tail, spin, timeout)) {
+            return false;
+        }
+    }
+
+    const char *slot = seg->slot(rx, tail);
+    uint64_t len;
+    std::memcpy(&len, slot, sizeof(len));
+    if (len > capacity) {
+        throw std::runtime_error("Received a message of unexpected size");
+    }
+    std::memcpy(buf, slot+sizeof(len), static_cast<size_t>(len));
+    size = static_cast<size_t>(len);
+
+    ring.tail.value.store(tail+1);
+    wake(ring.tail);
+    return true;
+}
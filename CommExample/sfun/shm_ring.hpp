@@ -0,0 +1,61 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <string>
+#include <memory>
+
+// Same-host transport for the Comm blocks. Transmitter and receiver share a
+// memory segment holding two single-producer single-consumer rings, one for
+// the data and one for the replies, so that both request/reply and streaming
+// work as with the zmq sockets.
+//
+// Address format: shm://<name>:<port>[?wait=futex|spin][&slots=N]
+//   wait=futex  spin briefly, then sleep in the kernel until the peer writes
+//               (default; platforms without futex yield instead of sleeping)
+//   wait=spin   busy-wait, lowest latency but keeps a core busy
+//   slots=N     messages per ring, a power of two (receiver only, default 64)
+
+// True if the address selects the shared memory transport
+bool is_shm_address(const std::string &addr);
+
+// Build the address from the block's host and port parameters, where the
+// host parameter is shm://<name> followed by the options
+std::string shm_address(const std::string &host, const std::string &port);
+
+class ShmChannel {
+  public:
+    // Receiver side: create the segment, replacing one left over by an
+    // earlier run. Messages may be up to max_msg_size bytes.
+    static std::unique_ptr<ShmChannel> create(const std::string &addr, const size_t max_msg_size);
+
+    // Transmitter side: attach to the receiver's segment, waiting up to
+    // timeout msecs for the receiver to create it. Its messages must fit.
+    static std::unique_ptr<ShmChannel> open(const std::string &addr, const size_t max_msg_size, const int timeout);
+
+    ~ShmChannel();
+
+    // Copy a message into the outgoing ring. Returns false if the ring stays
+    // full for timeout msecs.
+    bool send(const char *buf, const size_t size, const int timeout);
+
+    // Copy the next incoming message into buf. Returns false if none arrives
+    // within timeout msecs.
+    bool recv(char *buf, const size_t capacity, size_t &size, const int timeout);
+
+  private:
+    struct Segment;
+    class MappedRegion;
+
+    ShmChannel(std::unique_ptr<MappedRegion> r, const bool is_receiver, const bool spin_wait);
+
+    std::unique_ptr<MappedRegion> region;
+    Segment *seg;
+    int    tx;          // ring this side writes
+    int    rx;          // ring this side reads
+    bool   spin;
+    bool   owner;
+};
+
+#endif // SHM_RING_HPP
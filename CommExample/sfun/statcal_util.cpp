@@ -2,40 +2,404 @@
 
 #include <string.h>
 #include <vector>
-#include <utility>
-#include <iostream>
+#include <string>
 #include <cstring>
-#include <tuple>
+#include <stdexcept>
 #include "statcal_util.hpp"
 
-// [int type][int len][double][double]...[double]
+#define HEADER_SIZE    24
+#define PORT_DESC_SIZE 8
+#define DELTA_DESC_SIZE 8
 
-std::pair<MsgType,int> decode_header(const char *str)
+namespace {
+
+template <typename T>
+void put(char *buf, const size_t offset, const T value)
+{
+    std::memcpy(buf+offset, &value, sizeof(T));
+}
+
+template <typename T>
+T get(const char *buf, const size_t offset)
+{
+    T value;
+    std::memcpy(&value, buf+offset, sizeof(T));
+    return value;
+}
+
+// Header and port descriptors, returns the offset of the port data
+size_t put_header(const MsgType type, const unsigned int flags, const uint64_t seq, const double time,
+                  const std::vector<PortSpec> & ports, char *buf)
+{
+    put<uint16_t>(buf, 0, PROTOCOL_MAGIC);
+    put<uint8_t>(buf, 2, PROTOCOL_VERSION);
+    put<uint8_t>(buf, 3, static_cast<uint8_t>(type));
+    put<uint16_t>(buf, 4, static_cast<uint16_t>(ports.size()));
+    put<uint16_t>(buf, 6, static_cast<uint16_t>(flags));
+    put<uint64_t>(buf, 8, seq);
+    put<double>(buf, 16, time);
+
+    size_t offset = HEADER_SIZE;
+    for (auto &p : ports) {
+        put<uint32_t>(buf, offset, 0);
+        put<uint8_t>(buf, offset, static_cast<uint8_t>(p.type));
+        put<uint32_t>(buf, offset+4, static_cast<uint32_t>(p.width));
+        offset += PORT_DESC_SIZE;
+    }
+    return offset;
+}
+
+// Check the port descriptors, returns the offset of the port data
+size_t check_ports(const MsgHeader & hdr, const std::vector<PortSpec> & ports,
+                   const char *buf, const size_t size)
+{
+    if (hdr.num_ports != ports.size()) {
+        throw std::runtime_error("Number of ports of the transmitter does not match the number of ports of the receiver.");
+    }
+    if (size < HEADER_SIZE+PORT_DESC_SIZE*ports.size()) {
+        throw std::runtime_error("Received a message of unexpected size.");
+    }
+
+    size_t offset = HEADER_SIZE;
+    for (auto &p : ports) {
+        if (get<uint8_t>(buf, offset) != p.type || get<uint32_t>(buf, offset+4) != static_cast<uint32_t>(p.width)) {
+            throw std::runtime_error("Data type or width of a transmitter port does not match the receiver port.");
+        }
+        offset += PORT_DESC_SIZE;
+    }
+    return offset;
+}
+
+// Indices of the elements of cur which differ bit-wise from ref
+template <typename T>
+uint32_t find_changes(const char *cur, const char *ref, const int width, uint32_t *changed)
+{
+    uint32_t n = 0;
+    for (int k = 0; k < width; k++) {
+        T a, b;
+        std::memcpy(&a, cur+k*sizeof(T), sizeof(T));
+        std::memcpy(&b, ref+k*sizeof(T), sizeof(T));
+        if (a != b) {
+            changed[n++] = static_cast<uint32_t>(k);
+        }
+    }
+    return n;
+}
+
+uint32_t find_changes(const size_t elem_size, const char *cur, const char *ref, const int width, uint32_t *changed)
+{
+    switch (elem_size) {
+      case 1: return find_changes<uint8_t>(cur, ref, width, changed);
+      case 2: return find_changes<uint16_t>(cur, ref, width, changed);
+      case 4: return find_changes<uint32_t>(cur, ref, width, changed);
+      default: return find_changes<uint64_t>(cur, ref, width, changed);
+    }
+}
+
+[[noreturn]] void throw_bad_delta()
 {
-    MsgType type;
-    int len;
-    std::memcpy(&type, str, sizeof(int));
-    std::memcpy(&len, str+sizeof(int), sizeof(int));
-    return std::make_pair(type, len);
+    throw std::runtime_error("Received a delta coded message of unexpected size or encoding.");
 }
 
-void encode_data(const MsgType type, const std::vector<double> & data, std::string & ec)
+} // anonymous namespace
+
+size_t dtype_size(const DataType type)
+{
+    switch (type) {
+      case DT_DOUBLE:  return 8;
+      case DT_SINGLE:  return 4;
+      case DT_INT8:    return 1;
+      case DT_UINT8:   return 1;
+      case DT_INT16:   return 2;
+      case DT_UINT16:  return 2;
+      case DT_INT32:   return 4;
+      case DT_UINT32:  return 4;
+      case DT_BOOLEAN: return 1;
+    }
+    return 0;
+}
+
+size_t header_size()
+{
+    return HEADER_SIZE;
+}
+
+size_t encoded_size(const std::vector<PortSpec> & ports, const bool delta)
 {
-    size_t len  = data.size();
-    size_t rlen = sizeof(double)*len;
+    size_t size = HEADER_SIZE;
+    for (auto &p : ports) {
+        size += PORT_DESC_SIZE+(delta ? DELTA_DESC_SIZE : 0)+dtype_size(p.type)*p.width;
+    }
+    return size;
+}
 
-    ec.resize(2*sizeof(int)+rlen, 0);
- 
-    std::memcpy(&ec[0], &type, sizeof(int));
-    std::memcpy(&ec[sizeof(int)], &len, sizeof(int));
-        
-    if (len > 0) {
-        std::memcpy(&ec[2*sizeof(int)], &data[0], sizeof(double)*len);
+size_t data_size(const std::vector<PortSpec> & ports)
+{
+    size_t size = 0;
+    for (auto &p : ports) {
+        size += dtype_size(p.type)*p.width;
     }
+    return size;
 }
 
-void decode_data(const int len, const char *str, std::vector<double> & data)
+int max_width(const std::vector<PortSpec> & ports)
 {
-    data.resize(len, 0);
-    std::memcpy(&data[0], str+2*sizeof(int), len*sizeof(double)); 
+    int w = 0;
+    for (auto &p : ports) {
+        if (p.width > w) w = p.width;
+    }
+    return w;
+}
+
+size_t encode_message(const MsgType type, const uint64_t seq, const double time,
+                      const std::vector<PortSpec> & ports, const void *const *data, char *buf)
+{
+    size_t offset = put_header(type, 0, seq, time, ports, buf);
+
+    for (size_t k = 0; k < ports.size(); k++) {
+        size_t n = dtype_size(ports[k].type)*ports[k].width;
+        if (n > 0) {
+            std::memcpy(buf+offset, data[k], n);
+        }
+        offset += n;
+    }
+    return offset;
+}
+
+size_t encode_delta_message(const MsgType type, const uint64_t seq, const double time,
+                            const std::vector<PortSpec> & ports, const void *const *data,
+                            const bool keyframe, char *ref, uint32_t *changed, char *buf)
+{
+    size_t offset = put_header(type, MSG_DELTA, seq, time, ports, buf);
+
+    for (size_t k = 0; k < ports.size(); k++) {
+        const size_t e = dtype_size(ports[k].type);
+        const int    w = ports[k].width;
+        const char  *cur = reinterpret_cast<const char *>(data[k]);
+
+        uint32_t n = 0;
+        DeltaEncoding enc = DELTA_DENSE;
+        if (!keyframe) {
+            n = find_changes(e, cur, ref, w, changed);
+
+            const size_t dense  = e*w;
+            const size_t sparse = n*(sizeof(uint32_t)+e);
+            const size_t bitmap = (w+7)/8+n*e;
+            if (sparse < dense && sparse <= bitmap) {
+                enc = DELTA_SPARSE;
+            } else if (bitmap < dense) {
+                enc = DELTA_BITMAP;
+            }
+        }
+
+        put<uint32_t>(buf, offset, 0);
+        put<uint8_t>(buf, offset, static_cast<uint8_t>(enc));
+        put<uint32_t>(buf, offset+4, enc == DELTA_DENSE ? static_cast<uint32_t>(w) : n);
+        offset += DELTA_DESC_SIZE;
+
+        if (enc == DELTA_DENSE) {
+            std::memcpy(buf+offset, cur, e*w);
+            offset += e*w;
+        } else {
+            if (enc == DELTA_SPARSE) {
+                std::memcpy(buf+offset, changed, n*sizeof(uint32_t));
+                offset += n*sizeof(uint32_t);
+            } else {
+                char *bits = buf+offset;
+                std::memset(bits, 0, (w+7)/8);
+                for (uint32_t j = 0; j < n; j++) {
+                    bits[changed[j]/8] |= static_cast<char>(1 << (changed[j]%8));
+                }
+                offset += (w+7)/8;
+            }
+            for (uint32_t j = 0; j < n; j++) {
+                std::memcpy(buf+offset, cur+changed[j]*e, e);
+                offset += e;
+            }
+        }
+
+        std::memcpy(ref, cur, e*w);
+        ref += e*w;
+    }
+    return offset;
+}
+
+size_t conn_size(const std::vector<PortSpec> & ports)
+{
+    return HEADER_SIZE+PORT_DESC_SIZE*ports.size();
+}
+
+size_t encode_conn_message(const unsigned int features, const std::vector<PortSpec> & ports, char *buf,
+                           const unsigned int frame_size)
+{
+    return put_header(CONN, features, frame_size, 0.0, ports, buf);
+}
+
+unsigned int conn_frame_size(const MsgHeader & hdr)
+{
+    return hdr.seq > 0 ? static_cast<unsigned int>(hdr.seq) : 1;
+}
+
+std::vector<PortSpec> frame_ports(const std::vector<PortSpec> & ports, const unsigned int frame_size)
+{
+    std::vector<PortSpec> fp(ports);
+    for (auto &p : fp) {
+        p.width *= static_cast<int>(frame_size);
+    }
+    return fp;
+}
+
+std::vector<PortSpec> decode_conn_message(const MsgHeader & hdr, const char *buf, const size_t size)
+{
+    if (size < HEADER_SIZE+PORT_DESC_SIZE*hdr.num_ports) {
+        throw std::runtime_error("Received a message of unexpected size.");
+    }
+    std::vector<PortSpec> ports(hdr.num_ports);
+    size_t offset = HEADER_SIZE;
+    for (auto &p : ports) {
+        p.type  = static_cast<DataType>(get<uint8_t>(buf, offset));
+        p.width = static_cast<int>(get<uint32_t>(buf, offset+4));
+        offset += PORT_DESC_SIZE;
+    }
+    return ports;
+}
+
+std::string compare_ports(const std::vector<PortSpec> & tx_ports, const std::vector<PortSpec> & rx_ports)
+{
+    static const char *names[] = {"double", "single", "int8", "uint8", "int16", "uint16", "int32", "uint32", "boolean"};
+    auto name = [](const DataType t) { return t <= DT_BOOLEAN ? names[t] : "unknown"; };
+
+    if (tx_ports.size() != rx_ports.size()) {
+        return "the transmitter has " + std::to_string(tx_ports.size()) + " port(s), the receiver " +
+            std::to_string(rx_ports.size()) + ".";
+    }
+    for (size_t k = 0; k < tx_ports.size(); k++) {
+        if (tx_ports[k].type != rx_ports[k].type || tx_ports[k].width != rx_ports[k].width) {
+            return "port " + std::to_string(k+1) + " of the transmitter is " + std::to_string(tx_ports[k].width) +
+                " " + name(tx_ports[k].type) + ", of the receiver " + std::to_string(rx_ports[k].width) +
+                " " + name(rx_ports[k].type) + ".";
+        }
+    }
+    return "";
+}
+
+void set_message_flags(char *buf, const unsigned int flags)
+{
+    put<uint16_t>(buf, 6, static_cast<uint16_t>(get<uint16_t>(buf, 6) | flags));
+}
+
+MsgHeader decode_header(const char *buf, const size_t size)
+{
+    if (size < HEADER_SIZE) {
+        throw std::runtime_error("Received a message of unexpected size.");
+    }
+    if (get<uint16_t>(buf, 0) != PROTOCOL_MAGIC || get<uint8_t>(buf, 2) != PROTOCOL_VERSION) {
+        throw std::runtime_error("Received a message of another protocol version. Please rebuild the transmit and receive blocks from the same sources.");
+    }
+
+    MsgHeader hdr;
+    hdr.type      = static_cast<MsgType>(get<uint8_t>(buf, 3));
+    hdr.num_ports = get<uint16_t>(buf, 4);
+    hdr.flags     = get<uint16_t>(buf, 6);
+    hdr.seq       = get<uint64_t>(buf, 8);
+    hdr.time      = get<double>(buf, 16);
+    return hdr;
+}
+
+void decode_message(const MsgHeader & hdr, const std::vector<PortSpec> & ports,
+                    const char *buf, const size_t size, void *const *data)
+{
+    size_t offset = check_ports(hdr, ports, buf, size);
+    if (size != encoded_size(ports)) {
+        throw std::runtime_error("Data width of the transmitter does not match the data width of the receiver.");
+    }
+
+    for (size_t k = 0; k < ports.size(); k++) {
+        size_t n = dtype_size(ports[k].type)*ports[k].width;
+        if (n > 0) {
+            std::memcpy(data[k], buf+offset, n);
+        }
+        offset += n;
+    }
+}
+
+void decode_delta_message(const MsgHeader & hdr, const std::vector<PortSpec> & ports,
+                          const char *buf, const size_t size, char *ref, bool & has_ref)
+{
+    size_t offset = check_ports(hdr, ports, buf, size);
+
+    // Check the whole message before ref is touched
+    bool keyframe = true;
+    for (auto &p : ports) {
+        const size_t e = dtype_size(p.type);
+        if (offset+DELTA_DESC_SIZE > size) throw_bad_delta();
+        const uint8_t  enc = get<uint8_t>(buf, offset);
+        const uint32_t n   = get<uint32_t>(buf, offset+4);
+        offset += DELTA_DESC_SIZE;
+
+        size_t len;
+        if (enc == DELTA_DENSE && n == static_cast<uint32_t>(p.width)) {
+            len = e*p.width;
+        } else if (enc == DELTA_SPARSE && n <= static_cast<uint32_t>(p.width)) {
+            len = n*(sizeof(uint32_t)+e);
+            if (offset+len > size) throw_bad_delta();
+            for (uint32_t j = 0; j < n; j++) {
+                if (get<uint32_t>(buf, offset+j*sizeof(uint32_t)) >= static_cast<uint32_t>(p.width)) throw_bad_delta();
+            }
+            keyframe = false;
+        } else if (enc == DELTA_BITMAP && n <= static_cast<uint32_t>(p.width)) {
+            len = (p.width+7)/8+n*e;
+            keyframe = false;
+        } else {
+            throw_bad_delta();
+        }
+        if (offset+len > size) throw_bad_delta();
+        offset += len;
+    }
+    if (offset != size) throw_bad_delta();
+    if (!keyframe && !has_ref) {
+        throw std::runtime_error("Received delta coded data before the first keyframe.");
+    }
+
+    offset = HEADER_SIZE+PORT_DESC_SIZE*ports.size();
+    for (auto &p : ports) {
+        const size_t   e   = dtype_size(p.type);
+        const uint8_t  enc = get<uint8_t>(buf, offset);
+        const uint32_t n   = get<uint32_t>(buf, offset+4);
+        offset += DELTA_DESC_SIZE;
+
+        if (enc == DELTA_DENSE) {
+            std::memcpy(ref, buf+offset, e*p.width);
+            offset += e*p.width;
+        } else if (enc == DELTA_SPARSE) {
+            const char *values = buf+offset+n*sizeof(uint32_t);
+            for (uint32_t j = 0; j < n; j++) {
+                std::memcpy(ref+get<uint32_t>(buf, offset+j*sizeof(uint32_t))*e, values+j*e, e);
+            }
+            offset += n*(sizeof(uint32_t)+e);
+        } else {
+            const char *bits   = buf+offset;
+            const char *values = bits+(p.width+7)/8;
+            uint32_t j = 0;
+            for (int i = 0; i < p.width && j < n; i++) {
+                if (bits[i/8] & (1 << (i%8))) {
+                    std::memcpy(ref+i*e, values+(j++)*e, e);
+                }
+            }
+            offset += (p.width+7)/8+n*e;
+        }
+        ref += e*p.width;
+    }
+    has_ref = true;
+}
+
+void unpack_ports(const std::vector<PortSpec> & ports, const char *packed, void *const *data)
+{
+    for (size_t k = 0; k < ports.size(); k++) {
+        size_t n = dtype_size(ports[k].type)*ports[k].width;
+        if (n > 0) {
+            std::memcpy(data[k], packed, n);
+        }
+        packed += n;
+    }
 }
@@ -1,12 +1,164 @@
 // Copyright 2018 The MathWorks, Inc.
 
+#ifndef COMM_STATCAL_UTIL_HPP
+#define COMM_STATCAL_UTIL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Message layout, all fields little endian as on the host:
+//   header     [uint16 magic][uint8 version][uint8 type][uint16 num_ports][uint16 flags]
+//              [uint64 seq][double time]
+//   per port   [uint8 data type][uint8 reserved[3]][uint32 width]
+//   data       port 0 values, port 1 values, ... packed in their native size
+// Control messages (SHUTDOWN, ACK, PING, BATCH, RESET, replies) have no ports. CONN
+// has the port descriptors without data, the features in place of the flags
+// and the frame size in place of seq.
+//
+// In frame mode a data message carries K consecutive samples: each port is
+// K times as wide and holds the samples one after the other.
+//
+// Blocks multiplexed over one connection send the messages of a step as one
+// batch, a multipart message of a BATCH header numbered by seq, followed by
+// a [uint32 channel] frame and the message frame of each block; see
+// mux_link.hpp.
+//
+// With MSG_DELTA set the data of each port is delta coded against the
+// previous message of the stream and starts with
+//   [uint8 encoding][uint8 reserved[3]][uint32 count]
+//   DELTA_DENSE    all values
+//   DELTA_SPARSE   count uint32 indices, then the count changed values
+//   DELTA_BITMAP   one bit per element, set where it changed, then the values
+
+#define PROTOCOL_MAGIC   0x5a43
+#define PROTOCOL_VERSION 2
+
+#define MSG_DELTA  0x1 // header flag, port data is delta coded
+#define MSG_RESEND 0x2 // header flag, repeat of a request whose reply was lost
+
+// Features, exchanged in the flags of CONN
+#define FEATURE_STREAM 0x1 // streamed data acknowledged every K samples
+#define FEATURE_DELTA  0x2 // delta coded data
+#define FEATURE_RESEND 0x4 // MSG_RESEND copies are answered, not consumed again
+#define FEATURE_FRAME  0x8 // frames of several samples per message
+#define FEATURE_RESET  0x10 // RESET ends a run, the connection is kept for the next
+#define FEATURES_ALL   (FEATURE_STREAM | FEATURE_DELTA | FEATURE_RESEND | FEATURE_FRAME | FEATURE_RESET)
+
+typedef enum {
+    DELTA_DENSE = 0,
+    DELTA_SPARSE,
+    DELTA_BITMAP,
+} DeltaEncoding;
+
 typedef enum {
     CONN = 1,
     SHUTDOWN,
     INP_DATA,
+    STREAM_DATA,  // streamed input data, no reply
+    STREAM_SYNC,  // streamed input data, receiver replies with ACK once consumed
+    ACK,
+    PING,         // answered with PING, warms up the connection
+    BATCH,        // messages of several channels, answered with BATCH
+    RESET,        // end of a transmitter run, e.g. between Fast Restart runs.
+                  // The receiver ends its run too and expects the next one to
+                  // start again at message 1; answered with RESET.
 } MsgType;
 
-std::pair<MsgType,int> decode_header(const char *str);
+// Same values as the Simulink built-in DTypeId, so a port's data type id can
+// be cast directly
+typedef enum {
+    DT_DOUBLE = 0,
+    DT_SINGLE,
+    DT_INT8,
+    DT_UINT8,
+    DT_INT16,
+    DT_UINT16,
+    DT_INT32,
+    DT_UINT32,
+    DT_BOOLEAN,
+} DataType;
+
+struct PortSpec {
+    DataType type;
+    int      width;
+};
+
+struct MsgHeader {
+    MsgType      type;
+    unsigned int num_ports;
+    unsigned int flags;
+    uint64_t     seq;    // data message counter of the transmitter, 0 for control messages
+    double       time;   // simulation time of the transmitter
+};
+
+// Size in bytes of one element, 0 for unsupported types
+size_t dtype_size(const DataType type);
+
+// Size of a control message, and the largest size of a data message carrying
+// the given ports, dense or delta coded
+size_t header_size();
+size_t encoded_size(const std::vector<PortSpec> & ports, const bool delta = false);
+
+// Size of the values of all ports, packed
+size_t data_size(const std::vector<PortSpec> & ports);
+
+// Largest port width
+int max_width(const std::vector<PortSpec> & ports);
+
+// Encode a message into buf, which must hold encoded_size(ports) bytes.
+// data[k] points at the width of ports[k] values. Returns the message size.
+size_t encode_message(const MsgType type, const uint64_t seq, const double time,
+                      const std::vector<PortSpec> & ports, const void *const *data, char *buf);
+
+// Delta code a message against ref, the values of the previous message, which
+// holds data_size(ports) bytes and is updated. Each port is sent dense, as
+// changed indices or as a bitmap, whichever is smallest. A keyframe sends
+// every port dense. changed is scratch space for max_width(ports) indices.
+size_t encode_delta_message(const MsgType type, const uint64_t seq, const double time,
+                            const std::vector<PortSpec> & ports, const void *const *data,
+                            const bool keyframe, char *ref, uint32_t *changed, char *buf);
+
+// Handshake sent by the transmitter before the first sample and answered by
+// the receiver with its own: the ports of one sample, the supported features
+// and the frame size. Size of the message, and encode it into buf, returning
+// its size.
+size_t conn_size(const std::vector<PortSpec> & ports);
+size_t encode_conn_message(const unsigned int features, const std::vector<PortSpec> & ports, char *buf,
+                           const unsigned int frame_size = 1);
+
+// Frame size of a CONN message, 1 if the peer predates frames
+unsigned int conn_frame_size(const MsgHeader & hdr);
+
+// Ports of a message carrying frame_size samples of ports
+std::vector<PortSpec> frame_ports(const std::vector<PortSpec> & ports, const unsigned int frame_size);
+
+// Ports of a CONN message, its features are hdr.flags
+std::vector<PortSpec> decode_conn_message(const MsgHeader & hdr, const char *buf, const size_t size);
+
+// Which ports of the transmitter and the receiver differ, in words, or an
+// empty string if they match
+std::string compare_ports(const std::vector<PortSpec> & tx_ports, const std::vector<PortSpec> & rx_ports);
+
+// Add flags, e.g. MSG_RESEND, to the header of an encoded message
+void set_message_flags(char *buf, const unsigned int flags);
+
+// Decode the header of a message of size bytes. Throws std::runtime_error if
+// it is truncated or was sent with another protocol version.
+MsgHeader decode_header(const char *buf, const size_t size);
+
+// Copy the port data of a message into data[k]. Throws std::runtime_error if
+// the message does not carry exactly the given ports.
+void decode_message(const MsgHeader & hdr, const std::vector<PortSpec> & ports,
+                    const char *buf, const size_t size, void *const *data);
+
+// Apply a delta coded message to ref. has_ref is false until the first
+// keyframe was applied; a delta against a missing reference throws.
+void decode_delta_message(const MsgHeader & hdr, const std::vector<PortSpec> & ports,
+                          const char *buf, const size_t size, char *ref, bool & has_ref);
+
+// Copy packed port values, e.g. ref, to the ports
+void unpack_ports(const std::vector<PortSpec> & ports, const char *packed, void *const *data);
 
-void encode_data(const MsgType type, const std::vector<double> & data, std::string & ec);
-void decode_data(const int len, const char *str, std::vector<double> & data);
+#endif // COMM_STATCAL_UTIL_HPP
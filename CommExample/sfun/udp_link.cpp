@@ -0,0 +1,493 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include "udp_link.hpp"
+#include "async_log.hpp"
+
+#define UDP_MAGIC          0x5544 // "UD"
+#define UDP_VERSION        1
+#define UDP_HEADER_SIZE    28
+#define UDP_IP_OVERHEAD    48     // IPv6 and UDP headers, the larger of IPv4 and IPv6
+#define UDP_DEFAULT_MTU    1500
+#define UDP_MIN_MTU        576
+#define UDP_MAX_DATAGRAM   65507
+#define UDP_CONTROL_COPIES 3      // a control message is sent this many times
+#define UDP_RCVBUF         (4*1024*1024) // bytes queued by the receiver's kernel between steps
+
+namespace {
+
+#if defined(_WIN32)
+typedef SOCKET socket_handle;
+#define INVALID_HANDLE INVALID_SOCKET
+
+int last_error() { return WSAGetLastError(); }
+bool dropped_send(const int err) { return err == WSAEWOULDBLOCK || err == WSAENOBUFS || err == WSAECONNRESET; }
+
+void close_handle(socket_handle fd) { closesocket(fd); }
+
+// Winsock is started once per MEX file and left running
+void init_sockets()
+{
+    static const bool started = []() {
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }();
+    if (!started) {
+        throw std::runtime_error("Cannot start Winsock.");
+    }
+}
+#else
+typedef int socket_handle;
+#define INVALID_HANDLE (-1)
+
+int last_error() { return errno; }
+bool dropped_send(const int err) { return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS || err == ECONNREFUSED; }
+
+void close_handle(socket_handle fd) { close(fd); }
+
+void init_sockets() {}
+#endif
+
+template <typename T>
+void put(char *buf, const size_t offset, const T value)
+{
+    std::memcpy(buf+offset, &value, sizeof(T));
+}
+
+template <typename T>
+T get(const char *buf, const size_t offset)
+{
+    T value;
+    std::memcpy(&value, buf+offset, sizeof(T));
+    return value;
+}
+
+struct UdpAddress {
+    std::string   host;
+    std::string   port;
+    UdpLossPolicy loss;
+    int           wait;
+    unsigned int  mtu;
+};
+
+UdpAddress parse_udp_address(const std::string &addr)
+{
+    const std::string scheme = "udp://";
+    if (addr.compare(0, scheme.size(), scheme) != 0) {
+        throw std::runtime_error("UDP address must start with udp://");
+    }
+
+    std::string rest = addr.substr(scheme.size());
+    std::string query;
+    auto q = rest.find('?');
+    if (q != std::string::npos) {
+        query = rest.substr(q+1);
+        rest  = rest.substr(0, q);
+    }
+
+    UdpAddress a;
+    auto colon = rest.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon+1 == rest.size()) {
+        throw std::runtime_error("UDP address needs a host and a port: " + addr);
+    }
+    a.host = rest.substr(0, colon);
+    a.port = rest.substr(colon+1);
+    if (a.host.size() > 2 && a.host.front() == '[' && a.host.back() == ']') {
+        // IPv6 literal
+        a.host = a.host.substr(1, a.host.size()-2);
+    }
+    a.loss = UDP_LOSS_HOLD;
+    a.wait = -1;
+    a.mtu  = UDP_DEFAULT_MTU;
+
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        std::string opt = query.substr(0, amp);
+        query = (amp == std::string::npos) ? "" : query.substr(amp+1);
+
+        if (opt == "loss=hold") {
+            a.loss = UDP_LOSS_HOLD;
+        } else if (opt == "loss=zero") {
+            a.loss = UDP_LOSS_ZERO;
+        } else if (opt == "loss=error") {
+            a.loss = UDP_LOSS_ERROR;
+        } else if (opt.compare(0, 5, "wait=") == 0) {
+            char *end;
+            long ms = strtol(opt.c_str()+5, &end, 10);
+            if (end == opt.c_str()+5 || *end != '\0' || ms < 0) {
+                throw std::runtime_error("UDP wait option must be a non-negative number of msecs.");
+            }
+            a.wait = static_cast<int>(ms);
+        } else if (opt.compare(0, 4, "mtu=") == 0) {
+            unsigned long n = strtoul(opt.c_str()+4, nullptr, 10);
+            if (n < UDP_MIN_MTU || n > UDP_MAX_DATAGRAM+UDP_IP_OVERHEAD) {
+                throw std::runtime_error("UDP mtu option must be between " + std::to_string(UDP_MIN_MTU) +
+                                         " and " + std::to_string(UDP_MAX_DATAGRAM+UDP_IP_OVERHEAD) + ".");
+            }
+            a.mtu = static_cast<unsigned int>(n);
+        } else {
+            throw std::runtime_error("Unknown UDP address option: " + opt);
+        }
+    }
+    return a;
+}
+
+std::string error_text(const int err)
+{
+#if defined(_WIN32)
+    return "error " + std::to_string(err);
+#else
+    return std::strerror(err);
+#endif
+}
+
+} // anonymous namespace
+
+bool is_udp_address(const std::string &addr)
+{
+    return addr.compare(0, 6, "udp://") == 0;
+}
+
+std::string udp_address(const std::string &host, const std::string &port)
+{
+    auto q = host.find('?');
+    if (q == std::string::npos) {
+        return host + ":" + port;
+    }
+    return host.substr(0, q) + ":" + port + host.substr(q);
+}
+
+void UdpStats::print(std::ostream & os) const
+{
+    os << "  UDP: " << received << " message(s) received, " << stale << " stale, " << late << " late, "
+       << missing << " missing, " << oversize << " too large, " << held << " step(s) without new data\n";
+    os.flush();
+}
+
+class UdpChannel::Socket {
+  public:
+    Socket() : fd(INVALID_HANDLE) {}
+
+    ~Socket()
+    {
+        if (fd != INVALID_HANDLE) {
+            close_handle(fd);
+        }
+    }
+
+    // Bind to the port on all interfaces, both IPv6 and IPv4 where the
+    // host has IPv6
+    void bind(const std::string &port)
+    {
+        for (int family : {AF_INET6, AF_INET}) {
+            addrinfo hints = {};
+            hints.ai_family = family;
+            hints.ai_socktype = SOCK_DGRAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo *res = nullptr;
+            if (getaddrinfo(nullptr, port.c_str(), &hints, &res) != 0 || !res) {
+                continue;
+            }
+            fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+            if (fd != INVALID_HANDLE) {
+                if (family == AF_INET6) {
+                    int off = 0;
+                    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&off), sizeof(off));
+                }
+                int rcvbuf = UDP_RCVBUF;
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char *>(&rcvbuf), sizeof(rcvbuf));
+                if (::bind(fd, res->ai_addr, static_cast<int>(res->ai_addrlen)) == 0) {
+                    freeaddrinfo(res);
+                    return;
+                }
+                const int err = last_error();
+                close_handle(fd);
+                fd = INVALID_HANDLE;
+                freeaddrinfo(res);
+                throw std::runtime_error("Cannot take UDP datagrams on port " + port + ": " + error_text(err));
+            }
+            freeaddrinfo(res);
+        }
+        throw std::runtime_error("Cannot open a UDP socket on port " + port + ".");
+    }
+
+    // Send all datagrams to host and port
+    void connect(const std::string &host, const std::string &port)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *res = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+            throw std::runtime_error("Cannot resolve UDP host " + host + ".");
+        }
+        for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd == INVALID_HANDLE) {
+                continue;
+            }
+            if (::connect(fd, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0) {
+                freeaddrinfo(res);
+                return;
+            }
+            close_handle(fd);
+            fd = INVALID_HANDLE;
+        }
+        freeaddrinfo(res);
+        throw std::runtime_error("Cannot send UDP datagrams to " + host + ":" + port + ".");
+    }
+
+    // Wait up to timeout msecs for a datagram
+    bool readable(const int timeout)
+    {
+#if defined(_WIN32)
+        WSAPOLLFD p = { fd, POLLRDNORM, 0 };
+        return WSAPoll(&p, 1, timeout) > 0;
+#else
+        pollfd p = { fd, POLLIN, 0 };
+        int r;
+        do {
+            r = poll(&p, 1, timeout);
+        } while (r < 0 && errno == EINTR);
+        return r > 0;
+#endif
+    }
+
+    // Size of the datagram received, negative if none could be taken
+    long recv(char *buf, const size_t capacity)
+    {
+        return static_cast<long>(::recv(fd, buf, static_cast<int>(capacity), 0));
+    }
+
+    void send(const char *buf, const size_t size)
+    {
+        if (::send(fd, buf, static_cast<int>(size), 0) < 0) {
+            const int err = last_error();
+            if (!dropped_send(err)) {
+                throw std::runtime_error("Sending a UDP datagram failed: " + error_text(err));
+            }
+        }
+    }
+
+  private:
+    socket_handle fd;
+};
+
+UdpChannel::UdpChannel(std::unique_ptr<Socket> s, const size_t max_msg_size, const unsigned int mtu,
+                       const UdpLossPolicy policy, const int loss_wait) :
+    sock(std::move(s)), loss(policy), wait(loss_wait),
+    max_payload(std::min<size_t>(mtu-UDP_IP_OVERHEAD, UDP_MAX_DATAGRAM)-UDP_HEADER_SIZE),
+    sender(0), next_seq(1), peer(0), last_seq(0), partial_seq(0), partial_size(0), partial_count(0),
+    partial(max_msg_size), dgram(UDP_MAX_DATAGRAM)
+{
+    if ((max_msg_size+max_payload-1)/max_payload > 0xffff) {
+        throw std::runtime_error("Messages of " + std::to_string(max_msg_size) + " bytes need too many UDP datagrams.");
+    }
+}
+
+UdpChannel::~UdpChannel()
+{
+}
+
+std::unique_ptr<UdpChannel> UdpChannel::bind(const std::string &addr, const size_t max_msg_size)
+{
+    UdpAddress a = parse_udp_address(addr);
+    init_sockets();
+    std::unique_ptr<Socket> s(new Socket());
+    s->bind(a.port);
+    SFUN_LOG(LEVEL_DEBUG, "Taking UDP datagrams on port %s", a.port.c_str());
+    return std::unique_ptr<UdpChannel>(new UdpChannel(std::move(s), max_msg_size, a.mtu, a.loss, a.wait));
+}
+
+std::unique_ptr<UdpChannel> UdpChannel::connect(const std::string &addr, const size_t max_msg_size)
+{
+    UdpAddress a = parse_udp_address(addr);
+    init_sockets();
+    std::unique_ptr<Socket> s(new Socket());
+    s->connect(a.host, a.port);
+    std::unique_ptr<UdpChannel> c(new UdpChannel(std::move(s), max_msg_size, a.mtu, a.loss, a.wait));
+
+    std::random_device rd;
+    c->sender = rd() ^ static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    if (c->sender == 0) {
+        c->sender = 1;
+    }
+    SFUN_LOG(LEVEL_DEBUG, "Sending UDP datagrams to %s:%s, up to %llu bytes each", a.host.c_str(), a.port.c_str(),
+             static_cast<unsigned long long>(c->max_payload+UDP_HEADER_SIZE));
+    return c;
+}
+
+void UdpChannel::send(const char *buf, const size_t size, const bool control)
+{
+    const size_t frags = std::max<size_t>(1, (size+max_payload-1)/max_payload);
+    const uint64_t seq = next_seq++;
+    char *d = &dgram[0];
+    for (int copy = 0; copy < (control ? UDP_CONTROL_COPIES : 1); copy++) {
+        for (size_t f = 0; f < frags; f++) {
+            const size_t offset = f*max_payload;
+            const size_t n = std::min(max_payload, size-offset);
+            put<uint16_t>(d, 0, UDP_MAGIC);
+            put<uint8_t>(d, 2, UDP_VERSION);
+            put<uint8_t>(d, 3, control ? UDP_CONTROL : 0);
+            put<uint32_t>(d, 4, sender);
+            put<uint64_t>(d, 8, seq);
+            put<uint32_t>(d, 16, static_cast<uint32_t>(offset));
+            put<uint32_t>(d, 20, static_cast<uint32_t>(size));
+            put<uint16_t>(d, 24, static_cast<uint16_t>(f));
+            put<uint16_t>(d, 26, static_cast<uint16_t>(frags));
+            std::memcpy(d+UDP_HEADER_SIZE, buf+offset, n);
+            sock->send(d, UDP_HEADER_SIZE+n);
+        }
+    }
+}
+
+bool UdpChannel::recvLatest(char *buf, const size_t capacity, size_t &size, const int timeout)
+{
+    using std::chrono::steady_clock;
+    using std::chrono::microseconds;
+    const steady_clock::time_point deadline = steady_clock::now()+std::chrono::milliseconds(timeout);
+    bool got = false;
+    for (;;) {
+        // Once a message is complete only what is queued already is taken.
+        // The wait is rounded up, a step must not give up before it.
+        int remaining = 0;
+        if (!got) {
+            remaining = static_cast<int>(std::max<long long>(0,
+                (std::chrono::duration_cast<microseconds>(deadline-steady_clock::now()).count()+999)/1000));
+        }
+        if (!sock->readable(remaining)) {
+            if (got || remaining == 0) {
+                return got;
+            }
+            continue;
+        }
+        const long n = sock->recv(&dgram[0], dgram.size());
+        if (n <= 0) {
+            continue;
+        }
+        bool control = false;
+        if (!takeDatagram(static_cast<size_t>(n), buf, capacity, size, control)) {
+            continue;
+        }
+        if (got) {
+            stats.stale++;
+        }
+        if (control || loss == UDP_LOSS_ERROR) {
+            // Every message is wanted, in order
+            return true;
+        }
+        got = true;
+    }
+}
+
+bool UdpChannel::takeDatagram(const size_t n, char *buf, const size_t capacity, size_t &size, bool &control)
+{
+    const char *d = &dgram[0];
+    if (n < UDP_HEADER_SIZE || get<uint16_t>(d, 0) != UDP_MAGIC || get<uint8_t>(d, 2) != UDP_VERSION) {
+        // Not ours
+        return false;
+    }
+    const uint8_t  flags    = get<uint8_t>(d, 3);
+    const uint32_t id       = get<uint32_t>(d, 4);
+    const uint64_t seq      = get<uint64_t>(d, 8);
+    const size_t   offset   = get<uint32_t>(d, 16);
+    const size_t   msg_size = get<uint32_t>(d, 20);
+    const unsigned int frag  = get<uint16_t>(d, 24);
+    const unsigned int frags = get<uint16_t>(d, 26);
+    const size_t   len      = n-UDP_HEADER_SIZE;
+    if (frags == 0 || frag >= frags || offset+len > msg_size) {
+        return false;
+    }
+    if (msg_size > capacity || msg_size > partial.size()) {
+        // Larger than the ports of the receiver, e.g. of a transmitter with
+        // other ports, whose handshake reports the mismatch if it fits
+        if (stats.oversize++ == 0) {
+            SFUN_LOG(LEVEL_WARN, "Dropping messages of %llu bytes, this block takes up to %llu",
+                     static_cast<unsigned long long>(msg_size), static_cast<unsigned long long>(capacity));
+        }
+        return false;
+    }
+
+    if (id != peer) {
+        if (peer != 0) {
+            SFUN_LOG(LEVEL_INFO, "Another transmitter sends on the UDP port");
+        }
+        peer = id;
+        last_seq = 0;
+        partial_seq = 0;
+    }
+    if (seq <= last_seq) {
+        // Copies of a control message are expected
+        if (frag == 0 && !(flags & UDP_CONTROL)) {
+            stats.late++;
+        }
+        return false;
+    }
+
+    control = (flags & UDP_CONTROL) != 0;
+    if (frags == 1) {
+        std::memcpy(buf, d+UDP_HEADER_SIZE, len);
+        size = len;
+        deliver(seq);
+        return true;
+    }
+
+    if (seq != partial_seq) {
+        if (seq < partial_seq) {
+            // A fragment of a message older than the one being reassembled
+            return false;
+        }
+        // A newer message, the one being reassembled is lost
+        partial_seq = seq;
+        partial_size = msg_size;
+        partial_count = 0;
+        have_frag.assign(frags, 0);
+    }
+    if (msg_size != partial_size || frags != have_frag.size() || have_frag[frag]) {
+        return false;
+    }
+    have_frag[frag] = 1;
+    std::memcpy(&partial[offset], d+UDP_HEADER_SIZE, len);
+    if (++partial_count < frags) {
+        return false;
+    }
+    std::memcpy(buf, &partial[0], msg_size);
+    size = msg_size;
+    partial_seq = 0;
+    deliver(seq);
+    return true;
+}
+
+void UdpChannel::deliver(const uint64_t seq)
+{
+    if (last_seq > 0 && seq > last_seq+1) {
+        stats.missing += static_cast<unsigned long>(seq-last_seq-1);
+    }
+    last_seq = seq;
+    stats.received++;
+}
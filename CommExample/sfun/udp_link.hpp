@@ -0,0 +1,129 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef UDP_LINK_HPP
+#define UDP_LINK_HPP
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Datagram transport for the Comm blocks on lossy links, where waiting for a
+// lost sample to be sent again stalls every step after it. The transmitter
+// sends each message without waiting for a reply; the receiver outputs the
+// newest message that arrived by its step and drops older ones, a stale
+// sample being worth less than a lost one.
+//
+// Datagram layout, little endian as on the host:
+//   [uint16 magic][uint8 version][uint8 flags][uint32 sender][uint64 seq]
+//   [uint32 offset][uint32 msg size][uint16 fragment][uint16 fragments]
+//   followed by bytes offset..offset+n of the message
+// seq numbers the messages of a sender, which picks a random id when it
+// opens the channel, so that a transmitter started again is not taken for
+// one sending old messages. Messages larger than a datagram of the MTU are
+// sent in fragments and reassembled; a message missing a fragment is lost.
+// Control messages (UDP_CONTROL) are sent several times and are never
+// skipped for newer data.
+//
+// Address format: udp://<host>:<port>[?loss=hold|zero|error][&wait=MS][&mtu=N]
+//   loss=hold   a step without new data keeps the last outputs (default)
+//   loss=zero   a step without new data outputs zeros
+//   loss=error  every message is output in order, a step without new data
+//               or a lost message stops the run
+//   wait=MS     msecs a step waits for new data, default the block's timeout
+//   mtu=N       largest IP packet sent, default 1500
+// The receiver takes datagrams on the port on all interfaces, the host is
+// where the transmitter sends them.
+
+#define UDP_CONTROL 0x1 // datagram flag, control message sent several times
+
+typedef enum {
+    UDP_LOSS_HOLD = 0,
+    UDP_LOSS_ZERO,
+    UDP_LOSS_ERROR,
+} UdpLossPolicy;
+
+// True if the address selects the datagram transport
+bool is_udp_address(const std::string &addr);
+
+// Build the address from the block's host and port parameters, where the
+// host parameter is udp://<host> followed by the options
+std::string udp_address(const std::string &host, const std::string &port);
+
+// What happened to the messages of a run, as seen by the receiver
+struct UdpStats {
+    unsigned long received;   // complete messages
+    unsigned long stale;      // complete, but a newer one arrived before the step took it
+    unsigned long late;       // arrived after a newer one was taken
+    unsigned long missing;    // never arrived complete
+    unsigned long held;       // steps without new data
+    unsigned long oversize;   // larger than a message of the receiver, dropped
+
+    UdpStats() { reset(); }
+
+    void reset()
+    {
+        received = stale = late = missing = held = oversize = 0;
+    }
+
+    void print(std::ostream & os) const;
+};
+
+class UdpChannel {
+  public:
+    // Receiver side: take datagrams on the port of the address. Messages
+    // may be up to max_msg_size bytes.
+    static std::unique_ptr<UdpChannel> bind(const std::string &addr, const size_t max_msg_size);
+
+    // Transmitter side: send to the host and port of the address
+    static std::unique_ptr<UdpChannel> connect(const std::string &addr, const size_t max_msg_size);
+
+    ~UdpChannel();
+
+    UdpLossPolicy lossPolicy() const { return loss; }
+
+    // msecs a step waits for new data, negative for the block's timeout
+    int lossWait() const { return wait; }
+
+    // Send a message in as many datagrams as the MTU needs, a control message
+    // several times. Datagrams the network stack has no room for are dropped
+    // as on the wire.
+    void send(const char *buf, const size_t size, const bool control);
+
+    // Copy the newest complete message which arrived into buf, or the oldest
+    // control message if one arrived; with loss=error the oldest message.
+    // Waits up to timeout msecs for one, and returns false if none arrives.
+    bool recvLatest(char *buf, const size_t capacity, size_t &size, const int timeout);
+
+    UdpStats & getStats() { return stats; }
+
+  private:
+    class Socket;
+
+    UdpChannel(std::unique_ptr<Socket> s, const size_t max_msg_size, const unsigned int mtu,
+               const UdpLossPolicy policy, const int loss_wait);
+
+    std::unique_ptr<Socket> sock;
+    UdpLossPolicy loss;
+    int           wait;
+    size_t        max_payload;     // message bytes per datagram
+    uint32_t      sender;          // this side's id, transmitter only
+    uint64_t      next_seq;        // of the next message sent
+    uint32_t      peer;            // id of the transmitter heard last
+    uint64_t      last_seq;        // newest message of peer taken or completed
+    uint64_t      partial_seq;     // message being reassembled, 0 for none
+    size_t        partial_size;
+    unsigned int  partial_count;   // fragments of it received
+    std::vector<char> partial;     // its bytes
+    std::vector<char> have_frag;   // which of its fragments arrived
+    std::vector<char> dgram;       // one datagram
+    UdpStats      stats;
+
+    // Handle the datagram in dgram. Returns true and copies the message
+    // into buf once one is complete, control is set for a control message.
+    bool takeDatagram(const size_t n, char *buf, const size_t capacity, size_t &size, bool &control);
+    void deliver(const uint64_t seq);
+};
+
+#endif // UDP_LINK_HPP
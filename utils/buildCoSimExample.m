@@ -8,17 +8,32 @@ cd(fullfile(p.RootFolder,'CoSimExample','serverApp'));
 
 mex('-client', 'engine',...
     ['-I' fullfile(p.RootFolder,'CoSimExample','util')],...
+    ['-I' fullfile(p.RootFolder,'utils','include')],...
     ['-I' fullfile(p.RootFolder,'libzmq','include')],...
     ['-I' fullfile(p.RootFolder,'cppzmq')],...
     ['-L' fullfile(p.RootFolder,'libzmq','bin','x64','Release','v140','dynamic')],...
     '-llibzmq',...
     'statcalserver.cpp',...
+    'ewma_kernel.cpp',...
+    'ewma_scan.cpp',...
+    'stat_ops.cpp',...
     fullfile(p.RootFolder,'CoSimExample','util','statcal_util.cpp'));
 
+%% Build the port broker, which hands out ports and pooled servers
+cd(fullfile(p.RootFolder,'utils','portbroker'));
+
+mex('-client', 'engine',...
+    ['-I' fullfile(p.RootFolder,'libzmq','include')],...
+    ['-I' fullfile(p.RootFolder,'cppzmq')],...
+    ['-L' fullfile(p.RootFolder,'libzmq','bin','x64','Release','v140','dynamic')],...
+    '-llibzmq',...
+    'portbroker.cpp');
+
 %% Build the S-function
 cd(fullfile(p.RootFolder,'CoSimExample','sfun'));
 
 mex('-I..\util',...
+    ['-I' fullfile(p.RootFolder,'utils','include')],...
     ['-I' p.RootFolder '\libzmq\include'],...
     ['-I' fullfile(p.RootFolder,'libzmq','include')],...
     ['-I' fullfile(p.RootFolder,'cppzmq')],...
@@ -6,19 +6,77 @@
 
 mex(['-I' fullfile(p.RootFolder, 'cppzmq')],...
     ['-I' fullfile(p.RootFolder, 'libzmq','include')],...
+    ['-I' fullfile(p.RootFolder, 'utils','include')],...
     ['-L' fullfile(p.RootFolder,'libzmq','bin','x64','Release','v140','dynamic')],...
     '-llibzmq',...
     'sfcn_transmit.cpp',...
     'statcal_util.cpp',...
+    'shm_ring.cpp',...
+    'udp_link.cpp',...
+    'msg_log.cpp',...
+    'mux_link.cpp',...
     'mdlclient.cpp');
 
 mex(['-I' fullfile(p.RootFolder, 'cppzmq')],...
     ['-I' fullfile(p.RootFolder, 'libzmq','include')],...
+    ['-I' fullfile(p.RootFolder, 'utils','include')],...
     ['-L' fullfile(p.RootFolder,'libzmq','bin','x64','Release','v140','dynamic')],...
     '-llibzmq',...
     'sfcn_receive.cpp',...
     'statcal_util.cpp',...
-    'mdlclient.cpp');
+    'shm_ring.cpp',...
+    'udp_link.cpp',...
+    'msg_log.cpp',...
+    'mux_link.cpp',...
+    'mdlserver.cpp');
+
+%% Build the runtime library of the C interface, comm_runtime.h, for hosts
+%  which run the blocks without Simulink, and comm_loopback, its test
+runtimeDir = fullfile(p.RootFolder,'CommExample','sfun','comm_runtime');
+if ~exist(runtimeDir,'dir')
+    mkdir(runtimeDir);
+end
+
+mex('-c','-outdir',runtimeDir,...
+    ['-I' fullfile(p.RootFolder, 'cppzmq')],...
+    ['-I' fullfile(p.RootFolder, 'libzmq','include')],...
+    ['-I' fullfile(p.RootFolder, 'utils','include')],...
+    'comm_runtime.cpp',...
+    'statcal_util.cpp',...
+    'shm_ring.cpp',...
+    'udp_link.cpp',...
+    'msg_log.cpp',...
+    'mux_link.cpp',...
+    'mdlclient.cpp',...
+    'mdlserver.cpp');
+
+if ispc
+    runtimeObjs = dir(fullfile(runtimeDir,'*.obj'));
+    runtimeLib = fullfile(runtimeDir,'comm_runtime.lib');
+    runtimeLibs = {};
+    % lib.exe is on the path of the shell of the compiler mex uses
+    cc = mex.getCompilerConfigurations('C++','Selected');
+    archiver = ['"' cc.Details.CommandLineShell '" ' cc.Details.CommandLineShellArg ' && lib /NOLOGO /OUT:'];
+else
+    runtimeObjs = dir(fullfile(runtimeDir,'*.o'));
+    runtimeLib = fullfile(runtimeDir,'libcomm_runtime.a');
+    runtimeLibs = {'-lstdc++','-lpthread','-lrt'};
+    archiver = 'ar rcs ';
+end
+if exist(runtimeLib,'file')
+    delete(runtimeLib);
+end
+runtimeObjs = fullfile(runtimeDir,{runtimeObjs.name});
+if system([archiver '"' runtimeLib '"' sprintf(' "%s"',runtimeObjs{:})]) ~= 0
+    error('Could not create the runtime library %s', runtimeLib);
+end
+
+mex('-client', 'engine','-outdir',runtimeDir,...
+    ['-L' fullfile(p.RootFolder,'libzmq','bin','x64','Release','v140','dynamic')],...
+    'comm_loopback.c',...
+    runtimeLib,...
+    '-llibzmq',...
+    runtimeLibs{:});
 
 cd(p.RootFolder)
 
@@ -0,0 +1,271 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Messages at or below the log level are printed, e.g. LEVEL_WARN prints
+// warnings and errors
+enum LogLevel {
+    LEVEL_OFF = 0,
+    LEVEL_ERROR,
+    LEVEL_WARN,
+    LEVEL_INFO,
+    LEVEL_DEBUG,
+    LEVEL_TRACE
+};
+
+#define LOG_LEVEL_ENV   "ZMQ_SFUN_LOG_LEVEL" // off, error, warn, info, debug or trace
+#define LOG_SLOT_SIZE   256                  // bytes per message, longer ones are cut
+#define LOG_QUEUE_SLOTS 1024                 // power of two
+#define LOG_IDLE_WAIT   50                   // msecs the writer sleeps when idle
+
+#if defined(__GNUC__)
+#define LOG_PRINTF_FORMAT(f, a) __attribute__((format(printf, f, a)))
+#else
+#define LOG_PRINTF_FORMAT(f, a)
+#endif
+
+// Logger of a MEX file. Callers format their message into a slot of a
+// bounded lock-free queue and return; a writer thread prints the slots to
+// std::cout and flushes once per batch, so the simulation thread never waits
+// on the console. When the queue is full the message is dropped and counted
+// rather than blocking the caller. Between start() and stop() messages go
+// through the writer thread, outside of that they are printed directly.
+//
+// There is one logger, and so one log level, per MEX file or runtime
+// library. The level is a setting of the model rather than of a block: all
+// blocks running at the same time must ask for the same one, see start().
+class AsyncLog {
+  public:
+    static AsyncLog & instance()
+    {
+        static AsyncLog log;
+        return log;
+    }
+
+    bool enabled(const LogLevel l) const { return l <= level.load(std::memory_order_relaxed); }
+
+    LogLevel getLevel() const { return static_cast<LogLevel>(level.load(std::memory_order_relaxed)); }
+
+    static const char *levelName(const LogLevel l)
+    {
+        static const char *names[] = {"off", "error", "warn", "info", "debug", "trace"};
+        return (l >= LEVEL_OFF && l <= LEVEL_TRACE) ? names[l] : "unknown";
+    }
+
+    // Level named by str, or dflt if str is empty or not a level
+    static LogLevel parseLevel(const char *str, const LogLevel dflt)
+    {
+        if (str == nullptr || *str == '\0') {
+            return dflt;
+        }
+        for (int k = LEVEL_OFF; k <= LEVEL_TRACE; k++) {
+            if (std::strcmp(str, levelName(static_cast<LogLevel>(k))) == 0 || (str[0] == '0'+k && str[1] == '\0')) {
+                return static_cast<LogLevel>(k);
+            }
+        }
+        return dflt;
+    }
+
+    // True for the empty string, which stands for the default, and level names
+    static bool isLevelName(const char *str)
+    {
+        return *str == '\0' || parseLevel(str, static_cast<LogLevel>(-1)) != static_cast<LogLevel>(-1);
+    }
+
+    // Level of the environment variable, LEVEL_INFO if it is not set
+    static LogLevel envLevel()
+    {
+        return parseLevel(std::getenv(LOG_LEVEL_ENV), LEVEL_INFO);
+    }
+
+    void write(const LogLevel l, const char *fmt, ...) LOG_PRINTF_FORMAT(3, 4)
+    {
+        if (!enabled(l)) {
+            return;
+        }
+        va_list args;
+        va_start(args, fmt);
+        vwrite(fmt, args);
+        va_end(args);
+    }
+
+    // Text of several lines, e.g. a table, one message per line
+    void writeLines(const LogLevel l, const std::string & text)
+    {
+        if (!enabled(l)) {
+            return;
+        }
+        size_t begin = 0;
+        while (begin < text.size()) {
+            size_t end = text.find('\n', begin);
+            if (end == std::string::npos) end = text.size();
+            write(l, "%.*s", static_cast<int>(end-begin), text.data()+begin);
+            begin = end+1;
+        }
+    }
+
+    // Start the writer thread at level l. Calls nest, the thread runs until
+    // the last matching stop(). A nested call must ask for the level the log
+    // runs at, else the level is kept and std::runtime_error thrown; the call
+    // counts all the same and needs its stop().
+    void start(const LogLevel l)
+    {
+        std::lock_guard<std::mutex> guard(control_lock);
+        if (users++ > 0) {
+            if (l != getLevel()) {
+                throw std::runtime_error(std::string("Log level '") + levelName(l) + "' differs from the level '" +
+                                         levelName(getLevel()) + "' of the blocks already running. The log level "
+                                         "is one for the whole model, give all its blocks the same.");
+            }
+            return;
+        }
+        level.store(l, std::memory_order_relaxed);
+        stopping.store(false);
+        writer = std::thread([this]() { run(); });
+        running.store(true, std::memory_order_release);
+    }
+
+    // Print what is still queued and stop the writer thread. The thread is
+    // not left to static destruction, where joining it can deadlock while
+    // the MEX file is unloaded.
+    void stop()
+    {
+        std::lock_guard<std::mutex> guard(control_lock);
+        if (users == 0 || --users > 0) {
+            return;
+        }
+        running.store(false, std::memory_order_release);
+        stopping.store(true);
+        wake.notify_one();
+        writer.join();
+        drain();
+    }
+
+  private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        char text[LOG_SLOT_SIZE];
+    };
+
+    Slot slots[LOG_QUEUE_SLOTS];
+    std::atomic<size_t> head;           // next slot to fill
+    size_t tail;                        // next slot to print, writer only
+    std::atomic<int>  level;
+    std::atomic<bool> running;
+    std::atomic<bool> stopping;
+    std::atomic<bool> idle;
+    std::atomic<unsigned long> dropped;
+    std::mutex control_lock;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::thread writer;
+    int users;
+
+    AsyncLog() : head(0), tail(0), level(envLevel()), running(false), stopping(false),
+                 idle(false), dropped(0), users(0)
+    {
+        for (size_t k = 0; k < LOG_QUEUE_SLOTS; k++) {
+            slots[k].seq.store(k, std::memory_order_relaxed);
+        }
+    }
+
+    AsyncLog(const AsyncLog &) = delete;
+    AsyncLog & operator=(const AsyncLog &) = delete;
+
+    void vwrite(const char *fmt, va_list args)
+    {
+        if (!running.load(std::memory_order_acquire)) {
+            char text[LOG_SLOT_SIZE];
+            std::vsnprintf(text, sizeof(text), fmt, args);
+            std::lock_guard<std::mutex> guard(control_lock);
+            std::cout << text << std::endl;
+            return;
+        }
+
+        // Bounded multi-producer queue: claim a slot whose sequence number
+        // says it is free, fill it and publish it by advancing the number
+        size_t pos = head.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &slots[pos & (LOG_QUEUE_SLOTS-1)];
+            const size_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (seq < pos) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        std::vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+        slot->seq.store(pos+1, std::memory_order_release);
+
+        if (idle.load(std::memory_order_acquire)) {
+            wake.notify_one();
+        }
+    }
+
+    // Print the published slots, returns false if there were none
+    bool drain()
+    {
+        bool printed = false;
+        for (;;) {
+            Slot &slot = slots[tail & (LOG_QUEUE_SLOTS-1)];
+            if (slot.seq.load(std::memory_order_acquire) != tail+1) break;
+            std::cout << slot.text << '\n';
+            slot.seq.store(tail+LOG_QUEUE_SLOTS, std::memory_order_release);
+            tail++;
+            printed = true;
+        }
+        const unsigned long n = dropped.exchange(0, std::memory_order_relaxed);
+        if (n > 0) {
+            std::cout << n << " log messages dropped, the log queue was full" << '\n';
+            printed = true;
+        }
+        if (printed) {
+            std::cout.flush();
+        }
+        return printed;
+    }
+
+    void run()
+    {
+        while (!stopping.load()) {
+            if (drain()) {
+                continue;
+            }
+            // Producers only notify while the writer is idle. A wakeup lost
+            // between the check and the wait costs one LOG_IDLE_WAIT.
+            std::unique_lock<std::mutex> lock(wake_lock);
+            idle.store(true, std::memory_order_release);
+            if (!drain()) {
+                wake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_WAIT));
+            }
+            idle.store(false, std::memory_order_release);
+        }
+    }
+};
+
+// Format and queue a message if its level is enabled; the arguments are not
+// evaluated otherwise
+#define SFUN_LOG(lvl, ...) \
+    do { \
+        if (AsyncLog::instance().enabled(lvl)) AsyncLog::instance().write(lvl, __VA_ARGS__); \
+    } while (0)
+
+#endif // ASYNC_LOG_HPP
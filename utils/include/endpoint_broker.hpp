@@ -0,0 +1,98 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef ENDPOINT_BROKER_HPP
+#define ENDPOINT_BROKER_HPP
+
+#include <zmq.hpp>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "shared_context.hpp"
+
+#define BROKER_PREFIX       "broker://"
+#define BROKER_ADDR_ENV     "COSIM_BROKER"  // address of the port broker, default BROKER_DEFAULT_ADDR
+#define BROKER_SCOPE_ENV    "COSIM_SCOPE"   // prefix of the names, e.g. one per group of parallel models
+#define BROKER_DEFAULT_ADDR "tcp://127.0.0.1:5550"
+#define BROKER_TIMEOUT      2500            // msecs to wait for the broker
+
+// A block whose host parameter is broker://<name> asks the port broker of
+// this host (utils/portbroker) for its port instead of taking it from the
+// block dialog, so that the same model can run on every worker of a parallel
+// pool. Names are looked up in the scope given by the environment, if any:
+// blocks of models which talk to each other share a scope, other groups of
+// models use another one.
+//
+// Requests and replies are single text frames:
+//   PORT <name>     a free port, the same for all blocks asking with the name
+//                   until they released it
+//   RELEASE_PORT <name>
+//                   the port of the name can be handed out again once all
+//                   blocks which asked for it released it
+//   SERVER <name>   the port of a running statcalserver of the broker's pool,
+//                   the same for all blocks asking with the name until they
+//                   released it
+//   RELEASE <name>  the server of the name goes back to the pool once all
+//                   blocks which asked for it released it
+// answered with "OK <port>" or "ERROR <message>".
+class EndpointBroker {
+  public:
+    static bool isBrokerAddress(const std::string &host)
+    {
+        return host.compare(0, sizeof(BROKER_PREFIX)-1, BROKER_PREFIX) == 0;
+    }
+
+    // Name of the endpoint, in its scope
+    static std::string scopedName(const std::string &host)
+    {
+        const std::string name = host.substr(sizeof(BROKER_PREFIX)-1);
+        if (name.empty() || name.find_first_of(" \t\r\n") != std::string::npos) {
+            throw std::runtime_error("Endpoint name in " + host + " must not be empty or contain spaces.");
+        }
+        const char *scope = std::getenv(BROKER_SCOPE_ENV);
+        return (scope && *scope) ? std::string(scope) + "/" + name : name;
+    }
+
+    // Port given to the name of host, broker://<name>
+    static std::string port(const std::string &host) { return request("PORT " + scopedName(host)); }
+
+    // Port of the pooled server of the name of host. Release it at cleanup.
+    static std::string server(const std::string &host) { return request("SERVER " + scopedName(host)); }
+
+    static void release(const std::string &host) { request("RELEASE " + scopedName(host)); }
+
+    // Give back the port of the name of host, the block does not use it any more
+    static void releasePort(const std::string &host) { request("RELEASE_PORT " + scopedName(host)); }
+
+    // Send a request to the broker and return the text of its OK reply.
+    // Throws std::runtime_error if the broker does not answer or refuses.
+    static std::string request(const std::string &req)
+    {
+        const char *env = std::getenv(BROKER_ADDR_ENV);
+        const std::string addr = (env && *env) ? env : BROKER_DEFAULT_ADDR;
+
+        SharedContext context;
+        zmq::socket_t socket(context, ZMQ_REQ);
+        int linger = 0;
+        socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+        socket.connect(addr.c_str());
+        socket.send(req.data(), req.size());
+
+        zmq::pollitem_t items[] = { {(void*)socket, 0, ZMQ_POLLIN, 0 } };
+        zmq::poll(&items[0], 1, BROKER_TIMEOUT);
+        if (!(items[0].revents & ZMQ_POLLIN)) {
+            throw std::runtime_error("No answer from the port broker at " + addr +
+                                     ". Please ensure that portbroker is running, or set " BROKER_ADDR_ENV ".");
+        }
+        zmq::message_t reply;
+        socket.recv(&reply);
+        const std::string str(static_cast<const char *>(reply.data()), reply.size());
+        if (str.compare(0, 3, "OK ") != 0) {
+            throw std::runtime_error("Port broker: " + (str.compare(0, 6, "ERROR ") == 0 ? str.substr(6) : str));
+        }
+        SFUN_LOG(LEVEL_DEBUG, "Port broker: %s -> %s", req.c_str(), str.c_str()+3);
+        return str.substr(3);
+    }
+};
+
+#endif // ENDPOINT_BROKER_HPP
@@ -0,0 +1,189 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Histogram of latencies in nanoseconds with buckets of about 3% relative
+// width from 1 ns up to about 18 minutes, in the spirit of HdrHistogram.
+// Recording is a few instructions and never allocates, so it can stay
+// enabled in the step functions. Values up to 63 ns get a bucket each;
+// above that every power of two is split into 32 sub-buckets.
+class LatencyHistogram {
+  public:
+    LatencyHistogram() { reset(); }
+
+    void reset()
+    {
+        std::fill(counts, counts+NUM_BUCKETS, 0);
+        total = 0;
+        sum   = 0;
+        min_v = UINT64_MAX;
+        max_v = 0;
+    }
+
+    void record(uint64_t ns)
+    {
+        ns = std::min<uint64_t>(ns, (1ULL << 40)-1);
+        counts[bucket(ns)]++;
+        total++;
+        sum += ns;
+        min_v = std::min(min_v, ns);
+        max_v = std::max(max_v, ns);
+    }
+
+    void record(const std::chrono::steady_clock::duration d)
+    {
+        record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    }
+
+    void merge(const LatencyHistogram & other)
+    {
+        for (int k = 0; k < NUM_BUCKETS; k++) counts[k] += other.counts[k];
+        total += other.total;
+        sum   += other.sum;
+        min_v = std::min(min_v, other.min_v);
+        max_v = std::max(max_v, other.max_v);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const   { return total ? min_v : 0; }
+    uint64_t max() const   { return max_v; }
+    double   mean() const  { return total ? static_cast<double>(sum)/total : 0.0; }
+
+    // Upper end of the bucket holding the p-quantile, 0 <= p <= 1
+    uint64_t percentile(const double p) const
+    {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(p*total+0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total));
+        uint64_t seen = 0;
+        for (int k = 0; k < NUM_BUCKETS; k++) {
+            seen += counts[k];
+            if (seen >= rank) return std::min(upper(k), max_v);
+        }
+        return max_v;
+    }
+
+    // Flat form for sending in a message of doubles:
+    // [count, sum, min, max, n, (bucket, count) x n] for the non-empty buckets
+    void serialize(std::vector<double> & out) const
+    {
+        out.push_back(static_cast<double>(total));
+        out.push_back(static_cast<double>(sum));
+        out.push_back(static_cast<double>(min()));
+        out.push_back(static_cast<double>(max_v));
+        const size_t n_pos = out.size();
+        out.push_back(0);
+        for (int k = 0; k < NUM_BUCKETS; k++) {
+            if (counts[k] > 0) {
+                out.push_back(k);
+                out.push_back(static_cast<double>(counts[k]));
+                out[n_pos] += 1;
+            }
+        }
+    }
+
+    // Read the flat form at data[pos], returns false if it is malformed
+    bool deserialize(const std::vector<double> & data, size_t & pos)
+    {
+        reset();
+        if (pos+5 > data.size()) return false;
+        total = static_cast<uint64_t>(data[pos]);
+        sum   = static_cast<uint64_t>(data[pos+1]);
+        min_v = total ? static_cast<uint64_t>(data[pos+2]) : UINT64_MAX;
+        max_v = static_cast<uint64_t>(data[pos+3]);
+        const size_t n = static_cast<size_t>(data[pos+4]);
+        pos += 5;
+        if (pos+2*n > data.size()) return false;
+        for (size_t j = 0; j < n; j++, pos += 2) {
+            const int k = static_cast<int>(data[pos]);
+            if (k < 0 || k >= static_cast<int>(NUM_BUCKETS)) return false;
+            counts[k] = static_cast<uint64_t>(data[pos+1]);
+        }
+        return true;
+    }
+
+    // One line of a table in microseconds, see printHeader
+    void print(std::ostream & os, const char *name) const
+    {
+        char line[160];
+        std::snprintf(line, sizeof(line), "  %-12s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f",
+                      name, static_cast<unsigned long long>(total), mean()/1e3,
+                      percentile(0.5)/1e3, percentile(0.9)/1e3, percentile(0.99)/1e3,
+                      percentile(0.999)/1e3, max_v/1e3);
+        os << line << "\n";
+    }
+
+    static void printHeader(std::ostream & os, const char *title)
+    {
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-14s %10s %9s %9s %9s %9s %9s %9s",
+                      title, "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+        os << line << "\n";
+    }
+
+  private:
+    enum { SUB_BITS = 5, NUM_BUCKETS = 36 << SUB_BITS };   // up to 2^40 ns
+
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min_v;
+    uint64_t max_v;
+
+    static int msb(const uint64_t v)
+    {
+#if defined(_MSC_VER)
+        unsigned long idx;
+        return _BitScanReverse64(&idx, v) ? static_cast<int>(idx) : 0;
+#else
+        return v ? 63-__builtin_clzll(v) : 0;
+#endif
+    }
+
+    static int bucket(const uint64_t v)
+    {
+        const int shift = std::max(0, msb(v)-SUB_BITS);
+        return (shift << SUB_BITS)+static_cast<int>(v >> shift);
+    }
+
+    static uint64_t upper(const int k)
+    {
+        if (k < (2 << SUB_BITS)) return k;
+        const int      shift = (k >> SUB_BITS)-1;
+        const uint64_t m     = (k & ((1 << SUB_BITS)-1))+(1 << SUB_BITS);
+        return ((m+1) << shift)-1;
+    }
+};
+
+// Measures the time from construction to stop(), or to the end of the scope
+class LatencyTimer {
+  public:
+    explicit LatencyTimer(LatencyHistogram & h) : hist(&h), t0(std::chrono::steady_clock::now()) {}
+    ~LatencyTimer() { stop(); }
+
+    void stop()
+    {
+        if (hist) {
+            hist->record(std::chrono::steady_clock::now()-t0);
+            hist = nullptr;
+        }
+    }
+
+  private:
+    LatencyHistogram *hist;
+    std::chrono::steady_clock::time_point t0;
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
@@ -0,0 +1,113 @@
+// Copyright 2018 The MathWorks, Inc.
+
+#ifndef SHARED_CONTEXT_HPP
+#define SHARED_CONTEXT_HPP
+
+#include <zmq.hpp>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "async_log.hpp"
+
+#define IO_THREADS_ENV  "ZMQ_SFUN_IO_THREADS"  // I/O threads of the shared context, default 1
+#define IO_AFFINITY_ENV "ZMQ_SFUN_IO_AFFINITY" // CPUs they may run on, e.g. "2,3" or "4-7"
+
+// Handle on the zmq context shared by all blocks of a MEX file. The first
+// handle creates the context and the last one to go terminates it, so its
+// lifetime spans from the first block's setup to the last block's cleanup.
+// Dozens of blocks then share a few I/O threads instead of having one each.
+//
+// Declare the handle before the sockets of a class, so that the sockets are
+// closed before it is released; terminating a context waits for all of its
+// sockets.
+class SharedContext {
+  public:
+    SharedContext() : ctx(&acquire()) {}
+    ~SharedContext() { release(); }
+
+    operator zmq::context_t &() { return *ctx; }
+
+    // Number of I/O threads and CPU list from the environment
+    static int ioThreads()
+    {
+        const char *str = std::getenv(IO_THREADS_ENV);
+        const int n = str ? std::atoi(str) : 1;
+        return n >= 1 ? n : 1;
+    }
+
+    static std::vector<int> ioAffinity()
+    {
+        std::vector<int> cpus;
+        const char *str = std::getenv(IO_AFFINITY_ENV);
+        while (str && *str) {
+            char *end;
+            const long first = std::strtol(str, &end, 10);
+            if (end == str) break;
+            long last = first;
+            if (*end == '-') {
+                str = end+1;
+                last = std::strtol(str, &end, 10);
+                if (end == str) break;
+            }
+            for (long c = first; c <= last && c >= 0; c++) {
+                cpus.push_back(static_cast<int>(c));
+            }
+            str = (*end == ',') ? end+1 : end;
+        }
+        return cpus;
+    }
+
+  private:
+    zmq::context_t *ctx;
+
+    struct State {
+        std::mutex lock;
+        std::unique_ptr<zmq::context_t> ctx;
+        int users;
+        State() : users(0) {}
+    };
+
+    static State & state()
+    {
+        static State s;
+        return s;
+    }
+
+    static zmq::context_t & acquire()
+    {
+        State &s = state();
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (s.users++ == 0) {
+            const int threads = ioThreads();
+            s.ctx.reset(new zmq::context_t(threads));
+
+            // Applies to I/O threads started from now on, i.e. all of them
+            std::string cpu_list;
+#if defined(ZMQ_THREAD_AFFINITY_CPU_ADD)
+            for (int cpu : ioAffinity()) {
+                zmq_ctx_set(static_cast<void *>(*s.ctx), ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+                cpu_list += (cpu_list.empty() ? " on CPU " : ",")+std::to_string(cpu);
+            }
+#endif
+            SFUN_LOG(LEVEL_DEBUG, "Shared ZeroMQ context with %d I/O thread(s)%s", threads, cpu_list.c_str());
+        }
+        return *s.ctx;
+    }
+
+    static void release()
+    {
+        State &s = state();
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (--s.users == 0) {
+            s.ctx.reset(nullptr);
+        }
+    }
+
+    SharedContext(const SharedContext &) = delete;
+    SharedContext & operator=(const SharedContext &) = delete;
+};
+
+#endif // SHARED_CONTEXT_HPP
@@ -0,0 +1,419 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Port broker for co-simulations running side by side on one host, e.g. on
+//  the workers of a parallel pool. Blocks whose host parameter is
+//  broker://<name> ask it for the port of the name instead of having a port
+//  in the block dialog, see utils/include/endpoint_broker.hpp for the
+//  requests. The broker also keeps a pool of statcalserver processes started
+//  ahead of time, so that a simulation finds its server running.
+//
+//  Ports are handed out from a range. A name keeps its port until all blocks
+//  which asked for it released it, then the port may be handed out again, so
+//  that simulations with new names, e.g. a new scope every run, do not use
+//  up the range. A server serves the blocks of one name at a time and is
+//  returned to the pool once they released it. The
+//  pool is refilled with new servers and servers which exited are replaced.
+//
+//  Build (from the repository root):
+//    g++ -O2 -std=c++14 -Iutils/include -I<cppzmq> -I<libzmq>/include
+//        utils/portbroker/portbroker.cpp -o portbroker -lzmq
+//
+//  Run:
+//    portbroker [--port 5550] [--ports 6000-6999]
+//               [--server <statcalserver>] [--pool N] [--workers N]
+//    --port     port of the broker, on the loopback interface
+//    --ports    range of the ports handed out
+//    --server   statcalserver executable of the pool, no pool without
+//    --pool     servers kept running and unused, default 2
+//    --workers  worker threads of every server, default 1
+//
+#include <zmq.hpp>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#define POLL_INTERVAL 500 // msecs between checks of the pool
+
+namespace {
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void on_signal(int)
+{
+    stop_requested = 1;
+}
+
+// A statcalserver process
+class ServerProcess {
+  public:
+    ServerProcess(const std::string &path, const std::string &port, const unsigned int workers);
+    ~ServerProcess();
+
+    bool alive();
+
+  private:
+#if defined(_WIN32)
+    PROCESS_INFORMATION pi;
+#else
+    pid_t pid;
+    bool  exited;
+#endif
+
+    ServerProcess(const ServerProcess &) = delete;
+    ServerProcess & operator=(const ServerProcess &) = delete;
+};
+
+#if defined(_WIN32)
+ServerProcess::ServerProcess(const std::string &path, const std::string &port, const unsigned int workers)
+{
+    std::string cmd = "\"" + path + "\" " + port + " --workers " + std::to_string(workers);
+    STARTUPINFOA si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    ZeroMemory(&pi, sizeof(pi));
+    if (!CreateProcessA(NULL, &cmd[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+        throw std::runtime_error("Cannot start " + path);
+    }
+}
+
+ServerProcess::~ServerProcess()
+{
+    TerminateProcess(pi.hProcess, 0);
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+
+bool ServerProcess::alive()
+{
+    return WaitForSingleObject(pi.hProcess, 0) == WAIT_TIMEOUT;
+}
+#else
+ServerProcess::ServerProcess(const std::string &path, const std::string &port, const unsigned int workers) :
+    pid(0), exited(false)
+{
+    std::string w = std::to_string(workers);
+    std::vector<char *> argv = {const_cast<char *>(path.c_str()), const_cast<char *>(port.c_str()),
+                                const_cast<char *>("--workers"), &w[0], nullptr};
+    if (posix_spawnp(&pid, path.c_str(), nullptr, nullptr, argv.data(), environ) != 0) {
+        throw std::runtime_error("Cannot start " + path);
+    }
+}
+
+ServerProcess::~ServerProcess()
+{
+    if (!exited) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+bool ServerProcess::alive()
+{
+    if (!exited && waitpid(pid, nullptr, WNOHANG) == pid) {
+        exited = true;
+    }
+    return !exited;
+}
+#endif
+
+// Port handed out for a name
+struct NamedPort {
+    std::string  port;
+    unsigned int users;    // blocks which asked for it and did not release it
+};
+
+struct Server {
+    std::unique_ptr<ServerProcess> process;
+    std::string  port;
+    std::string  name;     // blocks it serves, empty while in the pool
+    unsigned int users;
+};
+
+class PortBroker {
+  public:
+    PortBroker(zmq::context_t &ctx, const int first, const int last) :
+        context(ctx), first_port(first), last_port(last), next_port(first), pool_size(0), workers(1)
+    {
+    }
+
+    void setPool(const std::string &path, const size_t size, const unsigned int num_workers)
+    {
+        server_path = path;
+        pool_size = size;
+        workers = num_workers;
+    }
+
+    // Answer a request, "OK <port>" or "ERROR <message>"
+    std::string handleRequest(const std::string &req);
+
+    // Replace servers of the pool which exited and start new ones until the
+    // pool is full
+    void refillPool();
+
+  private:
+    zmq::context_t &context;
+    int first_port;
+    int last_port;
+    int next_port;
+    std::set<int>  used_ports;
+    std::map<std::string, NamedPort> names;     // port of every name in use
+    std::list<Server> servers;
+    std::string  server_path;
+    size_t       pool_size;
+    unsigned int workers;
+
+    std::string freePort();
+    Server & startServer();
+};
+
+// A port of the range nobody uses. The ports are handed out in turn, so a
+// released one is not reused before the others; a port is bound briefly to
+// see that no other process has it.
+std::string PortBroker::freePort()
+{
+    for (int tries = first_port; tries <= last_port; tries++) {
+        const int port = next_port;
+        next_port = (next_port == last_port) ? first_port : next_port+1;
+        if (used_ports.count(port)) {
+            continue;
+        }
+        try {
+            zmq::socket_t probe(context, ZMQ_REP);
+            int linger = 0;
+            probe.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+            probe.bind(("tcp://*:" + std::to_string(port)).c_str());
+        } catch (zmq::error_t &) {
+            continue;
+        }
+        used_ports.insert(port);
+        return std::to_string(port);
+    }
+    throw std::runtime_error("No free port left in " + std::to_string(first_port) + "-" + std::to_string(last_port));
+}
+
+Server & PortBroker::startServer()
+{
+    servers.emplace_back();
+    Server &s = servers.back();
+    s.port = freePort();
+    s.users = 0;
+    try {
+        s.process.reset(new ServerProcess(server_path, s.port, workers));
+    } catch (...) {
+        servers.pop_back();
+        throw;
+    }
+    std::cout << "Started server on port " << s.port << std::endl;
+    return s;
+}
+
+void PortBroker::refillPool()
+{
+    size_t idle = 0;
+    for (auto it = servers.begin(); it != servers.end(); ) {
+        if (!it->process->alive()) {
+            std::cout << "Server on port " << it->port << " exited" << std::endl;
+            // The port stays taken, the server may have died holding it
+            it = servers.erase(it);
+            continue;
+        }
+        if (it->name.empty()) {
+            idle++;
+        }
+        ++it;
+    }
+    for (; idle < pool_size; idle++) {
+        startServer();
+    }
+}
+
+std::string PortBroker::handleRequest(const std::string &req)
+{
+    const size_t sp = req.find(' ');
+    const std::string cmd = req.substr(0, sp);
+    const std::string name = sp == std::string::npos ? std::string() : req.substr(sp+1);
+    if (name.empty()) {
+        return "ERROR Malformed request: " + req;
+    }
+
+    try {
+        if (cmd == "PORT") {
+            auto it = names.find(name);
+            if (it == names.end()) {
+                it = names.emplace(name, NamedPort{freePort(), 0}).first;
+                std::cout << "Port " << it->second.port << " for " << name << std::endl;
+            }
+            it->second.users++;
+            return "OK " + it->second.port;
+        }
+
+        if (cmd == "RELEASE_PORT") {
+            auto it = names.find(name);
+            if (it == names.end()) {
+                return "ERROR No port for " + name;
+            }
+            const std::string port = it->second.port;
+            if (--it->second.users == 0) {
+                used_ports.erase(std::stoi(port));
+                names.erase(it);
+                std::cout << "Port " << port << " of " << name << " released" << std::endl;
+            }
+            return "OK " + port;
+        }
+
+        if (cmd == "SERVER") {
+            if (server_path.empty()) {
+                return "ERROR No server pool, start portbroker with --server <statcalserver>";
+            }
+            for (auto &s : servers) {
+                if (s.name == name && s.process->alive()) {
+                    s.users++;
+                    return "OK " + s.port;
+                }
+            }
+            Server *server = nullptr;
+            for (auto &s : servers) {
+                if (s.name.empty() && s.process->alive()) {
+                    server = &s;
+                    break;
+                }
+            }
+            if (!server) {
+                // Pool is empty, this one starts cold
+                server = &startServer();
+            }
+            server->name = name;
+            server->users = 1;
+            std::cout << "Server on port " << server->port << " for " << name << std::endl;
+            return "OK " + server->port;
+        }
+
+        if (cmd == "RELEASE") {
+            for (auto &s : servers) {
+                if (s.name == name) {
+                    if (--s.users == 0) {
+                        s.name.clear();
+                        std::cout << "Server on port " << s.port << " back in the pool" << std::endl;
+                    }
+                    return "OK " + s.port;
+                }
+            }
+            return "ERROR No server for " + name;
+        }
+    } catch (std::exception &e) {
+        return std::string("ERROR ") + e.what();
+    }
+    return "ERROR Unknown request: " + req;
+}
+
+void print_usage()
+{
+    std::cerr << "Error: port broker should be launched using portbroker [--port <port_number>] "
+              << "[--ports <first>-<last>] [--server <statcalserver>] [--pool <n>] [--workers <n>]" << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    std::string port = "5550";
+    int first_port = 6000, last_port = 6999;
+    std::string server_path;
+    int pool_size = 2, workers = 1;
+
+    if (argc % 2 != 1) {
+        print_usage();
+        return 1;
+    }
+    try {
+        for (int k = 1; k < argc; k += 2) {
+            std::string opt = argv[k];
+            std::string val = argv[k+1];
+            if (opt == "--port") {
+                port = std::to_string(std::stoi(val));
+            } else if (opt == "--ports") {
+                size_t dash = val.find('-');
+                first_port = std::stoi(val.substr(0, dash));
+                last_port = dash == std::string::npos ? first_port : std::stoi(val.substr(dash+1));
+            } else if (opt == "--server") {
+                server_path = val;
+            } else if (opt == "--pool") {
+                pool_size = std::stoi(val);
+            } else if (opt == "--workers") {
+                workers = std::stoi(val);
+            } else {
+                throw std::invalid_argument(opt);
+            }
+        }
+        if (first_port < 1 || last_port > 65535 || first_port > last_port || pool_size < 0 || workers < 1) {
+            throw std::invalid_argument("range");
+        }
+    } catch (std::exception &) {
+        print_usage();
+        return 1;
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    zmq::context_t context(1);
+    zmq::socket_t socket(context, ZMQ_REP);
+    socket.bind(("tcp://127.0.0.1:" + port).c_str());
+
+    PortBroker broker(context, first_port, last_port);
+    if (!server_path.empty()) {
+        broker.setPool(server_path, static_cast<size_t>(pool_size), static_cast<unsigned int>(workers));
+    }
+
+    std::cout << "Port broker listening on port " << port << ", handing out ports "
+              << first_port << "-" << last_port << std::endl;
+
+    try {
+        while (!stop_requested) {
+            broker.refillPool();
+
+            zmq::pollitem_t items[] = { {(void*)socket, 0, ZMQ_POLLIN, 0 } };
+            try {
+                zmq::poll(&items[0], 1, POLL_INTERVAL);
+            } catch (zmq::error_t &e) {
+                if (e.num() == EINTR) continue;
+                throw;
+            }
+            if (!(items[0].revents & ZMQ_POLLIN)) {
+                continue;
+            }
+
+            zmq::message_t request;
+            socket.recv(&request);
+            const std::string reply = broker.handleRequest(
+                std::string(static_cast<const char *>(request.data()), request.size()));
+            socket.send(reply.data(), reply.size());
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Port broker stopped: " << e.what() << std::endl;
+    }
+
+    // Servers of the pool are stopped when the broker goes
+    return 0;
+}
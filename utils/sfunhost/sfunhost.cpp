@@ -0,0 +1,509 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Headless host for the example S-functions. Loads blocks built against the
+//  simstruc.h of this directory, calls their mdl* callbacks in the order
+//  Simulink does and reports the time of every mdlOutputs+mdlUpdate step, so
+//  that the block code can be profiled and run under valgrind or sanitizers
+//  without MATLAB.
+//
+//  Build (from the repository root), e.g. for the Comm blocks:
+//    g++ -O2 -g -std=c++14 -fPIC -shared -fvisibility=hidden -DMATLAB_MEX_FILE
+//        -Iutils/sfunhost -Iutils/include -ICommExample/sfun -I<cppzmq> -I<libzmq>/include
+//        CommExample/sfun/sfcn_receive.cpp CommExample/sfun/statcal_util.cpp
+//        CommExample/sfun/shm_ring.cpp CommExample/sfun/mux_link.cpp CommExample/sfun/mdlclient.cpp
+//        -o sfcn_receive.so -lzmq -lrt
+//    (same for sfcn_transmit.cpp, or CoSimExample/sfun/statcalsfcngateway.cpp
+//     with statcalclient.cpp and CoSimExample/util/statcal_util.cpp)
+//    g++ -O2 -g -std=c++14 -Iutils/sfunhost utils/sfunhost/sfunhost.cpp
+//        -o sfunhost -ldl -lpthread
+//
+//  Run:
+//    sfunhost [options] block.so param... [--- [options] block.so param...]
+//  Every block runs in its own thread, as if in its own model, e.g. a
+//  receive and a transmit block talking to each other:
+//    sfunhost --steps 1000000 ./sfcn_receive.so "'localhost'" "'5555'" 8 0.01 10
+//         --- ./sfcn_transmit.so "'localhost'" "'5555'" 8 0.01 10
+//
+//  Parameters are written as in the block dialog: 'text' is a char array,
+//  {'a','b'} a cell array of them, anything else a double scalar or
+//  [1 2 3] vector.
+//
+//  Options (per block, the first block's are the defaults of the others)
+//    --steps N      steps to run, default 100000
+//    --runs N       Fast Restart runs, each of them steps, between one
+//                   setup and cleanup of the runtime resources, default 1
+//    --warmup N     steps left out of the statistics, default 10
+//    --width N      width of dynamically sized ports
+//    --dtype NAME   data type of dynamically typed inputs, default double
+//    --input KIND   input signal: const, ramp (all elements change every
+//                   step) or sparse (one element changes), default ramp
+//    --format F     json (default) or csv
+//    --max-allocs N fail if the steps after the warmup allocated more than
+//                   N times from the heap, e.g. 0 to check that the steps
+//                   of a block do not allocate, default -1 (no check)
+//
+//  The allocations of a block's steps are counted on its thread only, not
+//  on the threads of libraries it uses. Counting needs glibc, whose malloc,
+//  calloc and realloc the host replaces; elsewhere allocs is reported as -1.
+//  The exit code is 1 if a block failed or allocated too often, e.g. to
+//  check that the steps of the Comm blocks do not allocate once warmed up:
+//    sfunhost --steps 20000 --warmup 1000 --max-allocs 0
+//         ./sfcn_receive.so "'shm://alloc'" "'1'" 64 0.01 10
+//         --- ./sfcn_transmit.so "'shm://alloc'" "'1'" 64 0.01 10
+//  and the same with udp://localhost, delta coding or frames. The warmup
+//  covers the first few hundred messages, during which the queues of libzmq
+//  grow. Over tcp:// zmq_send copies every message longer than 33 bytes to
+//  the heap, one allocation per step of the transmitter, which the blocks
+//  cannot avoid: sending from their own buffer would leave libzmq reading it
+//  after the socket is closed.
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include "simstruc.h"
+
+#if defined(__GLIBC__)
+#define SFUNHOST_COUNT_ALLOCS
+#endif
+
+namespace {
+
+// Heap allocations of the thread while counting is on
+thread_local bool counting_allocs = false;
+thread_local long num_allocs = 0;
+
+inline void count_alloc()
+{
+    if (counting_allocs) num_allocs++;
+}
+
+} // anonymous namespace
+
+#if defined(SFUNHOST_COUNT_ALLOCS)
+// The host's malloc takes the place of the C library's in the blocks too,
+// operator new of libstdc++ calls it
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+
+void *malloc(size_t n) noexcept
+{
+    count_alloc();
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) noexcept
+{
+    count_alloc();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) noexcept
+{
+    count_alloc();
+    return __libc_realloc(p, n);
+}
+}
+#endif
+
+namespace {
+
+const char *dtypeNames[] = {"double", "single", "int8", "uint8", "int16", "uint16", "int32", "uint32", "boolean"};
+
+struct BlockOptions {
+    long        steps;
+    long        runs;
+    long        warmup;
+    int         width;
+    DTypeId     dtype;
+    std::string input;
+    std::string format;
+    long        max_allocs;
+
+    BlockOptions() : steps(100000), runs(1), warmup(10), width(0), dtype(SS_DOUBLE), input("ramp"), format("json"),
+                     max_allocs(-1) {}
+};
+
+// Parse a parameter as written in the block dialog
+mxArray *parse_param(const std::string &s)
+{
+    std::unique_ptr<mxArray> p(new mxArray);
+    if (s.size() >= 2 && s.front() == '\'' && s.back() == '\'') {
+        p->kind = mxArray::MX_CHAR;
+        p->str  = s.substr(1, s.size()-2);
+    } else if (s.size() >= 2 && s.front() == '{' && s.back() == '}') {
+        p->kind = mxArray::MX_CELL;
+        std::stringstream ss(s.substr(1, s.size()-2));
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            item.erase(0, item.find_first_not_of(' '));
+            item.erase(item.find_last_not_of(' ')+1);
+            p->cells.push_back(parse_param(item));
+        }
+    } else {
+        std::string body = s;
+        if (body.size() >= 2 && body.front() == '[' && body.back() == ']') {
+            body = body.substr(1, body.size()-2);
+        }
+        std::replace(body.begin(), body.end(), ',', ' ');
+        std::stringstream ss(body);
+        double v;
+        while (ss >> v) p->num.push_back(v);
+        if (!ss.eof()) {
+            throw std::runtime_error("Cannot parse parameter " + s + ", quote char arrays as 'text'");
+        }
+    }
+    return p.release();
+}
+
+// A loaded block and its SimStruct
+class Block {
+  public:
+    Block(const std::string &lib, const std::vector<std::string> &params, const BlockOptions &o) :
+        path(lib), opt(o), handle(NULL), elapsed(0), allocs(0)
+    {
+#if defined(_WIN32)
+        handle = LoadLibraryA(lib.c_str());
+        SfunHostMethodsFcn fcn = handle ? reinterpret_cast<SfunHostMethodsFcn>(
+            GetProcAddress(static_cast<HMODULE>(handle), SFUNHOST_METHODS_SYMBOL)) : NULL;
+#else
+        handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) throw std::runtime_error(dlerror());
+        SfunHostMethodsFcn fcn = reinterpret_cast<SfunHostMethodsFcn>(dlsym(handle, SFUNHOST_METHODS_SYMBOL));
+#endif
+        if (!fcn) {
+            throw std::runtime_error(lib + " is not a block built for sfunhost");
+        }
+        fcn(&m);
+
+        for (auto &s : params) {
+            S.params.push_back(parse_param(s));
+        }
+    }
+
+    ~Block()
+    {
+        for (auto p : S.params) delete p;
+        // The library stays loaded, blocks may leave threads or static
+        // destructors behind
+    }
+
+    // Run the block, returns false on error
+    bool run()
+    {
+        if (!initialize()) return false;
+
+        bool ok = call("mdlSetupRuntimeResources", m.setupRuntimeResources);
+        for (long r = 0; ok && r < opt.runs; r++) {
+            S.stopRequested = false;
+            ok = call("mdlStart", m.start);
+            if (ok) ok = simulate(r == 0);
+
+            // As Simulink, terminate and release the resources after errors too
+            S.errorStatus = NULL;
+            ok = call("mdlTerminate", m.terminate) && ok;
+        }
+        S.errorStatus = NULL;
+        ok = call("mdlCleanupRuntimeResources", m.cleanupRuntimeResources) && ok;
+
+        if (opt.max_allocs >= 0 && allocs > opt.max_allocs) {
+            // One write, the blocks run in threads of their own
+            std::ostringstream msg;
+            msg << m.name << ": the steps allocated " << allocs << " times, more than " << opt.max_allocs << '\n';
+            std::cerr << msg.str() << std::flush;
+            ok = false;
+        }
+        return ok;
+    }
+
+    void report() const
+    {
+        if (samples.empty()) return;
+        std::vector<uint32_t> sorted(samples);
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (auto s : sorted) sum += s;
+        auto pct = [&](const double p) {
+            return sorted[std::min(static_cast<size_t>(p*sorted.size()), sorted.size()-1)];
+        };
+        const double secs = std::chrono::duration<double>(elapsed).count();
+#if defined(SFUNHOST_COUNT_ALLOCS)
+        const long num = allocs;
+#else
+        const long num = -1;
+#endif
+
+        char line[512];
+        if (opt.format == "csv") {
+            std::snprintf(line, sizeof(line), "%s,%zu,%.1f,%u,%u,%u,%u,%.1f,%ld",
+                          m.name, sorted.size(), sum/sorted.size(), pct(0.5), pct(0.99), pct(0.999),
+                          sorted.back(), sorted.size()/secs, num);
+        } else {
+            std::snprintf(line, sizeof(line),
+                          "{\"block\":\"%s\",\"steps\":%zu,\"mean_ns\":%.1f,\"p50_ns\":%u,\"p99_ns\":%u,"
+                          "\"p999_ns\":%u,\"max_ns\":%u,\"steps_per_s\":%.1f,\"allocs\":%ld}",
+                          m.name, sorted.size(), sum/sorted.size(), pct(0.5), pct(0.99), pct(0.999),
+                          sorted.back(), sorted.size()/secs, num);
+        }
+        std::cout << line << std::endl;
+    }
+
+    const std::string &format() const { return opt.format; }
+
+  private:
+    std::string     path;
+    BlockOptions    opt;
+    void           *handle;
+    SfunHostMethods m;
+    SimStruct       S;
+    std::vector<std::vector<char>> buffers;   // port signals and DWorks
+    std::vector<uint32_t> samples;            // step times in nanoseconds
+    std::chrono::steady_clock::duration elapsed;
+    long            allocs;                   // heap allocations of the steps after the warmup
+
+    bool failed(const char *fcn)
+    {
+        if (S.errorStatus == NULL) return false;
+        std::cerr << m.name << ": " << fcn << ": " << S.errorStatus << std::endl;
+        return true;
+    }
+
+    template <typename... Args>
+    bool call(const char *name, void (*fcn)(SimStruct *, Args...), Args... args)
+    {
+        if (fcn) {
+            fcn(&S, args...);
+        }
+        return !failed(name);
+    }
+
+    // Sizes, data types and work vectors, as in the model update
+    bool initialize()
+    {
+        if (!call("mdlInitializeSizes", m.initializeSizes)) return false;
+        if (ssGetNumSFcnParams(&S) != ssGetSFcnParamsCount(&S)) {
+            std::cerr << m.name << ": expects " << ssGetNumSFcnParams(&S) << " parameters, got "
+                      << ssGetSFcnParamsCount(&S) << std::endl;
+            return false;
+        }
+
+        for (int_T k = 0; k < ssGetNumInputPorts(&S); k++) {
+            if (S.inputs[k].width == DYNAMICALLY_SIZED && opt.width > 0 && m.setInputPortWidth) {
+                if (!call("mdlSetInputPortWidth", m.setInputPortWidth, k, opt.width)) return false;
+            }
+        }
+        for (int_T k = 0; k < ssGetNumOutputPorts(&S); k++) {
+            if (S.outputs[k].width == DYNAMICALLY_SIZED && opt.width > 0 && m.setOutputPortWidth) {
+                if (!call("mdlSetOutputPortWidth", m.setOutputPortWidth, k, opt.width)) return false;
+            }
+        }
+        if (has_dynamic_width() && !call("mdlSetDefaultPortWidth", m.setDefaultPortWidth)) return false;
+
+        for (int_T k = 0; k < ssGetNumInputPorts(&S); k++) {
+            if (S.inputs[k].dtype == DYNAMICALLY_TYPED && m.setInputPortDataType) {
+                if (!call("mdlSetInputPortDataType", m.setInputPortDataType, k, opt.dtype)) return false;
+            }
+        }
+        if (!call("mdlSetDefaultPortDataTypes", m.setDefaultPortDataTypes)) return false;
+
+        for (auto *ports : {&S.inputs, &S.outputs}) {
+            for (auto &p : *ports) {
+                if (p.width == DYNAMICALLY_SIZED) p.width = 1;
+                if (p.dtype == DYNAMICALLY_TYPED) p.dtype = SS_DOUBLE;
+                buffers.emplace_back(std::max<size_t>(p.width*sfunhost_dtype_size(p.dtype), 1));
+                p.signal = &buffers.back()[0];
+            }
+        }
+
+        if (!call("mdlSetWorkWidths", m.setWorkWidths)) return false;
+        for (auto &d : S.dwork) {
+            d.data.assign(d.width*sfunhost_dtype_size(d.dtype), 0);
+        }
+        if (!call("mdlInitializeSampleTimes", m.initializeSampleTimes)) return false;
+        return true;
+    }
+
+    bool has_dynamic_width() const
+    {
+        for (auto &p : S.inputs)  if (p.width == DYNAMICALLY_SIZED) return true;
+        for (auto &p : S.outputs) if (p.width == DYNAMICALLY_SIZED) return true;
+        return false;
+    }
+
+    template <typename T>
+    static void fill(void *signal, const int width, const long step, const std::string &input)
+    {
+        T *u = reinterpret_cast<T *>(signal);
+        if (input == "const") {
+            if (step == 0) std::fill(u, u+width, static_cast<T>(1));
+        } else if (input == "sparse") {
+            u[step % width] = static_cast<T>(step);
+        } else {
+            for (int j = 0; j < width; j++) u[j] = static_cast<T>(step+j);
+        }
+    }
+
+    void fill_inputs(const long step)
+    {
+        for (auto &p : S.inputs) {
+            switch (p.dtype) {
+              case SS_DOUBLE:  fill<double>(p.signal, p.width, step, opt.input); break;
+              case SS_SINGLE:  fill<float>(p.signal, p.width, step, opt.input); break;
+              case SS_INT8:    fill<int8_t>(p.signal, p.width, step, opt.input); break;
+              case SS_UINT8:   fill<uint8_t>(p.signal, p.width, step, opt.input); break;
+              case SS_INT16:   fill<int16_t>(p.signal, p.width, step, opt.input); break;
+              case SS_UINT16:  fill<uint16_t>(p.signal, p.width, step, opt.input); break;
+              case SS_INT32:   fill<int32_t>(p.signal, p.width, step, opt.input); break;
+              case SS_UINT32:  fill<uint32_t>(p.signal, p.width, step, opt.input); break;
+              case SS_BOOLEAN: fill<uint8_t>(p.signal, p.width, step, opt.input == "const" ? "const" : "sparse"); break;
+            }
+        }
+    }
+
+    // Steps of one run, the warmup steps are those of the first. The
+    // statistics cover the steps of all runs.
+    bool simulate(const bool first)
+    {
+        const double dt = S.sampleTime > 0 ? S.sampleTime : 1.0;
+        const long warmup = first ? opt.warmup : 0;
+        samples.reserve(samples.size()+std::max<long>(opt.steps-warmup, 0));
+
+        auto t_start = std::chrono::steady_clock::now();
+        for (long k = 0; k < opt.steps; k++) {
+            S.t = S.offsetTime+k*dt;
+            fill_inputs(k);
+            if (k == warmup) t_start = std::chrono::steady_clock::now();
+
+            const long allocs0 = num_allocs;
+            counting_allocs = k >= warmup;
+            auto t0 = std::chrono::steady_clock::now();
+            const bool stepped = call("mdlOutputs", m.outputs, 0) && call("mdlUpdate", m.update, 0);
+            auto t1 = std::chrono::steady_clock::now();
+            counting_allocs = false;
+            allocs += num_allocs-allocs0;
+            if (!stepped) return false;
+
+            if (k >= warmup) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1-t0).count();
+                samples.push_back(static_cast<uint32_t>(std::min<long long>(ns, UINT32_MAX)));
+            }
+            if (S.stopRequested) break;
+        }
+        elapsed += std::chrono::steady_clock::now()-t_start;
+        return true;
+    }
+};
+
+bool parse_option(const std::string &arg, const std::string &val, BlockOptions &opt)
+{
+    if (arg == "--steps") {
+        opt.steps = std::atol(val.c_str());
+    } else if (arg == "--runs") {
+        opt.runs = std::atol(val.c_str());
+    } else if (arg == "--warmup") {
+        opt.warmup = std::atol(val.c_str());
+    } else if (arg == "--width") {
+        opt.width = std::atoi(val.c_str());
+    } else if (arg == "--dtype") {
+        auto it = std::find(std::begin(dtypeNames), std::end(dtypeNames), val);
+        if (it == std::end(dtypeNames)) return false;
+        opt.dtype = static_cast<DTypeId>(it-std::begin(dtypeNames));
+    } else if (arg == "--input" && (val == "const" || val == "ramp" || val == "sparse")) {
+        opt.input = val;
+    } else if (arg == "--format" && (val == "json" || val == "csv")) {
+        opt.format = val;
+    } else if (arg == "--max-allocs") {
+        opt.max_allocs = std::atol(val.c_str());
+#if !defined(SFUNHOST_COUNT_ALLOCS)
+        if (opt.max_allocs >= 0) {
+            std::cerr << "--max-allocs needs a host built with glibc" << std::endl;
+            return false;
+        }
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void print_usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [--steps N] [--runs N] [--warmup N] [--width N] [--dtype NAME]"
+              << " [--input const|ramp|sparse] [--format json|csv] [--max-allocs N] block param... [--- ...]"
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::unique_ptr<Block>> blocks;
+    BlockOptions defaults;
+
+    try {
+        int k = 1;
+        while (k < argc) {
+            BlockOptions opt = defaults;
+            for (; k < argc && std::string(argv[k]).compare(0, 2, "--") == 0 && std::string(argv[k]) != "---"; k += 2) {
+                if (k+1 >= argc || !parse_option(argv[k], argv[k+1], opt)) {
+                    print_usage(argv[0]);
+                    return 2;
+                }
+            }
+            if (k >= argc) {
+                print_usage(argv[0]);
+                return 2;
+            }
+            if (blocks.empty()) defaults = opt;
+
+            std::string lib = argv[k++];
+            std::vector<std::string> params;
+            for (; k < argc && std::string(argv[k]) != "---"; k++) {
+                params.push_back(argv[k]);
+            }
+            k++;
+            blocks.emplace_back(new Block(lib, params, opt));
+        }
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    if (blocks.empty()) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<char> ok(blocks.size(), 0);
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < blocks.size(); k++) {
+        threads.emplace_back([&, k]() { ok[k] = blocks[k]->run(); });
+    }
+    ok[0] = blocks[0]->run();
+    for (auto &t : threads) t.join();
+
+    if (blocks[0]->format() == "csv") {
+        std::cout << "block,steps,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,steps_per_s,allocs" << std::endl;
+    }
+    for (auto &b : blocks) b->report();
+
+    return std::all_of(ok.begin(), ok.end(), [](char v) { return v != 0; }) ? 0 : 1;
+}
@@ -0,0 +1,308 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Stand-in for the Simulink simstruc.h so that the Level-2 C++ S-functions
+//  of the examples can be built as plain shared libraries and driven by
+//  sfunhost without MATLAB. Only the SimStruct and mxArray functions used
+//  by the blocks are provided, with the same names and arguments.
+//
+//  Build a block with -DMATLAB_MEX_FILE and this directory first on the
+//  include path; its #include "simulink.c" then picks up the registration
+//  function of this directory instead of the MEX gateway.
+//
+#ifndef SFUNHOST_SIMSTRUC_H
+#define SFUNHOST_SIMSTRUC_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef double       real_T;
+typedef double       time_T;
+typedef int          int_T;
+typedef unsigned int uint_T;
+typedef char         char_T;
+typedef unsigned int uint32_T;
+typedef bool         boolean_T;
+typedef int          DTypeId;
+
+enum {
+    SS_DOUBLE = 0,
+    SS_SINGLE,
+    SS_INT8,
+    SS_UINT8,
+    SS_INT16,
+    SS_UINT16,
+    SS_INT32,
+    SS_UINT32,
+    SS_BOOLEAN,
+};
+
+#define DYNAMICALLY_SIZED -1
+#define DYNAMICALLY_TYPED -1
+#define COMPLEX_NO   0
+#define COMPLEX_YES  1
+
+#define USE_DEFAULT_SIM_STATE 0
+#define MDL_START_AND_MDL_PROCESS_PARAMS_OK 1
+
+#define SS_OPTION_EXCEPTION_FREE_CODE       0x1
+#define SS_OPTION_WORKS_WITH_CODE_REUSE     0x2
+#define SS_OPTION_USE_TLC_WITH_ACCELERATOR  0x4
+#define SS_OPTION_CALL_TERMINATE_ON_EXIT    0x8
+
+// mdlRTW writes the parameters of the block for its TLC file, which the
+// host does not generate code from
+#define SSWRITE_VALUE_STR   0
+#define SSWRITE_VALUE_QSTR  1
+#define SSWRITE_VALUE_NUM   2
+
+#define INHERITED_SAMPLE_TIME  -1.0
+#define CONTINUOUS_SAMPLE_TIME  0.0
+
+// Block dialog parameter: a real double array, a char array or a cell array
+// of them
+struct mxArray {
+    enum Kind { MX_DOUBLE, MX_CHAR, MX_CELL } kind;
+    std::vector<double>   num;
+    std::string           str;
+    std::vector<mxArray*> cells;
+
+    mxArray() : kind(MX_DOUBLE) {}
+    ~mxArray() { for (auto c : cells) delete c; }
+};
+
+struct ssParamRec {
+    void *data;   // values of the run-time parameter, the dialog parameter's data
+};
+
+struct SimStruct;
+
+// Callbacks of one block, filled in by the block's sfunhost_methods()
+struct SfunHostMethods {
+    const char *name;
+    void (*initializeSizes)(SimStruct *);
+    void (*initializeSampleTimes)(SimStruct *);
+    void (*checkParameters)(SimStruct *);
+    void (*processParameters)(SimStruct *);
+    void (*setInputPortWidth)(SimStruct *, int_T, int_T);
+    void (*setOutputPortWidth)(SimStruct *, int_T, int_T);
+    void (*setDefaultPortWidth)(SimStruct *);
+    void (*setInputPortDataType)(SimStruct *, int_T, DTypeId);
+    void (*setDefaultPortDataTypes)(SimStruct *);
+    void (*setWorkWidths)(SimStruct *);
+    void (*setupRuntimeResources)(SimStruct *);
+    void (*start)(SimStruct *);
+    void (*outputs)(SimStruct *, int_T);
+    void (*update)(SimStruct *, int_T);
+    void (*terminate)(SimStruct *);
+    void (*cleanupRuntimeResources)(SimStruct *);
+};
+
+#define SFUNHOST_METHODS_SYMBOL "sfunhost_methods"
+typedef void (*SfunHostMethodsFcn)(SfunHostMethods *);
+
+struct SimStruct {
+    struct Port {
+        int_T   width;
+        DTypeId dtype;
+        void   *signal;   // owned by the host
+    };
+    struct DWork {
+        int_T   width;
+        DTypeId dtype;
+        std::vector<char> data;
+    };
+
+    std::vector<const mxArray*> params;
+    int_T              numParams;        // expected by the block
+    std::vector<bool>  tunable;
+    std::vector<ssParamRec> rtParams;
+    const char        *errorStatus;
+    std::vector<Port>  inputs;
+    std::vector<Port>  outputs;
+    double             sampleTime;
+    double             offsetTime;
+    unsigned int       options;
+    std::vector<void*> pwork;
+    std::vector<DWork> dwork;
+    time_T             t;
+    bool               stopRequested;
+
+    SimStruct() : numParams(0), errorStatus(NULL), sampleTime(INHERITED_SAMPLE_TIME),
+                  offsetTime(0.0), options(0), t(0.0), stopRequested(false) {}
+};
+
+inline size_t sfunhost_dtype_size(const DTypeId id)
+{
+    switch (id) {
+      case SS_DOUBLE:  return 8;
+      case SS_SINGLE:  return 4;
+      case SS_INT8:    return 1;
+      case SS_UINT8:   return 1;
+      case SS_INT16:   return 2;
+      case SS_UINT16:  return 2;
+      case SS_INT32:   return 4;
+      case SS_UINT32:  return 4;
+      case SS_BOOLEAN: return 1;
+    }
+    return 0;
+}
+
+// mxArray
+
+inline bool   mxIsChar(const mxArray *p)    { return p->kind == mxArray::MX_CHAR; }
+inline bool   mxIsDouble(const mxArray *p)  { return p->kind == mxArray::MX_DOUBLE; }
+inline bool   mxIsCell(const mxArray *p)    { return p->kind == mxArray::MX_CELL; }
+inline bool   mxIsComplex(const mxArray *)  { return false; }
+
+inline size_t mxGetNumberOfElements(const mxArray *p)
+{
+    switch (p->kind) {
+      case mxArray::MX_CHAR: return p->str.size();
+      case mxArray::MX_CELL: return p->cells.size();
+      default:               return p->num.size();
+    }
+}
+
+inline bool    mxIsEmpty(const mxArray *p)   { return mxGetNumberOfElements(p) == 0; }
+inline void   *mxGetData(const mxArray *p)   { return p->num.empty() ? NULL : const_cast<double *>(&p->num[0]); }
+inline double *mxGetPr(const mxArray *p)     { return reinterpret_cast<double *>(mxGetData(p)); }
+inline double  mxGetScalar(const mxArray *p) { return p->num.empty() ? 0.0 : p->num[0]; }
+
+inline mxArray *mxGetCell(const mxArray *p, const size_t idx)
+{
+    return idx < p->cells.size() ? p->cells[idx] : NULL;
+}
+
+// Copy of a char array, released with mxFree
+inline char *mxArrayToString(const mxArray *p)
+{
+    if (!mxIsChar(p)) return NULL;
+    char *s = static_cast<char *>(std::malloc(p->str.size()+1));
+    std::memcpy(s, p->str.c_str(), p->str.size()+1);
+    return s;
+}
+
+inline void mxFree(void *p) { std::free(p); }
+
+// Parameters
+
+inline int_T ssGetSFcnParamsCount(const SimStruct *S)        { return static_cast<int_T>(S->params.size()); }
+inline void  ssSetNumSFcnParams(SimStruct *S, const int_T n) { S->numParams = n; }
+inline int_T ssGetNumSFcnParams(const SimStruct *S)          { return S->numParams; }
+inline const mxArray *ssGetSFcnParam(const SimStruct *S, const int_T idx) { return S->params[idx]; }
+
+inline void ssSetSFcnParamTunable(SimStruct *S, const int_T idx, const int_T tunable)
+{
+    if (S->tunable.size() <= static_cast<size_t>(idx)) S->tunable.resize(idx+1, false);
+    S->tunable[idx] = tunable != 0;
+}
+
+// One run-time parameter per tunable dialog parameter, in parameter order
+inline void ssRegAllTunableParamsAsRunTimeParams(SimStruct *S, const char_T **)
+{
+    S->rtParams.clear();
+    for (size_t k = 0; k < S->tunable.size() && k < S->params.size(); k++) {
+        if (S->tunable[k]) {
+            ssParamRec rec = {mxGetData(S->params[k])};
+            S->rtParams.push_back(rec);
+        }
+    }
+}
+
+inline void ssUpdateAllTunableParamsAsRunTimeParams(SimStruct *S)
+{
+    ssRegAllTunableParamsAsRunTimeParams(S, NULL);
+}
+
+inline ssParamRec *ssGetRunTimeParamInfo(SimStruct *S, const int_T idx) { return &S->rtParams[idx]; }
+
+// Errors and status
+
+inline void        ssSetErrorStatus(SimStruct *S, const char *msg) { S->errorStatus = msg; }
+inline const char *ssGetErrorStatus(const SimStruct *S)           { return S->errorStatus; }
+inline void        ssSetStopRequested(SimStruct *S, const int_T v) { S->stopRequested = v != 0; }
+inline bool        ssGetStopRequested(const SimStruct *S)         { return S->stopRequested; }
+inline void        ssWarning(SimStruct *, const char *) {}
+inline bool        ssWriteRTWParamSettings(SimStruct *, const int_T, ...) { return true; }
+
+// Ports
+
+inline bool ssSetNumInputPorts(SimStruct *S, const int_T n)
+{
+    SimStruct::Port p = {0, SS_DOUBLE, NULL};
+    S->inputs.assign(n, p);
+    return true;
+}
+
+inline bool ssSetNumOutputPorts(SimStruct *S, const int_T n)
+{
+    SimStruct::Port p = {0, SS_DOUBLE, NULL};
+    S->outputs.assign(n, p);
+    return true;
+}
+
+inline int_T ssGetNumInputPorts(const SimStruct *S)  { return static_cast<int_T>(S->inputs.size()); }
+inline int_T ssGetNumOutputPorts(const SimStruct *S) { return static_cast<int_T>(S->outputs.size()); }
+
+inline void    ssSetInputPortWidth(SimStruct *S, const int_T k, const int_T w)        { S->inputs[k].width = w; }
+inline void    ssSetOutputPortWidth(SimStruct *S, const int_T k, const int_T w)       { S->outputs[k].width = w; }
+inline int_T   ssGetInputPortWidth(const SimStruct *S, const int_T k)                 { return S->inputs[k].width; }
+inline int_T   ssGetOutputPortWidth(const SimStruct *S, const int_T k)                { return S->outputs[k].width; }
+inline void    ssSetInputPortDataType(SimStruct *S, const int_T k, const DTypeId id)  { S->inputs[k].dtype = id; }
+inline void    ssSetOutputPortDataType(SimStruct *S, const int_T k, const DTypeId id) { S->outputs[k].dtype = id; }
+inline DTypeId ssGetInputPortDataType(const SimStruct *S, const int_T k)              { return S->inputs[k].dtype; }
+inline DTypeId ssGetOutputPortDataType(const SimStruct *S, const int_T k)             { return S->outputs[k].dtype; }
+
+inline void ssSetInputPortComplexSignal(SimStruct *, const int_T, const int_T) {}
+inline void ssSetOutputPortComplexSignal(SimStruct *, const int_T, const int_T) {}
+inline void ssSetInputPortRequiredContiguous(SimStruct *, const int_T, const int_T) {}
+inline void ssSetInputPortDirectFeedThrough(SimStruct *, const int_T, const int_T) {}
+inline void ssSetInputPortFrameData(SimStruct *, const int_T, const int_T) {}
+
+inline const void *ssGetInputPortSignal(const SimStruct *S, const int_T k)  { return S->inputs[k].signal; }
+inline void       *ssGetOutputPortSignal(const SimStruct *S, const int_T k) { return S->outputs[k].signal; }
+inline real_T     *ssGetOutputPortRealSignal(const SimStruct *S, const int_T k)
+{
+    return reinterpret_cast<real_T *>(S->outputs[k].signal);
+}
+
+// Sample times and options
+
+inline void   ssSetNumSampleTimes(SimStruct *, const int_T) {}
+inline void   ssSetSampleTime(SimStruct *S, const int_T, const double t) { S->sampleTime = t; }
+inline void   ssSetOffsetTime(SimStruct *S, const int_T, const double t) { S->offsetTime = t; }
+inline double ssGetSampleTime(const SimStruct *S, const int_T)          { return S->sampleTime; }
+inline time_T ssGetT(const SimStruct *S)                                { return S->t; }
+
+inline void ssSetSimStateCompliance(SimStruct *, const int_T) {}
+inline void ssSetOptions(SimStruct *S, const unsigned int opts) { S->options = opts; }
+inline void ssSetModelReferenceNormalModeSupport(SimStruct *, const int_T) {}
+inline void ssSetModelReferenceSampleTimeDefaultInheritance(SimStruct *) {}
+
+// Work vectors
+
+inline void   ssSetNumPWork(SimStruct *S, const int_T n)                       { S->pwork.assign(n, NULL); }
+inline void **ssGetPWork(SimStruct *S)                                         { return S->pwork.empty() ? NULL : &S->pwork[0]; }
+inline void  *ssGetPWorkValue(const SimStruct *S, const int_T idx)             { return S->pwork[idx]; }
+inline void   ssSetPWorkValue(SimStruct *S, const int_T idx, void *v)          { S->pwork[idx] = v; }
+
+inline void ssSetNumDWork(SimStruct *S, const int_T n)
+{
+    SimStruct::DWork d = {0, SS_DOUBLE, std::vector<char>()};
+    S->dwork.assign(n, d);
+}
+
+inline void  ssSetDWorkWidth(SimStruct *S, const int_T k, const int_T w)          { S->dwork[k].width = w; }
+inline void  ssSetDWorkDataType(SimStruct *S, const int_T k, const DTypeId id)    { S->dwork[k].dtype = id; }
+inline void *ssGetDWork(SimStruct *S, const int_T k)
+{
+    return S->dwork[k].data.empty() ? NULL : &S->dwork[k].data[0];
+}
+
+inline int_T ssGetDataTypeSize(const SimStruct *, const DTypeId id) { return static_cast<int_T>(sfunhost_dtype_size(id)); }
+
+#endif // SFUNHOST_SIMSTRUC_H
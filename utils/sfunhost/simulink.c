@@ -0,0 +1,64 @@
+// Copyright 2018 The MathWorks, Inc.
+
+//
+//  Included at the end of a block built for sfunhost, in place of the
+//  Simulink MEX gateway. Exports the function which hands the block's
+//  callbacks to the host; the callbacks themselves stay static.
+//
+#if defined(_WIN32)
+#define SFUNHOST_EXPORT __declspec(dllexport)
+#else
+#define SFUNHOST_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define SFUNHOST_STR2(x) #x
+#define SFUNHOST_STR(x)  SFUNHOST_STR2(x)
+
+extern "C" SFUNHOST_EXPORT void sfunhost_methods(SfunHostMethods *m)
+{
+    std::memset(m, 0, sizeof(*m));
+    m->name                  = SFUNHOST_STR(S_FUNCTION_NAME);
+    m->initializeSizes       = mdlInitializeSizes;
+    m->initializeSampleTimes = mdlInitializeSampleTimes;
+    m->outputs               = mdlOutputs;
+    m->terminate             = mdlTerminate;
+#if defined(MDL_CHECK_PARAMETERS)
+    m->checkParameters       = mdlCheckParameters;
+#endif
+#if defined(MDL_PROCESS_PARAMETERS)
+    m->processParameters     = mdlProcessParameters;
+#endif
+#if defined(MDL_SET_INPUT_PORT_WIDTH)
+    m->setInputPortWidth     = mdlSetInputPortWidth;
+#endif
+#if defined(MDL_SET_OUTPUT_PORT_WIDTH)
+    m->setOutputPortWidth    = mdlSetOutputPortWidth;
+#endif
+#if defined(MDL_SET_DEFAULT_PORT_WIDTH)
+    m->setDefaultPortWidth   = mdlSetDefaultPortWidth;
+#endif
+#if defined(MDL_SET_INPUT_PORT_DATA_TYPE)
+    m->setInputPortDataType  = mdlSetInputPortDataType;
+#endif
+#if defined(MDL_SET_DEFAULT_PORT_DATA_TYPES)
+    m->setDefaultPortDataTypes = mdlSetDefaultPortDataTypes;
+#endif
+#if defined(MDL_SET_WORK_WIDTHS)
+    m->setWorkWidths         = mdlSetWorkWidths;
+#endif
+#if defined(MDL_SETUP_RUNTIME_RESOURCES)
+    m->setupRuntimeResources = mdlSetupRuntimeResources;
+#endif
+#if defined(MDL_START)
+    m->start                 = mdlStart;
+#endif
+#if defined(MDL_UPDATE)
+    m->update                = mdlUpdate;
+#endif
+#if defined(MDL_CLEANUP_RUNTIME_RESOURCES)
+    m->cleanupRuntimeResources = mdlCleanupRuntimeResources;
+#endif
+#if defined(MDL_RTW)
+    (void)mdlRTW;   // code generation only
+#endif
+}